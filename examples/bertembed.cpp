@@ -19,7 +19,7 @@ void print_stats(const BertEmbeddingManager& bert, LMEmbeddingFolder* lef) {
 	std::cout << "Total uncompressed size: " << (lef->count_embeddings() * bert.embedding_dimension() * sizeof(float)) + lef->count_text_bytes() << " bytes.\n";
 }
 
-void do_embedding_search(BertEmbeddingManager& bert, const std::string& search, const std::string& in_file, int max_matches, double min_cos, bool show_per_file) {
+void do_embedding_search(BertEmbeddingManager& bert, const std::string& search, const std::string& in_file, int max_matches, double min_cos, bool show_per_file, const std::string& quant) {
 	LMEmbeddingFolder lef;
 	std::vector<LMEmbedding*> les;
 	double score;
@@ -29,6 +29,10 @@ void do_embedding_search(BertEmbeddingManager& bert, const std::string& search,
 	if (!is_stream) {
 		lef.in_from_file(in_file.c_str());
 		print_stats(bert, &lef);
+		if (quant == "f16" || quant == "i8") {
+			lef.quantize(quant == "f16" ? LMEMBED_F16 : LMEMBED_I8);
+			std::cout << "Embeddings quantized to " << quant << ", now using " << lef.count_embed_bytes() << " bytes.\n";
+		}
 	}
 
 	les = bert.embedding_for_text(search);
@@ -79,15 +83,45 @@ void do_embedding_search(BertEmbeddingManager& bert, const std::string& search,
 
 void compile_folder_embeddings(BertEmbeddingManager& bert, const std::string& folder, const std::string& out_file) {
 	std::cout << "Compiling embeddings for text documents in folder '" << folder << "'...\n";
-	LMEmbeddingFolder* lef = bert.embeddings_for_folder(folder, out_file.c_str());
+	LMEmbeddingFolder* lef = new LMEmbeddingFolder;
+	if (bert.get_nencoders() > 1 || bert.get_batch_size() > 0)
+		bert.embeddings_for_folder_pipelined(folder, lef, out_file.c_str());
+	else
+		bert.embeddings_for_folder(folder, lef, out_file.c_str());
 	print_stats(bert, lef);
+	delete lef;
+}
+
+/* Index the folder with the one-chunk-at-a-time path and with the batched pipeline, and compare. */
+void bench_folder_embeddings(BertEmbeddingManager& bert, const std::string& folder) {
+	LMEmbeddingFolder lef;
+	Stopwatch sw;
+	u64 ms;
+	double cps_serial, cps_pipe;
+
+	std::cout << "*** Per-chunk encoding:\n";
+	sw.start();
+	bert.embeddings_for_folder(folder, &lef);
+	ms = std::max(sw.stop(UNIT_MILLISECOND), (u64) 1);
+	cps_serial = lef.count_embeddings() * 1000.0 / ms;
+	std::cout << lef.count_embeddings() << " chunks in " << ms << " ms: " << cps_serial << " chunks/s.\n";
+
+	lef.free();
+	lef.known_files.clear();
+	std::cout << "*** Pipelined, " << bert.get_nencoders() << " encoder(s):\n";
+	sw.start();
+	bert.embeddings_for_folder_pipelined(folder, &lef);
+	ms = std::max(sw.stop(UNIT_MILLISECOND), (u64) 1);
+	cps_pipe = lef.count_embeddings() * 1000.0 / ms;
+	std::cout << lef.count_embeddings() << " chunks in " << ms << " ms: " << cps_pipe << " chunks/s.\n";
+	std::cout << "Speedup: " << cps_pipe / std::max(cps_serial, 1e-9) << "x\n";
 }
 
 int app_main() {
 	ArgParse ap;
-	std::string text, folder, out_file = "bert.embeddings", in_file = "bert.embeddings", search, model = "bge-large-en-ggml-model-f16.bin";
-	int max_matches = 8, n_sentences = 4;
-	bool show_per_file = false;
+	std::string text, folder, out_file = "bert.embeddings", in_file = "bert.embeddings", search, model = "bge-large-en-ggml-model-f16.bin", quant;
+	int max_matches = 8, n_sentences = 4, n_encoders = 1, batch_size = 0;
+	bool show_per_file = false, bench = false;
 	double min_cos = -2.0;
 
 	ap.add_argument("model", type_string, "BERT architecture embedding model (default is bge-large-en)");
@@ -98,6 +132,10 @@ int app_main() {
 	ap.add_argument("max_matches", type_int, "the number of best matches returned from the embedding search (default is 8)", &max_matches);
 	ap.add_argument("num_sentences", type_int, "the number of sentences in each embedding (default is 4)", &n_sentences);
 	ap.add_argument("min_cos", type_double, "specify a minimum cosine similarity for a search match", &min_cos);
+	ap.add_argument("quant", type_string, "store the embeddings as 'f16' or 'i8' in memory while searching (smaller, and faster for large files)");
+	ap.add_argument("encoders", type_int, "number of encoder threads (each with its own model context) for compiling embeddings", &n_encoders);
+	ap.add_argument("batch", type_int, "number of chunks per batch when compiling embeddings; using this or 'encoders' selects the pipelined indexer", &batch_size);
+	ap.add_argument("bench", type_none, "compile the folder with both the per-chunk and the pipelined indexers, and report chunks per second", &bench);
 	ap.add_argument("per_file", type_none, "show the best match for every file known to the embedding manager", &show_per_file);
 	ap.ensure_args(argc, argv);
 
@@ -106,6 +144,7 @@ int app_main() {
 	ap.value_str("in", in_file);
 	ap.value_str("search", search);
 	ap.value_str("model", model);
+	ap.value_str("quant", quant);
 	
 	if (search.empty() && folder.empty()) {
 		codehappy_cerr << "*** Error: if you're compiling an embeddings file, you must provide a folder containing text documents.\n";
@@ -115,11 +154,22 @@ int app_main() {
 
 	BertEmbeddingManager bert(model);
 	bert.set_nsentences(n_sentences);
+	bert.set_nencoders(n_encoders);
+	bert.set_batch_size(batch_size);
+
+	if (bench) {
+		if (folder.empty()) {
+			codehappy_cerr << "*** Error: 'bench' needs a folder of text documents.\n";
+			return 1;
+		}
+		bench_folder_embeddings(bert, folder);
+		return 0;
+	}
 
 	if (search.empty())
 		compile_folder_embeddings(bert, folder, out_file);
 	else
-		do_embedding_search(bert, search, in_file, max_matches, min_cos, show_per_file);
+		do_embedding_search(bert, search, in_file, max_matches, min_cos, show_per_file, quant);
 
 	return 0;
 }
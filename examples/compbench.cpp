@@ -0,0 +1,152 @@
+/***
+
+	compbench.cpp
+
+	Compression benchmark for the framed (chunked) container: compression ratio, compress and decompress
+	throughput, and random 4 KB read latency through a FramedReader, across LZF, zlib levels, and block sizes.
+	Compares against compressing the whole buffer in one single-threaded call, as RamFiles used to.
+
+	Call: compbench [file] [/mb N] [/threads N]
+	With no file, N MB (default 64) of synthetic text-like data is used.
+
+	2024, C. M. Street
+
+***/
+#define CODEHAPPY_NATIVE
+#include <libcodehappy.h>
+#include <random>
+
+static void synthetic_data(std::vector<u8>& data, u64 nbytes) {
+	static const char* words[] = { "the", "of", "and", "a", "to", "in", "is", "you", "that", "it", "he", "was", "for",
+		"on", "are", "as", "with", "his", "they", "I", "at", "be", "this", "have", "from", "or", "one", "had", "by",
+		"word", "but", "not", "what", "all", "were", "we", "when", "your", "can", "said", "compression", "block" };
+	const int nwords = sizeof(words) / sizeof(words[0]);
+	std::mt19937 rng(1234);
+
+	data.clear();
+	data.reserve(nbytes);
+	while (data.size() < nbytes) {
+		if (rng() % 50 == 0) {
+			// a run of noise, so it isn't all easy.
+			for (int e = 0; e < 64; ++e)
+				data.push_back(u8(rng()));
+			continue;
+		}
+		const char* w = words[rng() % nwords];
+		data.insert(data.end(), w, w + strlen(w));
+		data.push_back((rng() % 12 == 0) ? '\n' : ' ');
+	}
+	data.resize(nbytes);
+}
+
+static double mb_per_sec(u64 nbytes, u64 us) {
+	return (double) nbytes / (double) std::max(us, (u64) 1);
+}
+
+/* Compress and decompress the whole buffer in one call, on one thread. */
+static void bench_whole(const std::vector<u8>& data, bool zlib) {
+	std::vector<u8> cbuf, dbuf(data.size());
+	Stopwatch sw;
+	u64 cus, dus;
+	u32 method;
+
+	sw.start();
+	method = framed_compress_block(data.data(), (u32) data.size(), cbuf, zlib ? FRAMED_ZLIB : FRAMED_LZF, 6);
+	cus = sw.stop(UNIT_MICROSECOND);
+
+	sw.start();
+	bool ok = framed_decompress_block(cbuf.data(), (u32) cbuf.size(), method, dbuf.data(), (u32) dbuf.size());
+	dus = sw.stop(UNIT_MICROSECOND);
+
+	printf("%-10s %9s %7.3f %12.1f %12.1f %12s\n", zlib ? "zlib-6" : "LZF", "whole", (double) cbuf.size() / data.size(),
+		mb_per_sec(data.size(), cus), mb_per_sec(data.size(), dus), "-");
+	if (!ok || dbuf != data)
+		printf("  ** round trip mismatch!\n");
+}
+
+static void bench_framed(const std::vector<u8>& data, FramedCodec codec, int level, u32 block_size, ThreadPool& pool) {
+	Scratchpad comp, decomp;
+	Stopwatch sw;
+	u64 cus, dus, rus;
+	const int NREADS = 2000;
+	char name[32];
+
+	sw.start();
+	framed_compress(data.data(), data.size(), comp, block_size, codec, level, &pool);
+	cus = sw.stop(UNIT_MICROSECOND);
+
+	sw.start();
+	framed_decompress(comp, decomp, &pool);
+	dus = sw.stop(UNIT_MICROSECOND);
+	if (decomp.length() != data.size() || memcmp(decomp.buffer(), data.data(), data.size()) != 0)
+		printf("  ** round trip mismatch!\n");
+
+	// random 4 KB reads: each one decompresses at most a couple of blocks.
+	FramedReader fr;
+	std::mt19937 rng(99);
+	u8 buf[4096];
+	fr.open(comp);
+	sw.start();
+	for (int e = 0; e < NREADS; ++e)
+		fr.read_at(rng() % data.size(), buf, sizeof(buf));
+	rus = sw.stop(UNIT_MICROSECOND);
+
+	switch (codec) {
+	case FRAMED_LZF:
+		sprintf(name, "LZF");
+		break;
+	case FRAMED_ZLIB:
+		sprintf(name, "zlib-%d", level);
+		break;
+	case FRAMED_BEST:
+		sprintf(name, "best");
+		break;
+	default:
+		sprintf(name, "stored");
+		break;
+	}
+	printf("%-10s %8uK %7.3f %12.1f %12.1f %12.1f\n", name, block_size / 1024, (double) comp.length() / data.size(),
+		mb_per_sec(data.size(), cus), mb_per_sec(data.size(), dus), (double) rus / NREADS);
+}
+
+int app_main() {
+	ArgParse ap;
+	std::vector<u8> data;
+	int mb = 64, threads = 0;
+
+	ap.add_argument("mb", type_int, "size of the synthetic data in MB, if no file is given (default is 64)", &mb);
+	ap.add_argument("threads", type_int, "number of threads (default is one per hardware thread)", &threads);
+	ap.ensure_args(argc, argv);
+
+	if (ap.nonflag_args() > 0) {
+		std::string path;
+		ap.nonflag_arg(0, path);
+		RamFile rf(path, RAMFILE_READONLY | RAMFILE_MMAP);
+		if (rf.size() == 0) {
+			codehappy_cerr << "Unable to read " << path << "\n";
+			return 1;
+		}
+		data.assign(rf.buffer(), rf.buffer() + rf.size());
+	} else {
+		synthetic_data(data, (u64) std::max(mb, 1) * 1024 * 1024);
+	}
+
+	ThreadPool pool(threads);
+	printf("%llu bytes, %d threads\n\n", (unsigned long long) data.size(), pool.size());
+	printf("%-10s %9s %7s %12s %12s %12s\n", "codec", "block", "ratio", "comp MB/s", "decomp MB/s", "4K read us");
+	bench_whole(data, false);
+	bench_whole(data, true);
+
+	const u32 block_sizes[] = { 64 * 1024, 256 * 1024, 1024 * 1024 };
+	for (u32 bs : block_sizes) {
+		bench_framed(data, FRAMED_LZF, 0, bs, pool);
+		bench_framed(data, FRAMED_ZLIB, 1, bs, pool);
+		bench_framed(data, FRAMED_ZLIB, 6, bs, pool);
+		bench_framed(data, FRAMED_ZLIB, 9, bs, pool);
+		bench_framed(data, FRAMED_BEST, 6, bs, pool);
+	}
+
+	return 0;
+}
+
+/* end compbench.cpp */
@@ -0,0 +1,134 @@
+/***
+
+	convbench.cpp
+
+	Benchmark for FFT convolution against direct convolution, across impulse response lengths and block
+	sizes; then the reverb, EQ and resampling filters on a stereo signal, with a thread per channel.
+	Throughput is in samples per second (of one channel), and as a multiple of real time at 44.1 kHz.
+
+	Call: convbench [/seconds N] [/threads N]
+	N (default 10) is the length of the test signal.
+
+	2024, C. M. Street
+
+***/
+#define CODEHAPPY_NATIVE
+#include <libcodehappy.h>
+#include <random>
+
+/* Direct convolution is only timed on as much of the signal as this many multiply-adds. */
+const double DIRECT_BUDGET = 2e9;
+
+static double msamples(u64 n, u64 us) {
+	return (double) n / (double) std::max(us, (u64) 1);
+}
+
+static void report(const char* name, u64 n, u64 us, double err) {
+	printf("  %-26s %10.2f Ms/s %9.1fx", name, msamples(n, us), msamples(n, us) * 1e6 / 44100.0);
+	if (err >= 0.0)
+		printf("   max err %.2g", err);
+	printf("\n");
+}
+
+static void bench_ir(const std::vector<float>& x, u32 m, std::mt19937& rng) {
+	std::uniform_real_distribution<float> uni(-1.0f, 1.0f);
+	std::vector<float> h(m);
+	for (u32 e = 0; e < m; ++e)
+		h[e] = uni(rng) * expf(-5.0f * e / m) / sqrtf((float) m);
+
+	// Direct, on a slice.
+	const u32 nd = (u32) std::min((double) x.size(), std::max(DIRECT_BUDGET / m, 4096.0));
+	std::vector<float> yd(nd + m - 1);
+	Stopwatch sw;
+	sw.start();
+	convolve_direct(x.data(), nd, h.data(), m, yd.data());
+	u64 us = sw.stop(UNIT_MICROSECOND);
+
+	printf("impulse response %u samples:\n", m);
+	report("direct", nd, us, -1.0);
+
+	const u32 blocks[] = { 64, 256, 1024, 4096 };
+	for (u32 bs : blocks) {
+		if (bs > 4 * m && bs > 64)
+			continue;
+		PartitionedConvolver pc;
+		pc.init(h.data(), m, bs);
+		const u32 n = (u32) (x.size() / bs) * bs;
+		std::vector<float> y(n);
+		sw.start();
+		for (u32 s = 0; s < n; s += bs)
+			pc.process_block(x.data() + s, y.data() + s);
+		us = sw.stop(UNIT_MICROSECOND);
+
+		double err = 0.0;
+		for (u32 e = 0; e < std::min(n, nd); ++e)
+			err = std::max(err, (double) fabs(y[e] - yd[e]));
+		char name[64];
+		sprintf(name, "partitioned, block %u", bs);
+		report(name, n, us, err);
+	}
+}
+
+int app_main() {
+	ArgParse ap;
+	int seconds = 10, threads = 0;
+
+	ap.add_argument("seconds", type_int, "length of the test signal in seconds (default is 10)", &seconds);
+	ap.add_argument("threads", type_int, "number of threads (default is one per hardware thread)", &threads);
+	ap.ensure_args(argc, argv);
+
+	const u32 sr = 44100, n = (u32) std::max(seconds, 1) * sr;
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<float> uni(-0.5f, 0.5f);
+	std::vector<float> x(n);
+	for (float& v : x)
+		v = uni(rng);
+
+	ThreadPool pool(threads);
+	printf("%u samples, %d threads\n\n", n, pool.size());
+
+	const u32 irs[] = { 64, 256, 1024, 4096, 16384, 65536 };
+	for (u32 m : irs)
+		bench_ir(x, m, rng);
+
+	// The filters, on a stereo bus.
+	MixBus bus(2, sr);
+	bus.resize(n);
+	for (u32 e = 0; e < n * 2; ++e)
+		bus.data()[e] = uni(rng);
+	Stopwatch sw;
+	u64 us;
+
+	printf("\nfilters, stereo:\n");
+	{
+		MixBus b = bus;
+		ReverbParams rp;
+		rp.decay_sec = 2.0f;
+		sw.start();
+		bus_reverb(b, rp, &pool);
+		us = sw.stop(UNIT_MICROSECOND);
+		report("reverb, 2 s", n, us, -1.0);
+	}
+	{
+		MixBus b = bus;
+		std::vector<EqBand> bands = { { 80.0f, 4.0f }, { 400.0f, -2.0f }, { 3000.0f, 1.0f }, { 10000.0f, -6.0f } };
+		sw.start();
+		bus_eq(b, bands, 2047, &pool);
+		us = sw.stop(UNIT_MICROSECOND);
+		report("eq, 2047 taps", n, us, -1.0);
+	}
+	const u32 rates[] = { 48000, 22050, 96000 };
+	for (u32 r : rates) {
+		MixBus out;
+		char name[64];
+		sw.start();
+		bus_resample(bus, out, r, 24, &pool);
+		us = sw.stop(UNIT_MICROSECOND);
+		sprintf(name, "resample to %u", r);
+		report(name, n, us, -1.0);
+	}
+
+	return 0;
+}
+
+/* end convbench.cpp */
@@ -0,0 +1,179 @@
+/***
+
+	deltabench.cpp
+
+	Benchmark for binary deltas between large files: indexing the source and encoding the delta, on one
+	thread and on all of them, then applying the delta, checking that it rebuilds the target.
+
+	Call: deltabench [/src FILE /tgt FILE] [/mb N] [/edits N] [/chunk N] [/threads N] [/dir DIR]
+	Without a source and target, a synthetic pair of N MB (default 2048) is written to DIR (default /tmp),
+	the target being the source with N (default 10000) scattered insertions, deletions and overwrites.
+
+	2024, C. M. Street
+
+***/
+#define CODEHAPPY_NATIVE
+#include <libcodehappy.h>
+#include <random>
+
+#define	BLOCK	(1 << 20)
+
+static u64 sink;
+
+/* Block b of the synthetic source: the same every time it's asked for. */
+static void source_block(u64 b, std::vector<u8>& out) {
+	std::mt19937_64 rng(b * 7919 + 1);
+	out.resize(BLOCK);
+	for (u32 e = 0; e < BLOCK; e += 8) {
+		const u64 v = rng();
+		memcpy(out.data() + e, &v, 8);
+	}
+}
+
+static bool write_pair(const std::string& src_fn, const std::string& tgt_fn, u64 mb, u64 nedits) {
+	FILE* fs = fopen(src_fn.c_str(), "wb");
+	FILE* ft = fopen(tgt_fn.c_str(), "wb");
+	std::vector<u8> blk;
+	std::mt19937_64 rng(17);
+	bool ok = not_null(fs) && not_null(ft);
+
+	for (u64 b = 0; b < mb && ok; ++b) {
+		source_block(b, blk);
+		ok = fwrite(blk.data(), 1, blk.size(), fs) == blk.size();
+		// this block's share of the edits, back to front so the positions stay put
+		u64 n = nedits / mb + (b < nedits % mb ? 1 : 0);
+		std::vector<u32> pos(n);
+		for (auto& p : pos)
+			p = (u32) (rng() % (BLOCK - 512));
+		std::sort(pos.begin(), pos.end());
+		for (u64 e = n; e-- > 0; ) {
+			const u32 len = 1 + (u32) (rng() % 256);
+			switch (rng() % 3) {
+			case 0:
+				blk.insert(blk.begin() + pos[e], len, (u8) rng());
+				break;
+			case 1:
+				blk.erase(blk.begin() + pos[e], blk.begin() + pos[e] + len);
+				break;
+			default:
+				for (u32 i = 0; i < len; ++i)
+					blk[pos[e] + i] ^= (u8) (i + 1);
+				break;
+			}
+		}
+		ok = ok && fwrite(blk.data(), 1, blk.size(), ft) == blk.size();
+	}
+	if (not_null(fs))
+		ok = (fclose(fs) == 0) && ok;
+	if (not_null(ft))
+		ok = (fclose(ft) == 0) && ok;
+	return ok;
+}
+
+static bool same_files(const std::string& a, const std::string& b) {
+	RamFile ra, rb;
+	if (ra.open(a, RAMFILE_READ | RAMFILE_MMAP) || rb.open(b, RAMFILE_READ | RAMFILE_MMAP))
+		return false;
+	return ra.size() == rb.size() && (ra.size() == 0 || memcmp(ra.buffer(), rb.buffer(), (size_t) ra.size()) == 0);
+}
+
+static void bench_encode(const std::string& src_fn, const std::string& tgt_fn, const std::string& delta_fn, u32 chunk,
+			 ThreadPool& pool, const char* name) {
+	RamFile src, tgt;
+	BinDeltaIndex idx;
+	BinDeltaStats st;
+	Stopwatch sw;
+	u64 us_index, us_encode;
+
+	if (src.open(src_fn, RAMFILE_READ | RAMFILE_MMAP) || tgt.open(tgt_fn, RAMFILE_READ | RAMFILE_MMAP)) {
+		printf("Couldn't open %s or %s\n", src_fn.c_str(), tgt_fn.c_str());
+		return;
+	}
+	// touch both files first, so the times don't include reading them from disk
+	for (u64 e = 0; e < src.size(); e += 4096)
+		sink += src.buffer()[e];
+	for (u64 e = 0; e < tgt.size(); e += 4096)
+		sink += tgt.buffer()[e];
+
+	sw.start();
+	idx.build(src.buffer(), src.size(), chunk, &pool);
+	us_index = sw.stop(UNIT_MICROSECOND);
+	FILE* f = fopen(delta_fn.c_str(), "wb");
+	sw.start();
+	bool ok = not_null(f) && idx.encode(tgt.buffer(), tgt.size(), f, &st, &pool);
+	us_encode = sw.stop(UNIT_MICROSECOND);
+	if (not_null(f))
+		fclose(f);
+
+	printf("%s:\n", name);
+	printf("  %-30s %10.1f ms %8.2f GB/s  (%llu chunks)\n", "index the source:", us_index / 1000.0,
+		(double) src.size() / 1e3 / std::max(us_index, (u64) 1), (unsigned long long) idx.chunk_count());
+	printf("  %-30s %10.1f ms %8.2f GB/s%s\n", "encode the delta:", us_encode / 1000.0,
+		(double) tgt.size() / 1e3 / std::max(us_encode, (u64) 1), ok ? "" : "  ** write failed!");
+	printf("  delta %llu bytes: %llu copies of %llu bytes, %llu adds of %llu bytes\n", (unsigned long long) st.delta_size,
+		(unsigned long long) st.ncopies, (unsigned long long) st.copied, (unsigned long long) st.nadds,
+		(unsigned long long) st.added);
+}
+
+int app_main() {
+	ArgParse ap;
+	int mb = 2048, nedits = 10000, chunk = BINDELTA_CHUNK_DEFAULT, threads = 0;
+	std::string src_fn, tgt_fn, dir = "/tmp";
+	bool synthetic;
+
+	ap.add_argument("src", type_string, "the source file");
+	ap.add_argument("tgt", type_string, "the target file");
+	ap.add_argument("mb", type_int, "size of the synthetic files in MB (default is 2048)", &mb);
+	ap.add_argument("edits", type_int, "number of edits in the synthetic target (default is 10000)", &nedits);
+	ap.add_argument("chunk", type_int, "average chunk size (default is 2048)", &chunk);
+	ap.add_argument("threads", type_int, "number of threads (default is one per hardware thread)", &threads);
+	ap.add_argument("dir", type_string, "where to write the synthetic files and the delta (default is /tmp)");
+	ap.ensure_args(argc, argv);
+	if (ap.flag_present("src"))
+		ap.value_str("src", src_fn);
+	if (ap.flag_present("tgt"))
+		ap.value_str("tgt", tgt_fn);
+	if (ap.flag_present("dir"))
+		ap.value_str("dir", dir);
+
+	synthetic = src_fn.empty() || tgt_fn.empty();
+	if (synthetic) {
+		src_fn = dir + "/deltabench.src";
+		tgt_fn = dir + "/deltabench.tgt";
+		printf("Writing %d MB source and target with %d edits...\n", mb, nedits);
+		if (!write_pair(src_fn, tgt_fn, (u64) std::max(mb, 1), (u64) std::max(nedits, 0))) {
+			printf("Couldn't write the files in %s\n", dir.c_str());
+			return 1;
+		}
+	}
+	const std::string delta_fn = dir + "/deltabench.delta", out_fn = dir + "/deltabench.out";
+	printf("source %llu bytes, target %llu bytes\n\n", (unsigned long long) flength_64(src_fn.c_str()),
+		(unsigned long long) flength_64(tgt_fn.c_str()));
+
+	ThreadPool one(1), pool(threads);
+	bench_encode(src_fn, tgt_fn, delta_fn, (u32) chunk, one, "1 thread");
+	if (pool.size() > 1) {
+		char name[64];
+		sprintf(name, "%d threads", pool.size());
+		bench_encode(src_fn, tgt_fn, delta_fn, (u32) chunk, pool, name);
+	}
+
+	Stopwatch sw;
+	sw.start();
+	bool ok = bindelta_apply(src_fn.c_str(), delta_fn.c_str(), out_fn.c_str());
+	u64 us = sw.stop(UNIT_MICROSECOND);
+	ok = ok && same_files(out_fn, tgt_fn);
+	printf("apply the delta, to a file:\n");
+	printf("  %-30s %10.1f ms %8.2f GB/s%s\n", "", us / 1000.0, (double) flength_64(tgt_fn.c_str()) / 1e3 / std::max(us, (u64) 1),
+		ok ? "" : "  ** mismatch!");
+
+	remove(delta_fn.c_str());
+	remove(out_fn.c_str());
+	if (synthetic) {
+		remove(src_fn.c_str());
+		remove(tgt_fn.c_str());
+	}
+	return (int) (sink & 0);
+}
+
+/* end deltabench.cpp */
@@ -0,0 +1,135 @@
+/***
+
+	entbench.cpp
+
+	Entropy coder benchmark: compression ratio and encode/decode throughput for the Huffman coder (with the
+	lookup-table decoder and the original bit-at-a-time one), rANS with static and adaptive models at 4 and 8
+	ways, and zlib (miniz) for comparison.
+
+	Call: entbench [file] [/mb N]
+	With no file, N MB (default 16) of synthetic skewed data is used.
+
+	2024, C. M. Street
+
+***/
+#define CODEHAPPY_NATIVE
+#include <libcodehappy.h>
+#include <random>
+
+/* Order-0 skewed data, with a change of alphabet halfway so the adaptive model has something to adapt to. */
+static void synthetic_data(std::vector<u8>& data, u64 nbytes) {
+	std::mt19937 rng(1234);
+	std::geometric_distribution<int> geo(0.15);
+
+	data.resize(nbytes);
+	for (u64 e = 0; e < nbytes; ++e) {
+		int v = std::min(geo(rng), 63);
+		data[e] = (e < nbytes / 2) ? u8('a' + v) : u8(0x80 + v * 2);
+	}
+}
+
+static double mb_per_sec(u64 nbytes, u64 us) {
+	return (double) nbytes / (double) std::max(us, (u64) 1);
+}
+
+static void report(const char* name, const std::vector<u8>& data, u64 clen, u64 cus, u64 dus, bool ok) {
+	printf("%-18s %7.3f %12.1f %12.1f%s\n", name, (double) clen / std::max(data.size(), (size_t) 1),
+		mb_per_sec(data.size(), cus), mb_per_sec(data.size(), dus), ok ? "" : "  ** round trip mismatch!");
+}
+
+static void bench_huffman(const std::vector<u8>& data, bool reference) {
+	std::vector<char> cbuf(data.size() + data.size() / 2 + 1024);
+	Stopwatch sw;
+	u64 cus, dus;
+	u32 clen = 0, dlen;
+	char* dbuf;
+
+	sw.start();
+	entropy_compress_membuf((char*) data.data(), (u32) data.size(), cbuf.data(), (u32) cbuf.size(), &clen);
+	cus = sw.stop(UNIT_MICROSECOND);
+
+	sw.start();
+	if (reference)
+		entropy_decompress_membuf_reference(cbuf.data(), clen, &dbuf, &dlen);
+	else
+		entropy_decompress_membuf(cbuf.data(), clen, &dbuf, &dlen);
+	dus = sw.stop(UNIT_MICROSECOND);
+
+	report(reference ? "huffman (bitwise)" : "huffman (table)", data, clen, cus, dus,
+		dlen == data.size() && memcmp(dbuf, data.data(), dlen) == 0);
+	delete [] dbuf;
+}
+
+static void bench_rans(const std::vector<u8>& data, RansModel model, u32 ways) {
+	std::vector<u8> cbuf, dbuf;
+	Stopwatch sw;
+	u64 cus, dus;
+	char name[32];
+
+	sw.start();
+	rans_compress(data.data(), data.size(), cbuf, model, ways);
+	cus = sw.stop(UNIT_MICROSECOND);
+
+	sw.start();
+	bool ok = rans_decompress(cbuf.data(), cbuf.size(), dbuf);
+	dus = sw.stop(UNIT_MICROSECOND);
+
+	sprintf(name, "rans %s x%u", model == RANS_STATIC ? "static" : "adaptive", ways);
+	report(name, data, cbuf.size(), cus, dus, ok && dbuf == data);
+}
+
+static void bench_zlib(const std::vector<u8>& data, int level) {
+	std::vector<u8> cbuf, dbuf(data.size());
+	Stopwatch sw;
+	u64 cus, dus;
+	u32 method;
+	char name[32];
+
+	sw.start();
+	method = framed_compress_block(data.data(), (u32) data.size(), cbuf, FRAMED_ZLIB, level);
+	cus = sw.stop(UNIT_MICROSECOND);
+
+	sw.start();
+	bool ok = framed_decompress_block(cbuf.data(), (u32) cbuf.size(), method, dbuf.data(), (u32) dbuf.size());
+	dus = sw.stop(UNIT_MICROSECOND);
+
+	sprintf(name, "zlib-%d", level);
+	report(name, data, cbuf.size(), cus, dus, ok && dbuf == data);
+}
+
+int app_main() {
+	ArgParse ap;
+	std::vector<u8> data;
+	int mb = 16;
+
+	ap.add_argument("mb", type_int, "size of the synthetic data in MB, if no file is given (default is 16)", &mb);
+	ap.ensure_args(argc, argv);
+
+	if (ap.nonflag_args() > 0) {
+		std::string path;
+		ap.nonflag_arg(0, path);
+		RamFile rf(path, RAMFILE_READONLY | RAMFILE_MMAP);
+		if (rf.size() == 0) {
+			codehappy_cerr << "Unable to read " << path << "\n";
+			return 1;
+		}
+		data.assign(rf.buffer(), rf.buffer() + rf.size());
+	} else {
+		synthetic_data(data, (u64) std::max(mb, 1) * 1024 * 1024);
+	}
+
+	printf("%llu bytes\n\n", (unsigned long long) data.size());
+	printf("%-18s %7s %12s %12s\n", "coder", "ratio", "comp MB/s", "decomp MB/s");
+	bench_huffman(data, true);
+	bench_huffman(data, false);
+	bench_rans(data, RANS_STATIC, 4);
+	bench_rans(data, RANS_STATIC, 8);
+	bench_rans(data, RANS_ADAPTIVE, 4);
+	bench_rans(data, RANS_ADAPTIVE, 8);
+	bench_zlib(data, 1);
+	bench_zlib(data, 6);
+
+	return 0;
+}
+
+/* end entbench.cpp */
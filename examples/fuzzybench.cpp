@@ -0,0 +1,237 @@
+/***
+
+	fuzzybench.cpp
+
+	Benchmark for the bit-parallel edit distance against the textbook dynamic-programming one, on short
+	words and on long strings with and without a distance threshold; then fuzzy dictionary search, a query
+	at a time across the threads and many queries at once, against a plain scan of the dictionary.
+
+	Call: fuzzybench [/words N] [/dict FILE] [/queries N] [/threads N]
+	N (default 1000000) synthetic words are used, unless a word list (one word per line) is given.
+
+	2024, C. M. Street
+
+***/
+#define CODEHAPPY_NATIVE
+#include <libcodehappy.h>
+#include <fstream>
+#include <random>
+
+static u64 sink;
+
+static double ns_per(u64 us, u64 n) {
+	return 1000.0 * (double) us / (double) std::max(n, (u64) 1);
+}
+
+/* The row-at-a-time dynamic-programming distance, for comparison. */
+static u32 dp_distance(const std::string& a, const std::string& b, std::vector<u32>& row) {
+	row.resize(b.size() + 1);
+	for (u32 j = 0; j <= b.size(); ++j)
+		row[j] = j;
+	for (u32 i = 1; i <= a.size(); ++i) {
+		u32 diag = row[0];
+		row[0] = i;
+		for (u32 j = 1; j <= b.size(); ++j) {
+			const u32 up = row[j];
+			row[j] = std::min(std::min(up, row[j - 1]) + 1, diag + (a[i - 1] != b[j - 1] ? 1 : 0));
+			diag = up;
+		}
+	}
+	return row[b.size()];
+}
+
+/* Letters roughly in English proportions, in words of 2 to 15 letters. */
+static std::string random_word(std::mt19937& rng) {
+	static const char* letters = "eeeeeeeeeeeettttttttaaaaaaaooooooiiiiiinnnnnnsssssshhhhhhrrrrrrddddllllccuummwwffggyyppbbvkjxqz";
+	static const u32 nl = (u32) strlen(letters);
+	std::string w;
+	const u32 len = 2 + (rng() % 7) + (rng() % 8);
+	for (u32 e = 0; e < len; ++e)
+		w += letters[rng() % nl];
+	return w;
+}
+
+/* A dictionary word with a few random edits. */
+static std::string typo(const std::string& w, u32 nedits, std::mt19937& rng) {
+	std::string s = w;
+	for (u32 e = 0; e < nedits; ++e) {
+		const u32 p = (u32) (rng() % (s.size() + 1));
+		switch (rng() % 3) {
+		case 0:
+			s.insert(s.begin() + p, 'a' + rng() % 26);
+			break;
+		case 1:
+			if (p < s.size())
+				s.erase(s.begin() + p);
+			break;
+		default:
+			if (p < s.size())
+				s[p] = 'a' + rng() % 26;
+			break;
+		}
+	}
+	return s;
+}
+
+static void bench_pairs(const std::vector<std::string>& words, std::mt19937& rng) {
+	const u32 npairs = 1000000;
+	std::vector<u32> ia(npairs), ib(npairs), row;
+	for (u32 e = 0; e < npairs; ++e) {
+		ia[e] = rng() % words.size();
+		ib[e] = rng() % words.size();
+	}
+	Stopwatch sw;
+	u64 c = 0, us_dp, us_bp, us_k;
+	bool agree = true;
+
+	sw.start();
+	for (u32 e = 0; e < npairs; ++e)
+		c += dp_distance(words[ia[e]], words[ib[e]], row);
+	us_dp = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u32 e = 0; e < npairs; ++e)
+		c += edit_distance(words[ia[e]], words[ib[e]]);
+	us_bp = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u32 e = 0; e < npairs; ++e)
+		c += edit_distance(words[ia[e]], words[ib[e]], 2);
+	us_k = sw.stop(UNIT_MICROSECOND);
+	for (u32 e = 0; e < 10000; ++e)
+		agree = agree && dp_distance(words[ia[e]], words[ib[e]], row) == edit_distance(words[ia[e]], words[ib[e]]);
+	sink += c;
+
+	printf("word pairs:\n");
+	printf("  %-36s %10.1f ns\n", "dynamic programming:", ns_per(us_dp, npairs));
+	printf("  %-36s %10.1f ns%s\n", "edit_distance():", ns_per(us_bp, npairs), agree ? "" : "  ** mismatch!");
+	printf("  %-36s %10.1f ns\n", "edit_distance(), max 2:", ns_per(us_k, npairs));
+}
+
+static void bench_long(u32 len, std::mt19937& rng) {
+	std::string a, b;
+	std::vector<u32> row;
+	for (u32 e = 0; e < len; ++e)
+		a += 'a' + rng() % 4;
+	b = typo(a, len / 50, rng);
+	// the ends differ too, so the common prefix and suffix don't do all the work
+	a[0] = 'x';
+	b[b.size() - 1] = 'y';
+	Stopwatch sw;
+	u64 us_dp, us_bp, us_k;
+	u32 d_dp, d_bp, d_k;
+	const u32 reps = 20;
+
+	sw.start();
+	for (u32 r = 0; r < reps; ++r)
+		d_dp = dp_distance(a, b, row);
+	us_dp = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u32 r = 0; r < reps; ++r)
+		d_bp = edit_distance(a, b);
+	us_bp = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u32 r = 0; r < reps; ++r)
+		d_k = edit_distance(a, b, len / 20);
+	us_k = sw.stop(UNIT_MICROSECOND);
+
+	printf("strings of %u characters, distance %u:\n", len, d_dp);
+	printf("  %-36s %10.1f us\n", "dynamic programming:", (double) us_dp / reps);
+	printf("  %-36s %10.1f us%s\n", "edit_distance():", (double) us_bp / reps, d_bp == d_dp ? "" : "  ** mismatch!");
+	char name[64];
+	sprintf(name, "edit_distance(), max %u:", len / 20);
+	printf("  %-36s %10.1f us%s\n", name, (double) us_k / reps, d_k == std::min(d_dp, len / 20 + 1) ? "" : "  ** mismatch!");
+}
+
+static void bench_search(const FuzzyDictionary& dict, const std::vector<std::string>& queries, u32 k, ThreadPool& pool) {
+	std::vector<FuzzyMatch> matches;
+	std::vector<std::vector<FuzzyMatch>> many;
+	std::vector<u32> row;
+	Stopwatch sw;
+	u64 c = 0, us_one, us_many, us_scan;
+
+	sw.start();
+	for (const std::string& q : queries) {
+		dict.search(q.c_str(), (u32) q.size(), k, matches, &pool);
+		c += matches.size();
+	}
+	us_one = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	dict.search_many(queries, k, many, &pool);
+	us_many = sw.stop(UNIT_MICROSECOND);
+	u64 c_many = 0;
+	for (const auto& m : many)
+		c_many += m.size();
+
+	// A plain scan of every word, for a couple of queries.
+	const u32 nscan = std::min((u32) queries.size(), 2U);
+	u64 c_scan = 0, c_check = 0;
+	sw.start();
+	for (u32 q = 0; q < nscan; ++q)
+		for (u32 w = 0; w < dict.size(); ++w)
+			c_scan += (dp_distance(queries[q], dict.word(w), row) <= k);
+	us_scan = sw.stop(UNIT_MICROSECOND);
+	for (u32 q = 0; q < nscan; ++q)
+		c_check += many[q].size();
+	sink += c;
+
+	printf("search within %u edits: %.1f matches per query\n", k, (double) c / queries.size());
+	printf("  %-36s %10.0f queries/s\n", "scan with dynamic programming:", nscan * 1e6 / std::max(us_scan, (u64) 1));
+	printf("  %-36s %10.0f queries/s\n", "search(), a query at a time:", queries.size() * 1e6 / std::max(us_one, (u64) 1));
+	printf("  %-36s %10.0f queries/s%s\n", "search_many():", queries.size() * 1e6 / std::max(us_many, (u64) 1),
+		(c_many == c && c_check == c_scan) ? "" : "  ** mismatch!");
+}
+
+int app_main() {
+	ArgParse ap;
+	int nwords = 1000000, nqueries = 1000, threads = 0;
+	std::string dict_path;
+
+	ap.add_argument("words", type_int, "number of synthetic words (default is 1000000)", &nwords);
+	ap.add_argument("dict", type_string, "word list to use instead, one word per line");
+	ap.add_argument("queries", type_int, "number of search queries (default is 1000)", &nqueries);
+	ap.add_argument("threads", type_int, "number of threads (default is one per hardware thread)", &threads);
+	ap.ensure_args(argc, argv);
+	nqueries = std::max(nqueries, 2);
+	if (ap.flag_present("dict"))
+		ap.value_str("dict", dict_path);
+
+	std::mt19937 rng(11);
+	std::vector<std::string> words;
+	if (!dict_path.empty()) {
+		std::ifstream in(dict_path);
+		std::string line;
+		while (std::getline(in, line)) {
+			while (!line.empty() && (line.back() == '\r' || line.back() == ' '))
+				line.pop_back();
+			if (!line.empty())
+				words.push_back(line);
+		}
+		if (words.empty()) {
+			printf("No words in %s\n", dict_path.c_str());
+			return 1;
+		}
+	} else {
+		for (int e = 0; e < std::max(nwords, 100); ++e)
+			words.push_back(random_word(rng));
+	}
+
+	ThreadPool pool(threads);
+	FuzzyDictionary dict;
+	for (const std::string& w : words)
+		dict.add(w);
+	printf("%u words, %d threads\n\n", dict.size(), pool.size());
+
+	bench_pairs(words, rng);
+	bench_long(500, rng);
+	bench_long(5000, rng);
+	printf("\n");
+
+	std::vector<std::string> queries;
+	for (int e = 0; e < nqueries; ++e)
+		queries.push_back(typo(words[rng() % words.size()], 1 + rng() % 2, rng));
+	for (u32 k = 0; k <= 3; ++k)
+		bench_search(dict, queries, k, pool);
+
+	return (int) (sink & 0);
+}
+
+/* end fuzzybench.cpp */
@@ -4,7 +4,8 @@
 	
 	Compiles a text dataset to use for LoRA training. Give it a folder containing .txt 
 	files and it will auto-split the text into paragraphs and output .json in the gpt4all 
-	format (prompt, response, source).
+	format (prompt, response, source). The files are streamed through reader threads to the
+	output, so the dataset needn't fit in memory.
 
 	May 2023, C. M. Street
 
@@ -16,9 +17,11 @@ int app_main() {
 	TextDataset dataset;
 	ArgParse ap;
 	std::string outname = "lora.json";
+	int threads = 0;
 
 	ap.add_argument("dir", type_string, "The folder containing .txt files comprising the dataset (required)");
 	ap.add_argument("out", type_string, "The path to the desired output .json (default is 'lora.json')");
+	ap.add_argument("threads", type_int, "Number of reader threads (default is one per hardware thread)", &threads);
 	ap.ensure_args(argc, argv);
 
 	if (!ap.flag_present("dir")) {
@@ -29,9 +32,11 @@ int app_main() {
 		outname = ap.value_str("out");
 	}
 
-	dataset.add_from_folder(ap.value_str("dir").c_str());
+	if (!dataset.stream_folder_json(ap.value_str("dir").c_str(), outname.c_str(), threads)) {
+		codehappy_cerr << "Couldn't write " << outname << "\n";
+		return 1;
+	}
 	dataset.show_stats();
-	dataset.output_training_json(outname.c_str());
 
 	return 0;
 }
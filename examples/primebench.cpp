@@ -0,0 +1,181 @@
+/***
+
+	primebench.cpp
+
+	Benchmark for the 64-bit number theory functions against the 32-bit ones: primality testing, smallest
+	prime factors and full factorization, listing the primes in a range, and the pi function.
+
+	Call: primebench [/n N] [/threads N]
+	N (default 1000000) is the number of values used for the per-number tests.
+
+	2024, C. M. Street
+
+***/
+#define CODEHAPPY_NATIVE
+#include <libcodehappy.h>
+#include <random>
+
+static u64 sink;
+
+static double ns_per(u64 us, u64 n) {
+	return 1000.0 * (double) us / (double) std::max(n, (u64) 1);
+}
+
+static void random_values(std::vector<u64>& vals, int n, int bits, u64 seed) {
+	std::mt19937_64 rng(seed);
+	vals.resize(n);
+	for (auto& v : vals)
+		v = (rng() >> (64 - bits)) | 1;
+}
+
+static void bench_isprime(int n) {
+	std::vector<u64> v32, v64;
+	Stopwatch sw;
+	u64 c = 0, us32, us32_64, us64;
+
+	random_values(v32, n, 32, 1);
+	random_values(v64, n, 64, 2);
+
+	sw.start();
+	for (u64 v : v32)
+		c += isprime((u32) v);
+	us32 = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u64 v : v32)
+		c += isprime64(v);
+	us32_64 = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u64 v : v64)
+		c += isprime64(v);
+	us64 = sw.stop(UNIT_MICROSECOND);
+	sink += c;
+
+	printf("isprime, 32-bit odd values:          %10.1f ns\n", ns_per(us32, n));
+	printf("isprime64, 32-bit odd values:        %10.1f ns\n", ns_per(us32_64, n));
+	printf("isprime64, 64-bit odd values:        %10.1f ns\n", ns_per(us64, n));
+}
+
+static void bench_factor(int n) {
+	std::vector<u64> v32, v64, semi;
+	std::vector<u64> f;
+	std::mt19937_64 rng(3);
+	Stopwatch sw;
+	u64 c = 0, us_pf, us_pfs, us_f32, us_f64, us_semi;
+
+	random_values(v32, n, 32, 4);
+	random_values(v64, n / 10, 64, 5);
+	// products of two 32-bit primes: the hard case for rho.
+	semi.resize(n / 100);
+	for (auto& s : semi)
+		s = next_prime64(rng() >> 32) * next_prime64(rng() >> 32);
+
+	sw.start();
+	for (u64 v : v32)
+		c += prime_factor((u32) v);
+	us_pf = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u64 v : v32)
+		c += prime_factor_small((u32) v);
+	us_pfs = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u64 v : v32) {
+		factor64(v, f);
+		c += f.size();
+	}
+	us_f32 = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u64 v : v64) {
+		factor64(v, f);
+		c += f.size();
+	}
+	us_f64 = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	for (u64 v : semi) {
+		factor64(v, f);
+		c += f.size();
+	}
+	us_semi = sw.stop(UNIT_MICROSECOND);
+	sink += c;
+
+	printf("prime_factor, 32-bit:                %10.1f ns\n", ns_per(us_pf, v32.size()));
+	printf("prime_factor_small, 32-bit:          %10.1f ns\n", ns_per(us_pfs, v32.size()));
+	printf("factor64, 32-bit (full):             %10.1f ns\n", ns_per(us_f32, v32.size()));
+	printf("factor64, 64-bit (full):             %10.1f ns\n", ns_per(us_f64, v64.size()));
+	printf("factor64, 64-bit semiprimes:         %10.1f ns\n", ns_per(us_semi, semi.size()));
+}
+
+static void bench_range(u64 lo, u64 hi, ThreadPool& pool) {
+	std::vector<u64> primes;
+	Stopwatch sw;
+	u64 c = 0, us_walk, us_sieve;
+
+	sw.start();
+	if (hi <= 0xFFFFFFFFULL) {
+		for (u32 p = next_prime((u32) lo - 1); p != 0 && p <= hi; p = next_prime(p))
+			++c;
+	} else {
+		for (u64 p = next_prime64(lo - 1); p != 0 && p <= hi; p = next_prime64(p))
+			++c;
+	}
+	us_walk = sw.stop(UNIT_MICROSECOND);
+	sw.start();
+	prime_sieve(lo, hi, primes, &pool);
+	us_sieve = sw.stop(UNIT_MICROSECOND);
+
+	printf("primes in [%llu, %llu]: %llu\n", (unsigned long long) lo, (unsigned long long) hi, (unsigned long long) c);
+	printf("  %-34s %10.3f s\n", hi <= 0xFFFFFFFFULL ? "next_prime() walk:" : "next_prime64() walk:", us_walk / 1e6);
+	printf("  %-34s %10.3f s%s\n", "prime_sieve():", us_sieve / 1e6, primes.size() == c ? "" : "  ** count mismatch!");
+}
+
+static void bench_pi(u64 x, ThreadPool& pool) {
+	Stopwatch sw;
+	u64 us, pi64, pi_sieve = 0, us_sieve = 0;
+
+	printf("pi(%llu):\n", (unsigned long long) x);
+	if (x <= 0xFFFFFFFFULL) {
+		sw.start();
+		u32 pi32 = pi_function((u32) x);
+		us = sw.stop(UNIT_MICROSECOND);
+		printf("  %-34s %10.3f s  %u\n", "pi_function():", us / 1e6, pi32);
+
+		sw.start();
+		pi_sieve = prime_count(0, x, &pool);
+		us_sieve = sw.stop(UNIT_MICROSECOND);
+		printf("  %-34s %10.3f s  %llu\n", "prime_count():", us_sieve / 1e6, (unsigned long long) pi_sieve);
+	}
+	sw.start();
+	pi64 = pi_function64(x, &pool);
+	us = sw.stop(UNIT_MICROSECOND);
+	printf("  %-34s %10.3f s  %llu%s\n", "pi_function64():", us / 1e6, (unsigned long long) pi64,
+		(us_sieve == 0 || pi64 == pi_sieve) ? "" : "  ** mismatch!");
+}
+
+int app_main() {
+	ArgParse ap;
+	int n = 1000000, threads = 0;
+
+	ap.add_argument("n", type_int, "number of values for the per-number tests (default is 1000000)", &n);
+	ap.add_argument("threads", type_int, "number of threads (default is one per hardware thread)", &threads);
+	ap.ensure_args(argc, argv);
+	n = std::max(n, 100);
+
+	ThreadPool pool(threads);
+	printf("%d threads\n\n", pool.size());
+
+	bench_isprime(n);
+	bench_factor(n);
+	printf("\n");
+
+	bench_range(4000000000ULL, 4010000000ULL, pool);
+	bench_range(1ULL << 40, (1ULL << 40) + 10000000ULL, pool);
+	printf("\n");
+
+	bench_pi(4000000000ULL, pool);
+	bench_pi(100000000000ULL, pool);
+	bench_pi(1000000000000ULL, pool);
+	bench_pi(10000000000000ULL, pool);
+
+	return (int) (sink & 0);
+}
+
+/* end primebench.cpp */
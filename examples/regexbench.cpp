@@ -0,0 +1,147 @@
+/***
+
+	regexbench.cpp
+
+	Benchmark for RegexDFA: find_all() over log-like text, against regexec() a line at a time; then a timing
+	check that find() stays linear on text that makes a match-per-start search quadratic (a*b|c on a long
+	run of a's ending in c), doubling the length each time.
+
+	Call: regexbench [/mb N] [/file FILE] [/pattern P]
+	N MB (default 64) of synthetic log lines are used, unless a file is given. The default pattern is
+	"ERROR [a-z]+ [0-9]+".
+
+	2024, C. M. Street
+
+***/
+#define CODEHAPPY_NATIVE
+#include <libcodehappy.h>
+#include <random>
+
+static double mb_per_sec(u64 bytes, u64 us) {
+	return (double) bytes / (double) std::max(us, (u64) 1);
+}
+
+/* Lines like "2024-05-01 12:34:56 INFO request 1234 took 17 ms", one in 50 an ERROR. */
+static void synthetic_log(u64 bytes, std::string& out) {
+	static const char* levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN" };
+	static const char* words[] = { "request", "session", "cache", "worker", "queue", "flush", "connect", "retry" };
+	std::mt19937 rng(17);
+	char line[256];
+
+	out.clear();
+	out.reserve(bytes + 256);
+	while (out.size() < bytes) {
+		const bool err = (rng() % 50) == 0;
+		const unsigned mon = 1 + rng() % 12, day = 1 + rng() % 28;
+		const unsigned hh = rng() % 24, mm = rng() % 60, ss = rng() % 60;
+		const unsigned lv = rng() % 5, wd = rng() % 8;
+		const unsigned id = rng() % 100000, ms = rng() % 1000;
+		sprintf(line, "2024-%02u-%02u %02u:%02u:%02u %s %s %u took %u ms\n", mon, day, hh, mm, ss,
+			err ? "ERROR" : levels[lv], words[wd], id, ms);
+		out += line;
+	}
+}
+
+static void bench_log(const std::string& text, const std::string& pattern) {
+	RegexDFA re(pattern.c_str(), REGEX_MULTILINE);
+	std::vector<std::pair<size_t, size_t>> matches;
+	std::string line;
+	Stopwatch sw;
+	u64 n_exec = 0, us_dfa, us_exec;
+
+	if (!re.ok()) {
+		printf("Couldn't compile \"%s\"\n", pattern.c_str());
+		return;
+	}
+	sw.start();
+	re.find_all(text.data(), text.size(), matches);
+	us_dfa = sw.stop(UNIT_MICROSECOND);
+
+	regexp* prog = regcomp((char*) pattern.c_str());
+	NOT_NULL_OR_RETURN_VOID(prog);
+	sw.start();
+	for (const char* p = text.data(), * end = p + text.size(); p < end; ) {
+		const char* eol = (const char*) memchr(p, '\n', end - p);
+		if (is_null(eol))
+			eol = end;
+		line.assign(p, eol - p);
+		char* s = &line[0];
+		while (*s && regexec(prog, s)) {
+			++n_exec;
+			s = (prog->endp[0] > prog->startp[0]) ? prog->endp[0] : prog->endp[0] + 1;
+			if (s > &line[0] + line.size())
+				break;
+		}
+		p = eol + 1;
+	}
+	us_exec = sw.stop(UNIT_MICROSECOND);
+	free(prog);
+
+	printf("\"%s\" over %llu bytes:\n", pattern.c_str(), (unsigned long long) text.size());
+	printf("  %-34s %10llu matches %8.1f MB/s\n", "RegexDFA::find_all():", (unsigned long long) matches.size(),
+		mb_per_sec(text.size(), us_dfa));
+	printf("  %-34s %10llu matches %8.1f MB/s\n", "regexec(), a line at a time:", (unsigned long long) n_exec,
+		mb_per_sec(text.size(), us_exec));
+}
+
+/* find() on "aaa...ac" for a*b|c: the only match is the c at the end, and every a starts a partial a*b. */
+static void check_linear(void) {
+	RegexDFA re("a*b|c");
+	double first_ns = 0.;
+
+	printf("find() of a*b|c in a...ac:\n");
+	for (size_t n = 20000; n <= 20000 * 64; n *= 2) {
+		std::string t(n, 'a');
+		size_t s = 0, e = 0;
+		bool found = false;
+		Stopwatch sw;
+		u64 us = ~0ULL;
+
+		t[n - 1] = 'c';
+		// the best of three, against timer noise.
+		for (int r = 0; r < 3; ++r) {
+			sw.start();
+			found = re.find(t.data(), t.size(), s, e);
+			us = std::min(us, sw.stop(UNIT_MICROSECOND));
+		}
+		const double ns = 1000.0 * (double) us / (double) n;
+		if (first_ns == 0.)
+			first_ns = std::max(ns, 0.001);
+		printf("  %8llu chars %10llu us %8.2f ns/char%s\n", (unsigned long long) n, (unsigned long long) us, ns,
+			(!found || s != n - 1 || e != n) ? "  ** wrong match!" : (ns > first_ns * 8. && us > 1000 ? "  ** not linear!" : ""));
+	}
+}
+
+int app_main() {
+	ArgParse ap;
+	int mb = 64;
+	std::string fn, pattern = "ERROR [a-z]+ [0-9]+", text;
+
+	ap.add_argument("mb", type_int, "size of the synthetic log in MB (default is 64)", &mb);
+	ap.add_argument("file", type_string, "a text file to search instead");
+	ap.add_argument("pattern", type_string, "the regular expression (default is \"ERROR [a-z]+ [0-9]+\")");
+	ap.ensure_args(argc, argv);
+	if (ap.flag_present("file"))
+		ap.value_str("file", fn);
+	if (ap.flag_present("pattern"))
+		ap.value_str("pattern", pattern);
+
+	if (!fn.empty()) {
+		RamFile rf;
+		if (rf.open(fn, RAMFILE_READ | RAMFILE_MMAP)) {
+			printf("Couldn't open %s\n", fn.c_str());
+			return 1;
+		}
+		text.assign((const char*) rf.buffer(), (size_t) rf.size());
+		// regexec() works on NUL-terminated lines
+		std::replace(text.begin(), text.end(), '\0', ' ');
+	} else {
+		synthetic_log((u64) std::max(mb, 1) << 20, text);
+	}
+
+	bench_log(text, pattern);
+	check_linear();
+	return 0;
+}
+
+/* end regexbench.cpp */
@@ -111,6 +111,8 @@ int app_main() {
 		codehappy_cerr << "no images returned from SDServer::txt2img_slerp()?\n";
 		return 1;
 	}
+	std::cout << "Conditioning cache hit rate: " << sd_server.cond_cache_hit_rate() * 100. << "%, noise cache hit rate: "
+	          << sd_server.noise_cache_hit_rate() * 100. << "%\n";
 
 	std::cout << "Writing images to frame%04d.png...\n";
 	int fs = frame_number_start();
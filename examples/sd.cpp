@@ -12,11 +12,103 @@
 #define CODEHAPPY_NATIVE
 #include <libcodehappy.h>
 
+/* the prompt for benchmark request e: the queue batches requests with different prompts. */
+static std::string bench_prompt(const std::string& prompt, int e) {
+	static const char* variants[] = { "", ", at dawn", ", in winter", ", oil painting" };
+	return prompt + variants[e % 4];
+}
+
+/* the largest difference in any channel of any pixel between two images. */
+static int max_pixel_diff(SBitmap* b1, SBitmap* b2) {
+	int ret = 0;
+	if (is_null(b1) || is_null(b2) || b1->width() != b2->width() || b1->height() != b2->height())
+		return 255;
+	for (u32 y = 0; y < b1->height(); ++y) {
+		for (u32 x = 0; x < b1->width(); ++x) {
+			RGBColor c1 = b1->get_pixel(x, y), c2 = b2->get_pixel(x, y);
+			ret = std::max(ret, std::abs((int) RGB_RED(c1) - (int) RGB_RED(c2)));
+			ret = std::max(ret, std::abs((int) RGB_GREEN(c1) - (int) RGB_GREEN(c2)));
+			ret = std::max(ret, std::abs((int) RGB_BLUE(c1) - (int) RGB_BLUE(c2)));
+		}
+	}
+	return ret;
+}
+
+/* Generate n_req images (with four different prompts) one txt2img() call at a time, then through an SDJobQueue
+   with n_ctx model contexts, and report images per minute for each, and whether the queued images match. A small
+   image size makes this quick. */
+void bench_queue(const std::string& model_path, const std::string& vae_path, const std::string& prompt,
+                 const std::string& neg_prompt, int w, int h, double cfg, int n_req, int n_ctx, int max_batch) {
+	Stopwatch sw;
+	u64 ms;
+	std::vector<SDServer*> servers;
+	std::vector<SBitmap*> seq_imgs;
+	int max_diff = 0;
+
+	std::cout << "Generating " << n_req << " images, one call at a time...\n";
+	sw.start();
+	for (int e = 0; e < n_req; ++e) {
+		SBitmap** out = sd_server.txt2img(bench_prompt(prompt, e), neg_prompt, w, h, cfg, e);
+		seq_imgs.push_back(is_null(out) ? nullptr : out[0]);
+		delete [] out;
+	}
+	ms = std::max(sw.stop(UNIT_MILLISECOND), (u64) 1);
+	std::cout << "Sequential: " << ms << " ms, " << (n_req * 60000.0 / ms) << " images/min\n";
+
+	// the first context is sd_server's; the rest load their own copy of the model.
+	servers.push_back(&sd_server);
+	while (servers.size() < (size_t) n_ctx) {
+		SDServer* server = new SDServer;
+		server->set_nthreads(std::max(sd_server.get_nthreads() / n_ctx, 1U));
+		server->set_steps(sd_server.get_steps());
+		server->set_sampler_type(sd_server.get_sampler_type());
+		server->set_scheduler_type(sd_server.get_scheduler_type());
+		if (!server->load_from_file(sd_server.get_model_path(), sd_server.get_vae_path())) {
+			delete server;
+			break;
+		}
+		servers.push_back(server);
+	}
+	if (servers.size() > 1)
+		sd_server.set_nthreads(std::max(sd_server.get_nthreads() / n_ctx, 1U));
+
+	std::cout << "Generating " << n_req << " images through the job queue (" << servers.size() << " contexts, up to " << max_batch << " images per run)...\n";
+	sw.start();
+	{
+		SDJobQueue q(servers, max_batch);
+		std::vector<std::future<SDResult>> results;
+		for (int e = 0; e < n_req; ++e) {
+			SDRequest req;
+			req.prompt = bench_prompt(prompt, e);
+			req.neg_prompt = neg_prompt;
+			req.w = w;
+			req.h = h;
+			req.cfg_scale = cfg;
+			req.seed = e;
+			results.push_back(q.submit(req));
+		}
+		for (int e = 0; e < n_req; ++e) {
+			SDResult res = results[e].get();
+			max_diff = std::max(max_diff, res.imgs.empty() ? 255 : max_pixel_diff(res.imgs[0], seq_imgs[e]));
+			for (SBitmap* bmp : res.imgs)
+				delete bmp;
+		}
+		ms = std::max(sw.stop(UNIT_MILLISECOND), (u64) 1);
+		std::cout << "Queued: " << ms << " ms, " << (n_req * 60000.0 / ms) << " images/min (" << q.count_runs() << " runs)\n";
+	}
+	std::cout << "Largest pixel difference from the sequential images: " << max_diff << "\n";
+
+	for (SBitmap* bmp : seq_imgs)
+		delete bmp;
+	for (size_t e = 1; e < servers.size(); ++e)
+		delete servers[e];
+}
+
 int app_main() {
 	ArgParse ap;
 	std::string model_path, prompt, neg_prompt, out_path = "output.png", vae_path;
 	const int MAX_SAMPLER = 7, MAX_SCHEDULER = 3;
-	int w = 512, h = 512, threads = -1, steps = 30, sampler = -1, scheduler = -1;
+	int w = 512, h = 512, threads = -1, steps = 30, sampler = -1, scheduler = -1, bench = 0, contexts = 1, batch = 4;
 	i64 seed = -1ll;
 	double cfg = 7.0;
 
@@ -33,6 +125,9 @@ int app_main() {
 	ap.add_argument("sampler", type_int, "sampler type (0-7)", &sampler);
 	ap.add_argument("scheduler", type_int, "scheduler type (0-3)", &scheduler);
 	ap.add_argument("seed", type_int64, "random seed to use (default is randomly chosen seed)", &seed);
+	ap.add_argument("bench", type_int, "benchmark: generate this many images sequentially, then via the job queue, and report images/min", &bench);
+	ap.add_argument("contexts", type_int, "number of model contexts for the job queue benchmark (default is 1)", &contexts);
+	ap.add_argument("batch", type_int, "maximum images per batched run for the job queue benchmark (default is 4)", &batch);
 	ap.ensure_args(argc, argv);
 
 	ap.value_str("prompt", prompt);
@@ -80,6 +175,11 @@ int app_main() {
 		std::cout << "Scheduler: " << scheduler << "\n";
 	}
 
+	if (bench > 0) {
+		bench_queue(model_path, vae_path, prompt, neg_prompt, w, h, cfg, bench, std::max(contexts, 1), std::max(batch, 1));
+		return 0;
+	}
+
 	SBitmap** out = sd_server.txt2img(prompt, neg_prompt, w, h, cfg, seed);
 
 	std::cout << "The random seed used for this generation was " << sd_server.get_last_seed() << "\n";
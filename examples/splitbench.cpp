@@ -0,0 +1,182 @@
+/***
+
+	splitbench.cpp
+
+	Benchmark for splitting strings: SplitString, which copies every field into a std::string, against
+	SplitView, which returns spans of the source found with SIMD compares. Splits CSV-like lines a line at
+	a time on a delimiter, then the whole text on whitespace, then steps through it word by word with the
+	NUL-terminated and the bounded advance_to_next_word().
+
+	Call: splitbench [/mb N] [/file FILE] [/sep C] [/reps N]
+	N MB (default 64) of synthetic text is used, unless a file is given; the delimiter defaults to ','.
+
+	2024, C. M. Street
+
+***/
+#define CODEHAPPY_NATIVE
+#include <libcodehappy.h>
+#include <random>
+
+static u64 sink;
+
+static double fields_per_sec(u64 n, u64 us) {
+	return (double) n * 1e6 / (double) std::max(us, (u64) 1);
+}
+
+static double mb_per_sec(u64 bytes, u64 us) {
+	return (double) bytes / (double) std::max(us, (u64) 1);
+}
+
+/* Lines of 4 to 19 fields, each 0 to 15 characters: words, numbers, the odd empty field and space. */
+static void synthetic_text(u64 bytes, char sep, std::string& out) {
+	static const char* letters = "eeeeeeeeeeeettttttttaaaaaaaooooooiiiiiinnnnnnsssssshhhhhhrrrrrrddddllllccuummwwffggyyppbbvkjxqz";
+	static const u32 nl = (u32) strlen(letters);
+	std::mt19937 rng(11);
+
+	out.clear();
+	out.reserve(bytes + 256);
+	while (out.size() < bytes) {
+		const u32 nf = 4 + rng() % 16;
+		for (u32 f = 0; f < nf; ++f) {
+			if (f > 0)
+				out += sep;
+			const u32 len = rng() % 16;
+			const bool num = (rng() % 4) == 0;
+			for (u32 e = 0; e < len; ++e) {
+				if (!num && e > 0 && (rng() % 8) == 0)
+					out += ' ';
+				else
+					out += num ? (char) ('0' + rng() % 10) : letters[rng() % nl];
+			}
+		}
+		out += '\n';
+	}
+}
+
+static void bench_lines(const std::string& text, char sep, int reps) {
+	const char* buf = text.data(), * end = buf + text.size();
+	SplitString ss(sep);
+	SplitView sv(sep);
+	Stopwatch sw;
+	u64 n_ss = 0, n_sv = 0, us_ss, us_sv;
+
+	sw.start();
+	for (int r = 0; r < reps; ++r) {
+		for (const char* p = buf; p < end; ) {
+			const char* eol = advance_to_char(p, end, '\n');
+			ss = std::string(p, eol - p);
+			n_ss += ss.nstrs();
+			p = eol + 1;
+		}
+	}
+	us_ss = sw.stop(UNIT_MICROSECOND);
+
+	sw.start();
+	for (int r = 0; r < reps; ++r) {
+		for (const char* p = buf; p < end; ) {
+			const char* eol = advance_to_char(p, end, '\n');
+			sv.split(p, eol - p);
+			n_sv += sv.nstrs();
+			p = eol + 1;
+		}
+	}
+	us_sv = sw.stop(UNIT_MICROSECOND);
+
+	printf("split on '%c', a line at a time (%llu fields):\n", sep, (unsigned long long) (n_sv / reps));
+	printf("  %-30s %12.0f fields/s %8.1f MB/s\n", "SplitString:", fields_per_sec(n_ss, us_ss), mb_per_sec(text.size() * reps, us_ss));
+	printf("  %-30s %12.0f fields/s %8.1f MB/s%s\n", "SplitView:", fields_per_sec(n_sv, us_sv), mb_per_sec(text.size() * reps, us_sv),
+		n_ss == n_sv ? "" : "  ** mismatch!");
+}
+
+static void bench_whitespace(const std::string& text, int reps) {
+	SplitString ss;
+	SplitView sv;
+	Stopwatch sw;
+	u64 n_ss = 0, n_sv = 0, us_ss, us_sv;
+
+	sw.start();
+	for (int r = 0; r < reps; ++r) {
+		ss.clear();
+		ss.split_on_whitespace(text);
+		n_ss += ss.nstrs();
+	}
+	us_ss = sw.stop(UNIT_MICROSECOND);
+
+	sw.start();
+	for (int r = 0; r < reps; ++r) {
+		sv.split_on_whitespace(text);
+		n_sv += sv.nstrs();
+	}
+	us_sv = sw.stop(UNIT_MICROSECOND);
+
+	printf("split on whitespace, the whole text (%llu fields):\n", (unsigned long long) (n_sv / reps));
+	printf("  %-30s %12.0f fields/s %8.1f MB/s\n", "SplitString:", fields_per_sec(n_ss, us_ss), mb_per_sec(text.size() * reps, us_ss));
+	printf("  %-30s %12.0f fields/s %8.1f MB/s%s\n", "SplitView:", fields_per_sec(n_sv, us_sv), mb_per_sec(text.size() * reps, us_sv),
+		n_ss == n_sv ? "" : "  ** mismatch!");
+}
+
+static void bench_words(std::string& text, int reps) {
+	char* buf = &text[0];
+	const char* end = buf + text.size();
+	Stopwatch sw;
+	u64 n_nul = 0, n_bounded = 0, us_nul, us_bounded;
+
+	sw.start();
+	for (int r = 0; r < reps; ++r) {
+		for (char* p = advance_past_whitespace(buf); *p; p = advance_to_next_word(p))
+			++n_nul;
+	}
+	us_nul = sw.stop(UNIT_MICROSECOND);
+
+	sw.start();
+	for (int r = 0; r < reps; ++r) {
+		for (const char* p = advance_past_whitespace((const char*) buf, end); p < end; p = advance_to_next_word(p, end))
+			++n_bounded;
+	}
+	us_bounded = sw.stop(UNIT_MICROSECOND);
+
+	printf("word by word:\n");
+	printf("  %-30s %12.0f words/s  %8.1f MB/s\n", "advance_to_next_word(p):", fields_per_sec(n_nul, us_nul),
+		mb_per_sec(text.size() * reps, us_nul));
+	printf("  %-30s %12.0f words/s  %8.1f MB/s%s\n", "advance_to_next_word(p, end):", fields_per_sec(n_bounded, us_bounded),
+		mb_per_sec(text.size() * reps, us_bounded), n_nul == n_bounded ? "" : "  ** mismatch!");
+}
+
+int app_main() {
+	ArgParse ap;
+	int mb = 64, reps = 1;
+	std::string fn, sep_str = ",", text;
+
+	ap.add_argument("mb", type_int, "size of the synthetic text in MB (default is 64)", &mb);
+	ap.add_argument("file", type_string, "a text file to split instead");
+	ap.add_argument("sep", type_string, "the delimiter (default is ',')");
+	ap.add_argument("reps", type_int, "times to repeat each test (default is 1)", &reps);
+	ap.ensure_args(argc, argv);
+	if (ap.flag_present("file"))
+		ap.value_str("file", fn);
+	if (ap.flag_present("sep"))
+		ap.value_str("sep", sep_str);
+	const char sep = sep_str.empty() ? ',' : sep_str[0];
+	reps = std::max(reps, 1);
+
+	if (!fn.empty()) {
+		RamFile rf;
+		if (rf.open(fn, RAMFILE_READ | RAMFILE_MMAP)) {
+			printf("Couldn't open %s\n", fn.c_str());
+			return 1;
+		}
+		text.assign((const char*) rf.buffer(), (size_t) rf.size());
+		// the NUL-terminated splits would stop short at an embedded NUL
+		std::replace(text.begin(), text.end(), '\0', ' ');
+	} else {
+		synthetic_text((u64) std::max(mb, 1) << 20, sep, text);
+	}
+	printf("%llu bytes of text\n\n", (unsigned long long) text.size());
+
+	bench_lines(text, sep, reps);
+	bench_whitespace(text, reps);
+	bench_words(text, reps);
+	return (int) (sink & 0);
+}
+
+/* end splitbench.cpp */
@@ -32,11 +32,18 @@ public:
 	// Create embeddings for all text files (*.txt) in a folder. As above, documents are broken into
 	// chunks of sentences.
 	// If 'lef_pathname' is non-null, the LMEmbeddingFolder contents will be initialized from that file (if it
-	// exists), and embeddings_for_folder() will save the LMEmbeddingFolder after each file's embeddings
-	// are added. This way, if a long embedding operation is stopped it can continue at the most recent file.
+	// exists), and each file's embeddings are appended to it (as an LMEmbeddingLog) as soon as they're done.
+	// This way, if a long embedding operation is stopped it can continue at the most recent file.
 	LMEmbeddingFolder* embeddings_for_folder(const std::string& path, const char* lef_pathname = nullptr);
 	void embeddings_for_folder(const std::string& path, LMEmbeddingFolder* lef, const char* lef_pathname = nullptr);
 
+	// As embeddings_for_folder(), but pipelined: a reader thread loads and sentencifies files, a batcher
+	// packs chunks of similar length (from any number of files) into bert_encode_batch() calls, and
+	// get_nencoders() encoder threads run the batches, each with its own model context. The n_threads
+	// ggml threads are shared out among the encoders. Files are added to lef in the order they complete.
+	// Note that each extra encoder loads another copy of the model.
+	void embeddings_for_folder_pipelined(const std::string& path, LMEmbeddingFolder* lef, const char* lef_pathname = nullptr);
+
 	// Return the embedding dimension for the model. 
 	int embedding_dimension() const	{ NOT_NULL_OR_RETURN(model, 0); return bert_n_embd(model); }
 
@@ -47,14 +54,26 @@ public:
 	void set_save_text(bool st)		{ save_text = st; }
 	int get_nsentences() const		{ return n_sentences; }
 	void set_nsentences(int nsentences)	{ n_sentences = nsentences; }
+	int get_nencoders() const		{ return n_encoders; }
+	void set_nencoders(int nencoders)	{ n_encoders = nencoders; }
+	// The number of chunks per bert_encode_batch() call in the pipelined indexer; 0 picks a size from the model context.
+	int get_batch_size() const		{ return batch_sz; }
+	void set_batch_size(int bs)		{ batch_sz = bs; }
 
 private:
 	char* normalize_string(const std::string& in_str) const;
+	void text_chunks(const std::string& str, std::vector<std::string>& chunks, std::vector<u32>& offs) const;
+	LMEmbedding* new_embedding(const std::string& chunk) const;
+	int auto_batch_size() const;
 
 	bert_ctx* model;
+	std::string model_path;
+	std::vector<bert_ctx*> worker_models;
 	int n_threads;
 	bool save_text;
 	int n_sentences;
+	int n_encoders;
+	int batch_sz;
 };
 
 /*** Break a C string, in place, into sentences. If sentences is non-null, this vector is filled with pointers
@@ -0,0 +1,118 @@
+/***
+
+	bindelta.h
+
+	Binary deltas between large files, in the style of rsync and xdelta: a delta is a list of instructions
+	to COPY a run of bytes from the source, or ADD bytes carried in the delta, that together rebuild the
+	target. Its size is roughly the size of what changed, whatever the size of the files or where the changes
+	are (bdelta, in extern.h, gives up once the files differ by more than about 1000 bytes.)
+
+	The source is cut into chunks at content-defined boundaries: wherever a gear hash (a rolling hash of the
+	last 64 bytes) falls below a threshold, so chunks average the chunk size given (and are cut at 8 times it.)
+	Since the boundaries depend only on nearby bytes, an insertion or deletion only disturbs the chunks around
+	it; the rest of the file cuts the same way it did before. The start of each chunk is hashed into an index.
+	The target is cut the same way, and each target chunk that starts like a source chunk (checked byte for
+	byte) becomes a COPY, extended forwards and backwards as far as the bytes keep matching; what's between the
+	COPYs is ADDed. Edits closer together than about a chunk can cost the bytes between them.
+
+	Finding the boundaries and hashing the chunks of the source and the target are split across a thread pool;
+	the index lives in one flat open-addressed table.
+
+	The format:
+
+	header (BINDELTA_HEADER_SIZE bytes):
+		magic			8 bytes
+		source length		u64
+		target length		u64
+
+	instructions, each an opcode byte and LEB128 varints:
+		COPY (1)		offset (zigzag-encoded, relative to the end of the previous COPY), length
+		ADD (2)			length, then that many bytes
+		END (0)			followed by the SpookyHash-64 of the target, u64
+
+	Deltas stream to a RamFile, a vector or a file on disk; applying one reads the delta sequentially and
+	checks the hash of what it built. Source and target files are read through memory-mapped RamFiles, so
+	they can be larger than 4 GB (and so can the output of bindelta_apply() to a file.)
+
+	2024, C. M. Street
+
+***/
+#ifndef __BINDELTA_H__
+#define __BINDELTA_H__
+
+#define	BINDELTA_HEADER_SIZE	24
+
+/*** The default average chunk size; a power of two between 64 and 1 MB. Smaller chunks find smaller matches, but
+     make a bigger index (up to 96 bytes per chunk.) ***/
+#define	BINDELTA_CHUNK_DEFAULT	2048
+
+/*** What an encode did. ***/
+struct BinDeltaStats {
+	u64 copied;		// target bytes copied from the source
+	u64 added;		// target bytes carried in the delta
+	u64 ncopies;
+	u64 nadds;
+	u64 delta_size;
+};
+
+/*** An index of the chunks of a source, to encode any number of targets against. ***/
+class BinDeltaIndex {
+public:
+	BinDeltaIndex();
+
+	// Index the source. Its data isn't copied, so it must outlive the index. pool == nullptr uses the shared pool.
+	void build(const u8* src, u64 len, u32 avg_chunk = BINDELTA_CHUNK_DEFAULT, ThreadPool* pool = nullptr);
+	void clear(void);
+
+	u64 source_length(void) const	{ return src_len; }
+	u64 chunk_count(void) const	{ return nchunks; }
+	u32 chunk_size(void) const	{ return avg; }
+
+	// Encode a delta from the source to the target. Returns false if the output couldn't be written.
+	bool encode(const u8* tgt, u64 len, RamFile* out, BinDeltaStats* stats = nullptr, ThreadPool* pool = nullptr) const;
+	bool encode(const u8* tgt, u64 len, std::vector<u8>& out, BinDeltaStats* stats = nullptr, ThreadPool* pool = nullptr) const;
+	bool encode(const u8* tgt, u64 len, FILE* out, BinDeltaStats* stats = nullptr, ThreadPool* pool = nullptr) const;
+
+private:
+	struct Slot {
+		u64 hash;
+		u64 offset;
+		u32 len;
+	};
+
+	template <class Sink> bool encode_to(const u8* tgt, u64 len, Sink& sink, BinDeltaStats* stats, ThreadPool* pool) const;
+	const Slot* lookup(u64 hash) const;
+
+	const u8* src;
+	u64 src_len;
+	u32 avg;
+	u64 nchunks;
+	std::vector<Slot> table;	// a power of two in size; empty slots have len == 0
+	u64 table_mask;
+};
+
+/*** Encode a delta from src to tgt in one call. ***/
+extern bool bindelta_encode(const u8* src, u64 src_len, const u8* tgt, u64 tgt_len, RamFile* out,
+			u32 avg_chunk = BINDELTA_CHUNK_DEFAULT, BinDeltaStats* stats = nullptr, ThreadPool* pool = nullptr);
+extern bool bindelta_encode(const u8* src, u64 src_len, const u8* tgt, u64 tgt_len, std::vector<u8>& out,
+			u32 avg_chunk = BINDELTA_CHUNK_DEFAULT, BinDeltaStats* stats = nullptr, ThreadPool* pool = nullptr);
+extern bool bindelta_encode(RamFile* src, RamFile* tgt, RamFile* out, u32 avg_chunk = BINDELTA_CHUNK_DEFAULT,
+			BinDeltaStats* stats = nullptr, ThreadPool* pool = nullptr);
+/*** The same for files on disk: the source and target are mapped, and the delta written as it's made. ***/
+extern bool bindelta_encode(const char* src_fn, const char* tgt_fn, const char* delta_fn,
+			u32 avg_chunk = BINDELTA_CHUNK_DEFAULT, BinDeltaStats* stats = nullptr, ThreadPool* pool = nullptr);
+
+/*** Does the buffer start with a delta header? If so, the lengths of the source and target it's for. ***/
+extern bool is_bindelta(const u8* delta, u64 len);
+extern bool bindelta_lengths(const u8* delta, u64 len, u64& src_len, u64& tgt_len);
+
+/*** Apply a delta to the source, rebuilding the target. All return false if the delta is corrupt, is for a source of
+     another length, or doesn't produce the target it was made from (or the output couldn't be written.) ***/
+extern bool bindelta_apply(const u8* src, u64 src_len, const u8* delta, u64 delta_len, RamFile* out);
+extern bool bindelta_apply(const u8* src, u64 src_len, const u8* delta, u64 delta_len, std::vector<u8>& out);
+extern bool bindelta_apply(RamFile* src, RamFile* delta, RamFile* out);
+/*** The same for files on disk; the output is streamed to out_fn, so it can be any size. ***/
+extern bool bindelta_apply(const char* src_fn, const char* delta_fn, const char* out_fn);
+
+#endif  // __BINDELTA_H__
+/* end bindelta.h */
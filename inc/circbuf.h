@@ -16,6 +16,15 @@
 	each operation also hold the mutex. There are also lockfree and non-caching versions
 	of each operation.
 
+	The first call to median() or percentile() sorts the buffer into an order statistic tree
+	(a treap with subtree sizes, OrderStatTree below), which is then kept up to date as objects
+	are inserted and removed: after that, each insertion or removal costs O(log n) more, and
+	median and percentile queries are O(log n) instead of a copy and sort of the whole buffer.
+
+	SpscRing is a lock-free queue for one producer thread and one consumer thread. A producer
+	that mustn't block (a telemetry callback, say) pushes its samples there, and the consumer
+	moves them into a CircBuffer with drain(), taking the mutex once per batch.
+
 	Useful for moving averages, rate estimators, convolution operations, fast estimation of 
 	median or percentiles, or generally keeping running tabs on a stream of quantities.
 
@@ -37,6 +46,232 @@
 #define _CIRCBUF_H_
 
 #include <functional>
+#include <atomic>
+
+/*** Lock-free single-producer, single-consumer FIFO. push() must only be called from one thread
+     and pop() from one (other) thread; the capacity is rounded up to a power of two. ***/
+template<typename _T_>
+class SpscRing {
+public:
+	SpscRing(u32 capacity) {
+		assert(capacity > 0 && capacity <= (1U << 31));
+		cap = 2;
+		while (cap < capacity)
+			cap <<= 1;
+		mask = cap - 1;
+		buf = new _T_ [cap];
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+		head_cache = 0;
+		tail_cache = 0;
+	}
+
+	~SpscRing() {
+		delete [] buf;
+	}
+
+	/* Producer: add an object. Returns false, without blocking, if the ring is full. */
+	bool push(const _T_& val) {
+		const u32 t = tail.load(std::memory_order_relaxed);
+		if (t - head_cache == cap) {
+			head_cache = head.load(std::memory_order_acquire);
+			if (t - head_cache == cap)
+				return false;
+		}
+		buf[t & mask] = val;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* Consumer: take the oldest object. Returns false if the ring is empty. */
+	bool pop(_T_& val) {
+		const u32 h = head.load(std::memory_order_relaxed);
+		if (h == tail_cache) {
+			tail_cache = tail.load(std::memory_order_acquire);
+			if (h == tail_cache)
+				return false;
+		}
+		val = buf[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* Consumer: take up to max_count objects at once. Returns the number taken. */
+	u32 pop_bulk(_T_* out, u32 max_count) {
+		const u32 h = head.load(std::memory_order_relaxed);
+		tail_cache = tail.load(std::memory_order_acquire);
+		u32 n = std::min(tail_cache - h, max_count);
+		for (u32 e = 0; e < n; ++e)
+			out[e] = buf[(h + e) & mask];
+		head.store(h + n, std::memory_order_release);
+		return n;
+	}
+
+	/* A snapshot of the number of objects waiting: exact only when neither side is busy. */
+	u32 elements() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+	bool empty() const   { return 0 == elements(); }
+	u32 size() const     { return cap; }
+
+private:
+	SpscRing(const SpscRing&) = delete;
+	SpscRing& operator=(const SpscRing&) = delete;
+
+	_T_* buf;
+	u32 cap;
+	u32 mask;
+	/* The producer's cache line, then the consumer's: each keeps a stale copy of the other's
+	   index, so it only touches the other line when it seems to be full (or empty). */
+	alignas(64) std::atomic<u32> tail;
+	u32 head_cache;
+	alignas(64) std::atomic<u32> head;
+	u32 tail_cache;
+};
+
+/*** Order statistic tree: a multiset kept sorted by SortPredicate, with insert(), erase() (of one
+     equivalent object) and select() (the k'th smallest) in O(log n) expected time. It's a treap
+     whose nodes know the size of their subtrees, stored in a pool of nodes indexed by u32. ***/
+template<typename _T_, typename SortPredicate = std::less<_T_> >
+class OrderStatTree {
+public:
+	OrderStatTree() {
+		clear();
+	}
+
+	void clear() {
+		nodes.resize(1);	// node 0 is the null node, with size 0
+		nodes[0].size = 0;
+		nodes[0].left = nodes[0].right = 0;
+		free_list.clear();
+		root = 0;
+		seed = 0x9E3779B9U;
+	}
+
+	void reserve(u32 n) {
+		nodes.reserve(n + 1);
+	}
+
+	u32 size() const { return nodes[root].size; }
+
+	void insert(const _T_& val) {
+		u32 nd, l, r;
+		if (free_list.empty()) {
+			nd = (u32) nodes.size();
+			nodes.push_back(Node());
+		} else {
+			nd = free_list.back();
+			free_list.pop_back();
+		}
+		/* xorshift32 priorities */
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		nodes[nd].val = val;
+		nodes[nd].prio = seed;
+		nodes[nd].left = nodes[nd].right = 0;
+		nodes[nd].size = 1;
+		split(root, val, true, l, r);
+		root = merge(merge(l, nd), r);
+	}
+
+	/* Remove one object equivalent to val; false if there isn't one. */
+	bool erase(const _T_& val) {
+		u32 l, m, r;
+		split(root, val, false, l, r);		// l < val <= r
+		split(r, val, true, m, r);		// m == val < r
+		bool found = (m != 0);
+		if (found) {
+			free_list.push_back(m);
+			m = merge(nodes[m].left, nodes[m].right);
+		}
+		root = merge(merge(l, m), r);
+		return found;
+	}
+
+	/* The k'th smallest object (k from 0); k must be less than size(). */
+	const _T_& select(u32 k) const {
+		u32 nd = root;
+		assert(k < size());
+		forever {
+			const u32 ls = nodes[nodes[nd].left].size;
+			if (k < ls) {
+				nd = nodes[nd].left;
+			} else if (k == ls) {
+				return nodes[nd].val;
+			} else {
+				k -= ls + 1;
+				nd = nodes[nd].right;
+			}
+		}
+	}
+
+	/* The number of objects less than val. */
+	u32 rank(const _T_& val) const {
+		u32 nd = root, ret = 0;
+		while (nd != 0) {
+			if (pred(nodes[nd].val, val)) {
+				ret += nodes[nodes[nd].left].size + 1;
+				nd = nodes[nd].right;
+			} else {
+				nd = nodes[nd].left;
+			}
+		}
+		return ret;
+	}
+
+private:
+	struct Node {
+		_T_ val;
+		u32 prio;
+		u32 left, right;
+		u32 size;
+	};
+
+	void update(u32 nd) {
+		nodes[nd].size = 1 + nodes[nodes[nd].left].size + nodes[nodes[nd].right].size;
+	}
+
+	/* Split the subtree t into l and r: with or_equal, l gets the objects <= val, else those < val. */
+	void split(u32 t, const _T_& val, bool or_equal, u32& l, u32& r) {
+		if (0 == t) {
+			l = r = 0;
+			return;
+		}
+		const bool go_left = or_equal ? !pred(val, nodes[t].val) : pred(nodes[t].val, val);
+		if (go_left) {
+			split(nodes[t].right, val, or_equal, nodes[t].right, r);
+			l = t;
+		} else {
+			split(nodes[t].left, val, or_equal, l, nodes[t].left);
+			r = t;
+		}
+		update(t);
+	}
+
+	/* Merge two subtrees, every object in a preceding every object in b. */
+	u32 merge(u32 a, u32 b) {
+		if (0 == a)
+			return b;
+		if (0 == b)
+			return a;
+		if (nodes[a].prio > nodes[b].prio) {
+			nodes[a].right = merge(nodes[a].right, b);
+			update(a);
+			return a;
+		}
+		nodes[b].left = merge(a, nodes[b].left);
+		update(b);
+		return b;
+	}
+
+	std::vector<Node> nodes;
+	std::vector<u32> free_list;
+	u32 root;
+	u32 seed;
+	SortPredicate pred;
+};
 
 template<typename _T_, typename SortPredicate = std::less<_T_>, typename HashFunction = std::hash<_T_> >
 class CircBuffer {
@@ -50,6 +285,7 @@ public:
 		sz = size;
 		csum = 0;
 		valid_flags = FLAG_SUM;
+		ost_on = false;
 	}
 
 	/* Create a circular buffer of the given size and fill it identically with "fill". */
@@ -71,6 +307,7 @@ public:
 			csum += fill;
 		}
 		valid_flags = FLAG_MODE | FLAG_MEDIAN | FLAG_MIN | FLAG_MAX | FLAG_SUM;
+		ost_on = false;
 	}
 
 	~CircBuffer() {
@@ -80,6 +317,25 @@ public:
 	/* Insertions and removals. These all grab our mutex for thread safety. */
 	void insert(_T_ val) {
 		lock();
+		insert_lockfree(val);
+		unlock();
+	}
+
+	/* Move everything waiting in an SpscRing into the buffer, holding the mutex once. Call this
+	   from the ring's consumer thread. Returns the number of objects inserted. */
+	u32 drain(SpscRing<_T_>& ring) {
+		_T_ v;
+		u32 n = 0;
+		ScopeMutex sm(m);
+		while (ring.pop(v)) {
+			insert_lockfree(v);
+			++n;
+		}
+		return n;
+	}
+
+	/* Insert without the mutex, for a buffer only one thread uses. */
+	void insert_lockfree(_T_ val) {
 		if (nel == sz) {
 			cache_remove(buf[idx_first]);
 			buf[idx_first] = val;
@@ -88,6 +344,9 @@ public:
 			buf[idx(idx_first + nel)] = val;
 			++nel;
 		}
+		if (ost_on) {
+			ost.insert(val);
+		}
 		if (valid(FLAG_SUM)) {
 			csum += val;
 		}
@@ -112,16 +371,14 @@ public:
 			/* (We could check that the inserted value isn't equal to known mode, but that's a pretty edge case.) */
 			invalidate_sort();
 		}
-		unlock();
 	}
 
 	void remove_newest() {
 		lock();
-		if (valid(FLAG_MIN | FLAG_MAX | FLAG_SUM)) {
+		if (nel > 0) {
 			cache_remove(newest());
-		}
-		if (nel > 0)
 			--nel;
+		}
 		invalidate_sort();
 		unlock();
 	}
@@ -130,9 +387,7 @@ public:
 		if (0 == nel)
 			return;
 		lock();
-		if (valid(FLAG_MIN | FLAG_MAX | FLAG_SUM)) {
-			cache_remove(oldest());
-		}
+		cache_remove(oldest());
 		idx_first = idx(idx_first + 1);
 		--nel;
 		invalidate_sort();
@@ -140,28 +395,25 @@ public:
 	}
 
 	void remove_index(u32 i) {
-		if (0 == nel) {
+		if (i >= nel) {
 			return;
 		}
 		if (i == (nel - 1)) {
 			remove_newest();
 			return;
 		}
-		i += idx_first;
-		if (idx_first == i) {
+		if (0 == i) {
 			remove_oldest();
 			return;
 		}
 		lock();
-		if (valid(FLAG_MIN | FLAG_MAX | FLAG_SUM)) {
-			cache_remove(buf[i]);
-		}
-		u32 j;
-		j = idx(i + 1);
-		while (j != idx_first) {
-			buf[i] = buf[j];
-			i = j;
-			j = idx(i + 1);
+		u32 p = idx(idx_first + i);
+		cache_remove(buf[p]);
+		/* Close the gap, shifting the newer objects down. */
+		for (u32 e = i + 1; e < nel; ++e) {
+			u32 q = idx(p + 1);
+			buf[p] = buf[q];
+			p = q;
 		}
 		--nel;
 		invalidate_sort();
@@ -233,10 +485,9 @@ public:
 	_T_ operator[](u32 ix) const {
 		if (nel == 0)
 			return buf[0];
-		ix += idx_first;
 		if (ix >= nel)
 			ix %= nel;
-		return buf[ix];
+		return buf[idx(idx_first + ix)];
 	}
 
 	/* Operations: const lockfree versions that _do not_ use or update cache results. The 
@@ -340,7 +591,14 @@ public:
 	_T_ median_lockfree() {
 		if (valid(FLAG_MEDIAN))
 			return cmed;
-		_T_ ret = median_nocache();
+		if (0 == nel)
+			return (*this)[0];
+		build_ost();
+		_T_ ret;
+		if ((nel & 1) == 0)
+			ret = (ost.select(nel / 2) + ost.select((nel / 2) - 1)) / 2;
+		else
+			ret = ost.select(nel / 2);
 		if (nel > 0) {
 			cmed = ret;
 			is_valid(FLAG_MEDIAN);
@@ -380,13 +638,8 @@ public:
 			return max_lockfree();
 		if (0 == pct)
 			return min_lockfree();
-		std::vector<_T_> els(nel);
-		for (u32 e = 0; e < nel; ++e) {
-			els[e] = (*this)[e];
-		}
-		std::sort(els.begin(), els.end(), SortPredicate{});
-		u32 idx = ((nel - 1) * pct) / 100;
-		return (*this)[idx];
+		build_ost();
+		return ost.select((u32) (((u64) (nel - 1) * pct) / 100));
 	}
 
 	_T_ sum_lockfree() {
@@ -441,14 +694,24 @@ public:
 	u32 size() const     { return sz;  }
 
 private:
+	/* Wrap an index into buf. */
 	u32 idx(u32 i) const {
-		if (0 == nel)
-			return 0;
-		if (i >= nel)
-			i %= nel;
+		if (i >= sz)
+			i %= sz;
 		return i;
 	}
 
+	/* Start keeping the order statistic tree, if we aren't already. */
+	void build_ost() {
+		if (ost_on)
+			return;
+		ost.clear();
+		ost.reserve(sz);
+		for (u32 e = 0; e < nel; ++e)
+			ost.insert((*this)[e]);
+		ost_on = true;
+	}
+
 	void lock()   { m.lock(); }
 	void unlock() { m.unlock(); }
 
@@ -458,6 +721,9 @@ private:
 	void is_valid(u32 flag)    { valid_flags |= flag; }
 
 	void cache_remove(const _T_& val) {
+		if (ost_on) {
+			ost.erase(val);
+		}
 		if (val == cmin) {
 			invalidate(FLAG_MIN);
 		}
@@ -482,6 +748,8 @@ private:
 	_T_ csum;
 	_T_ cmed;
 	_T_ cmod;
+	OrderStatTree<_T_, SortPredicate> ost;
+	bool ost_on;
 	const u32 FLAG_MAX = 1, FLAG_MIN = 2, FLAG_SUM = 4, FLAG_MEDIAN = 8, FLAG_MODE = 16;
 };
 
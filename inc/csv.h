@@ -159,5 +159,87 @@ private:
 	csvdata* data_;
 };
 
+/*** Streaming CSV reading, for files too big to load as csvdata. The file is memory-mapped, and quotes,
+	delimiters and newlines are found 64 bytes at a time with SIMD compares and bitmasks. Fields are
+	returned as CsvFields pointing into the file, without copies, either a row at a time to a callback
+	or gathered into typed columns. Only 8-bit (ASCII/UTF-8) CSV is supported. ***/
+
+/*** A field of a row. A quoted field is given without its enclosing quotes, but doubled quotes ("")
+	inside it are still doubled; str() undoes that. ***/
+struct CsvField {
+	const char*	data;
+	u32		len;
+	bool		quoted;
+
+	std::string str() const;
+
+	/*** Parse the field as a number; these return false if it isn't one. ***/
+	bool to_int(i64& val) const;
+	bool to_double(double& val) const;
+
+	/*** The type csv_read() would give the field: CSV_VOID, CSV_INT, CSV_DOUBLE or CSV_STR. ***/
+	int type() const;
+};
+
+/*** Called for each row with its index (0 is the first row after any headers) and its fields.
+	Return false to stop reading. ***/
+typedef std::function<bool(u64 row, const CsvField* fields, u32 nfields)> CsvRowFn;
+
+/*** A column from CsvReader::read_columns(). Its type is the widest type of any value in it
+	(CSV_INT, then CSV_DOUBLE, then CSV_STR), or CSV_VOID if it's all empty. Only the array for
+	that type is filled in; strings are dictionary-coded, each row's value being dict[codes[row]].
+	valid[row] is 0 where the row has no value. ***/
+struct CsvColumn {
+	std::string			name;
+	int				typ;
+	std::vector<i64>		ints;
+	std::vector<double>		doubles;
+	std::vector<u32>		codes;
+	std::vector<std::string>	dict;
+	std::vector<u8>			valid;
+
+	const std::string& str(u64 row) const	{ return dict[codes[row]]; }
+};
+
+class CsvReader {
+public:
+	CsvReader();
+	~CsvReader();
+
+	/*** Map the CSV file. Returns 0 on success. ***/
+	int open(const char* filename, bool has_headers);
+	int open(const std::string& filename, bool has_headers);
+
+	/*** Read CSV in memory. The data isn't copied, so it must outlive the reader. ***/
+	void open(const char* data, u64 len, bool has_headers);
+
+	void close(void);
+
+	/*** The field separator, ',' by default. Set it before opening. ***/
+	void set_delimiter(char delim)	{ sep = delim; }
+
+	/*** The header names, empty if the file has no headers. ***/
+	const std::vector<std::string>& headers(void) const	{ return hdrs; }
+
+	/*** Call fn for each row, in order. Returns the number of rows read. ***/
+	u64 for_each_row(CsvRowFn fn);
+
+	/*** Read every row into typed columns (one per header, or as many as the widest row.) The file is
+		cut into chunks that are parsed in parallel; the quote state at each chunk boundary is found
+		first, so quoted newlines are handled. Returns the number of rows. pool == nullptr uses the
+		shared pool. ***/
+	u64 read_columns(std::vector<CsvColumn>& cols, ThreadPool* pool = nullptr);
+
+private:
+	void read_headers(bool has_headers);
+
+	RamFile rf;
+	const u8* buf;
+	u64 len;
+	u64 body;
+	std::vector<std::string> hdrs;
+	char sep;
+};
+
 #endif  // __CSV_H
 /* end csv.h */
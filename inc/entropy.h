@@ -2,7 +2,8 @@
 
 	entropy.h
 
-	An entropy encoder/compressor.
+	An entropy encoder/compressor: a Huffman-style order-0 coder, and an interleaved rANS coder with static or
+	adaptive models.
 
 	Copyright (c) 2014-2022 C. M. Street
 
@@ -41,9 +42,35 @@ extern void entropy_decompress_file(const char* fname_in, const char* fname_out)
 /*** Decompresses an entropy-compressed memory buffer. Note that this allocates buf_out and returns the length in output_len. ***/
 extern void entropy_decompress_membuf(char* buf_in, u32 input_len, char** buf_out, u32* output_len);
 
+/*** The same, with the original bit-at-a-time tree walk instead of the lookup table. For testing and benchmarks. ***/
+extern void entropy_decompress_membuf_reference(char* buf_in, u32 input_len, char** buf_out, u32* output_len);
+
 /*** Slower but much better compression for low-entropy data ***/
 extern bool entropy_compress_file_full(const char* fname_in, const char* fname_out);
 
 extern bool entropy_decompress_file_full(const char* fname_in, const char* fname_out);
 
+/*** rANS coding. 'ways' (4 or 8) interleaved coder states let the decoder work on several symbols at once. The
+     static model sends a frequency table and codes blocks in parallel; the adaptive model needs no table and follows
+     data whose statistics change as it goes, but is serial. pool == nullptr uses the shared thread pool. ***/
+enum RansModel {
+	RANS_STATIC = 0,
+	RANS_ADAPTIVE,
+};
+
+extern void rans_compress(const u8* data, u64 len, std::vector<u8>& out, RansModel model = RANS_STATIC, u32 ways = 4,
+				ThreadPool* pool = nullptr);
+/*** Returns false if the data is corrupt. ***/
+extern bool rans_decompress(const u8* data, u64 len, std::vector<u8>& out, ThreadPool* pool = nullptr);
+
+/*** Like entropy_compress_membuf(): returns true if the compressed data fits in buf_out. ***/
+extern bool rans_compress_membuf(const char* buf_in, u32 input_len, char* buf_out, u32 output_len, u32* compress_len,
+				RansModel model = RANS_STATIC, u32 ways = 4);
+/*** Like entropy_decompress_membuf(): allocates buf_out. Returns false if the data is corrupt. ***/
+extern bool rans_decompress_membuf(const char* buf_in, u32 input_len, char** buf_out, u32* output_len);
+
+/*** fname_out is overwritten. These return false if a file can't be read or written, or is corrupt. ***/
+extern bool rans_compress_file(const char* fname_in, const char* fname_out, RansModel model = RANS_STATIC, u32 ways = 4);
+extern bool rans_decompress_file(const char* fname_in, const char* fname_out);
+
 #endif  // __ENTROPY_H
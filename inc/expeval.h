@@ -7,6 +7,13 @@
 	Supports user-defined operators (in-fix binary, pre-fix or post-fix unary), user-defined functions (with any number
 	of arguments), and user-defined variables which can be assigned a value at evaluation time.
 
+	The first evaluate() compiles the expression to bytecode for a small stack machine: variables are bound to
+	slots (numbered in the order of variable_name()), built-in operators and functions get their own opcodes,
+	and subexpressions with constant operands are folded. Redefining operators or functions, or set(), will
+	recompile it. evaluate_batch() runs the same program over columns of variable values, a block of rows at a
+	time, with each instruction a simple loop over the block that the compiler can vectorize; use it when the
+	same formula is evaluated for many inputs.
+
 	C. M. Street
 
 ***/
@@ -193,6 +200,30 @@ enum TokenType {
 	TOKEN_FALSE
 };
 
+/* bytecode opcodes */
+enum ExpOpcode {
+	EXPOP_CONST, EXPOP_VAR,
+	// evaluation ends here: a stack underflow, or a call to an undefined function
+	EXPOP_FAIL, EXPOP_UNDEF,
+	// user-defined operators and functions, which call the callback with one argument or an array of them
+	EXPOP_CALL1, EXPOP_CALLN,
+	// the built-ins
+	EXPOP_POS, EXPOP_NEG, EXPOP_NOT, EXPOP_FACT,
+	EXPOP_ADD, EXPOP_SUB, EXPOP_MUL, EXPOP_DIV, EXPOP_IDIV, EXPOP_MOD, EXPOP_POW,
+	EXPOP_EQ, EXPOP_NE, EXPOP_LT, EXPOP_LE, EXPOP_GT, EXPOP_GE, EXPOP_AND, EXPOP_OR,
+	EXPOP_ABS, EXPOP_SGN, EXPOP_FLOOR, EXPOP_CEIL, EXPOP_EXP, EXPOP_LN, EXPOP_SQRT, EXPOP_GAMMA,
+	EXPOP_SIN, EXPOP_COS, EXPOP_TAN, EXPOP_ASIN, EXPOP_ACOS, EXPOP_ATAN, EXPOP_ATAN2
+};
+
+/* bytecode instruction */
+struct ExpInstr {
+	uint8_t op;			// an ExpOpcode
+	uint8_t left_int;		// is the (left) operand an integer in evaluate_batch()?
+	uint16_t nargs;			// number of values popped off the stack
+	uint32_t arg;			// constant index or variable slot
+	EvaluationCallbackType fn;	// callback, for evaluate()
+};
+
 struct Token {
 	TokenType type;
 	std::string representation;
@@ -227,41 +258,46 @@ public:
 		expression = expression_str;
 		tokens.clear();
 		rpn.clear();
-		variables.clear();
+		var_names.clear();
+		var_values.clear();
 		tokenize();
 		buildRPN();
 		extractVariables();
+		compiled = false;
 	}
 
 	// Return the number of different named variables in this expression
 	size_t count_variables() const {
-		return variables.size();
+		return var_names.size();
 	}
 
 	// Return the name of the i'th named variable in this expression
 	std::string variable_name(size_t i) const {
-		if (i >= variables.size()) return "";
-		auto it = variables.begin();
-		std::advance(it, i);
-		return it->first;
+		if (i >= var_names.size()) return "";
+		return var_names[i];
+	}
+
+	// Return the index of the named variable, or -1 if there's no such variable
+	int variable_index(const std::string& name) const {
+		auto it = std::lower_bound(var_names.begin(), var_names.end(), name);
+		if (it == var_names.end() || *it != name) return -1;
+		return (int)(it - var_names.begin());
 	}
 
 	// Get the value of a variable by index or name
 	ExpValue& get_variable(size_t i) {
 		static ExpValue err(ERR_OUT_OF_BOUNDS);
-		if (i >= variables.size()) {
+		if (i >= var_values.size()) {
 			return err;
 		}
-		auto it = variables.begin();
-		std::advance(it, i);
-		return it->second;
+		return var_values[i];
 	}
 
 	ExpValue& get_variable(const std::string& name) {
-		auto it = variables.find(name);
 		static ExpValue err(ERR_OUT_OF_BOUNDS);
-		if (it != variables.end()) {
-			return it->second;
+		int i = variable_index(name);
+		if (i >= 0) {
+			return var_values[i];
 		} else {
 			return err;
 		}
@@ -269,40 +305,34 @@ public:
 
 	// Set the value of a variable
 	int set_variable(const std::string& variable_name, const ExpValue& new_value) {
-		auto it = variables.find(variable_name);
-		if (it != variables.end()) {
-			it->second = new_value;
+		int i = variable_index(variable_name);
+		if (i >= 0) {
+			var_values[i] = new_value;
 			return 0;
 		}
 		return 1; // Variable not found
 	}
 
 	int set_variable(size_t i, const ExpValue& new_value) {
-		if (i >= variables.size()) return 1;
-		auto it = variables.begin();
-		std::advance(it, i);
-		it->second = new_value;
+		if (i >= var_values.size()) return 1;
+		var_values[i] = new_value;
 		return 0;
 	}
 
 	// Assign one variable's value to another
 	int set_variable(const std::string& variable_dest, const std::string& variable_src) {
-		auto src_it = variables.find(variable_src);
-		auto dst_it = variables.find(variable_dest);
-		if (src_it != variables.end() && dst_it != variables.end()) {
-			dst_it->second = src_it->second;
+		int i_src = variable_index(variable_src);
+		int i_dest = variable_index(variable_dest);
+		if (i_src >= 0 && i_dest >= 0) {
+			var_values[i_dest] = var_values[i_src];
 			return 0;
 		}
 		return 1; // One or both variables not found
 	}
 
 	int set_variable(int i_dest, int i_src) {
-		if (i_dest >= (int)variables.size() || i_src >= (int)variables.size()) return 1;
-		auto dest_it = variables.begin();
-		auto src_it = variables.begin();
-		std::advance(dest_it, i_dest);
-		std::advance(src_it, i_src);
-		dest_it->second = src_it->second;
+		if (i_dest < 0 || i_src < 0 || i_dest >= (int)var_values.size() || i_src >= (int)var_values.size()) return 1;
+		var_values[i_dest] = var_values[i_src];
 		return 0;
 	}
 
@@ -322,6 +352,7 @@ public:
 		op.precedence = op_priority;
 		op.callback = eval_callback;
 		operators.push_back(op);
+		compiled = false;
 		return 0;
 	}
 
@@ -360,177 +391,177 @@ public:
 		func.arg_count = c_args;
 		func.callback = eval_callback;
 		functions[fn_name] = func;
+		compiled = false;
 		return 0;
 	}
 
-	// Evaluate the expression
-	ExpValue evaluate() {
-		std::stack<ExpValue> stack;
-		static ExpValue err_undef(ERR_UNDEFINED);
-		static ExpValue err_oob(ERR_OUT_OF_BOUNDS);
-		
-		for (const Token& token : rpn) {
+	// Compile the expression to bytecode. evaluate() and evaluate_batch() do this when they need to.
+	void compile() {
+		struct StackEntry {
+			bool konst;		// the value of a CONST instruction, the last one in the code so far
+			ValueType vt;		// its type, when the variables are doubles (as in evaluate_batch())
+		};
+		std::vector<StackEntry> st;
+		bool stop = false;
+
+		code.clear();
+		consts.clear();
+		max_depth = 0;
+		batch_ok = true;
+
+		for (size_t t = 0; t < rpn.size() && !stop; ++t) {
+			const Token& token = rpn[t];
+			ExpInstr in = { EXPOP_CONST, 0, 0, 0, nullptr };
+
 			switch (token.type) {
 				case TOKEN_NUMBER:
 				case TOKEN_TRUE:
 				case TOKEN_FALSE:
-					stack.push(token.value);
+					in.arg = (uint32_t)consts.size();
+					consts.push_back(token.value);
+					code.push_back(in);
+					st.push_back({ true, token.value.vt });
 					break;
-					
-				case TOKEN_VARIABLE: {
-					auto it = variables.find(token.representation);
-					if (it != variables.end()) {
-						stack.push(it->second);
-					} else {
-						return err_oob;
-					}
+
+				case TOKEN_VARIABLE:
+					in.op = EXPOP_VAR;
+					in.arg = (uint32_t)variable_index(token.representation);
+					code.push_back(in);
+					st.push_back({ false, VALUE_DOUBLE });
 					break;
-				}
-				
-				case TOKEN_FUNCTION: {
-					// Pop arguments from stack
-					ExpValue args;
-					args.reserve_array(token.value.i_val); // Number of args stored in i_val
-					
-					// Pop arguments in reverse order
-					for (int i = token.value.i_val - 1; i >= 0; --i) {
-						if (stack.empty()) return err_oob;
-						args[i] = stack.top();
-						stack.pop();
-					}
-					
-					// Evaluate function
-					ExpValue result;
-					auto func_it = functions.find(token.representation);
-					if (func_it != functions.end() && func_it->second.callback) {
-						func_it->second.callback(args, result);
+
+				case TOKEN_FUNCTION:
+				case TOKEN_OPERATOR: {
+					bool undefined = false;
+					if (token.type == TOKEN_FUNCTION) {
+						// Number of args stored in i_val
+						auto func_it = functions.find(token.representation);
+						in.nargs = (uint16_t)token.value.i_val;
+						if (func_it != functions.end() && func_it->second.callback) {
+							in.fn = func_it->second.callback;
+						} else {
+							undefined = true;
+						}
 					} else {
-						result = err_undef;
+						in.nargs = (token.op_type == OP_INFIX) ? 2 : 1;
+						in.fn = token.callback;
 					}
-					
-					// Check for error
-					if (result.vt == VALUE_ERROR) {
-						return result;
+
+					// Stack underflow, or an undefined function: evaluation ends with an error here.
+					if (st.size() < in.nargs || undefined) {
+						in.op = (st.size() < in.nargs) ? EXPOP_FAIL : EXPOP_UNDEF;
+						code.push_back(in);
+						stop = true;
+						break;
 					}
-					
-					stack.push(result);
-					break;
-				}
-				
-				case TOKEN_OPERATOR: {
-					ExpValue result;
-					
-					// Handle different operator types
-					if (token.op_type == OP_PREFIX) {
-						// Unary prefix: pop one operand
-						if (stack.empty()) return err_oob;
-						ExpValue operand = stack.top();
-						stack.pop();
-						
-						// Special handling for logical operators (short-circuiting)
-						if (token.representation == "!" && operand.vt == VALUE_INT) {
-							// Logical NOT with short-circuit
-							result = ExpValue(operand.i_val == 0 ? (int64_t) 1 : (int64_t) 0);
-						} else if (token.callback) {
-							token.callback(operand, result);
-						}
-						
-						// Check for error
-						if (result.vt == VALUE_ERROR) {
-							return result;
-						}
-						
-						stack.push(result);
-						
-					} else if (token.op_type == OP_POSTFIX) {
-						// Unary postfix: pop one operand
-						if (stack.empty()) return err_oob;
-						ExpValue operand = stack.top();
-						stack.pop();
-						
-						if (token.callback) {
-							token.callback(operand, result);
-						}
-						
-						// Check for error
-						if (result.vt == VALUE_ERROR) {
-							return result;
-						}
-						
-						stack.push(result);
-						
-					} else if (token.op_type == OP_INFIX) {
-						// Binary: pop two operands (right then left)
-						if (stack.size() < 2) return err_oob;
-						ExpValue right = stack.top();
-						stack.pop();
-						ExpValue left = stack.top();
-						stack.pop();
-						
-						// Special handling for logical operators (short-circuiting)
-						if (token.representation == "&&" && left.vt == VALUE_INT) {
-							if (left.i_val == 0) {
-								// Short-circuit: don't evaluate right operand
-								result = ExpValue((int64_t) 0);
-							} else {
-								// Need to evaluate right operand
-								if (right.vt == VALUE_ERROR) {
-									return right;
-								}
-								// Convert to boolean
-								int64_t right_bool = (right.vt == VALUE_INT) ? 
-									(right.i_val != 0 ? 1 : 0) : 
-									(right.d_val != 0.0 ? 1 : 0);
-								result = ExpValue(right_bool);
-							}
-						} else if (token.representation == "||" && left.vt == VALUE_INT) {
-							if (left.i_val != 0) {
-								// Short-circuit: don't evaluate right operand
-								result = ExpValue((int64_t) 1);
-							} else {
-								// Need to evaluate right operand
-								if (right.vt == VALUE_ERROR) {
-									return right;
-								}
-								// Convert to boolean
-								int64_t right_bool = (right.vt == VALUE_INT) ? 
-									(right.i_val != 0 ? 1 : 0) : 
-									(right.d_val != 0.0 ? 1 : 0);
-								result = ExpValue(right_bool);
-							}
-						} else {
-							// Standard infix operator
-							ExpValue operands;
-							operands.reserve_array(2);
-							operands[0] = left;
-							operands[1] = right;
-							
-							if (token.callback) {
-								token.callback(operands, result);
-							}
+					in.op = opcode_for(in.fn, in.nargs);
+
+					// Fold built-ins with constant operands, unless that gives an error.
+					bool fold = (in.op >= EXPOP_POS);
+					for (size_t e = 0; e < in.nargs && fold; ++e) {
+						fold = st[st.size() - 1 - e].konst;
+					}
+					if (fold) {
+						ExpValue vals[2], ret;
+						size_t sp = 0;
+						for (size_t e = code.size() - in.nargs; e < code.size(); ++e) {
+							vals[sp++] = consts[code[e].arg];
 						}
-						
-						// Check for error
-						if (result.vt == VALUE_ERROR) {
-							return result;
+						if (step(in, nullptr, nullptr, vals, sp, ret)) {
+							code.resize(code.size() - in.nargs);
+							st.resize(st.size() - in.nargs);
+							in = { EXPOP_CONST, 0, 0, (uint32_t)consts.size(), nullptr };
+							consts.push_back(vals[0]);
+							code.push_back(in);
+							st.push_back({ true, vals[0].vt });
+							break;
 						}
-						
-						stack.push(result);
 					}
+
+					ValueType left = VALUE_INT, right = VALUE_INT;
+					if (in.nargs > 0) {
+						left = st[st.size() - in.nargs].vt;
+						right = st.back().vt;
+					}
+					if (in.op < EXPOP_POS) {
+						batch_ok = false;
+					}
+					in.left_int = (left == VALUE_INT);
+					code.push_back(in);
+					st.resize(st.size() - in.nargs);
+					st.push_back({ false, result_type(in.op, left, right) });
 					break;
 				}
-				
+
 				default:
 					break;
 			}
+			max_depth = std::max(max_depth, st.size());
 		}
-		
+
+		vm_stack.resize(std::max(max_depth, (size_t) 1));
+		compiled = true;
+	}
+
+	// Evaluate the expression
+	ExpValue evaluate() {
+		if (!compiled) {
+			compile();
+		}
+
+		ExpValue* st = vm_stack.data();
+		size_t sp = 0;
+		ExpValue ret;
+		for (const ExpInstr& in : code) {
+			if (!step(in, consts.data(), var_values.data(), st, sp, ret)) {
+				return ret;
+			}
+		}
+
 		// Final result should be the only thing on the stack
-		if (stack.empty()) {
-			return err_undef;
+		if (sp == 0) {
+			return ExpValue(ERR_UNDEFINED);
+		}
+
+		return st[sp - 1];
+	}
+
+	// Evaluate the expression for n sets of variable values at once. columns[v] points to the n values of
+	// variable v (numbered as for variable_name()), and the n results are written to out. Arithmetic is in
+	// double precision, with integer operations done on the integral doubles (without overflow checks), and
+	// rows where evaluate() would give an error come out NaN. Expressions that use user-defined operators or
+	// functions are evaluated row by row; the variables keep their values either way.
+	void evaluate_batch(const double* const* columns, size_t n, double* out) {
+		if (!compiled) {
+			compile();
+		}
+
+		if (!batch_ok) {
+			std::vector<ExpValue> saved;
+			saved.swap(var_values);
+			var_values.resize(saved.size());
+			for (size_t i = 0; i < n; ++i) {
+				for (size_t v = 0; v < var_values.size(); ++v) {
+					var_values[v] = ExpValue(columns[v][i]);
+				}
+				ExpValue result = evaluate();
+				if (result.vt == VALUE_DOUBLE) {
+					out[i] = result.d_val;
+				} else if (result.vt == VALUE_INT) {
+					out[i] = (double)result.i_val;
+				} else {
+					out[i] = std::nan("");
+				}
+			}
+			var_values.swap(saved);
+			return;
+		}
+
+		std::vector<double> scratch(max_depth * EXP_BATCH_BLOCK + 1);
+		uint8_t bad[EXP_BATCH_BLOCK];
+		for (size_t base = 0; base < n; base += EXP_BATCH_BLOCK) {
+			batch_block(columns, base, std::min(n - base, (size_t) EXP_BATCH_BLOCK), out + base, scratch.data(), bad);
 		}
-		
-		return stack.top();
 	}
 
 private:
@@ -543,9 +574,393 @@ private:
 	std::string expression;
 	std::vector<Token> tokens;
 	std::vector<Token> rpn;
-	std::map<std::string, ExpValue> variables;
+	std::vector<std::string> var_names;	// sorted; a variable's slot is its index here
+	std::vector<ExpValue> var_values;
 	std::vector<Token> operators;
 	std::map<std::string, Function> functions;
+
+	// The compiled program, and the stack evaluate() runs it on
+	enum { EXP_BATCH_BLOCK = 256 };
+	bool compiled = false;
+	bool batch_ok = false;
+	size_t max_depth = 0;
+	std::vector<ExpInstr> code;
+	std::vector<ExpValue> consts;
+	std::vector<ExpValue> vm_stack;
+
+	// The opcode for a callback: built-ins have their own, anything else is a call.
+	static uint8_t opcode_for(EvaluationCallbackType fn, size_t nargs) {
+		static const struct {
+			EvaluationCallbackType fn;
+			size_t nargs;
+			uint8_t op;
+		} builtins[] = {
+			{ callback_unary_plus, 1, EXPOP_POS }, { callback_unary_minus, 1, EXPOP_NEG },
+			{ callback_logical_not, 1, EXPOP_NOT }, { callback_factorial, 1, EXPOP_FACT },
+			{ callback_add, 2, EXPOP_ADD }, { callback_subtract, 2, EXPOP_SUB },
+			{ callback_multiply, 2, EXPOP_MUL }, { callback_divide, 2, EXPOP_DIV },
+			{ callback_int_divide, 2, EXPOP_IDIV }, { callback_modulo, 2, EXPOP_MOD },
+			{ callback_power, 2, EXPOP_POW }, { callback_pow, 2, EXPOP_POW },
+			{ callback_equal, 2, EXPOP_EQ }, { callback_not_equal, 2, EXPOP_NE },
+			{ callback_less_than, 2, EXPOP_LT }, { callback_less_equal, 2, EXPOP_LE },
+			{ callback_greater_than, 2, EXPOP_GT }, { callback_greater_equal, 2, EXPOP_GE },
+			{ callback_logical_and, 2, EXPOP_AND }, { callback_logical_or, 2, EXPOP_OR },
+			{ callback_abs, 1, EXPOP_ABS }, { callback_sgn, 1, EXPOP_SGN },
+			{ callback_floor, 1, EXPOP_FLOOR }, { callback_ceil, 1, EXPOP_CEIL },
+			{ callback_exp, 1, EXPOP_EXP }, { callback_ln, 1, EXPOP_LN },
+			{ callback_sqrt, 1, EXPOP_SQRT }, { callback_gamma, 1, EXPOP_GAMMA },
+			{ callback_sin, 1, EXPOP_SIN }, { callback_cos, 1, EXPOP_COS },
+			{ callback_tan, 1, EXPOP_TAN }, { callback_asin, 1, EXPOP_ASIN },
+			{ callback_acos, 1, EXPOP_ACOS }, { callback_atan, 1, EXPOP_ATAN },
+			{ callback_atan2, 2, EXPOP_ATAN2 },
+		};
+		for (const auto& b : builtins) {
+			if (b.fn == fn && b.nargs == nargs) {
+				return b.op;
+			}
+		}
+		return (nargs == 1) ? EXPOP_CALL1 : EXPOP_CALLN;
+	}
+
+	// The type of a built-in's result, given the types of its operands
+	static ValueType result_type(int op, ValueType left, ValueType right) {
+		switch (op) {
+			case EXPOP_ADD:
+			case EXPOP_SUB:
+			case EXPOP_MUL:
+				return (left == VALUE_INT && right == VALUE_INT) ? VALUE_INT : VALUE_DOUBLE;
+			case EXPOP_POS:
+			case EXPOP_NEG:
+			case EXPOP_ABS:
+			case EXPOP_FLOOR:
+			case EXPOP_CEIL:
+				return left;
+			case EXPOP_IDIV:
+			case EXPOP_MOD:
+			case EXPOP_EQ:
+			case EXPOP_NE:
+			case EXPOP_LT:
+			case EXPOP_LE:
+			case EXPOP_GT:
+			case EXPOP_GE:
+			case EXPOP_AND:
+			case EXPOP_OR:
+			case EXPOP_NOT:
+			case EXPOP_FACT:
+			case EXPOP_SGN:
+				return VALUE_INT;
+			default:
+				return VALUE_DOUBLE;
+		}
+	}
+
+	// The double precision cases of + - * /, done directly; false for anything else (integer arithmetic with its
+	// overflow checks, errors, division by zero), which is left to the callback.
+	static bool double_arith(int op, const ExpValue& left, const ExpValue& right, ExpValue& result) {
+		if ((left.vt != VALUE_INT && left.vt != VALUE_DOUBLE) || (right.vt != VALUE_INT && right.vt != VALUE_DOUBLE)) {
+			return false;
+		}
+		if (op != EXPOP_DIV && left.vt == VALUE_INT && right.vt == VALUE_INT) {
+			return false;
+		}
+		const double l = (left.vt == VALUE_DOUBLE) ? left.d_val : (double)left.i_val;
+		const double r = (right.vt == VALUE_DOUBLE) ? right.d_val : (double)right.i_val;
+		switch (op) {
+			case EXPOP_ADD:
+				result = ExpValue(l + r);
+				break;
+			case EXPOP_SUB:
+				result = ExpValue(l - r);
+				break;
+			case EXPOP_MUL:
+				result = ExpValue(l * r);
+				break;
+			default:
+				if (r == 0.0) {
+					return false;
+				}
+				result = ExpValue(l / r);
+				break;
+		}
+		return true;
+	}
+
+	// Run one instruction on the value stack. Returns false, with the result in ret, if evaluation ends here.
+	static bool step(const ExpInstr& in, const ExpValue* k, const ExpValue* vars, ExpValue* st, size_t& sp, ExpValue& ret) {
+		ExpValue result;
+
+		switch (in.op) {
+			case EXPOP_CONST:
+				st[sp++] = k[in.arg];
+				return true;
+
+			case EXPOP_VAR:
+				st[sp++] = vars[in.arg];
+				return true;
+
+			case EXPOP_FAIL:
+				ret = ExpValue(ERR_OUT_OF_BOUNDS);
+				return false;
+
+			case EXPOP_UNDEF:
+				ret = ExpValue(ERR_UNDEFINED);
+				return false;
+
+			case EXPOP_AND:
+			case EXPOP_OR: {
+				// Short-circuiting, for an integer left operand; otherwise the result is 0.
+				const ExpValue& left = st[sp - 2];
+				const ExpValue& right = st[sp - 1];
+				if (left.vt == VALUE_INT) {
+					bool is_and = (in.op == EXPOP_AND);
+					if (is_and ? left.i_val == 0 : left.i_val != 0) {
+						result = ExpValue(is_and ? (int64_t) 0 : (int64_t) 1);
+					} else {
+						if (right.vt == VALUE_ERROR) {
+							ret = right;
+							return false;
+						}
+						// Convert to boolean
+						int64_t right_bool = (right.vt == VALUE_INT) ? 
+							(right.i_val != 0 ? 1 : 0) : 
+							(right.d_val != 0.0 ? 1 : 0);
+						result = ExpValue(right_bool);
+					}
+				}
+				break;
+			}
+
+			case EXPOP_ADD:
+			case EXPOP_SUB:
+			case EXPOP_MUL:
+			case EXPOP_DIV:
+				if (double_arith(in.op, st[sp - 2], st[sp - 1], result)) {
+					break;
+				}
+				// fall through
+
+			default:
+				if (in.nargs == 1) {
+					if (in.fn) {
+						in.fn(st[sp - 1], result);
+					}
+				} else if (in.fn) {
+					// The arguments as an array: a view of them on the stack, which it doesn't own.
+					ExpValue args;
+					args.vt = VALUE_ARRAY;
+					args.nel_array = in.nargs;
+					args.a_val = st + sp - in.nargs;
+					in.fn(args, result);
+					args.vt = VALUE_INT;
+				}
+				break;
+		}
+
+		// Check for error
+		if (result.vt == VALUE_ERROR) {
+			ret = result;
+			return false;
+		}
+
+		sp -= in.nargs;
+		st[sp++] = result;
+		return true;
+	}
+
+	// evaluate_batch() on rows [base, base + m): each instruction is a loop over the block, on a stack of
+	// columns in scratch. bad[] marks the rows that have hit an error.
+	void batch_block(const double* const* columns, size_t base, size_t m, double* out, double* scratch, uint8_t* bad) const {
+		const size_t B = EXP_BATCH_BLOCK;
+		size_t sp = 0, i;
+
+		memset(bad, 0, m);
+		for (const ExpInstr& in : code) {
+			if (in.op == EXPOP_FAIL || in.op == EXPOP_UNDEF) {
+				sp = 0;
+				break;
+			}
+			if (in.op == EXPOP_CONST || in.op == EXPOP_VAR) {
+				double* r = scratch + sp * B;
+				if (in.op == EXPOP_VAR) {
+					memcpy(r, columns[in.arg] + base, m * sizeof(double));
+				} else {
+					const ExpValue& k = consts[in.arg];
+					const double v = (k.vt == VALUE_INT) ? (double)k.i_val : k.d_val;
+					for (i = 0; i < m; ++i) r[i] = v;
+				}
+				++sp;
+				continue;
+			}
+
+			// Operands: a is the result (and the left or only operand), b the right operand.
+			double* a = scratch + (sp - in.nargs) * B;
+			const double* b = a + B;
+			switch (in.op) {
+				case EXPOP_POS:
+					break;
+				case EXPOP_NEG:
+					// (integers have no negative zero)
+					if (in.left_int) {
+						for (i = 0; i < m; ++i) a[i] = 0.0 - a[i];
+					} else {
+						for (i = 0; i < m; ++i) a[i] = -a[i];
+					}
+					break;
+				case EXPOP_NOT:
+					for (i = 0; i < m; ++i) a[i] = (a[i] == 0.0) ? 1.0 : 0.0;
+					break;
+				case EXPOP_FACT:
+					for (i = 0; i < m; ++i) {
+						const double d = a[i];
+						if (d < 0 || d != floor(d) || d > 20) {
+							bad[i] = 1;
+							continue;
+						}
+						int64_t f = 1;
+						for (int64_t j = 2; j <= (int64_t)d; ++j) f *= j;
+						a[i] = (double)f;
+					}
+					break;
+				case EXPOP_ADD:
+					for (i = 0; i < m; ++i) a[i] += b[i];
+					break;
+				case EXPOP_SUB:
+					for (i = 0; i < m; ++i) a[i] -= b[i];
+					break;
+				case EXPOP_MUL:
+					for (i = 0; i < m; ++i) a[i] *= b[i];
+					break;
+				case EXPOP_DIV:
+					for (i = 0; i < m; ++i) {
+						bad[i] |= (uint8_t)(b[i] == 0.0);
+						a[i] /= b[i];
+					}
+					break;
+				case EXPOP_IDIV:
+				case EXPOP_MOD:
+					for (i = 0; i < m; ++i) {
+						// (outside the range of int64_t, the conversion is undefined: call it an error.)
+						if (!(fabs(a[i]) < 9.2e18 && fabs(b[i]) < 9.2e18) || (int64_t)b[i] == 0) {
+							bad[i] = 1;
+							continue;
+						}
+						const int64_t l = (int64_t)a[i], r = (int64_t)b[i];
+						a[i] = (double)((in.op == EXPOP_IDIV) ? l / r : l % r);
+					}
+					break;
+				case EXPOP_POW:
+					for (i = 0; i < m; ++i) {
+						const double p = pow(a[i], b[i]);
+						bad[i] |= (uint8_t)((a[i] == 0.0 && b[i] < 0) || (a[i] < 0 && floor(b[i]) != b[i]) || !std::isfinite(p));
+						a[i] = p;
+					}
+					break;
+				case EXPOP_EQ:
+					for (i = 0; i < m; ++i) a[i] = (fabs(a[i] - b[i]) < 1e-10) ? 1.0 : 0.0;
+					break;
+				case EXPOP_NE:
+					for (i = 0; i < m; ++i) a[i] = (fabs(a[i] - b[i]) >= 1e-10) ? 1.0 : 0.0;
+					break;
+				case EXPOP_LT:
+					for (i = 0; i < m; ++i) a[i] = (a[i] < b[i]) ? 1.0 : 0.0;
+					break;
+				case EXPOP_LE:
+					for (i = 0; i < m; ++i) a[i] = (a[i] <= b[i]) ? 1.0 : 0.0;
+					break;
+				case EXPOP_GT:
+					for (i = 0; i < m; ++i) a[i] = (a[i] > b[i]) ? 1.0 : 0.0;
+					break;
+				case EXPOP_GE:
+					for (i = 0; i < m; ++i) a[i] = (a[i] >= b[i]) ? 1.0 : 0.0;
+					break;
+				case EXPOP_AND:
+					for (i = 0; i < m; ++i) a[i] = (in.left_int && a[i] != 0.0 && b[i] != 0.0) ? 1.0 : 0.0;
+					break;
+				case EXPOP_OR:
+					for (i = 0; i < m; ++i) a[i] = (in.left_int && (a[i] != 0.0 || b[i] != 0.0)) ? 1.0 : 0.0;
+					break;
+				case EXPOP_ABS:
+					for (i = 0; i < m; ++i) a[i] = fabs(a[i]);
+					break;
+				case EXPOP_SGN:
+					for (i = 0; i < m; ++i) a[i] = (double)((a[i] > 0) - (a[i] < 0));
+					break;
+				case EXPOP_FLOOR:
+					for (i = 0; i < m; ++i) a[i] = floor(a[i]);
+					break;
+				case EXPOP_CEIL:
+					for (i = 0; i < m; ++i) a[i] = ceil(a[i]);
+					break;
+				case EXPOP_EXP:
+					for (i = 0; i < m; ++i) {
+						a[i] = exp(a[i]);
+						bad[i] |= (uint8_t)std::isinf(a[i]);
+					}
+					break;
+				case EXPOP_LN:
+					for (i = 0; i < m; ++i) {
+						bad[i] |= (uint8_t)(a[i] <= 0);
+						a[i] = log(a[i]);
+					}
+					break;
+				case EXPOP_SQRT:
+					for (i = 0; i < m; ++i) {
+						bad[i] |= (uint8_t)(a[i] < 0);
+						a[i] = sqrt(a[i]);
+					}
+					break;
+				case EXPOP_GAMMA:
+					for (i = 0; i < m; ++i) {
+						bad[i] |= (uint8_t)(a[i] <= 0 && fabs(a[i] - round(a[i])) < 1e-10);
+						a[i] = tgamma(a[i]);
+						bad[i] |= (uint8_t)!std::isfinite(a[i]);
+					}
+					break;
+				case EXPOP_SIN:
+					for (i = 0; i < m; ++i) a[i] = sin(a[i]);
+					break;
+				case EXPOP_COS:
+					for (i = 0; i < m; ++i) a[i] = cos(a[i]);
+					break;
+				case EXPOP_TAN:
+					for (i = 0; i < m; ++i) {
+						// Check for asymptotes
+						const double remainder = fmod(fabs(a[i]) + M_PI_2, M_PI);
+						bad[i] |= (uint8_t)(fabs(remainder - M_PI_2) < 1e-10);
+						a[i] = tan(a[i]);
+						bad[i] |= (uint8_t)std::isinf(a[i]);
+					}
+					break;
+				case EXPOP_ASIN:
+					for (i = 0; i < m; ++i) {
+						bad[i] |= (uint8_t)(a[i] < -1 || a[i] > 1);
+						a[i] = asin(a[i]);
+					}
+					break;
+				case EXPOP_ACOS:
+					for (i = 0; i < m; ++i) {
+						bad[i] |= (uint8_t)(a[i] < -1 || a[i] > 1);
+						a[i] = acos(a[i]);
+					}
+					break;
+				case EXPOP_ATAN:
+					for (i = 0; i < m; ++i) a[i] = atan(a[i]);
+					break;
+				case EXPOP_ATAN2:
+					for (i = 0; i < m; ++i) a[i] = atan2(a[i], b[i]);
+					break;
+				default:
+					break;
+			}
+			sp -= in.nargs - 1;
+		}
+
+		// Final result is the top of the stack
+		const double* r = scratch + (sp > 0 ? sp - 1 : 0) * B;
+		for (i = 0; i < m; ++i) {
+			out[i] = (sp == 0 || bad[i]) ? std::nan("") : r[i];
+		}
+	}
 	
 	void initializeBuiltIns() {
 		// Clear existing operators and functions
@@ -852,16 +1267,18 @@ private:
 	}
 	
 	void extractVariables() {
-		variables.clear();
+		var_names.clear();
 		
 		for (const Token& token : tokens) {
 			if (token.type == TOKEN_VARIABLE) {
-				// Initialize variable with undefined value
-				if (variables.find(token.representation) == variables.end()) {
-					variables[token.representation] = ExpValue(ERR_UNDEFINED);
-				}
+				var_names.push_back(token.representation);
 			}
 		}
+		std::sort(var_names.begin(), var_names.end());
+		var_names.erase(std::unique(var_names.begin(), var_names.end()), var_names.end());
+
+		// Initialize variables with undefined value
+		var_values.assign(var_names.size(), ExpValue(ERR_UNDEFINED));
 	}
 	
 	// Built-in function callbacks
@@ -1106,6 +1523,10 @@ private:
 				output = ExpValue(ERR_FN_DOMAIN);
 				return;
 			}
+			if (d > 20) { // (and before it's too big to convert)
+				output = ExpValue(ERR_OVERFLOW);
+				return;
+			}
 			n = (int64_t)d;
 		} else {
 			if (input.i_val < 0) {
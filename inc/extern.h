@@ -1266,12 +1266,9 @@ void
  * Because its memory usage and expected running time are O(N + D^2),
  * it works well only when the strings differ by a small number of bytes.
  * This implementation stops trying when the strings differ by more than
- * 1000 bytes, and falls back to producing a patch that simply emits the new
- * string.
- *
- * Thus, bdelta does not save any space when given two strings that differ by
- * more than 1000 bytes.  This may be improved in a future version of the
- * library.
+ * 1000 bytes, and falls back to a chunked delta (see bindelta.h), whose
+ * size is roughly the size of the differences however many there are; or,
+ * if that's no smaller, to a patch that simply emits the new string.
  *
  * Example:
  *	#include <ccan/bdelta/bdelta.h>
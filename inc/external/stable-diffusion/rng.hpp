@@ -1,6 +1,7 @@
 #ifndef __RNG_H__
 #define __RNG_H__
 
+#include <memory>
 #include <random>
 #include <vector>
 
@@ -8,6 +9,8 @@ class RNG {
 public:
     virtual void manual_seed(uint64_t seed)      = 0;
     virtual std::vector<float> randn(uint32_t n) = 0;
+    // CMS: a copy of the generator, in its current state.
+    virtual std::shared_ptr<RNG> clone() const   = 0;
 };
 
 class STDDefaultRNG : public RNG {
@@ -19,6 +22,10 @@ public:
         generator.seed((unsigned int)seed);
     }
 
+    std::shared_ptr<RNG> clone() const {
+        return std::make_shared<STDDefaultRNG>(*this);
+    }
+
     std::vector<float> randn(uint32_t n) {
         std::vector<float> result;
         float mean   = 0.0;
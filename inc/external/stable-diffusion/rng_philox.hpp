@@ -98,6 +98,10 @@ public:
         this->offset = 0;
     }
 
+    std::shared_ptr<RNG> clone() const {
+        return std::make_shared<PhiloxRNG>(*this);
+    }
+
     std::vector<float> randn(uint32_t n) {
         std::vector<std::vector<uint32_t>> counter(4, std::vector<uint32_t>(n, 0));
         for (uint32_t i = 0; i < n; i++) {
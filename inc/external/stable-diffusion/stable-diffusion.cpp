@@ -101,6 +101,15 @@ public:
 
     std::string trigger_word = "img";  // should be user settable
 
+    // CMS: the schedule in use, so it can be changed without reloading the model.
+    schedule_t cur_schedule = DEFAULT;
+    rng_type_t cur_rng_type = STD_DEFAULT_RNG;
+    // CMS: conditioning/noise cache (owned by the caller), or NULL.
+    SDGenCache* gen_cache = NULL;
+    // CMS: for a batch of latents with their own seeds, the generator of each (sampler noise for latent i
+    // comes from batch_rngs[i].) Empty to draw all the noise from rng.
+    std::vector<std::shared_ptr<RNG>> batch_rngs;
+
     StableDiffusionGGML() = default;
 
     StableDiffusionGGML(int n_threads,
@@ -112,6 +121,11 @@ public:
           vae_decode_only(vae_decode_only),
           free_params_immediately(free_params_immediately),
           lora_model_dir(lora_model_dir) {
+        set_rng_type(rng_type);
+    }
+
+    void set_rng_type(rng_type_t rng_type) {
+        cur_rng_type = rng_type;
         if (rng_type == STD_DEFAULT_RNG) {
             rng = std::make_shared<STDDefaultRNG>();
         } else if (rng_type == CUDA_RNG) {
@@ -119,6 +133,49 @@ public:
         }
     }
 
+    // CMS: the ancestral samplers' noise, from batch_rngs if there's one per latent, otherwise from rng.
+    void set_sampler_noise(ggml_tensor* noise) {
+        if (batch_rngs.size() != (size_t)noise->ne[3]) {
+            ggml_tensor_set_f32_randn(noise, rng);
+            return;
+        }
+        const int64_t n_per = noise->ne[0] * noise->ne[1] * noise->ne[2];
+        float* data         = (float*)noise->data;
+        for (size_t b = 0; b < batch_rngs.size(); b++) {
+            std::vector<float> r = batch_rngs[b]->randn((uint32_t)n_per);
+            memcpy(data + b * n_per, r.data(), n_per * sizeof(float));
+        }
+    }
+
+    std::shared_ptr<SigmaSchedule> new_schedule(schedule_t schedule) {
+        std::shared_ptr<SigmaSchedule> ret;
+        switch (schedule) {
+            case KARRAS:
+                ret = std::make_shared<KarrasSchedule>();
+                break;
+            case AYS:
+                ret          = std::make_shared<AYSSchedule>();
+                ret->version = version;
+                break;
+            default:
+                ret = std::make_shared<DiscreteSchedule>();
+                break;
+        }
+        return ret;
+    }
+
+    /*** CMS: swap the sigma schedule on a loaded model. The new schedule takes the model's noise levels from the old one. ***/
+    void set_schedule(schedule_t schedule) {
+        if (schedule == cur_schedule)
+            return;
+        std::shared_ptr<SigmaSchedule> sched = new_schedule(schedule);
+        memcpy(sched->alphas_cumprod, denoiser->schedule->alphas_cumprod, sizeof(sched->alphas_cumprod));
+        memcpy(sched->sigmas, denoiser->schedule->sigmas, sizeof(sched->sigmas));
+        memcpy(sched->log_sigmas, denoiser->schedule->log_sigmas, sizeof(sched->log_sigmas));
+        denoiser->schedule = sched;
+        cur_schedule       = schedule;
+    }
+
     ~StableDiffusionGGML() {
 #ifndef CODEHAPPY_CUDA
         if (clip_backend != backend) {
@@ -446,24 +503,20 @@ public:
             switch (schedule) {
                 case DISCRETE:
                     LOG_INFO("running with discrete schedule");
-                    denoiser->schedule = std::make_shared<DiscreteSchedule>();
                     break;
                 case KARRAS:
                     LOG_INFO("running with Karras schedule");
-                    denoiser->schedule = std::make_shared<KarrasSchedule>();
                     break;
                 case AYS:
                     LOG_INFO("Running with Align-Your-Steps schedule");
-                    denoiser->schedule          = std::make_shared<AYSSchedule>();
-                    denoiser->schedule->version = version;
                     break;
                 case DEFAULT:
-                    // Don't touch anything.
                     break;
                 default:
                     LOG_ERROR("Unknown schedule %i", schedule);
                     abort();
             }
+            denoiser->schedule = new_schedule(schedule);
         }
 
         for (int i = 0; i < TIMESTEPS; i++) {
@@ -471,6 +524,7 @@ public:
             denoiser->schedule->sigmas[i]         = std::sqrt((1 - denoiser->schedule->alphas_cumprod[i]) / denoiser->schedule->alphas_cumprod[i]);
             denoiser->schedule->log_sigmas[i]     = std::log(denoiser->schedule->sigmas[i]);
         }
+        cur_schedule = schedule;
 
         LOG_DEBUG("finished loaded file");
         ggml_free(ctx);
@@ -1029,7 +1083,7 @@ public:
 
                     if (sigmas[i + 1] > 0) {
                         // x = x + noise_sampler(sigmas[i], sigmas[i + 1]) * s_noise * sigma_up
-                        ggml_tensor_set_f32_randn(noise, rng);
+                        set_sampler_noise(noise);
                         // noise = load_tensor_from_file(work_ctx, "./rand" + std::to_string(i+1) + ".bin");
                         {
                             float* vec_x     = (float*)x->data;
@@ -1238,7 +1292,7 @@ public:
 
                     // Noise addition
                     if (sigmas[i + 1] > 0) {
-                        ggml_tensor_set_f32_randn(noise, rng);
+                        set_sampler_noise(noise);
                         {
                             float* vec_x     = (float*)x->data;
                             float* vec_noise = (float*)noise->data;
@@ -1354,7 +1408,7 @@ public:
 
                     if (sigmas[i + 1] > 0) {
                         // x += sigmas[i + 1] * noise_sampler(sigmas[i], sigmas[i + 1])
-                        ggml_tensor_set_f32_randn(noise, rng);
+                        set_sampler_noise(noise);
                         // noise = load_tensor_from_file(res_ctx, "./rand" + std::to_string(i+1) + ".bin");
                         {
                             float* vec_x     = (float*)x->data;
@@ -1556,6 +1610,149 @@ void free_sd_ctx(sd_ctx_t* sd_ctx) {
     free(sd_ctx);
 }
 
+/*** CMS: generation settings that can be changed on a loaded context, without reloading the model. ***/
+void sd_ctx_set_n_threads(sd_ctx_t* sd_ctx, int n_threads) {
+    sd_ctx->sd->n_threads = n_threads;
+}
+
+void sd_ctx_set_rng_type(sd_ctx_t* sd_ctx, enum rng_type_t rng_type) {
+    sd_ctx->sd->set_rng_type(rng_type);
+}
+
+void sd_ctx_set_schedule(sd_ctx_t* sd_ctx, enum schedule_t s) {
+    sd_ctx->sd->set_schedule(s);
+}
+
+void sd_ctx_set_gen_cache(sd_ctx_t* sd_ctx, SDGenCache* cache) {
+    sd_ctx->sd->gen_cache = cache;
+}
+
+/*** CMS: the conditioning/noise cache. ***/
+SDGenCache::SDGenCache() {
+	max_conds = 64;
+	max_noise = 64;
+	cond_hits = 0;
+	cond_misses = 0;
+	noise_hits = 0;
+	noise_misses = 0;
+}
+
+static bool cacheable_tensor(ggml_tensor* t) {
+	return t != nullptr && t->type == GGML_TYPE_F32 && ggml_is_contiguous(t);
+}
+
+static void tensor_to_cache(ggml_tensor* t, SDGenCache::Tensor& out) {
+	out.data.resize(ggml_nelements(t));
+	memcpy(out.data.data(), t->data, out.data.size() * sizeof(float));
+	for (int i = 0; i < 4; ++i)
+		out.ne[i] = t->ne[i];
+}
+
+static ggml_tensor* tensor_from_cache(const SDGenCache::Tensor& in, ggml_context* work_ctx) {
+	ggml_tensor* t = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, in.ne[0], in.ne[1], in.ne[2], in.ne[3]);
+	memcpy(t->data, in.data.data(), in.data.size() * sizeof(float));
+	return t;
+}
+
+bool SDGenCache::get_cond(const std::string& key, ggml_context* work_ctx, ggml_tensor** c, ggml_tensor** c_vector) {
+	auto it = conds.find(key);
+	if (it == conds.end()) {
+		++cond_misses;
+		return false;
+	}
+	++cond_hits;
+	*c = tensor_from_cache(it->second.c, work_ctx);
+	*c_vector = (it->second.has_c_vector ? tensor_from_cache(it->second.c_vector, work_ctx) : nullptr);
+	return true;
+}
+
+void SDGenCache::put_cond(const std::string& key, ggml_tensor* c, ggml_tensor* c_vector) {
+	if (max_conds == 0 || !cacheable_tensor(c) || (c_vector != nullptr && !cacheable_tensor(c_vector)))
+		return;
+	if (conds.find(key) != conds.end())
+		return;
+	while (conds.size() >= max_conds) {
+		conds.erase(cond_order.front());
+		cond_order.pop_front();
+	}
+	Cond& entry = conds[key];
+	tensor_to_cache(c, entry.c);
+	entry.has_c_vector = (c_vector != nullptr);
+	if (entry.has_c_vector)
+		tensor_to_cache(c_vector, entry.c_vector);
+	cond_order.push_back(key);
+}
+
+bool SDGenCache::get_noise(const std::string& key, ggml_tensor* dest, std::shared_ptr<RNG>* rng_after) {
+	auto it = noise.find(key);
+	if (it == noise.end() || (int64_t) it->second.t.data.size() != ggml_nelements(dest)) {
+		++noise_misses;
+		return false;
+	}
+	++noise_hits;
+	memcpy(dest->data, it->second.t.data.data(), it->second.t.data.size() * sizeof(float));
+	*rng_after = it->second.rng_after->clone();
+	return true;
+}
+
+void SDGenCache::put_noise(const std::string& key, ggml_tensor* src, const std::shared_ptr<RNG>& rng_after) {
+	if (max_noise == 0 || !cacheable_tensor(src))
+		return;
+	if (noise.find(key) != noise.end())
+		return;
+	while (noise.size() >= max_noise) {
+		noise.erase(noise_order.front());
+		noise_order.pop_front();
+	}
+	Noise& entry = noise[key];
+	tensor_to_cache(src, entry.t);
+	entry.rng_after = rng_after->clone();
+	noise_order.push_back(key);
+}
+
+void SDGenCache::clear() {
+	conds.clear();
+	cond_order.clear();
+	noise.clear();
+	noise_order.clear();
+}
+
+/* get_learned_condition(), through the cache if there is one. */
+static std::pair<ggml_tensor*, ggml_tensor*> cached_learned_condition(sd_ctx_t* sd_ctx, ggml_context* work_ctx, const std::string& text,
+                                                                      int clip_skip, int width, int height, bool force_zero_embeddings = false) {
+    SDGenCache* cache = sd_ctx->sd->gen_cache;
+    if (cache == nullptr) {
+        return sd_ctx->sd->get_learned_condition(work_ctx, text, clip_skip, width, height, force_zero_embeddings);
+    }
+    std::string key = std::to_string(clip_skip) + ":" + std::to_string(width) + "x" + std::to_string(height) +
+                      (force_zero_embeddings ? ":z:" : ":") + text;
+    std::pair<ggml_tensor*, ggml_tensor*> ret;
+    if (cache->get_cond(key, work_ctx, &ret.first, &ret.second)) {
+        return ret;
+    }
+    ret = sd_ctx->sd->get_learned_condition(work_ctx, text, clip_skip, width, height, force_zero_embeddings);
+    cache->put_cond(key, ret.first, ret.second);
+    return ret;
+}
+
+/* fill a tensor with the Gaussian noise for a seed, through the cache if there is one. */
+static void cached_randn(sd_ctx_t* sd_ctx, ggml_tensor* t, int64_t seed) {
+    SDGenCache* cache = sd_ctx->sd->gen_cache;
+    std::string key;
+    if (cache != nullptr) {
+        key = std::to_string(seed) + ":" + std::to_string((int) sd_ctx->sd->cur_rng_type) + ":" + std::to_string(t->ne[0]) + "x" +
+              std::to_string(t->ne[1]) + "x" + std::to_string(t->ne[2]) + "x" + std::to_string(t->ne[3]);
+        if (cache->get_noise(key, t, &sd_ctx->sd->rng)) {
+            return;
+        }
+    }
+    sd_ctx->sd->rng->manual_seed(seed);
+    ggml_tensor_set_f32_randn(t, sd_ctx->sd->rng);
+    if (cache != nullptr) {
+        cache->put_noise(key, t, sd_ctx->sd->rng);
+    }
+}
+
 /*** CMS (May '24: interpolate two ggml tensors. parameterized as [0., 1.] with 0. meaning "fully the first tensor" and 1. "fully the second". ***/
 //// First: linear interpolation functions.
 static float interp_float(float f1, float f2, float param) {
@@ -2137,11 +2334,11 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
 
     // Get learned condition
     t0                    = ggml_time_ms();
-    auto cond_pair        = sd_ctx->sd->get_learned_condition(work_ctx, prompt, clip_skip, width, height);
+    auto cond_pair        = cached_learned_condition(sd_ctx, work_ctx, prompt, clip_skip, width, height);
     ggml_tensor* c        = cond_pair.first;
     ggml_tensor* c_vector = cond_pair.second;  // [adm_in_channels, ]
     if (interpolating(interp_data) && !interp_data->prompt2.empty()) {
-    	auto cond2 = sd_ctx->sd->get_learned_condition(work_ctx, interp_data->prompt2, clip_skip, width, height);
+    	auto cond2 = cached_learned_condition(sd_ctx, work_ctx, interp_data->prompt2, clip_skip, width, height);
     	interp_data->c2 = cond2.first;
     	interp_data->c_vector2 = cond2.second;
     }
@@ -2153,11 +2350,11 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
         if (sd_ctx->sd->version == VERSION_XL && negative_prompt.size() == 0) {
             force_zero_embeddings = true;
         }
-        auto uncond_pair = sd_ctx->sd->get_learned_condition(work_ctx, negative_prompt, clip_skip, width, height, force_zero_embeddings);
+        auto uncond_pair = cached_learned_condition(sd_ctx, work_ctx, negative_prompt, clip_skip, width, height, force_zero_embeddings);
         uc               = uncond_pair.first;
         uc_vector        = uncond_pair.second;  // [adm_in_channels, ]
         if (interpolating(interp_data) && !interp_data->neg_prompt2.empty()) {
-        	auto uncond2 = sd_ctx->sd->get_learned_condition(work_ctx, interp_data->neg_prompt2, clip_skip, width, height, false);
+        	auto uncond2 = cached_learned_condition(sd_ctx, work_ctx, interp_data->neg_prompt2, clip_skip, width, height, false);
         	interp_data->uc2 = uncond2.first;
         	interp_data->uc_vector2 = uncond2.second;
         }
@@ -2187,27 +2384,25 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
         int64_t cur_seed       = (interpolating(interp_data) ? seed : seed + b);
         LOG_INFO("generating image: %i/%i - seed %i", b + 1, batch_count, cur_seed);
 
-        sd_ctx->sd->rng->manual_seed(cur_seed);
         struct ggml_tensor* x_t   = NULL;
         struct ggml_tensor* noise = NULL;
         if (init_latent == NULL) {
             x_t = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
-            ggml_tensor_set_f32_randn(x_t, sd_ctx->sd->rng);
+            cached_randn(sd_ctx, x_t, cur_seed);
         } else {
             x_t   = init_latent;
             noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
-            ggml_tensor_set_f32_randn(noise, sd_ctx->sd->rng);
+            cached_randn(sd_ctx, noise, cur_seed);
         }
         if (interpolating(interp_data) && interp_data->seed2 >= 0) {
-        	sd_ctx->sd->rng->manual_seed(interp_data->seed2);
         	if (init_latent == nullptr) {
         		interp_data->x_t2 = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
-	        	ggml_tensor_set_f32_randn(interp_data->x_t2, sd_ctx->sd->rng);
+	        	cached_randn(sd_ctx, interp_data->x_t2, interp_data->seed2);
 	        	interp_data->noise2 = nullptr;
         	} else {
         		interp_data->x_t2 = init_latent;
         		interp_data->noise2 = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
-	        	ggml_tensor_set_f32_randn(interp_data->x_t2, sd_ctx->sd->rng);        		
+	        	cached_randn(sd_ctx, interp_data->noise2, interp_data->seed2);
 	        }
 	}
 
@@ -2496,6 +2691,246 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
     return result_images;
 }
 
+// CMS: stack conditioning tensors ([dim, n_token] or [dim]) of the same shape on a new batch dimension.
+static ggml_tensor* stack_cond(ggml_context* work_ctx, const std::vector<ggml_tensor*>& conds) {
+    if (conds.empty() || conds[0] == NULL) {
+        return NULL;
+    }
+    ggml_tensor* c     = conds[0];
+    const size_t bytes = ggml_nbytes(c);
+    ggml_tensor* ret   = (ggml_n_dims(c) == 1) ? ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, c->ne[0], conds.size())
+                                               : ggml_new_tensor_3d(work_ctx, GGML_TYPE_F32, c->ne[0], c->ne[1], conds.size());
+    for (size_t i = 0; i < conds.size(); i++) {
+        memcpy((char*)ret->data + i * bytes, conds[i]->data, bytes);
+    }
+    return ret;
+}
+
+static bool same_shape(const ggml_tensor* a, const ggml_tensor* b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return ggml_are_same_shape(a, b);
+}
+
+/*** CMS: several images with their own prompts and seeds, denoised together. The latents of items with the same
+     LoRAs and prompt lengths are stacked on the batch dimension, each with its own conditioning, so one UNet
+     evaluation covers all of them. Item i comes out as txt2img() (or img2img()) would make it alone. ***/
+sd_image_t* generate_batch(sd_ctx_t* sd_ctx,
+                           const sd_batch_item_t* items,
+                           int n_items,
+                           int clip_skip,
+                           float cfg_scale,
+                           int width,
+                           int height,
+                           enum sample_method_t sample_method,
+                           int sample_steps,
+                           float strength) {
+    LOG_DEBUG("generate_batch %d x %dx%d", n_items, width, height);
+    if (sd_ctx == NULL || items == NULL || n_items <= 0) {
+        return NULL;
+    }
+    const bool use_init = (items[0].init_image != NULL);
+    for (int i = 1; i < n_items; i++) {
+        if ((items[i].init_image != NULL) != use_init) {
+            LOG_ERROR("generate_batch: either every item has an init image, or none does");
+            return NULL;
+        }
+    }
+    StableDiffusionGGML* sd = sd_ctx->sd;
+
+    struct ggml_init_params params;
+    params.mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
+    params.mem_size += width * height * 3 * sizeof(float) * 2;
+    params.mem_size *= n_items;
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    struct ggml_context* work_ctx = ggml_init(params);
+    if (!work_ctx) {
+        LOG_ERROR("ggml_init() failed");
+        return NULL;
+    }
+
+    int64_t t0 = ggml_time_ms();
+
+    std::vector<float> sigmas = sd->denoiser->schedule->get_sigmas(sample_steps);
+    if (use_init) {
+        size_t t_enc = static_cast<size_t>(sample_steps * strength);
+        LOG_INFO("target t_enc is %zu steps", t_enc);
+        std::vector<float> sigma_sched(sigmas.begin() + sample_steps - t_enc - 1, sigmas.end());
+        sigmas.swap(sigma_sched);
+    }
+
+    const int C = 4;
+    const int W = width / 8;
+    const int H = height / 8;
+    std::vector<std::pair<std::unordered_map<std::string, float>, std::string>> prompts(n_items);
+    std::vector<ggml_tensor*> c(n_items, NULL), c_vector(n_items, NULL), uc(n_items, NULL), uc_vector(n_items, NULL);
+    std::vector<ggml_tensor*> x_t(n_items, NULL), noise(n_items, NULL);
+    std::vector<std::shared_ptr<RNG>> rngs(n_items);
+    std::vector<ggml_tensor*> final_latents(n_items, NULL);
+    std::vector<bool> done(n_items, false);
+
+    for (int i = 0; i < n_items; i++) {
+        prompts[i] = extract_and_remove_lora(items[i].prompt == NULL ? "" : items[i].prompt);
+    }
+
+    LOG_INFO("sampling using %s method", sampling_methods_str[sample_method]);
+    for (int first = 0; first < n_items; first++) {
+        if (done[first]) {
+            continue;
+        }
+        // the items with the same LoRAs share the model weights: condition them all now.
+        sd->apply_loras(prompts[first].first);
+        std::vector<int> lora_group;
+        std::map<std::pair<std::string, bool>, std::pair<ggml_tensor*, ggml_tensor*>> conds;
+        auto cond_for = [&](const std::string& text, bool force_zero) {
+            auto key = std::make_pair(text, force_zero);
+            auto it  = conds.find(key);
+            if (it == conds.end()) {
+                it = conds.insert(std::make_pair(key, cached_learned_condition(sd_ctx, work_ctx, text, clip_skip, width, height, force_zero))).first;
+            }
+            return it->second;
+        };
+        for (int i = first; i < n_items; i++) {
+            if (done[i] || prompts[i].first != prompts[first].first) {
+                continue;
+            }
+            lora_group.push_back(i);
+            auto cond   = cond_for(prompts[i].second, false);
+            c[i]        = cond.first;
+            c_vector[i] = cond.second;
+            if (cfg_scale != 1.0) {
+                std::string neg = (items[i].negative_prompt == NULL) ? "" : items[i].negative_prompt;
+                bool force_zero = (sd->version == VERSION_XL && neg.empty());
+                auto uncond     = cond_for(neg, force_zero);
+                uc[i]           = uncond.first;
+                uc_vector[i]    = uncond.second;
+            }
+
+            // the same noise (and, for img2img, latent) txt2img() or img2img() would use for this seed.
+            if (!use_init) {
+                x_t[i] = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+                cached_randn(sd_ctx, x_t[i], items[i].seed);
+            } else {
+                sd->rng->manual_seed(items[i].seed);
+                ggml_tensor* init_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
+                sd_image_to_tensor(items[i].init_image->data, init_img);
+                if (!sd->use_tiny_autoencoder) {
+                    ggml_tensor* moments = sd->encode_first_stage(work_ctx, init_img);
+                    x_t[i]               = sd->get_first_stage_encoding(work_ctx, moments);
+                } else {
+                    x_t[i] = sd->encode_first_stage(work_ctx, init_img);
+                }
+                noise[i] = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+                cached_randn(sd_ctx, noise[i], items[i].seed);
+            }
+            rngs[i] = sd->rng->clone();
+        }
+        int64_t t1 = ggml_time_ms();
+        LOG_INFO("conditioning %zu images completed, taking %" PRId64 " ms", lora_group.size(), t1 - t0);
+
+        // latents can only be stacked when their conditioning has the same shape (long prompts take more tokens.)
+        for (size_t g = 0; g < lora_group.size(); g++) {
+            const int lead = lora_group[g];
+            if (done[lead]) {
+                continue;
+            }
+            std::vector<int> run;
+            for (size_t k = g; k < lora_group.size(); k++) {
+                const int i = lora_group[k];
+                if (!done[i] && same_shape(c[i], c[lead]) && same_shape(c_vector[i], c_vector[lead]) &&
+                    same_shape(uc[i], uc[lead]) && same_shape(uc_vector[i], uc_vector[lead])) {
+                    run.push_back(i);
+                    done[i] = true;
+                }
+            }
+            const int n = (int)run.size();
+            std::vector<ggml_tensor*> run_c, run_c_vector, run_uc, run_uc_vector, run_x_t, run_noise;
+            sd->batch_rngs.clear();
+            for (int i : run) {
+                run_c.push_back(c[i]);
+                run_c_vector.push_back(c_vector[i]);
+                run_uc.push_back(uc[i]);
+                run_uc_vector.push_back(uc_vector[i]);
+                run_x_t.push_back(x_t[i]);
+                run_noise.push_back(noise[i]);
+                sd->batch_rngs.push_back(rngs[i]);
+            }
+            // the latents are [W, H, C, 1] each: stacking them is the same as stacking 3-d tensors.
+            ggml_tensor* batch_x_t    = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, n);
+            ggml_tensor* batch_noise  = use_init ? ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, n) : NULL;
+            const size_t latent_bytes = ggml_nbytes(run_x_t[0]);
+            for (int b = 0; b < n; b++) {
+                memcpy((char*)batch_x_t->data + b * latent_bytes, run_x_t[b]->data, latent_bytes);
+                if (use_init) {
+                    memcpy((char*)batch_noise->data + b * latent_bytes, run_noise[b]->data, latent_bytes);
+                }
+            }
+
+            int64_t sampling_start = ggml_time_ms();
+            ggml_tensor* x_0       = sd->sample(work_ctx,
+                                                batch_x_t,
+                                                batch_noise,
+                                                stack_cond(work_ctx, run_c),
+                                                NULL,
+                                                stack_cond(work_ctx, run_c_vector),
+                                                stack_cond(work_ctx, run_uc),
+                                                NULL,
+                                                stack_cond(work_ctx, run_uc_vector),
+                                                NULL,
+                                                0.f,
+                                                cfg_scale,
+                                                cfg_scale,
+                                                sample_method,
+                                                sigmas,
+                                                -1,
+                                                NULL,
+                                                NULL);
+            sd->batch_rngs.clear();
+            int64_t sampling_end = ggml_time_ms();
+            LOG_INFO("sampling %d latents completed, taking %.2fs", n, (sampling_end - sampling_start) * 1.0f / 1000);
+
+            for (int b = 0; b < n; b++) {
+                ggml_tensor* latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+                memcpy(latent->data, (char*)x_0->data + b * latent_bytes, latent_bytes);
+                final_latents[run[b]] = latent;
+            }
+        }
+        t0 = ggml_time_ms();
+    }
+
+    if (sd->free_params_immediately) {
+        sd->cond_stage_model->free_params_buffer();
+        sd->diffusion_model->free_params_buffer();
+    }
+
+    sd_image_t* result_images = (sd_image_t*)calloc(n_items, sizeof(sd_image_t));
+    if (result_images == NULL) {
+        ggml_free(work_ctx);
+        return NULL;
+    }
+    int64_t t3 = ggml_time_ms();
+    for (int i = 0; i < n_items; i++) {
+        struct ggml_tensor* img = sd->decode_first_stage(work_ctx, final_latents[i]);
+        if (img != NULL) {
+            result_images[i].width   = width;
+            result_images[i].height  = height;
+            result_images[i].channel = 3;
+            result_images[i].data    = sd_tensor_to_image(img);
+        }
+    }
+    int64_t t4 = ggml_time_ms();
+    LOG_INFO("decode_first_stage completed, taking %.2fs", (t4 - t3) * 1.0f / 1000);
+    if (sd->free_params_immediately && !sd->use_tiny_autoencoder) {
+        sd->first_stage_model->free_params_buffer();
+    }
+    ggml_free(work_ctx);
+
+    return result_images;
+}
+
 SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                            sd_image_t init_image,
                            int width,
@@ -150,6 +150,56 @@ struct SDInterpolationData {
 	void clear_tensors();
 };
 
+/*** CMS: a cache of text conditioning and initial noise, kept between generations. Re-encoding the same prompt
+	and redrawing the same noise is pure waste in interpolation (the endpoints are the same for every frame) and
+	when iterating on a prompt. Conditioning is keyed by (text, clip skip, size, zero-embedding flag), noise by
+	(seed, latent shape, RNG type); a noise hit also restores the generator state, so results are identical
+	with or without the cache. Both depend on the loaded model, so clear() when the model changes. ***/
+class RNG;
+
+struct SDGenCache {
+	SDGenCache();
+
+	struct Tensor {
+		std::vector<float> data;
+		int64_t ne[4];
+	};
+	struct Cond {
+		Tensor c;
+		Tensor c_vector;
+		bool has_c_vector;
+	};
+	struct Noise {
+		Tensor t;
+		// the generator's state after drawing the noise, since the samplers draw more from it.
+		std::shared_ptr<RNG> rng_after;
+	};
+
+	// lookups: on a hit, the cached data is copied into new tensors in work_ctx.
+	bool get_cond(const std::string& key, ggml_context* work_ctx, ggml_tensor** c, ggml_tensor** c_vector);
+	void put_cond(const std::string& key, ggml_tensor* c, ggml_tensor* c_vector);
+	bool get_noise(const std::string& key, ggml_tensor* dest, std::shared_ptr<RNG>* rng_after);
+	void put_noise(const std::string& key, ggml_tensor* src, const std::shared_ptr<RNG>& rng_after);
+
+	void clear();
+
+	// maximum number of entries of each kind; the oldest are dropped first.
+	size_t max_conds;
+	size_t max_noise;
+
+	// hit/miss counters.
+	uint64_t cond_hits;
+	uint64_t cond_misses;
+	uint64_t noise_hits;
+	uint64_t noise_misses;
+
+private:
+	std::map<std::string, Cond> conds;
+	std::deque<std::string> cond_order;
+	std::map<std::string, Noise> noise;
+	std::deque<std::string> noise_order;
+};
+
 SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             const char* vae_path,
                             const char* taesd_path,
@@ -170,6 +220,13 @@ SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
 
 SD_API void free_sd_ctx(sd_ctx_t* sd_ctx);
 
+/*** CMS: change generation settings on a loaded context. These are cheap: the model is not reloaded. ***/
+SD_API void sd_ctx_set_n_threads(sd_ctx_t* sd_ctx, int n_threads);
+SD_API void sd_ctx_set_rng_type(sd_ctx_t* sd_ctx, enum rng_type_t rng_type);
+SD_API void sd_ctx_set_schedule(sd_ctx_t* sd_ctx, enum schedule_t s);
+/*** CMS: use (or with nullptr, stop using) a conditioning/noise cache. The caller owns the cache. ***/
+SD_API void sd_ctx_set_gen_cache(sd_ctx_t* sd_ctx, SDGenCache* cache);
+
 /*** CMS: add interpolation ***/
 SD_API sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                            const char* prompt,
@@ -209,6 +266,28 @@ SD_API sd_image_t* img2img(sd_ctx_t* sd_ctx,
                            const char* input_id_images_path,
                            SDInterpolationData* interp_data = nullptr);
 
+/*** CMS: one image of a batch: its own prompt, negative prompt and seed, and (for img2img) init image. ***/
+typedef struct {
+    const char* prompt;
+    const char* negative_prompt;
+    int64_t seed;
+    const sd_image_t* init_image;  // NULL for txt2img. Every item of a batch has one, or none does.
+} sd_batch_item_t;
+
+/*** CMS: generate n_items images of the same size, sampler, steps and CFG scale (and img2img strength) together:
+     their latents are denoised as one batch, each with its own conditioning. Item i comes out as txt2img() or
+     img2img() would make it alone with that seed. Returns n_items images. ***/
+SD_API sd_image_t* generate_batch(sd_ctx_t* sd_ctx,
+                                  const sd_batch_item_t* items,
+                                  int n_items,
+                                  int clip_skip,
+                                  float cfg_scale,
+                                  int width,
+                                  int height,
+                                  enum sample_method_t sample_method,
+                                  int sample_steps,
+                                  float strength);
+
 SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                            sd_image_t init_image,
                            int width,
@@ -24,6 +24,13 @@ extern u32 flength(const char *fname);
 extern u64 flength_64(const char *fname);
 #define	flength_32(fname)	flength(fname)
 
+/*** 64-bit file positioning, truncating a file to a given length, forcing its data to disk, and renaming a file over another. ***/
+extern int fseek_64(FILE* f, i64 offset, int whence);
+extern i64 ftell_64(FILE* f);
+extern bool truncate_file(FILE* f, u64 len);
+extern bool sync_file(FILE* f);
+extern bool replace_file(const char* src, const char* dest);
+
 /*** Does the named file exist? ***/
 extern bool FileExists(const char *fname);
 extern bool FileExists(const std::string& fname);
@@ -0,0 +1,190 @@
+/***
+
+	framed.h
+
+	A seekable, chunked compression container. The data is cut into fixed-size blocks that are compressed
+	independently (LZF or zlib), followed by an index of where each block is. Blocks compress and decompress
+	in parallel on a thread pool, and a reader can get at any byte by decompressing only the block it's in.
+
+	This is the format compressed RamFiles are stored in (so a FramedReader can read them without loading
+	them), and framed_compress()/framed_decompress() do the same for in-memory buffers and Scratchpads.
+
+	The format:
+
+	header (FRAMED_HEADER_SIZE bytes):
+		magic			12 bytes, 'RAM\x7e' + the RamFile compression magic
+		block size		u32
+		index offset		u64
+		index length		u32
+		CRC-32 of the above	u32
+
+	blocks: each compressed independently, anywhere in the file.
+
+	index:
+		uncompressed length	u64
+		block count		u32
+		per block:		offset u64, compressed length u32, method u32
+		CRC-32 of the above	u32
+
+	2024, C. M. Street
+
+***/
+#ifndef __FRAMED_H__
+#define __FRAMED_H__
+
+#define	FRAMED_HEADER_SIZE	32
+#define	FRAMED_INDEX_ENTRY	16
+#define	FRAMED_INDEX_SIZE(n)	(16 + FRAMED_INDEX_ENTRY * (u64) (n))
+
+/*** The default (uncompressed) block size. ***/
+#define	FRAMED_BLOCK_DEFAULT	(256 * 1024)
+
+/*** How a block is stored, in the index. ***/
+#define	FRAMED_METHOD_STORED	0
+#define	FRAMED_METHOD_LZF	1
+#define	FRAMED_METHOD_ZLIB	2
+
+/*** Which compressor to use for each block. ***/
+enum FramedCodec {
+	FRAMED_BEST = 0,	// try LZF and zlib, and keep whichever is smaller
+	FRAMED_LZF,		// fastest
+	FRAMED_ZLIB,		// smaller; the level (1-9) trades speed for size
+	FRAMED_STORE,		// no compression
+};
+
+/*** Where a block is in the container. ***/
+struct FramedChunk {
+	u64 offset;		// where the compressed block is
+	u32 clen;		// its compressed length
+	u32 method;		// one of the FRAMED_METHOD_* values
+};
+
+/*** Little-endian integers in a byte buffer. ***/
+inline void put_le32(u8* p, u32 v) {
+	p[0] = u8(v);
+	p[1] = u8(v >> 8);
+	p[2] = u8(v >> 16);
+	p[3] = u8(v >> 24);
+}
+
+inline void put_le64(u8* p, u64 v) {
+	put_le32(p, u32(v));
+	put_le32(p + 4, u32(v >> 32));
+}
+
+inline u32 get_le32(const u8* p) {
+	return u32(p[0]) | (u32(p[1]) << 8) | (u32(p[2]) << 16) | (u32(p[3]) << 24);
+}
+
+inline u64 get_le64(const u8* p) {
+	return u64(get_le32(p)) | (u64(get_le32(p + 4)) << 32);
+}
+
+/*** Does the buffer start with a framed header? ***/
+extern bool is_framed(const u8* data, u64 len);
+
+/*** Compress one block. Returns the FRAMED_METHOD_* used; blocks that don't compress are stored. ***/
+extern u32 framed_compress_block(const u8* src, u32 len, std::vector<u8>& out, FramedCodec codec = FRAMED_BEST, int level = 6);
+
+/*** Decompress one block of len bytes into dest. Returns false if it's corrupt. ***/
+extern bool framed_decompress_block(const u8* src, u32 clen, u32 method, u8* dest, u32 len);
+
+/*** Compress the listed blocks of data (block i is [i * block_size, (i + 1) * block_size)) in parallel. out[e] and
+     methods[e] get the compressed bytes and method of block which[e]. pool == nullptr uses the shared pool. ***/
+extern void framed_compress_blocks(const u8* data, u64 len, u32 block_size, const std::vector<u64>& which,
+				std::vector< std::vector<u8> >& out, std::vector<u32>& methods,
+				FramedCodec codec = FRAMED_BEST, int level = 6, ThreadPool* pool = nullptr);
+
+/*** Build or parse the header and the index. The parse functions return false if they're corrupt. ***/
+extern void framed_build_header(u8* hdr, u32 block_size, u64 index_offset, u32 index_len);
+extern bool framed_parse_header(const u8* hdr, u64 file_len, u32& block_size, u64& index_offset, u32& index_len);
+extern void framed_build_index(const std::vector<FramedChunk>& chunks, u64 total_len, std::vector<u8>& out);
+extern bool framed_parse_index(const u8* ix, u32 index_len, u32 block_size, u64 file_len, u64& total_len,
+				std::vector<FramedChunk>& chunks);
+
+/*** Compress a buffer into a complete framed container, or decompress one. Both return true on success. ***/
+extern bool framed_compress(const u8* data, u64 len, Scratchpad& out, u32 block_size = FRAMED_BLOCK_DEFAULT,
+				FramedCodec codec = FRAMED_BEST, int level = 6, ThreadPool* pool = nullptr);
+extern bool framed_compress(const Scratchpad& in, Scratchpad& out, u32 block_size = FRAMED_BLOCK_DEFAULT,
+				FramedCodec codec = FRAMED_BEST, int level = 6, ThreadPool* pool = nullptr);
+extern bool framed_decompress(const u8* data, u64 len, Scratchpad& out, ThreadPool* pool = nullptr);
+extern bool framed_decompress(const Scratchpad& in, Scratchpad& out, ThreadPool* pool = nullptr);
+
+/*** The same, also giving the block table (for callers that update a container in place.) ***/
+extern bool framed_compress(const u8* data, u64 len, Scratchpad& out, std::vector<FramedChunk>& chunks, u32 block_size,
+				FramedCodec codec, int level, ThreadPool* pool);
+extern bool framed_decompress(const u8* data, u64 len, Scratchpad& out, std::vector<FramedChunk>& chunks,
+				u32& block_size, ThreadPool* pool);
+
+/*** Random access to a framed container on disk or in memory, without decompressing all of it. Blocks are
+     decompressed as they're touched and kept in a small LRU cache; a read that spans many blocks decompresses
+     them in parallel. A FramedReader isn't thread-safe: use one per thread. ***/
+class FramedReader {
+public:
+	FramedReader(u32 cache_blocks = 8);
+	~FramedReader();
+
+	// Open a framed file; only the header and index are read. Returns 0 on success.
+	int open(const char* fn);
+	int open(const std::string& fn);
+	// Read a framed container in memory. The data isn't copied, so it must outlive the reader.
+	int open(const u8* data, u64 len);
+	int open(const Scratchpad& sp);
+	void close();
+
+	// The uncompressed size, the read position, and moving it.
+	u64 size() const		{ return total; }
+	u64 tell() const		{ return pos; }
+	bool eof() const		{ return pos >= total; }
+	bool seek(u64 offset);
+
+	// Read up to nbytes at the read position, advancing it. Returns the number of bytes read.
+	u64 read(void* dest, u64 nbytes);
+	// Read up to nbytes at offset, without moving the read position.
+	u64 read_at(u64 offset, void* dest, u64 nbytes);
+	// Read exactly nb bytes: returns 0 on success, -1 at end-of-file (like RamFile::getmem().)
+	int getmem(u8* to, u32 nb);
+	// Read a byte, or -1 at end-of-file.
+	int getc();
+
+	u32 block_size() const		{ return bsize; }
+	u32 block_count() const		{ return (u32) chunks.size(); }
+
+	// The number of decompressed blocks to keep around, and the pool for multi-block reads (nullptr for the
+	// shared pool.)
+	void set_cache_size(u32 nblocks);
+	void set_pool(ThreadPool* tp)	{ pool = tp; }
+
+	u64 cache_hits() const		{ return hits; }
+	u64 cache_misses() const	{ return misses; }
+
+private:
+	struct CachedBlock {
+		u32 block;
+		u64 last_used;
+		std::vector<u8> data;
+	};
+
+	int load_index(void);
+	u32 block_len(u32 b) const;
+	bool fetch_compressed(u32 b, std::vector<u8>& buf, const u8*& src);
+	const u8* get_block(u32 b);
+
+	FILE* f;
+	const u8* mem;
+	u64 mem_len;
+	u64 file_len;
+	u32 bsize;
+	u64 total;
+	u64 pos;
+	std::vector<FramedChunk> chunks;
+	std::vector<CachedBlock> cache;
+	u32 max_cache;
+	u64 tick;
+	u64 hits;
+	u64 misses;
+	ThreadPool* pool;
+};
+
+#endif  // __FRAMED_H__
+/* end framed.h */
@@ -0,0 +1,104 @@
+/***
+
+	fuzzy.h
+
+	Fast Levenshtein (edit) distance, and fuzzy lookup of a string in a large dictionary.
+
+	The distance is computed with the bit-parallel algorithm of Myers (1999), in Hyyrö's formulation for
+	edit distance: the differences between adjacent cells of a column of the dynamic-programming matrix
+	are packed into bit vectors, so each character of the text advances a whole column (64 rows of the
+	matrix per machine word) in a dozen word operations, instead of one cell at a time. Patterns longer
+	than 64 characters are split into blocks of 64 rows, with the carries passed from block to block.
+
+	Given a maximum distance k, only the diagonal band of rows that can still hold a distance <= k is
+	computed (Ukkonen's cutoff), and the computation stops as soon as the answer must exceed k; for long
+	strings that's O(n * k / 64) instead of O(n * m).
+
+	Distances count bytes, not UTF-8 code points.
+
+	FuzzyDictionary keeps its words bucketed by length, each bucket packed at a fixed stride. A search
+	within k edits only looks at the buckets within k of the query's length (no string within k edits can
+	be shorter or longer than that), skips words whose character sets alone put them more than k away,
+	runs the bit-parallel distance on the rest with the query's match vectors precomputed once, and splits
+	the candidates across threads. With the distance this cheap, a linear scan of the candidate buckets
+	beats a BK-tree, whose pruning falls off quickly past k = 1 and which chases pointers all over memory.
+
+	2024, C. M. Street
+
+***/
+#ifndef __FUZZY_H__
+#define __FUZZY_H__
+
+/*** The edit distance between a and b. If it's greater than max_dist, returns max_dist + 1 instead, and
+     the distance is only computed as far as needed to know that. ***/
+extern u32 edit_distance(const char* a, u32 len_a, const char* b, u32 len_b, u32 max_dist = UINT32_MAX - 1);
+extern u32 edit_distance(const char* a, const char* b, u32 max_dist = UINT32_MAX - 1);
+extern u32 edit_distance(const std::string& a, const std::string& b, u32 max_dist = UINT32_MAX - 1);
+
+/*** A pattern with its match vectors precomputed, for finding its distance to many texts. ***/
+class LevenshteinPattern {
+public:
+	LevenshteinPattern() { m = 0; nb = 0; }
+	LevenshteinPattern(const char* pattern);
+	LevenshteinPattern(const char* pattern, u32 len);
+	void init(const char* pattern, u32 len);
+
+	u32 length(void) const { return m; }
+
+	// The edit distance from the pattern to text, or max_dist + 1 if it's more than max_dist.
+	u32 distance(const char* text, u32 len, u32 max_dist = UINT32_MAX - 1) const;
+
+private:
+	u32 m, nb;
+	// peq[c * nb + b] has bit i set if pattern character 64 * b + i is c.
+	std::vector<u64> peq;
+};
+
+struct FuzzyMatch {
+	u32 index;
+	u32 distance;
+};
+
+/*** A word list for fuzzy lookup. ***/
+class FuzzyDictionary {
+public:
+	FuzzyDictionary() {}
+
+	// Add a word; its index is the number of words added before it.
+	u32 add(const char* word);
+	u32 add(const char* word, u32 len);
+	u32 add(const std::string& word);
+	void clear(void);
+
+	u32 size(void) const { return (u32) offs.size(); }
+	const char* word(u32 i) const { return text.data() + offs[i]; }
+	u32 word_length(u32 i) const { return lens[i]; }
+
+	// All the words within max_dist edits of the query, nearest first (ties in index order.) The search is
+	// split across the pool's threads (default: the shared pool.)
+	void search(const char* query, u32 max_dist, std::vector<FuzzyMatch>& matches, ThreadPool* pool = nullptr) const;
+	void search(const char* query, u32 len, u32 max_dist, std::vector<FuzzyMatch>& matches, ThreadPool* pool = nullptr) const;
+
+	// The nearest word within max_dist edits (the lowest index on ties.) Returns false if there is none.
+	bool nearest(const char* query, u32 max_dist, FuzzyMatch& match, ThreadPool* pool = nullptr) const;
+
+	// Many searches, run in parallel a query per thread: matches[i] are the matches for queries[i].
+	void search_many(const std::vector<std::string>& queries, u32 max_dist, std::vector<std::vector<FuzzyMatch>>& matches,
+			ThreadPool* pool = nullptr) const;
+
+private:
+	struct LengthBucket {
+		std::vector<char> chars;	// the words of this length, packed end to end
+		std::vector<u32> ids;
+		std::vector<u64> sigs;		// which characters each word has, for a quick lower bound
+	};
+
+	void scan(const LevenshteinPattern& pat, u64 sig, u32 max_dist, u32 len, u32 i0, u32 i1, std::vector<FuzzyMatch>& out) const;
+
+	std::vector<char> text;		// every word, NUL-terminated
+	std::vector<u32> offs, lens;
+	std::vector<LengthBucket> buckets;	// indexed by length
+};
+
+#endif  // __FUZZY_H__
+/* end fuzzy.h */
@@ -39,13 +39,33 @@
 	You can re-run optimize*() to create more generations, and sometimes achieve a
 	better solution, or reset() to free the generated solutions and start over.
 
+	Each generation's new organisms are evaluated in parallel on a ThreadPool (the
+	shared pool unless set_thread_pool() gives another), so the target function is
+	called from several threads at once: it must be safe to call concurrently, which
+	means treating user_data as read-only or guarding whatever it changes. If it
+	can't be, call set_serial(true) and it will only be called from the thread
+	calling optimize*().
+
+	Fitnesses are cached by input vector, so organisms that are bit-for-bit copies of
+	one evaluated before (common once the population converges) cost nothing. This
+	assumes the target function is deterministic; turn it off with
+	set_fitness_cache(false) if it isn't. The cache is dropped by reset() and when
+	the target function or user data is changed.
+
+	For large searches, set_islands() splits the population into several islands
+	that breed separately (in parallel) and every few generations send copies of
+	their best organisms to the next island round the ring. Islands keep more
+	diversity than one big population, and are less likely to converge together on
+	a local optimum.
+
 	Copyright (c) 2022 C. M. Street.
 
 ***/
 #ifndef __GENETIC_H__
 #define __GENETIC_H__
 
-/*** Callback for the target functions ***/
+/*** Callback for the target functions. Unless the optimizer is set_serial(), this is called from
+     several threads at once, with different input vectors and the same user data. ***/
 typedef double (*OptimizeCallback)(double *, void *);
 
 struct GeneticOrganism {
@@ -59,6 +79,17 @@ public:
 	u32 age;
 };
 
+/*** A sub-population: there's one of these, or several with the island model. Each has its own
+     random number generator so the islands can breed on different threads. ***/
+struct GeneticIsland {
+public:
+	GeneticIsland(u32 seed) : rng(seed) {}
+	~GeneticIsland();
+
+	std::vector<GeneticOrganism *> orgs;
+	DetRand rng;
+};
+
 class GeneticOptimizer {
 public:
 	GeneticOptimizer(u32 n_inputs);
@@ -74,39 +105,63 @@ public:
 	bool is_verbose() const { return vs.is_verbose(); }
 	void verbose(bool v)    { if (v) vs.verbose(); else vs.quiet(); }
 
-	void set_target_fn(OptimizeCallback fn) { target_fn = fn; }
-	void set_user_data(void* ud) { user_data = ud; }
+	void set_target_fn(OptimizeCallback fn) { target_fn = fn; clear_cache(); }
+	void set_user_data(void* ud) { user_data = ud; clear_cache(); }
 	void set_constraint_sum_weights(double sum) { constraint_sum = sum; constraint = true; }
 	void set_optimum_is_zero(bool isz) { optimum_is_zero = isz; }
 
+	// The pool to evaluate fitness and breed islands on (nullptr for ThreadPool::shared().)
+	void set_thread_pool(ThreadPool* tp) { pool = tp; }
+	// Call the target function only from the optimizing thread, for functions that aren't thread-safe.
+	void set_serial(bool s) { serial = s; }
+	// Cache fitness by input vector (the default); turn off for non-deterministic target functions.
+	void set_fitness_cache(bool use) { use_cache = use; if (!use) clear_cache(); }
+	// Split the population into n_islands (1 to 64) islands, which exchange n_migrants organisms every
+	// migration_interval generations. Changing the number of islands resets the population.
+	void set_islands(u32 n_islands, u32 migration_interval = 10, u32 n_migrants = 16);
+
 	double* optimize_min(double accuracy);
 	double* optimize_max(double accuracy);
 
 	void reset();
 
+	// The number of calls made to the target function, and the number of evaluations the cache saved.
+	u64 evaluations() const { return n_evals; }
+	u64 cache_hits() const  { return n_hits; }
+
 private:
+	void init(u32 n_inputs, OptimizeCallback fn, void* ud);
 	double* optimize(double accuracy);
-	void new_generation(void);
-	double random_input_in_range(u32 input_idx) const;
-	void fill_random_inputs(double* v) const;
+	void breed(void);
+	void new_generation(GeneticIsland* isl) const;
+	double random_input_in_range(u32 input_idx, DetRand& rng) const;
+	void fill_random_inputs(double* v, DetRand& rng) const;
 	double calc_fitness();
+	void evaluate(std::vector<GeneticOrganism *>& eval);
+	void normalize_fitness(GeneticIsland* isl) const;
+	void migrate(void);
+	bool better(double f1, double f2) const { return want_max ? f1 > f2 : f1 < f2; }
+	bool cache_lookup(u64 hash, const double* in, double* fit) const;
+	void cache_insert(u64 hash, const double* in, double fit);
+	void clear_cache(void);
 	u32 weight_from_normed_fitness(double fit) const;
-	GeneticOrganism* couple(GeneticOrganism* p1, GeneticOrganism* p2) const;
+	GeneticOrganism* couple(GeneticOrganism* p1, GeneticOrganism* p2, DetRand& rng) const;
 	void enforce_sum_constraint(double* v) const;
 
 	const u32 NUM_ORGANISMS = 8192;
 	const u32 GENERATION_TURNOVER = 2048;
 	const u32 INITIAL_MUTATION = 64;
 	const u32 LAST_MUTATION = 8;
+	const u32 MAX_ISLANDS = 64;
+	const u32 CACHE_MAX_DOUBLES = 1 << 24;
 
-	std::vector<GeneticOrganism *> orgs;
+	std::vector<GeneticIsland *> islands;
 	double* best_in;
 	double* lobound_in;
 	double* hibound_in;
 	u32 mutation_chance;
 	u32 ni;
 	double best_fitness;
-	double worst_fit;
 	OptimizeCallback target_fn;
 	VerboseStream vs;
 	bool want_max;
@@ -114,6 +169,17 @@ private:
 	bool constraint;
 	double constraint_sum;
 	bool optimum_is_zero;
+	ThreadPool* pool;
+	bool serial;
+	bool use_cache;
+	u32 n_islands;
+	u32 migration_interval;
+	u32 n_migrants;
+	std::unordered_map<u64, u32> cache_map;
+	std::vector<double> cache_in;
+	std::vector<double> cache_fit;
+	u64 n_evals;
+	u64 n_hits;
 };
 
 #endif  // __GENETIC_H__
@@ -3,7 +3,8 @@
 	isprime.h
 
 	Super fast functions isprime() and prime_factor(),
-	for 32-bit integer input.
+	for 32-bit integer input, and isprime64(), prime_factor64()
+	and factor64() for 64-bit input.
 
 	Copyright (c) 2014-2022 C. M. Street
 
@@ -95,4 +96,38 @@ extern uint32_t next_prime_small(uint32_t i);
 ***/
 extern uint32_t previous_prime_small(uint32_t i);
 
+/***
+
+	int isprime64(u64 i)
+
+	Returns 1 iff i is prime, for any 64-bit i. Values that fit in
+	32 bits use isprime(); larger ones use a deterministic
+	Miller-Rabin test with Montgomery multiplication.
+
+***/
+extern int isprime64(u64 i);
+
+/***
+
+	u64 prime_factor64(u64 i)
+
+	Returns the smallest prime factor of a composite i.
+	If i is a prime number, returns i.
+	If i is 0 or 1, returns i.
+
+***/
+extern u64 prime_factor64(u64 i);
+
+/***
+
+	void factor64(u64 i, std::vector<u64>& factors)
+
+	Fills factors with the prime factorization of i, in
+	increasing order and with multiplicity (so 12 gives 2, 2, 3.)
+	Large factors are found with Pollard-Brent rho. If i is 0 or
+	1, factors is left empty.
+
+***/
+extern void factor64(u64 i, std::vector<u64>& factors);
+
 #endif // ISPRIME_H
\ No newline at end of file
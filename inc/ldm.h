@@ -13,6 +13,8 @@
 #ifndef __LDM_H__
 #define __LDM_H__
 
+#include <future>
+
 enum SDSamplerType {
 	sd_euler_ancestral = 0, sd_euler, sd_heun, sd_dpm2, sd_dpmpp2sa, sd_dpmpp2m, sd_dpmpp2mv2, sd_lcm,
 	sd_max_sampler_valid = sd_lcm
@@ -23,10 +25,18 @@ enum SDSchedulerType {
 	sd_max_scheduler_valid = sd_ays
 };
 
+/* noise generators: the standard library RNG, or Philox (which matches the noise of CUDA-based SD front-ends.) */
+enum SDRNGType {
+	sd_rng_std = 0, sd_rng_cuda,
+	sd_max_rng_valid = sd_rng_cuda
+};
+
 /* Default negative prompt: by default, it's empty, but you can set it to something else if you like, and it allows us
    to use default arguments in the API. Any prompt specified in txt2img() or img2img() overrides it. */
 extern std::string default_neg_prompt;
 
+struct SDRequest;
+
 class SDServer {
 public:
 	SDServer();
@@ -49,6 +59,12 @@ public:
 	                 i64* seed_return = nullptr,
 	                 int batch_size = 1);
 
+	/* generate the images for several requests in one batched run: the latents are denoised together, each with
+	   its own prompt, negative prompt, seed and (for img2img) initial image. The requests must batch with each
+	   other (see SDRequest::batches_with()); image e of a request uses seed + e. Returns the images of all the
+	   requests, in order, each the same as a txt2img()/img2img() call with that seed would make. */
+	SBitmap** generate_batch(const std::vector<SDRequest>& reqs);
+
 	/* generate interpolated images, between prompts, noise seeds, negative prompts, and/or CFG scale, by spherical
 		linear interpolation ('slerping'). this can do morphs and all kinds of interesting vfx. */
 	SBitmap** txt2img_slerp(int n_steps,
@@ -131,14 +147,17 @@ public:
 	   (sd_version == 0 means we will download a 2.x model). Returns true on success. */
 	bool load_default_model(int sd_version = 0, bool download_if_missing = false);
 
-	/* get or set secondary parameters (computation threads, sampler type, sampler steps, or scheduler type.)
-	   these are set to reasonably sane values by default. */
+	/* get or set secondary parameters (computation threads, sampler type, sampler steps, scheduler type, or
+	   RNG type.) these are set to reasonably sane values by default. They're applied to the loaded model at the
+	   start of each generation, so changing them is cheap: the model is never reloaded. */
 	void set_nthreads(u32 nt);
 	u32 get_nthreads() const			{ return nthreads; }
 	void set_sampler_type(SDSamplerType sampler_type);
 	SDSamplerType get_sampler_type() const	{ return sampler; }
 	void set_scheduler_type(SDSchedulerType scheduler_type);
 	SDSchedulerType get_scheduler_type() const	{ return scheduler; }
+	void set_rng_type(SDRNGType rng_type);
+	SDRNGType get_rng_type() const		{ return rng; }
 	void set_steps(u32 st);
 	u32 get_steps() const				{ return steps; }
 
@@ -150,12 +169,30 @@ public:
 	void set_variation_seed(i64 seed);
 	i64 get_variation_seed() const		{ return variation_seed; }
 
+	/* text conditioning (by prompt, negative prompt and size) and initial noise (by seed and size) are cached
+	   between generations, so interpolation frames and repeated prompts only pay for sampling. The cache is on
+	   by default, and is cleared whenever a model is loaded. Images are identical with or without it. */
+	void set_cache_enabled(bool enabled);
+	bool get_cache_enabled() const		{ return cache_enabled; }
+	void set_cache_size(u32 max_conds, u32 max_noise);
+	void clear_cache();
+	u64 cond_cache_hits() const			{ return gen_cache.cond_hits; }
+	u64 cond_cache_misses() const			{ return gen_cache.cond_misses; }
+	u64 noise_cache_hits() const			{ return gen_cache.noise_hits; }
+	u64 noise_cache_misses() const		{ return gen_cache.noise_misses; }
+	double cond_cache_hit_rate() const;
+	double noise_cache_hit_rate() const;
+
 	/* get the model path */
 	const std::string& get_model_path() const	{ return model_p; }
 	const std::string& get_vae_path() const	{ return vae_p; }
 
 private:
+	/* these expect mtx to be held. */
 	bool ensure_model();
+	bool load_locked(const std::string& model_path, const std::string& vae_path, ggml_type wtype);
+	bool load_default_locked(int sd_version, bool download_if_missing);
+	void apply_gen_settings();
 
 	/* ggml format model (you can use the Python script by leejet in /inc/external/stable-diffusion/models to convert
 	   your own checkpoints, if you like) */
@@ -170,6 +207,80 @@ private:
 	i64 variation_seed;
 	SDSamplerType sampler;
 	SDSchedulerType scheduler;
+	SDRNGType rng;
+	SDGenCache gen_cache;
+	bool cache_enabled;
+
+	/* each server owns its model context, so separate SDServers can generate at the same time; this
+	   serializes use of this one. */
+	std::mutex mtx;
+};
+
+/* A txt2img or img2img request for SDJobQueue or SDServer::generate_batch(). */
+struct SDRequest {
+	SDRequest();
+
+	/* can the two requests share a batched run? They need the same size, CFG scale, steps and sampler, and
+	   for img2img, the same strength; the prompts, seeds and initial images may differ. */
+	bool batches_with(const SDRequest& req) const;
+
+	std::string prompt;
+	std::string neg_prompt;
+	u32 w;			// for txt2img; img2img uses the size of init_img.
+	u32 h;
+	double cfg_scale;
+	i64 seed;		// -1 for a random seed; image i uses seed + i.
+	int n_images;
+	u32 steps;		// 0 for the server's setting.
+	int sampler;		// an SDSamplerType, or -1 for the server's setting.
+	SBitmap* init_img;	// for img2img (not owned: keep it until the result is ready), or nullptr.
+	double img_strength;	// for img2img.
+};
+
+struct SDResult {
+	std::vector<SBitmap*> imgs;
+	i64 seed;		// the seed of the first image.
+};
+
+/* A queue of txt2img and img2img requests, served by one worker thread per SDServer. Each worker takes the oldest
+   pending request along with any other pending requests that can share its run (same size, CFG scale, steps and
+   sampler; see SDRequest::batches_with()), up to max_batch images, and generates them all in one generate_batch()
+   call, where the UNet denoises every latent of the run at once. Scheduler, RNG type etc. are each server's own.
+
+   Give each worker its own SDServer (with its own loaded model) to generate on several contexts at once. */
+class SDJobQueue {
+public:
+	SDJobQueue(SDServer* server, int max_batch = 8);
+	SDJobQueue(const std::vector<SDServer*>& servers, int max_batch = 8);
+	~SDJobQueue();
+
+	/* queue a request. The images in the result belong to the caller. */
+	std::future<SDResult> submit(const SDRequest& req);
+
+	/* finish the pending requests and stop the workers. No requests may be submitted afterward. */
+	void close();
+
+	/* the number of requests served, and the number of generation runs it took. */
+	u64 count_requests() const			{ return n_requests; }
+	u64 count_runs() const				{ return n_runs; }
+
+private:
+	struct Job {
+		SDRequest req;
+		std::promise<SDResult> result;
+	};
+
+	void start(const std::vector<SDServer*>& servers);
+	void worker_main(SDServer* server);
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<Job*> pending;
+	std::vector<std::thread> workers;
+	int max_imgs;
+	bool closing;
+	std::atomic<u64> n_requests;
+	std::atomic<u64> n_runs;
 };
 
 /* the default Stable Diffusion server. */
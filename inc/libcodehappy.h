@@ -62,6 +62,22 @@
 #define CODEHAPPY_X86_64
 #endif
 
+/* SIMD instruction sets we may use directly. SSE2 is always present on x86-64; AVX2/F16C only when
+   the compiler is targeting them (e.g. -march=native.) Every SIMD path has a portable scalar fallback. */
+#ifdef CODEHAPPY_X86_64
+#define CODEHAPPY_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+#if defined(__AVX2__)
+#define CODEHAPPY_AVX2
+#endif
+#if defined(__F16C__)
+#define CODEHAPPY_F16C
+#endif
+#endif  // CODEHAPPY_X86_64
+
 #ifdef _MSC_VER
 #define CODEHAPPY_MSFT
 #endif
@@ -168,6 +184,9 @@ private:
 /*** Dynamic memory buffers, used in ramfiles &c. ***/
 #include "scratchpad.h"
 
+/*** Thread pools and blocking work queues. ***/
+#include "threadpool.h"
+
 /*** Declarations and definitions intended to help porting old library code. ***/
 #include "port.h"
 
@@ -190,6 +209,9 @@ private:
 /*** Sound rendering, PCM WAV support, etc. ***/
 #include "wavrender.h"
 
+/*** FFT convolution, reverb, EQ and resampling for audio. ***/
+#include "wavfilter.h"
+
 /*** Some basic user input functions. ***/
 #include "input.h"
 
@@ -211,6 +233,9 @@ private:
 /*** Arithmetic with saturation. ***/
 #include "overflow.h"
 
+/*** Seekable chunked compression. ***/
+#include "framed.h"
+
 /*** RAM files ***/
 #include "ramfiles.h"
 
@@ -220,6 +245,15 @@ private:
 /*** Miscellaneous contributed functions. ***/
 #include "extern.h"
 
+/*** Bit-parallel edit distance and fuzzy dictionary search. ***/
+#include "fuzzy.h"
+
+/*** Regular expressions compiled to a lazily built DFA. ***/
+#include "regexdfa.h"
+
+/*** Binary deltas between large files. ***/
+#include "bindelta.h"
+
 /*** Calendar, date, and time functions. ***/
 #include "calendar.h"
 
@@ -12,6 +12,16 @@
 #define __LMEMBED_H__
 
 /*** embeddings and embedding managers ***/
+
+/* Storage formats for embedding values. F16 halves, and I8 (with a per-vector scale) quarters, the
+   memory needed by an embedding. Searches over quantized embeddings re-score their final candidates
+   against the full precision query. */
+enum LMEmbedType {
+	LMEMBED_F32 = 0,
+	LMEMBED_F16,
+	LMEMBED_I8,
+};
+
 struct LMEmbedding {
 	LMEmbedding();
 	~LMEmbedding();
@@ -25,9 +35,22 @@ struct LMEmbedding {
 	// Compute the dot product of the embedding with another.
 	double dot_product(const LMEmbedding* le) const;
 
+	// Compute the dot product of the embedding with a float array of n_embed elements.
+	double dot_product(const float* v) const;
+
 	// Copy the values from the provided float array.
 	void copy_from_array(int n_el, const float* array);
 
+	// Convert the embedding to the specified storage format. The float32 values are released unless
+	// keep_f32 is set. Converting a quantized embedding back to LMEMBED_F32 dequantizes it.
+	void quantize(LMEmbedType type, bool keep_f32 = false);
+
+	// Fill the passed array with the (dequantized, if necessary) float values of the embedding.
+	void to_float_array(float* out) const;
+
+	// Bytes used by the embedding values in memory.
+	size_t embed_bytes() const;
+
 	// Write to a ramfile.
 	void out_to_ramfile(RamFile* rf);
 
@@ -44,30 +67,50 @@ struct LMEmbedding {
 	std::string original_text() const;
 
 	int n_embed;		// size (dimension) of the embedding
-	float* embed_data;	// embedding representation
+	float* embed_data;	// embedding representation (nullptr if quantized and the float values were released)
 	char* text;		// text
+	LMEmbedType embed_type;	// storage format of qdata
+	void* qdata;		// quantized representation (IEEE half (u16) or i8 values), if embed_type != LMEMBED_F32
+	float qscale;		// I8: the value represented by a quantized 1
+	float qmag;		// magnitude of the float values, saved when the embedding is quantized
 };
 
-const int MAX_EMBED_MATCHES = 256;
 const int DEFAULT_EMBED_MATCHES = 16;
 
+/* The best k matches of a search, kept in a min-heap on cosine similarity so each candidate costs
+   O(log k). Any k may be requested. The heap order is replaced by best-first order by sort_matches(). */
 struct LMBestMatch {
 	LMBestMatch(int max_matches = DEFAULT_EMBED_MATCHES);
 	~LMBestMatch();
 
 	bool check_match(LMEmbedding* lme, double score, const char* fname = nullptr, u32 offs = 0);
+	// Would a match with this score be kept?
+	bool would_accept(double score) const;
+	// Move all matches from another LMBestMatch (for instance, one filled by another thread) into this one.
+	void merge(LMBestMatch& other);
 	void set_min_cosine_similarity(double min_val)	{ min_cos_sim = min_val; }
 	void sort_matches();
+	void clear();
 
 	int n_matches;
 	int n_matches_max;
-	LMEmbedding* matches[MAX_EMBED_MATCHES];
-	double cos_sim[MAX_EMBED_MATCHES];
-	const char* filename[MAX_EMBED_MATCHES];
-	u32 offset[MAX_EMBED_MATCHES];
+	std::vector<LMEmbedding*> matches;
+	std::vector<double> cos_sim;
+	std::vector<const char*> filename;
+	std::vector<u32> offset;
 	double min_cos_sim;
-	int i_min;
+	// Are the matches passed to check_match() from now on ours to free, when bumped or cleared?
 	bool i_own_this_memory;
+
+private:
+	bool insert_match(LMEmbedding* lme, double score, const char* fname, u32 offs, bool own);
+	void swap_entries(int i, int j);
+	void sift_up(int i);
+	void sift_down(int i);
+	void heapify();
+	void free_entry(int i);
+	std::vector<u8> owned;
+	bool is_sorted;
 };
 
 struct LMEmbeddingFile {
@@ -88,6 +131,7 @@ struct LMEmbeddingFile {
 	void in_from_ramfile(RamFile* rf);
 	void out_to_stream_fmt(std::ostream& o = std::cout);
 	void free();
+	void quantize(LMEmbedType type, bool keep_f32 = false);
 	int count_embeddings() const;
 	int count_text_bytes() const;
 };
@@ -109,7 +153,82 @@ struct LMEmbeddingFolder {
 	int count_embeddings() const;
 	int count_text_bytes() const;
 	int best_match(int file_idx, const LMEmbedding* le, double* score = nullptr);
-	void best_matches(LMBestMatch& best_matches, const LMEmbedding* le);
+	// Search every file for the best matches to le. The search is split across nthreads threads (0 to use all
+	// cores), each filling its own LMBestMatch, and the per-thread results are merged.
+	void best_matches(LMBestMatch& best_matches, const LMEmbedding* le, int nthreads = 0);
+	// Convert every embedding in the folder to the specified storage format.
+	void quantize(LMEmbedType type, bool keep_f32 = false);
+	size_t count_embed_bytes() const;
+};
+
+/* An append-only log of LMEmbeddingFiles, for building an embedding folder incrementally. Each file's
+   embeddings are written as one checksummed record, so saving after every file costs the size of that
+   file rather than the size of the folder. close() writes a trailing index of the records and their pathnames,
+   so opening a cleanly closed log only decodes the records that are live. If the log wasn't closed cleanly
+   (or its index doesn't check out), open() scans every record up to the first one that fails its checksum,
+   and truncates the rest. If a pathname is appended more than once, the latest record wins; compact_async()
+   rewrites the log without the superseded records on a background thread, while appends continue.
+
+   LMEmbeddingFolder::in_from_file() reads logs as well as whole-folder files. */
+class LMEmbeddingLog {
+public:
+	LMEmbeddingLog();
+	~LMEmbeddingLog();
+
+	// Open (or create) the log for appending. The records already in the log are loaded into lef, if it's
+	// non-null. An existing folder file in the whole-file format is converted to a log. Returns true on success.
+	bool open(const char* path, LMEmbeddingFolder* lef = nullptr);
+
+	// Append a file's embeddings. The record is flushed to disk before returning. Returns true on success.
+	bool append(LMEmbeddingFile* lef);
+
+	// Write the trailing index and close the log. Waits for any compaction in progress.
+	void close();
+
+	// Rewrite the log without superseded records, on a background thread. Does nothing while a compaction
+	// is still running.
+	void compact_async();
+	void wait_compaction();
+
+	// Start a compaction automatically when more than this fraction of the records are superseded (0 to disable.)
+	void set_auto_compact(double dead_fraction)	{ auto_compact = dead_fraction; }
+
+	int count_records() const			{ return (int) records.size(); }
+	int count_superseded() const			{ return n_dead; }
+	// Total bytes written to the log since open(), including compaction.
+	u64 bytes_written() const			{ return n_written; }
+
+	// Is the named file an embedding log?
+	static bool is_log_file(const char* path);
+
+	// Read the live records of a log into lef, without opening it for writing. Returns true on success.
+	static bool read(const char* path, LMEmbeddingFolder* lef);
+
+private:
+	struct Record {
+		u64 offset;
+		u32 size;		// including the record header
+		std::string pathname;
+	};
+
+	bool write_record(FILE* f, const u8* rec, u32 size);
+	bool write_index(FILE* f, const std::vector<Record>& recs, u64 index_offset);
+	void compact_thread(size_t n_snapshot);
+	void compact_records(size_t n_snapshot);
+	void reap_compactor();
+	void note_pathname(const std::string& pathname);
+
+	FILE* f;
+	std::string log_path;
+	std::vector<Record> records;
+	std::unordered_map<std::string, int> latest;	// pathname -> index of its latest record
+	u64 end_offset;		// where the next record goes
+	u64 n_written;
+	int n_dead;
+	double auto_compact;
+	std::mutex mtx;
+	std::thread* compactor;
+	std::atomic<bool> compact_done;
 };
 
 /* read/match embeddings from file -- we don't need them all in memory for a lookup */
@@ -31,6 +31,23 @@ extern char* advance_to_next_matching_char(char* ptr, const char* candidates);
 /*** advance a char pointer to the next alphabetic character (A-Z, a-z) ***/
 extern char* advance_to_next_alpha(char* ptr);
 
+/*** Bounded versions of the above, for text that needn't be NUL-terminated: each stops at end (and returns
+	end if it gets there.) Whitespace is as isspace() in the C locale. These look at 64 bytes at a time, with
+	SSE2 or AVX2 compares where available, so they're much quicker over long stretches. ***/
+extern const char* advance_past_whitespace(const char* ptr, const char* end);
+extern const char* advance_to_whitespace(const char* ptr, const char* end);
+extern const char* advance_to_next_word(const char* ptr, const char* end);
+extern const char* advance_to_next_line(const char* ptr, const char* end);
+extern const char* advance_to_char(const char* ptr, const char* end, char c);
+extern const char* advance_to_next_matching_char(const char* ptr, const char* end, const char* candidates);
+
+/*** The bitmasks behind them: bit i is set if p[i] is c, or is whitespace. All 64 bytes at p must be readable. ***/
+extern u64 char_mask64(const char* p, char c);
+extern u64 whitespace_mask64(const char* p);
+
+/*** The index of the lowest set bit of a (non-zero) mask. ***/
+extern u32 mask_ctz(u64 m);
+
 /*** parse a (32-bit) integer at the current pointer position and advance
 	past it -- behavior undefined for integers larger than 32 bits ***/
 extern char* advance_and_parse_integer(char* ptr, int* i);
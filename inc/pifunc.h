@@ -20,5 +20,19 @@ extern u32 nth_prime(u32 i);
 extern u32 next_prime(u32 i);
 extern u32 previous_prime(u32 i);
 
+/* 64-bit versions of next_prime() and previous_prime(). next_prime64() returns 0 past the largest 64-bit prime. */
+extern u64 next_prime64(u64 i);
+extern u64 previous_prime64(u64 i);
+
+/* The primes in [lo, hi] in increasing order, or just how many there are, by a segmented sieve of Eratosthenes
+   run in parallel on pool (nullptr for the shared pool.) Sieving needs the primes up to sqrt(hi), so a range that
+   is narrow compared to that is tested a number at a time instead. */
+extern void prime_sieve(u64 lo, u64 hi, std::vector<u64>& primes, ThreadPool* pool = nullptr);
+extern u64 prime_count(u64 lo, u64 hi, ThreadPool* pool = nullptr);
+
+/* The pi function for 64-bit input, by the Meissel-Lehmer method: time grows as about x^(2/3), and it needs a
+   prime table of about x^(2/3) / 10 bytes (so it's practical to around 10^14.) */
+extern u64 pi_function64(u64 x, ThreadPool* pool = nullptr);
+
 #endif  // __PI_FUNC_H__
 /* end pifunc.h */
\ No newline at end of file
@@ -18,13 +18,23 @@
 
 	* RAM files can be compressed and decompressed completely transparently.
 
+	* Read-only RAM files can be memory-mapped (RAMFILE_MMAP): opening is O(1), pages are read on demand, and
+	they're shared with the OS page cache (and other processes mapping the same file.) Mapped files may be
+	larger than 4 GB; use the 64-bit API (size(), tell(), read(), write()) for those.
+
+	* Flushes are incremental: the RAM file tracks which bytes changed since the file was read or last flushed,
+	and writes only those (and anything appended.) Compressed RAM files are stored as independently compressed
+	chunks, and only the chunks that changed are recompressed and appended; the file's chunk index is switched
+	over afterwards. Any flush that overwrites existing bytes in the file first writes them to a small journal
+	(the file name + ".rfj"), which is replayed the next time the file is opened if we crashed part way.
+
 	Disadvantages of RAM files:
 
-	* Very large files will eat up a lot of RAM, and most platforms will be unable to open a file 2 GB in size
-	or larger.
+	* Very large files will eat up a lot of RAM, unless they are opened read-only and memory-mapped. A RAM file
+	that isn't mapped can't be 4 GB or larger.
 
-	* No incremental writes (at least currently) -- you have to manually flush or close the file to write data to disk,
-	at which point the entire file is written.
+	* Nothing is written until you flush or close the file. If you modify the contents through buffer(), call
+	modified() so the next flush knows to write those bytes.
 
 	Copyright (c) 2014-2022 Chris Street
 
@@ -67,13 +77,30 @@
 /*** flags at and above this are for internal use only ***/
 #define	RAMFILE_INTERNAL		128
 
+/*** open the file read-only, memory-mapped rather than read into a buffer. This is an open-time
+	option only. Compressed files can't be usefully mapped, so they are read and decompressed as
+	usual (and must be under 4 GB.) ***/
+#define	RAMFILE_MMAP			1024
+
 /*** Some reasonable defaults. ***/
 #define RAMFILE_DEFAULT			(RAMFILE_CREATE_IF_MISSING)
 #define RAMFILE_DEFAULT_COMPRESS	(RAMFILE_CREATE_IF_MISSING | RAMFILE_COMPRESS)
 #define	RAMFILE_READ			(RAMFILE_READONLY)
 
+/*** The default size of the independently compressed chunks in a compressed RAM file. ***/
+#define	RAMFILE_CHUNK_DEFAULT		FRAMED_BLOCK_DEFAULT
+
 typedef u64 * EmbeddedRamFile;
 
+/*** Access pattern hints for memory-mapped RAM files; see RamFile::advise(). ***/
+enum RamFileAdvice {
+	RAMFILE_ADVISE_NORMAL = 0,
+	RAMFILE_ADVISE_SEQUENTIAL,
+	RAMFILE_ADVISE_RANDOM,
+	RAMFILE_ADVISE_WILLNEED,
+	RAMFILE_ADVISE_DONTNEED,
+};
+
 class RamFile {
 public:
 	// Creates an empty ramfile.
@@ -109,12 +136,41 @@ public:
 	// Returns true on success.  On failure, does not change the read/write pointer.
 	bool seek_from_here(i64 pos);
 
-	// The ramfile's length.
+	// The ramfile's length. This is the 32-bit compatibility version of size(): it's truncated for files
+	// of 4 GB or more.
 	u32 length(void) const;
 
-	// Forces a write to disk for the ramfile.
+	// The ramfile's length, and the read/write pointer's offset from the beginning of the file.
+	u64 size(void) const;
+	u64 tell(void) const;
+
+	// Read up to nbytes from the read pointer into dest, or write nbytes from src with the current write
+	// options. Both return the number of bytes actually read or written.
+	u64 read(void* dest, u64 nbytes);
+	u64 write(const void* src, u64 nbytes);
+
+	// Is the ramfile memory-mapped?
+	bool mapped(void) const;
+
+	// Give the OS a hint about how a memory-mapped ramfile will be accessed, for the whole file (len == 0) or
+	// for [offset, offset + len). Does nothing if the ramfile isn't mapped.
+	void advise(RamFileAdvice advice, u64 offset = 0, u64 len = 0);
+
+	// Forces a write to disk for the ramfile. Only the bytes changed since the last flush (or since the file was
+	// opened) are written, if the file on disk is still in the same format.
 	void flush(void);
 
+	// Tell the ramfile that nbytes at offset were changed directly through buffer().
+	void modified(u64 offset, u64 nbytes);
+
+	// The uncompressed size of the chunks a compressed ramfile is stored in. Changing it makes the next flush
+	// rewrite the whole file. (Compressed ramfiles are framed containers: see framed.h. A FramedReader can
+	// read them without decompressing the whole file.)
+	void set_chunk_size(u32 nbytes);
+
+	// How the chunks of a compressed ramfile are compressed. The default tries both LZF and zlib.
+	void set_codec(FramedCodec codec, int level = 6);
+
 	// Opens a static RAM file with the specified options. Returns 0 on success. Static RAM files encapsulate
 	// memory buffers; they do not have an associated disk file. The scratchpad takes ownership of the buffer.
 	void open_static(char* data, uint dlen, uint32_t options);
@@ -173,10 +229,11 @@ public:
 	// Is the read pointer at the end of the ramfile?
 	bool eof(void) const;
 
-	// Puts a sequence of bytes in memory to the RAM file.
+	// Puts a sequence of bytes in memory to the RAM file. Returns 0 on success. (A 32-bit wrapper for write().)
 	int putmem(const char* data, u32 nbytes);
 
-	// Gets a sequence of bytes in memory from the RAM file.
+	// Gets a sequence of bytes in memory from the RAM file. Returns 0 on success, or -1 if it hits end-of-file.
+	// (A 32-bit wrapper for read().)
 	int getmem(u8* to, u32 nb);
 
 	// Writes the contents of a scratchpad to the RAM file with the current write options. Returns 0 on success.
@@ -222,10 +279,36 @@ private:
 	// Helper function: decompress a compressed ramfile
 	void decompress(void);
 
+	// Helpers for memory-mapped ramfiles.
+	bool map_file(const char* fn);
+	void unmap_file(void);
+
+	// Helpers for the chunked compressed format, and incremental flushes.
+	bool decompress_framed(void);
+	void clear_disk_state(void);
+	void mark_dirty(u64 lo, u64 hi);
+	bool flush_raw(void);
+	bool flush_framed(void);
+	bool write_framed(void);
+
 	char* fname;		// the file name
 	Scratchpad sp;		// the file contents
 	u8* readp;		// the current read position
 	u32 options;		// options
+	void* map_base;		// the mapping, if the ramfile is memory-mapped
+	u64 map_len;
+
+	// What we know of the file on disk, as of the last open or flush.
+	u32 disk_format;	// one of the RAMFILE_DISK_* formats
+	u64 disk_len;		// the length of the (uncompressed) contents
+	u64 dirty_lo;		// [dirty_lo, dirty_hi) of those contents has been changed since
+	u64 dirty_hi;
+	u64 disk_size;		// for compressed files: the file size, and how much of it is unreferenced
+	u64 disk_garbage;
+	u32 chunk_size;
+	std::vector<FramedChunk> chunks;
+	FramedCodec codec;
+	int level;
 };
 
 
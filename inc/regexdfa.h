@@ -0,0 +1,172 @@
+/***
+
+	regexdfa.h
+
+	Regular expression matching with a lazily built DFA, for scanning large amounts of text.
+
+	Patterns use the same syntax as regcomp() (see extern.h): the pattern is compiled by regcomp() and
+	its program -- a backtracking NFA -- is flattened into a Thompson NFA, which is then run as a DFA whose
+	states are sets of NFA states. DFA states are only built as the text reaches them, and cached with their
+	transitions, so matching costs one table lookup per byte once the cache is warm, and never backtracks:
+	patterns that go exponential under regexec() run in linear time.
+
+	The cache holds at most a budget of states (set_state_budget()). When it fills, it's flushed and
+	rebuilt; if that keeps happening within one scan, the scan carries on as a plain NFA simulation (a set of
+	states advanced per byte, still linear time) rather than thrash the cache.
+
+	Where every match must start with the same literal string, the scan skips ahead to each occurrence of
+	it with memchr() (vectorized in any reasonable C library) instead of stepping the DFA a byte at a time.
+
+	The matches found are leftmost-longest (as in POSIX), which can differ from what regexec()'s
+	backtracking reports when several matches start at the same place; there are no submatches. Use
+	regexec() when you need the parenthesized parts. find() takes two passes, both DFAs: forward to where the
+	leftmost-longest match ends, its states keeping the possible matches in order of where they started, then
+	backward from that end over the reversed pattern to where the match starts.
+
+	RegexSet matches many patterns in a single pass over the text, reporting which of them matched.
+
+	A RegexDFA or RegexSet changes its cache as it matches, so use one object per thread (copies are
+	independent).
+
+	2024, C. M. Street
+
+***/
+#ifndef __REGEXDFA_H__
+#define __REGEXDFA_H__
+
+#include <unordered_map>
+
+/* Compile flags: ^ and $ also match after and before each newline. */
+#define	REGEX_MULTILINE		1
+
+/*** The automaton shared by RegexDFA and RegexSet. ***/
+class RegexAutomaton {
+public:
+	// Compiled successfully?
+	bool ok(void) const { return !nodes.empty(); }
+
+	// The most DFA states to cache at once (default 2000); each takes a transition per byte class.
+	void set_state_budget(u32 max_states);
+	u32 cached_states(void) const;
+	// Did the last scan fall back to NFA simulation?
+	bool used_nfa(void) const { return nfa_mode; }
+	// The literal every match starts with, if any.
+	const std::string& literal_prefix(void) const { return prefix; }
+
+protected:
+	RegexAutomaton();
+	bool build(const std::vector<std::string>& patterns, u32 flags, bool reverse = false);
+	void reset(void);
+
+	// How run() scans: for matches starting anywhere; only for those starting at 'from'; for the end of the
+	// leftmost-longest match (the last position reported); or anchored, with the reversed pattern (build() with
+	// reverse set.)
+	enum { RUN_UNANCHORED, RUN_ANCHORED, RUN_LEFTMOST, RUN_REVERSE, RUN_MODES };
+
+	// Run over t[from, len), starting at the beginning of a line if bol. hit(p, ids) is called at each position
+	// p where some match ends, with the indices of the patterns matching there; scanning stops when it returns
+	// false, or (unless unanchored) when no match can be extended any further. Returns where it stopped.
+	template <class Hit> size_t run(u32 mode, const u8* t, size_t from, size_t len, bool bol, Hit hit);
+	bool at_bol(const u8* t, size_t pos) const { return pos == 0 || (multiline && t[pos - 1] == '\n'); }
+	bool at_eol(const u8* t, size_t pos, size_t len) const { return pos == len || (multiline && t[pos] == '\n'); }
+	size_t next_prefix(const u8* t, size_t from, size_t len) const;
+
+	u32 npatterns;
+
+private:
+	struct NfaNode {
+		u8 type;
+		u8 ch;
+		u32 out;
+		u32 arg;	// SPLIT: the other branch; CLASS: the class; MATCH: the pattern index
+	};
+	struct DState {
+		std::vector<u32> set;		// the NFA nodes: those that consume a byte, pending $s and matches
+		std::vector<u32> ids;		// patterns matched on reaching this state
+		std::vector<u32> eol_ids;	// patterns matched if the text (or line) ends here
+	};
+	struct Cache {
+		std::vector<DState> states;
+		std::vector<u8> flags;
+		std::vector<i32> next;		// [state * nbc + byte class], -1 if not built yet
+		std::unordered_map<std::string, i32> index;
+		i32 start[2];			// not at / at the beginning of a line
+	};
+
+	bool add_program(const char* pattern, u32 id, u32& entry);
+	void add_reverse(void);
+	void closure(const std::vector<u32>& seeds, bool bol, bool eol, std::vector<u32>& out);
+	void step(const std::vector<u32>& set, u8 c, bool anchored, std::vector<u32>& out);
+	void step_leftmost(const std::vector<u32>& set, u8 c, std::vector<u32>& out);
+	void advance(u32 a, const std::vector<u32>& set, u8 c, std::vector<u32>& out);
+	bool dead_end(u32 a, const std::vector<u32>& set) const;
+	void describe(DState& ds);
+	i32 intern(u32 a, std::vector<u32>& set);
+	i32 start_state(u32 a, bool bol);
+	i32 transition(u32 a, i32 s, u8 c);
+	void flush(u32 a);
+	void find_prefix(void);
+
+	std::vector<NfaNode> nodes;
+	std::vector<u64> classes;	// four words per class
+	u32 start_node;
+	u32 rev_start;
+	bool multiline;
+	u8 byte_class[256];
+	u32 nbc;
+	u32 budget;
+	Cache cache[RUN_MODES];
+	u32 flushes, epoch;
+	bool nfa_mode;
+	std::string prefix;
+
+	std::vector<u32> mark, stack, tmp_set, tmp_seeds;
+	u32 gen;
+	std::vector<u32> lmark, lgroup, leols, lafter;	// step_leftmost(): the nodes an earlier group has
+	u32 lgen;
+};
+
+/*** One regular expression. ***/
+class RegexDFA : public RegexAutomaton {
+public:
+	RegexDFA() {}
+	RegexDFA(const char* pattern, u32 flags = 0) { compile(pattern, flags); }
+
+	// Returns false if the pattern doesn't compile.
+	bool compile(const char* pattern, u32 flags = 0);
+
+	// Does the pattern match anywhere in the text?
+	bool search(const char* text, size_t len);
+	bool search(const char* str) { return search(str, strlen(str)); }
+	bool search(const std::string& str) { return search(str.data(), str.size()); }
+
+	// The leftmost-longest match at or after 'from': text[start, end).
+	bool find(const char* text, size_t len, size_t& start, size_t& end, size_t from = 0);
+
+	// Every non-overlapping leftmost-longest match, as (start, end) pairs.
+	void find_all(const char* text, size_t len, std::vector<std::pair<size_t, size_t>>& matches);
+
+private:
+	std::vector<u8> rtext;		// the text before a match's end, reversed
+};
+
+/*** Many regular expressions, matched together. ***/
+class RegexSet : public RegexAutomaton {
+public:
+	RegexSet() {}
+
+	// Add a pattern; returns its index, or -1 if it doesn't compile. Call compile() after the last one.
+	int add(const char* pattern);
+	bool compile(u32 flags = 0);
+	u32 size(void) const { return (u32) patterns.size(); }
+
+	// The indices of the patterns that match somewhere in the text, in order. Returns true if any did.
+	bool match(const char* text, size_t len, std::vector<u32>& which);
+	bool match(const std::string& str, std::vector<u32>& which) { return match(str.data(), str.size(), which); }
+
+private:
+	std::vector<std::string> patterns;
+};
+
+#endif  // __REGEXDFA_H__
+/* end regexdfa.h */
@@ -68,6 +68,10 @@ public:
 	/* Reallocate the scratchpad buffer to contain at least nbytes bytes of data. */
 	int realloc(u32 nbytes);
 
+	/* Set the length of the data to nbytes, reallocating if necessary: for filling the buffer directly. Any new
+	   bytes are uninitialized. Returns 0 on success. */
+	int resize(u32 nbytes);
+
 	/* Reallocate the scratchpad buffer to be exactly the size required to contain its data. */
 	int compact(void);
 
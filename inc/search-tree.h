@@ -6,12 +6,26 @@
 	are of interest, and you can use the SearchReplaceTree to look for (and replace) instances of those
 	strings.
 
+	The terms are kept in a trie, which is compiled (on the first search after terms are added) into an
+	Aho-Corasick automaton: each trie node gets a failure link to the longest suffix of its string that's
+	also in the trie, and the links are folded into a flat transition table, one row per node. The text is
+	then scanned a character at a time, one table lookup each, however many terms there are and however
+	long they are.
+
+	Matches are leftmost-longest and don't overlap: of the terms matching at the earliest position, the
+	longest wins, and the search carries on after it. Replacement builds the new string in one pass over
+	the old (replacements aren't searched again.) Strings of a megabyte or more are searched in chunks on
+	a thread pool, and the chunks stitched together so the matches come out the same as one pass would.
+
 	2024, C. M. Street
 
 ***/
 
 const int SRTNODE_SPACE = 26, SRTNODE_NONLETTER = 27, SRTNODE_COUNT = 28;
 
+/* Strings at least this long are searched and rebuilt in parallel. */
+const size_t SRT_PARALLEL_MIN = 1 << 20;
+
 static std::string srt_empty_str;
 
 int srtnode_idx_from_char(int c);
@@ -24,6 +38,13 @@ struct SRTNode {
 	char * replace;
 };
 
+/* A match: the term at [start, start + len) in the search string. */
+struct SRTMatch {
+	size_t start;
+	size_t len;
+	SRTNode* node;
+};
+
 /* Note that this implementation of SearchReplaceTree is case-insensitive, and treats all whitespace as the
    same character. */
 class SearchReplaceTree {
@@ -39,9 +60,16 @@ public:
 	void search_string(const std::string& search_str);
 	void search_string(const char * search_str);
 
-	/* Returns a pointer to the next occurrence of any of the searchable terms. (nullptr when no more) */
+	/* Returns a pointer to the next occurrence of any of the searchable terms (nullptr when no more), and moves
+	   the search pointer past it. */
 	const char * next_searchable(SRTNode ** node_ret = nullptr);
 
+	/* The length of the match next_searchable() last returned. */
+	int match_length() const { return match_len; }
+
+	/* Every match in the string, in order. */
+	void find_all(std::vector<SRTMatch>& matches);
+
 	/* Replaces all occurrences of search terms with their specified replacement (or the replacement given, if non-empty/null) */
 	void do_all_replace(const std::string& replace = srt_empty_str);
 	void do_all_replace(const char * replace);
@@ -55,6 +83,9 @@ public:
 	/* Returns the string, with any replacements or deletions. */
 	std::string& str() { return sstr; }
 
+	/* The thread pool for long strings (default: the shared pool.) */
+	void set_pool(ThreadPool* tp) { pool = tp; }
+
 private:
 	SRTNode * tree;
 	// current search string
@@ -63,8 +94,21 @@ private:
 	const char * sptr;
 	// returned length of matched phrase
 	int match_len;
-	// attempt a match at the current search position
-	SRTNode * search_at();
+	ThreadPool* pool;
+
+	// the automaton: delta[state * SRTNODE_COUNT + character index] is the next state (state 0 is the root.)
+	// out[state] is the state of the longest term ending there, or -1.
+	bool compiled;
+	std::vector<i32> delta;
+	std::vector<i32> depth;
+	std::vector<i32> out;
+	std::vector<SRTNode*> state_node;
+	u8 char_idx[256];
+
+	void compile();
+	bool find_match(const char * s, size_t len, size_t from, size_t limit, SRTMatch& m) const;
+	void find_range(const char * s, size_t len, size_t from, size_t limit, std::vector<SRTMatch>& matches) const;
+	void splice(const std::vector<SRTMatch>& matches, const char * replace, bool del);
 };
 
 /*** end search-tree.h ***/
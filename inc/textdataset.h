@@ -4,6 +4,12 @@
 
 	Loads text files (individually, or by the directoryful, etc.) Can output
 	them into .json files for model training, etc.
+
+	For corpora too big to hold in memory, the stream_*_json() functions go straight from
+	the text files to the .json: reader threads load files, cut them into paragraphs and
+	format their json, and the calling thread writes each file's output in order. Only a
+	bounded number of files are in flight at once, so memory use doesn't grow with the
+	corpus, and the reading and formatting scale with the threads.
 	
 	May 2023, C. M. Street
 
@@ -11,6 +17,9 @@
 #ifndef _TEXTDATASET_H
 #define _TEXTDATASET_H
 
+/* The default number of files the streaming functions may have in flight. */
+const u32 TEXTDATASET_FILES_IN_FLIGHT = 64;
+
 /* A series of text lines makes a Paragraph. */
 class Paragraph {
 public:
@@ -26,11 +35,11 @@ public:
 	SplitString content;
 	std::string src;
 	int length;
-	const int max_two_splits = 200;
-	const int min_three_splits = 60;
-	const int min_four_splits = 80;
-	const int max_three_splits = 300;
-	const int max_four_splits = 400;
+	static const int max_two_splits = 200;
+	static const int min_three_splits = 60;
+	static const int min_four_splits = 80;
+	static const int max_three_splits = 300;
+	static const int max_four_splits = 400;
 };
 
 /* A collection of Paragraphs. */
@@ -42,14 +51,27 @@ public:
 	void output_training_json(const char* pathname_out) const;
 	void show_stats() const;
 
+	// Write the training json for the .txt files in a folder (or the files listed) without loading them into
+	// the dataset: the output is what add_from_folder()/add_from_file() then output_training_json() would write.
+	// n_threads readers (0 for one per hardware thread); at most max_files_in_flight files are read and not
+	// yet written at a time. Returns false if the output couldn't be written.
+	bool stream_folder_json(const char* path, const char* pathname_out, int n_threads = 0,
+				u32 max_files_in_flight = TEXTDATASET_FILES_IN_FLIGHT);
+	bool stream_files_json(const std::vector<std::string>& filenames, const char* pathname_out, int n_threads = 0,
+				u32 max_files_in_flight = TEXTDATASET_FILES_IN_FLIGHT);
+
 private:
 	std::vector<Paragraph> paras;
-	int total_length;
+	u64 total_length;
+	u64 n_streamed;		// paragraphs written by stream_*_json()
 	const int min_len_paragraph = 20;
 };
 
 /* helper: output json-escaped text to the passed ostream. */
 extern void output_json_escaped_text(const std::string& str, std::ostream& o);
 
+/* helper: append json-escaped text to the string, as above. */
+extern void append_json_escaped_text(const char* str, size_t len, std::string& out);
+
 #endif  // _TEXTDATASET_H
 /* end textdataset.h */
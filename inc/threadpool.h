@@ -0,0 +1,134 @@
+/***
+
+	threadpool.h
+
+	A simple fixed-size thread pool, and a (optionally bounded) blocking work queue
+	for building producer/consumer pipelines.
+
+	ThreadPool runs submitted tasks on its worker threads; wait() blocks until all
+	submitted tasks have completed. parallel_for() splits an index range into chunks
+	and runs them on the pool (the calling thread helps out.)
+
+	WorkQueue<T> is a FIFO that blocks consumers while it's empty and, if it has a
+	maximum size, blocks producers while it's full. close() wakes everyone up: after
+	a close, push() fails and pop() fails once the queue is drained.
+
+	2024, C. M. Street
+
+***/
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <memory>
+
+template <typename T>
+class WorkQueue {
+public:
+	// max_items == 0 for an unbounded queue.
+	WorkQueue(size_t max_items = 0) {
+		max_el = max_items;
+		closed = false;
+	}
+
+	// Add an item, blocking while the queue is full. Returns false if the queue has been closed.
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		cv_push.wait(lock, [this]() { return closed || max_el == 0 || q.size() < max_el; });
+		if (closed)
+			return false;
+		q.push_back(std::move(item));
+		cv_pop.notify_one();
+		return true;
+	}
+
+	// Remove an item, blocking while the queue is empty. Returns false if the queue is closed and empty.
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		cv_pop.wait(lock, [this]() { return closed || !q.empty(); });
+		if (q.empty())
+			return false;
+		item = std::move(q.front());
+		q.pop_front();
+		cv_push.notify_one();
+		return true;
+	}
+
+	// Remove an item if one is available, without blocking.
+	bool try_pop(T& item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		if (q.empty())
+			return false;
+		item = std::move(q.front());
+		q.pop_front();
+		cv_push.notify_one();
+		return true;
+	}
+
+	// No more items will be pushed; wake any waiting producers and consumers.
+	void close() {
+		std::unique_lock<std::mutex> lock(mtx);
+		closed = true;
+		cv_push.notify_all();
+		cv_pop.notify_all();
+	}
+
+	bool is_closed() {
+		std::unique_lock<std::mutex> lock(mtx);
+		return closed;
+	}
+
+	size_t size() {
+		std::unique_lock<std::mutex> lock(mtx);
+		return q.size();
+	}
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv_push;
+	std::condition_variable cv_pop;
+	std::deque<T> q;
+	size_t max_el;
+	bool closed;
+};
+
+class ThreadPool {
+public:
+	// Create a pool with nthreads workers (0 to use one per hardware thread.)
+	ThreadPool(int nthreads = 0);
+	~ThreadPool();
+
+	// Submit a task to run on a worker thread.
+	void run(std::function<void()> fn);
+
+	// Block until every task submitted so far has completed.
+	void wait();
+
+	// Call fn(i0, i1) on subranges [i0, i1) of [begin, end), each of at least 'grain' indices (except
+	// perhaps the last), in parallel. Returns when the entire range has been processed.
+	void parallel_for(i64 begin, i64 end, std::function<void(i64, i64)> fn, i64 grain = 1);
+
+	// The number of worker threads.
+	int size() const	{ return (int) workers.size(); }
+
+	// A process-wide pool with one worker per hardware thread, created on first use.
+	static ThreadPool& shared();
+
+private:
+	void worker_main();
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mtx;
+	std::condition_variable cv_task;
+	std::condition_variable cv_done;
+	u32 n_pending;
+	bool stopping;
+};
+
+#endif  // __THREADPOOL_H__
+/* end threadpool.h */
@@ -91,6 +91,50 @@ extern ustring utf16_to_utf32(utf16string str);
 /*** Convert a UTF-32 string to UTF-16, and return the allocated result. ***/
 extern utf16string utf32_to_utf16(ustring str);
 
+/*** Validation and transcoding over buffers with lengths. The input needn't be NUL-terminated, and the output
+	goes into a buffer the caller provides: nothing is allocated, and no terminator is written.
+
+	These are strict (RFC 3629): overlong UTF-8, surrogate codepoints (other than paired up in UTF-16) and
+	codepoints past U+10FFFF are errors, where the NUL-terminated functions above let some of them through.
+	Runs of ASCII, or of UTF-16 without surrogates, are found and converted 16 bytes at a time with SSE2;
+	with AVX2, UTF-8 is validated 32 bytes at a time by table lookups on the nibbles of each pair of bytes
+	(Keiser and Lemire), counting the codepoints as it goes.
+
+	The conversions return the number of code units written, or UTF_ERROR if the input is invalid (what's
+	in the output by then is unspecified.) The output must have room for the result: the *_length_from_*()
+	functions give its exact size for valid input, or allow for the worst case -- a codepoint for each
+	byte of UTF-8 or unit of UTF-16, 3 bytes of UTF-8 for each unit of UTF-16, 4 for each codepoint. ***/
+#define	UTF_ERROR			((size_t) -1)
+
+/*** Is the buffer ASCII? Valid UTF-8, UTF-16, UTF-32? ***/
+extern bool ascii_valid(const char* buf, size_t len);
+extern bool utf8_valid(const char* buf, size_t len);
+extern bool utf16_valid(const u16ch* buf, size_t len);
+extern bool utf32_valid(const uch* buf, size_t len);
+
+/*** Validate UTF-8 and count its codepoints in one pass. Returns UTF_ERROR if it's invalid. ***/
+extern size_t utf8_count(const char* buf, size_t len);
+
+/*** The size of the conversion of valid input, in code units of the output. ***/
+extern size_t utf32_length_from_utf8(const char* buf, size_t len);
+extern size_t utf16_length_from_utf8(const char* buf, size_t len);
+extern size_t utf8_length_from_utf16(const u16ch* buf, size_t len);
+extern size_t utf32_length_from_utf16(const u16ch* buf, size_t len);
+extern size_t utf8_length_from_utf32(const uch* buf, size_t len);
+extern size_t utf16_length_from_utf32(const uch* buf, size_t len);
+
+/*** Convert into the caller's buffer. ***/
+extern size_t utf8_to_utf32(const char* in, size_t len, uch* out);
+extern size_t utf8_to_utf16(const char* in, size_t len, u16ch* out);
+extern size_t utf16_to_utf8(const u16ch* in, size_t len, char* out);
+extern size_t utf16_to_utf32(const u16ch* in, size_t len, uch* out);
+extern size_t utf32_to_utf8(const uch* in, size_t len, char* out);
+extern size_t utf32_to_utf16(const uch* in, size_t len, u16ch* out);
+
+/*** Convert into a vector or string, sized exactly. Returns false (and leaves it empty) if the input is invalid. ***/
+extern bool utf8_to_utf32(const char* in, size_t len, std::vector<uch>& out);
+extern bool utf32_to_utf8(const uch* in, size_t len, std::string& out);
+
 /*** Support macros ***/
 #ifndef	NEW_USTR
 #define	NEW_USTR(n)		((ustring)new u32 [n + 1])
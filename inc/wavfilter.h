@@ -0,0 +1,138 @@
+/***
+
+	wavfilter.h
+
+	Fast filtering for WavBuild/MixBus audio: FFT convolution with arbitrary impulse responses, the reverb
+	and EQ filters built on it, and a polyphase resampler (which only computes the output samples it keeps,
+	so it filters directly rather than through the FFT.)
+
+	The engine is uniformly partitioned overlap-save convolution. The impulse response is cut into blocks
+	of B samples, each transformed once; every block of input is transformed once, kept in a frequency-
+	domain delay line, and the output block is the inverse transform of the sum of (input spectrum *
+	partition spectrum) over the partitions. That's O(log B) work per sample per partition instead of the
+	O(M) per sample of direct convolution, with only B samples of latency, so it streams: feed it a block,
+	get a block back.
+
+	The transforms are a planned single-precision real FFT (tables computed once, in place, no allocation
+	per call); inc/external/fft.h's recursive double-precision transform computes its twiddles on every
+	butterfly, which is fine for analysis but not for a filter running thousands of transforms a second.
+
+	The whole-buffer filters run each channel on its own thread.
+
+	2024, C. M. Street
+
+***/
+#ifndef __WAVFILTER_H__
+#define __WAVFILTER_H__
+
+/*** Real FFT of a power-of-two size n >= 4, in single precision. The spectrum has n/2 + 1 bins, with the
+     real and imaginary parts in separate arrays. forward() and inverse() are const and use only the caller's
+     buffers, so one plan can be shared between threads. ***/
+class FftPlan {
+public:
+	FftPlan() { n = 0; }
+	explicit FftPlan(u32 size) { init(size); }
+	void init(u32 size);
+
+	u32 size(void) const { return n; }
+	u32 bins(void) const { return n / 2 + 1; }
+
+	// in[n] to re[n/2 + 1], im[n/2 + 1].
+	void forward(const float* in, float* re, float* im) const;
+	// Back again, scaled by 1/n so that inverse(forward(x)) == x. re and im are used as scratch.
+	void inverse(float* re, float* im, float* out) const;
+
+private:
+	void complex_fft(float* re, float* im, bool inv) const;
+
+	u32 n;
+	std::vector<u32> rev;
+	std::vector<float> tw_re, tw_im;
+	std::vector<float> rtw_re, rtw_im;
+};
+
+/*** Uniformly partitioned overlap-save convolution with one impulse response. ***/
+class PartitionedConvolver {
+public:
+	PartitionedConvolver();
+
+	// Set the impulse response and the block size (rounded up to a power of two, at least 16). Clears the
+	// history. Returns false if ir_len is 0.
+	bool init(const float* ir, u32 ir_len, u32 block_size = 256);
+	// Silence the history, keeping the impulse response.
+	void reset(void);
+
+	u32 block_size(void) const { return B; }
+	u32 ir_length(void) const { return ir_len; }
+	u32 partitions(void) const { return P; }
+
+	// Convolve exactly block_size() samples. Output sample i is the convolution at input sample i: the
+	// block itself adds no delay.
+	void process_block(const float* in, float* out);
+	// Any number of samples, buffered into blocks: the output lags the input by block_size() samples.
+	void process(const float* in, float* out, u32 n);
+
+private:
+	FftPlan fft;
+	u32 B, P, ir_len;
+	std::vector<float> h_re, h_im;
+	std::vector<float> x_re, x_im;
+	u32 fdl_pos;
+	std::vector<float> window;
+	std::vector<float> acc_re, acc_im;
+	std::vector<float> y;
+	std::vector<float> in_fifo, out_fifo;
+	u32 fifo_pos;
+};
+
+/*** Direct-form FIR convolution, the O(n * m) way; faster than FFT convolution for very short responses.
+     y[0 .. n + m - 1) = x[0 .. n) * h[0 .. m). ***/
+extern void convolve_direct(const float* x, u32 n, const float* h, u32 m, float* y);
+
+/*** Convolve each channel of the bus with an impulse response. A mono response is used for every channel; a
+     stereo one has a response per channel. The result is wet * (bus * ir) + dry * bus; with keep_tail it is
+     extended by the length of the response, so reverb tails ring out. block_size 0 picks one for speed. Returns
+     false if the formats don't fit. ***/
+extern bool bus_convolve(MixBus& bus, const MixBus& ir, float wet = 1.0f, float dry = 0.0f, bool keep_tail = true,
+			ThreadPool* pool = nullptr, u32 block_size = 0);
+
+/*** Synthetic room reverb: decorrelated noise per channel, decaying by 60 dB over decay_sec, darkening over
+     time (damping 0 to 1), after a predelay. ***/
+struct ReverbParams {
+	float decay_sec = 1.8f;
+	float predelay_ms = 20.0f;
+	float damping = 0.5f;
+	float wet = 0.25f;
+	float dry = 1.0f;
+	u32 seed = 1;
+};
+
+extern void reverb_impulse(MixBus& ir, u32 nchannels, u32 sample_rate, const ReverbParams& rp);
+extern bool bus_reverb(MixBus& bus, const ReverbParams& rp = ReverbParams(), ThreadPool* pool = nullptr);
+
+/*** Graphic EQ: gains in dB at a set of frequencies, interpolated on a log-frequency scale between them and
+     held flat beyond the ends. It's a linear-phase FIR of 'taps' taps, and the output is compensated for
+     its delay, so nothing moves in time. ***/
+struct EqBand {
+	float freq_hz;
+	float gain_db;
+};
+
+extern void eq_fir(const std::vector<EqBand>& bands, u32 sample_rate, u32 taps, std::vector<float>& h);
+extern bool bus_eq(MixBus& bus, const std::vector<EqBand>& bands, u32 taps = 2047, ThreadPool* pool = nullptr);
+
+/*** Windowed-sinc (Kaiser) lowpass: cutoff as a fraction of the sample rate (0 to 0.5). ***/
+extern void lowpass_fir(double cutoff, u32 taps, double kaiser_beta, std::vector<float>& h);
+
+/*** Change the sample rate with a polyphase windowed-sinc filter (band-limited to the lower of the two
+     Nyquist frequencies.) quality is the number of zero crossings on each side of the sinc, 8 to 64. ***/
+extern bool bus_resample(const MixBus& in, MixBus& out, u32 new_rate, u32 quality = 24, ThreadPool* pool = nullptr);
+
+/*** The same, on WavBuilds: each returns a new WavBuild, or nullptr. ***/
+extern WavBuild* wav_convolve(const WavBuild* wb, const WavBuild* ir, float wet = 1.0f, float dry = 0.0f, ThreadPool* pool = nullptr);
+extern WavBuild* wav_reverb(const WavBuild* wb, const ReverbParams& rp = ReverbParams(), ThreadPool* pool = nullptr);
+extern WavBuild* wav_eq(const WavBuild* wb, const std::vector<EqBand>& bands, ThreadPool* pool = nullptr);
+extern WavBuild* wav_resample(const WavBuild* wb, u32 new_rate, ThreadPool* pool = nullptr);
+
+#endif  // __WAVFILTER_H__
+/* end wavfilter.h */
@@ -286,6 +286,75 @@ private:
 	void mix_from_pos(WavBuild* wb2, u32 ns_start1, u32 ns_start2, u32 nsamples);
 };
 
+/*** A 32-bit float mixing bus. Samples are interleaved, with 16-bit full scale at [-1, 1); mixes add linearly
+     and never clip, so any number of voices can be summed, scaled and panned with full headroom, and only
+     converted (and clipped) to 16-bit PCM at the output. The kernels underneath use SSE2/AVX2 where available,
+     and are the same ones the WavBuild mix methods now use. ***/
+class MixBus {
+public:
+	MixBus(u32 nchannels = 2, u32 sample_rate = 44100);
+	// Load a WavBuild's samples onto a new bus.
+	explicit MixBus(const WavBuild* wb);
+
+	u32 num_channels(void) const { return nch; }
+	u32 sample_rate(void) const { return sr; }
+	u32 num_samples(void) const { return u32(buf.size() / nch); }
+	float* data(void) { return buf.data(); }
+	const float* data(void) const { return buf.data(); }
+	float* sample_pos(u32 nsample) { return buf.data() + size_t(nsample) * nch; }
+	// Extends with silence, or truncates.
+	void resize(u32 nsamples) { buf.resize(size_t(nsamples) * nch, 0.0f); }
+	void clear(void) { buf.clear(); }
+
+	// Add a WavBuild (or another bus) in at the given sample position, times gain, panned -100 (left) to
+	// 100 (right) if this bus is stereo. The bus grows as needed. Mono is spread to stereo and stereo
+	// averaged to mono; returns false if the sample rates differ (or for buses, the channel counts.)
+	bool mix_in(const WavBuild* wb, u32 ns_start = 0, float gain = 1.0f, int pan = 0);
+	bool mix_in(const MixBus& bus, u32 ns_start = 0, float gain = 1.0f, int pan = 0);
+
+	void apply_gain(float gain);
+	// Largest sample magnitude on the bus; 1.0 is 16-bit full scale.
+	float peak(void) const;
+	// Scale so the peak is at the given level, if there's any signal.
+	void normalize(float level = 1.0f);
+
+	// Convert nsamples samples from ns_start to 16-bit PCM, clipping. out needs room for nsamples * num_channels().
+	void to_pcm(u16* out, u32 ns_start, u32 nsamples) const;
+	// Append the bus to a WavBuild as PCM (a new one is allocated if wb is nullptr.) Returns nullptr if the
+	// WavBuild's format doesn't match.
+	WavBuild* to_wav_build(WavBuild* wb = nullptr) const;
+
+private:
+	std::vector<float> buf;
+	u32 nch;
+	u32 sr;
+};
+
+/*** Streams blocks of signed 16-bit PCM to a .WAV file as they're produced, so a long render never has to be in
+     memory all at once. The lengths in the header are patched in by close(). ***/
+class WavStreamWriter {
+public:
+	WavStreamWriter();
+	~WavStreamWriter();
+
+	bool open(const char* path, u32 nchannels, u32 sample_rate);
+	// Append nframes frames of interleaved samples. Returns false on a write error.
+	bool write(const i16* samples, u32 nframes);
+	// Finish the header and close the file; returns false if anything failed along the way.
+	bool close(void);
+	u64 num_samples(void) const { return nframes; }
+
+private:
+	FILE* f;
+	u32 nch;
+	u32 sr;
+	u64 nframes;
+	bool ok;
+};
+
+/* Receives each block of a streamed render: nframes frames of interleaved signed 16-bit PCM. Return false to stop. */
+typedef std::function<bool(const i16* pcm, u32 nframes)> WavBlockSink;
+
 /* Forward declarations */
 struct Patch;
 class Voices;
@@ -326,12 +395,24 @@ public:
 	WavBuild* build_note(WavBuild* wb, MusicalNote note, int octave, u32 msec, u32 amp = 0, NoteStyle ns = style_legato, Waveform wf = wave_sine, int pan = 0) const;
 
 	// SoundFont rendering. If 'program' is non-negative, we will render only the specified program index,
-	// else the entire MIDI will be rendered.
+	// else the entire MIDI will be rendered. (These use stream_midi() below, on the shared thread pool.)
 	WavBuild* build_midi(WavBuild* wb, tml_message* midi, tsf* soundfont, int program = MIDI_PROGRAM_ALL);
 	WavBuild* build_midi(WavBuild* wb, const char* midi_path, tsf* soundfont, int program = MIDI_PROGRAM_ALL);
 	WavBuild* build_midi(WavBuild* wb, const char* midi_path, const char* sf_path, int program = MIDI_PROGRAM_ALL);
 	tsf* load_soundfont_for_render(const char* sf_path);
 
+	// Parallel, streaming SoundFont rendering. The MIDI channels are split among up to 'max_parts' copies of the
+	// soundfont (0 for one per thread), which render side by side; their mix is handed to 'sink' a block of
+	// 'block_msec' at a time, so memory use doesn't grow with the length of the song. Rendering continues past
+	// the last event until the notes have died away. Returns the number of sample frames rendered.
+	u64 stream_midi(tml_message* midi, tsf* soundfont, WavBlockSink sink, int program = MIDI_PROGRAM_ALL,
+			ThreadPool* pool = nullptr, u32 max_parts = 0, u32 block_msec = 1000);
+	// Render a MIDI straight to a .WAV file, a block at a time.
+	bool render_midi_to_file(const char* wav_path, tml_message* midi, tsf* soundfont, int program = MIDI_PROGRAM_ALL,
+			ThreadPool* pool = nullptr);
+	bool render_midi_to_file(const char* wav_path, const char* midi_path, const char* sf_path, int program = MIDI_PROGRAM_ALL,
+			ThreadPool* pool = nullptr);
+
 	// Mix wb2 into wb1. The mixing begins at (length wb1 - length wb2), so if wb1 is longer audio, wb2 will be heard at the end.
 	void mix_from_end(WavBuild* wb1, WavBuild* wb2) const;
 	void mix_from_end(WavBuild* wb1, WavBuild* wb2, u32 msec) const;
@@ -47,6 +47,14 @@ gcc-ar rcs bin/libcodehappy.a *.o
 
 echo "*** Build tests and examples"
 g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/compress.cpp -o compress.o
+g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/compbench.cpp -o compbench.o
+g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/entbench.cpp -o entbench.o
+g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/primebench.cpp -o primebench.o
+g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/fuzzybench.cpp -o fuzzybench.o
+g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/splitbench.cpp -o splitbench.o
+g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/regexbench.cpp -o regexbench.o
+g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/deltabench.cpp -o deltabench.o
+g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/convbench.cpp -o convbench.o
 g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/testfont.cpp -o testfont.o
 g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/colors.cpp -o colors.o
 g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/256color.cpp -o 256color.o
@@ -74,6 +82,14 @@ g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc examples/sam-img.cpp -o sam-img.
 g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc examples/llava.cpp -o llava.o
 g++ -O3 -flto -fuse-linker-plugin -m64 -c -Iinc examples/exifdemo.cpp -o exifdemo.o
 g++ -O3 -flto -fuse-linker-plugin -m64 compress.o bin/libcodehappy.a -lpthread -o compress
+g++ -O3 -flto -fuse-linker-plugin -m64 compbench.o bin/libcodehappy.a -lpthread -o compbench
+g++ -O3 -flto -fuse-linker-plugin -m64 entbench.o bin/libcodehappy.a -lpthread -o entbench
+g++ -O3 -flto -fuse-linker-plugin -m64 primebench.o bin/libcodehappy.a -lpthread -o primebench
+g++ -O3 -flto -fuse-linker-plugin -m64 fuzzybench.o bin/libcodehappy.a -lpthread -o fuzzybench
+g++ -O3 -flto -fuse-linker-plugin -m64 splitbench.o bin/libcodehappy.a -lpthread -o splitbench
+g++ -O3 -flto -fuse-linker-plugin -m64 regexbench.o bin/libcodehappy.a -lpthread -o regexbench
+g++ -O3 -flto -fuse-linker-plugin -m64 deltabench.o bin/libcodehappy.a -lpthread -o deltabench
+g++ -O3 -flto -fuse-linker-plugin -m64 convbench.o bin/libcodehappy.a -lpthread -o convbench
 g++ -O3 -flto -fuse-linker-plugin -m64 testfont.o bin/libcodehappy.a -lpthread -o testfont
 g++ -O3 -flto -fuse-linker-plugin -m64 colors.o bin/libcodehappy.a -lpthread -o colors
 g++ -O3 -flto -fuse-linker-plugin -m64 256color.o bin/libcodehappy.a -lpthread -o 256color
@@ -48,6 +48,14 @@ gcc-ar rcs bin/libcodehappyd.a *.o
 
 echo *** Build tests and examples
 g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/compress.cpp -o compress.o
+g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/compbench.cpp -o compbench.o
+g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/entbench.cpp -o entbench.o
+g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/primebench.cpp -o primebench.o
+g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/fuzzybench.cpp -o fuzzybench.o
+g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/splitbench.cpp -o splitbench.o
+g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/regexbench.cpp -o regexbench.o
+g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/deltabench.cpp -o deltabench.o
+g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/convbench.cpp -o convbench.o
 g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/testfont.cpp -o testfont.o
 g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/colors.cpp -o colors.o
 g++ -g -Wa,-mbig-obj -m64 -c -Iinc -DCODEHAPPY_NATIVE examples/256color.cpp -o 256color.o
@@ -75,6 +83,14 @@ g++ -g -Wa,-mbig-obj -m64 -c -Iinc examples/sam-img.cpp -o sam-img.o
 g++ -g -Wa,-mbig-obj -m64 -c -Iinc examples/llava.cpp -o llava.o
 g++ -g -Wa,-mbig-obj -m64 -c -Iinc examples/exifdemo.cpp -o exifdemo.o
 g++ -g -Wa,-mbig-obj -m64 compress.o bin/libcodehappyd.a -lpthread -o compress
+g++ -g -Wa,-mbig-obj -m64 compbench.o bin/libcodehappyd.a -lpthread -o compbench
+g++ -g -Wa,-mbig-obj -m64 entbench.o bin/libcodehappyd.a -lpthread -o entbench
+g++ -g -Wa,-mbig-obj -m64 primebench.o bin/libcodehappyd.a -lpthread -o primebench
+g++ -g -Wa,-mbig-obj -m64 fuzzybench.o bin/libcodehappyd.a -lpthread -o fuzzybench
+g++ -g -Wa,-mbig-obj -m64 splitbench.o bin/libcodehappyd.a -lpthread -o splitbench
+g++ -g -Wa,-mbig-obj -m64 regexbench.o bin/libcodehappyd.a -lpthread -o regexbench
+g++ -g -Wa,-mbig-obj -m64 deltabench.o bin/libcodehappyd.a -lpthread -o deltabench
+g++ -g -Wa,-mbig-obj -m64 convbench.o bin/libcodehappyd.a -lpthread -o convbench
 g++ -g -Wa,-mbig-obj -m64 testfont.o bin/libcodehappyd.a -lpthread -o testfont
 g++ -g -Wa,-mbig-obj -m64 colors.o bin/libcodehappyd.a -lpthread -o colors
 g++ -g -Wa,-mbig-obj -m64 256color.o bin/libcodehappyd.a -lpthread -o 256color
@@ -12,9 +12,12 @@
 BertEmbeddingManager::BertEmbeddingManager(const std::string& model_path) {
 	model = bert_load_from_file(model_path.c_str());
 	assert(not_null(model));
+	this->model_path = model_path;
 	n_threads = std::max((int) std::thread::hardware_concurrency() / 2, 1);
 	save_text = true;
 	n_sentences = 1;
+	n_encoders = 1;
+	batch_sz = 0;
 }
 
 BertEmbeddingManager::~BertEmbeddingManager() {
@@ -22,6 +25,9 @@ BertEmbeddingManager::~BertEmbeddingManager() {
 		bert_free(model);
 	}
 	model = nullptr;
+	for (auto ctx : worker_models)
+		bert_free(ctx);
+	worker_models.clear();
 }
 
 std::vector<LMEmbedding*> BertEmbeddingManager::embedding_for_text(const std::string& str) {
@@ -172,19 +178,18 @@ static bool ends_in_punc(const char* str) {
 	return false;
 }
 
-void BertEmbeddingManager::embedding_for_text(const std::string& str, std::vector<LMEmbedding*>& le, std::vector<u32>& offs) {
-	/* We break the text into blocks/chunks of n_sentence sentences, and then create an LMEmbedding for each chunk. */
+void BertEmbeddingManager::text_chunks(const std::string& str, std::vector<std::string>& chunks, std::vector<u32>& offs) const {
+	/* We break the text into blocks/chunks of n_sentence sentences. */
 	std::vector<char*> sentences;
 	char* ntxt = normalize_string(str);
 	const int MAX_LEN = 640;
+	int n_sent = std::max(n_sentences, 1);
 
 	sentencify(ntxt, &sentences);
 
-	n_sentences = std::max(n_sentences, 1);
-
-	for (int i = 0; i < sentences.size(); i += n_sentences) {
+	for (int i = 0; i < sentences.size(); i += n_sent) {
 		std::string full;
-		for (int e = i; e < (i + n_sentences) && e < sentences.size(); ++e) {
+		for (int e = i; e < (i + n_sent) && e < sentences.size(); ++e) {
 			if (e != i)
 				full += " ";
 			full += sentences[e];
@@ -199,19 +204,34 @@ void BertEmbeddingManager::embedding_for_text(const std::string& str, std::vecto
 			full.erase(MAX_LEN, std::string::npos);
 		}
 
-		LMEmbedding* lme = new LMEmbedding;
-		lme->n_embed = embedding_dimension();
-		lme->embed_data = new float [lme->n_embed];	
-		if (save_text) {
-			lme->text = new char [full.length() + 1];
-			strcpy(lme->text, full.c_str());
-		}
-		bert_encode(model, n_threads, full.c_str(), lme->embed_data);
-		le.push_back(lme);
+		chunks.push_back(full);
 		offs.push_back(sentences[i] - ntxt);
 	}
 
-	delete ntxt;
+	delete [] ntxt;
+}
+
+LMEmbedding* BertEmbeddingManager::new_embedding(const std::string& chunk) const {
+	LMEmbedding* lme = new LMEmbedding;
+	lme->n_embed = embedding_dimension();
+	lme->embed_data = new float [lme->n_embed];
+	if (save_text) {
+		lme->text = new char [chunk.length() + 1];
+		strcpy(lme->text, chunk.c_str());
+	}
+	return lme;
+}
+
+void BertEmbeddingManager::embedding_for_text(const std::string& str, std::vector<LMEmbedding*>& le, std::vector<u32>& offs) {
+	/* Create an LMEmbedding for each chunk of n_sentence sentences. */
+	std::vector<std::string> chunks;
+
+	text_chunks(str, chunks, offs);
+	for (const auto& chunk : chunks) {
+		LMEmbedding* lme = new_embedding(chunk);
+		bert_encode(model, n_threads, chunk.c_str(), lme->embed_data);
+		le.push_back(lme);
+	}
 }
 
 LMEmbeddingFile* BertEmbeddingManager::embeddings_for_file(const std::string& str) {
@@ -235,8 +255,10 @@ LMEmbeddingFolder* BertEmbeddingManager::embeddings_for_folder(const std::string
 }
 
 void BertEmbeddingManager::embeddings_for_folder(const std::string& path, LMEmbeddingFolder* lef, const char* lef_pathname) {
-	if (not_null(lef_pathname) && FileExists(lef_pathname)) {
-		lef->in_from_file(lef_pathname);
+	// each finished file is appended to the embedding log, so an interrupted run resumes where it left off.
+	LMEmbeddingLog log;
+	if (not_null(lef_pathname)) {
+		log.open(lef_pathname, lef);
 	}
 
 	DIR* di = opendir(path.c_str());
@@ -259,10 +281,193 @@ void BertEmbeddingManager::embeddings_for_folder(const std::string& path, LMEmbe
 		lef->known_files.insert(filename);
 
 		if (not_null(lef_pathname)) {
-			lef->out_to_file(lef_pathname);
+			log.append(lef->files.back());
 		}
 	}
 	closedir(di);
+	log.close();
+}
+
+/*** The pipelined folder indexer. ***/
+
+/* A text file, broken into chunks, waiting for its embeddings. */
+struct BertFileJob {
+	LMEmbeddingFile* lef;
+	std::vector<std::string> chunks;
+	int n_left;		// chunks not yet encoded (guarded by BertPipeline::mtx)
+};
+
+/* A batch of chunks (from one or more files) for one bert_encode_batch() call. */
+struct BertBatch {
+	std::vector<BertFileJob*> jobs;
+	std::vector<int> idx;
+};
+
+struct BertPipeline {
+	BertPipeline(int n_encoders) : files_q(PIPELINE_FILES_QUEUED), batch_q(n_encoders * 2) {
+		n_encoders_live = n_encoders;
+	}
+
+	// how many chunked files the reader may get ahead of the encoders.
+	static const int PIPELINE_FILES_QUEUED = 64;
+
+	WorkQueue<BertFileJob*> files_q;	// reader -> batcher
+	WorkQueue<BertBatch*> batch_q;		// batcher -> encoders
+	WorkQueue<BertFileJob*> done_q;		// encoders (or reader, for empty files) -> caller
+	std::mutex mtx;
+	int n_encoders_live;
+};
+
+// helper: the batcher sorts its window of pending chunks by length and cuts it into batches,
+// so each batch holds chunks of similar length.
+static void emit_batches(std::vector<std::pair<BertFileJob*, int>>& pending, int batch_size, bool flush, WorkQueue<BertBatch*>& batch_q) {
+	std::sort(pending.begin(), pending.end(), [](const std::pair<BertFileJob*, int>& a, const std::pair<BertFileJob*, int>& b) {
+		return a.first->chunks[a.second].length() > b.first->chunks[b.second].length();
+	});
+	size_t i = 0;
+	while (i < pending.size()) {
+		if (!flush && pending.size() - i < (size_t) batch_size)
+			break;
+		BertBatch* batch = new BertBatch;
+		for (size_t e = i; e < pending.size() && e < i + batch_size; ++e) {
+			batch->jobs.push_back(pending[e].first);
+			batch->idx.push_back(pending[e].second);
+		}
+		i += batch->jobs.size();
+		batch_q.push(batch);
+	}
+	pending.erase(pending.begin(), pending.begin() + i);
+}
+
+int BertEmbeddingManager::auto_batch_size() const {
+	// batches are capped by the compute buffer: bert_encode_batch() shrinks any batch that needs more than
+	// about 1 GB, at mem_per_input per input. Our chunks are limited to 640 characters, which is well
+	// under the context length for typical BERT models, so a moderate fixed batch keeps buffers small.
+	const int TOKENS_PER_BATCH = 4096;
+	int n_ctx = std::max((int) bert_n_max_tokens(model), 1);
+	return CLAMP(TOKENS_PER_BATCH / n_ctx, 1, 32);
+}
+
+void BertEmbeddingManager::embeddings_for_folder_pipelined(const std::string& path, LMEmbeddingFolder* lef, const char* lef_pathname) {
+	LMEmbeddingLog log;
+	if (not_null(lef_pathname)) {
+		log.open(lef_pathname, lef);
+	}
+
+	int n_enc = std::max(n_encoders, 1);
+	int batch_size = (batch_sz > 0 ? batch_sz : auto_batch_size());
+	// each encoder owns a context; the first is the one we already have.
+	while (worker_models.size() + 1 < (size_t) n_enc) {
+		bert_ctx* ctx = bert_load_from_file(model_path.c_str());
+		if (is_null(ctx))
+			break;
+		worker_models.push_back(ctx);
+	}
+	n_enc = (int) worker_models.size() + 1;
+	int threads_per_enc = std::max(n_threads / n_enc, 1);
+	BertPipeline pl(n_enc);
+
+	// reader: find new text files, read and sentencify them. It checks a copy of known_files, since
+	// this thread adds to the original as files complete.
+	std::unordered_set<std::string> known_files = lef->known_files;
+	std::thread reader([this, &path, &known_files, &pl]() {
+		DIR* di = opendir(path.c_str());
+		dirent* entry;
+
+		while (not_null(di) && (entry = readdir(di))) {
+			if (!is_text_file_extension(entry->d_name))
+				continue;
+			std::string filename;
+			make_pathname(path, entry->d_name, filename);
+			if (known_files.find(filename) != known_files.end()) {
+				std::cout << "Skipping " << filename << ", already in embeddings file...\n";
+				continue;
+			}
+
+			BertFileJob* job = new BertFileJob;
+			job->lef = new LMEmbeddingFile;
+			job->lef->pathname = filename;
+			text_chunks(string_from_text_file(filename), job->chunks, job->lef->offsets);
+			for (const auto& chunk : job->chunks)
+				job->lef->embeds.push_back(new_embedding(chunk));
+			job->n_left = (int) job->chunks.size();
+			if (job->chunks.empty())
+				pl.done_q.push(job);
+			else
+				pl.files_q.push(job);
+		}
+		if (not_null(di))
+			closedir(di);
+		pl.files_q.close();
+	});
+
+	// batcher: gather chunks from several files and pack them into batches of similar length.
+	std::thread batcher([&pl, batch_size]() {
+		const int WINDOW_BATCHES = 8;
+		std::vector<std::pair<BertFileJob*, int>> pending;
+		BertFileJob* job;
+
+		while (pl.files_q.pop(job)) {
+			for (int e = 0; e < (int) job->chunks.size(); ++e)
+				pending.push_back(std::make_pair(job, e));
+			if (pending.size() >= (size_t) batch_size * WINDOW_BATCHES)
+				emit_batches(pending, batch_size, false, pl.batch_q);
+		}
+		emit_batches(pending, batch_size, true, pl.batch_q);
+		pl.batch_q.close();
+	});
+
+	// encoders: each owns a bert_ctx and runs whole batches through it.
+	std::vector<std::thread> encoders;
+	for (int w = 0; w < n_enc; ++w) {
+		bert_ctx* ctx = (w == 0 ? model : worker_models[w - 1]);
+		encoders.push_back(std::thread([ctx, &pl, threads_per_enc]() {
+			BertBatch* batch;
+			std::vector<const char*> texts;
+			std::vector<float*> embeds;
+
+			while (pl.batch_q.pop(batch)) {
+				int n = (int) batch->jobs.size();
+				texts.resize(n);
+				embeds.resize(n);
+				for (int e = 0; e < n; ++e) {
+					texts[e] = batch->jobs[e]->chunks[batch->idx[e]].c_str();
+					embeds[e] = batch->jobs[e]->lef->embeds[batch->idx[e]]->embed_data;
+				}
+				bert_encode_batch(ctx, threads_per_enc, n, n, texts.data(), embeds.data());
+
+				ScopeMutex sm(pl.mtx);
+				for (auto job : batch->jobs) {
+					if (--job->n_left == 0)
+						pl.done_q.push(job);
+				}
+				sm.unlock();
+				delete batch;
+			}
+
+			ScopeMutex sm(pl.mtx);
+			if (--pl.n_encoders_live == 0)
+				pl.done_q.close();
+		}));
+	}
+
+	// and collect the finished files here.
+	BertFileJob* job;
+	while (pl.done_q.pop(job)) {
+		std::cout << job->lef->pathname << std::endl;
+		lef->known_files.insert(job->lef->pathname);
+		lef->files.push_back(job->lef);
+		delete job;
+		if (not_null(lef_pathname)) {
+			log.append(lef->files.back());
+		}
+	}
+	log.close();
+
+	reader.join();
+	batcher.join();
+	for (auto& th : encoders)
+		th.join();
 }
 
 char* BertEmbeddingManager::normalize_string(const std::string& in_str) const {
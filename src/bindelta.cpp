@@ -0,0 +1,519 @@
+/***
+
+	bindelta.cpp
+
+	Binary deltas between large files: content-defined chunking, a hash index of the source, and COPY/ADD
+	instructions.
+
+	2024, C. M. Street
+
+***/
+
+static const u8 __magic_bindelta[8] = {'D', 'L', 'T', 0x7e, 0x0c, 0x48, 0x19, 0x01};
+
+#define	BD_END		0
+#define	BD_COPY		1
+#define	BD_ADD		2
+
+#define	BD_HASH_SEED	0x62646c7461ULL
+/* Each thread finds the chunk boundaries of a segment of at least this many bytes. */
+#define	BD_SEGMENT	(1 << 20)
+/* Chunks are indexed by a hash of their first BD_HEAD bytes. */
+#define	BD_HEAD		32
+/* Output is gathered into a buffer of this size before it's written out. */
+#define	BD_WRITE_BUFFER	(1 << 20)
+
+/*** Content-defined chunking. ***/
+
+/* The gear hash's byte values: fixed, from a splitmix64 sequence. */
+struct GearTable {
+	u64 v[256];
+	GearTable() {
+		u64 x = 0x2545f4914f6cdd1dULL;
+		for (u32 e = 0; e < 256; ++e) {
+			u64 z = (x += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			v[e] = z ^ (z >> 31);
+		}
+	}
+};
+
+static const u64* gear_values() {
+	static GearTable gt;
+	return gt.v;
+}
+
+/* The ends of the chunks of data[0, len); the last is len. A chunk ends after any byte where the gear hash has its
+   top log2(avg) bits clear, or when it reaches avg * 8 bytes. Each byte shifts the hash left one bit, so the hash
+   only depends on the last 64 bytes: each thread can start its segment 64 bytes early and get the same hashes as a
+   single pass would. There's deliberately no minimum chunk size: where a chunk ends mustn't depend on where the
+   one before it ended, or an edit would move the boundaries after it until they happened to fall back in step. */
+static void cdc_cuts(const u8* data, u64 len, u32 avg, std::vector<u64>& ends, ThreadPool& tp) {
+	const u64* gear = gear_values();
+	u32 shift = 64;
+	const u64 max_chunk = (u64) avg * 8;
+	const u64 nseg = (len + BD_SEGMENT - 1) / BD_SEGMENT;
+	std::vector< std::vector<u64> > cand(nseg);
+
+	for (u32 b = avg; b > 1; b >>= 1)
+		--shift;
+
+	tp.parallel_for(0, (i64) nseg, [&](i64 s0, i64 s1) {
+		for (i64 s = s0; s < s1; ++s) {
+			// (locals, so the compiler needn't reload them after each push_back())
+			const u64* g = gear;
+			const u8* d = data;
+			const u32 sh = shift;
+			const u64 a = (u64) s * BD_SEGMENT, b = std::min(a + BD_SEGMENT, len);
+			std::vector<u64>& c = cand[s];
+			u64 h = 0;
+			for (u64 p = (a >= 64 ? a - 64 : 0); p < a; ++p)
+				h = (h << 1) + g[d[p]];
+			c.reserve((size_t) ((b - a) / avg) * 2 + 16);
+			u64 p = a;
+			for (; p < b; ++p) {
+				h = (h << 1) + g[d[p]];
+				if ((h >> sh) == 0)
+					c.push_back(p + 1);
+			}
+		}
+	}, 1);
+
+	u64 last = 0;
+	ends.clear();
+	ends.reserve((size_t) (len / avg) + 16);
+	for (const auto& c : cand) {
+		for (u64 e : c) {
+			while (e - last > max_chunk) {
+				last += max_chunk;
+				ends.push_back(last);
+			}
+			ends.push_back(e);
+			last = e;
+		}
+	}
+	while (len - last > max_chunk) {
+		last += max_chunk;
+		ends.push_back(last);
+	}
+	if (last < len)
+		ends.push_back(len);
+}
+
+/* The hash of the start of each chunk. A target chunk that starts like a source chunk is checked byte for byte, and
+   copied from as far as it matches: so a chunk with an edit in it still yields the bytes before the edit. */
+static void cdc_hashes(const u8* data, const std::vector<u64>& ends, std::vector<u64>& hashes, ThreadPool& tp) {
+	hashes.resize(ends.size());
+	tp.parallel_for(0, (i64) ends.size(), [&](i64 i0, i64 i1) {
+		for (i64 i = i0; i < i1; ++i) {
+			const u64 a = (i > 0 ? ends[i - 1] : 0);
+			hashes[i] = SpookyHash::Hash64(data + a, (size_t) std::min(ends[i] - a, (u64) BD_HEAD), BD_HASH_SEED);
+		}
+	}, 1024);
+}
+
+/* How many bytes a and b have in common from the start, up to n. */
+static u64 common_length(const u8* a, const u8* b, u64 n) {
+	u64 i = 0;
+	while (i + 8 <= n) {
+		u64 x, y;
+		memcpy(&x, a + i, 8);
+		memcpy(&y, b + i, 8);
+		if (x != y) {
+			x ^= y;
+#ifdef CODEHAPPY_MSFT
+			while ((x & 0xff) == 0) {
+				x >>= 8;
+				++i;
+			}
+			return i;
+#else
+			return i + (u64) (__builtin_ctzll(x) >> 3);
+#endif
+		}
+		i += 8;
+	}
+	while (i < n && a[i] == b[i])
+		++i;
+	return i;
+}
+
+/*** Writing deltas. ***/
+
+struct BinDeltaRamFileSink {
+	RamFile* rf;
+	bool write(const u8* p, size_t n) { return rf->write(p, n) == n; }
+};
+
+struct BinDeltaVectorSink {
+	std::vector<u8>* v;
+	bool write(const u8* p, size_t n) {
+		v->insert(v->end(), p, p + n);
+		return true;
+	}
+};
+
+struct BinDeltaFileSink {
+	FILE* f;
+	bool write(const u8* p, size_t n) { return n == 0 || fwrite(p, 1, n, f) == n; }
+};
+
+/* Buffers small writes; big ones go straight through. */
+template <class Sink> class BinDeltaWriter {
+public:
+	BinDeltaWriter(Sink& s) : sink(s), ok(true), total(0) { buf.reserve(BD_WRITE_BUFFER); }
+
+	void put(const u8* p, u64 n) {
+		total += n;
+		if (buf.size() + n <= BD_WRITE_BUFFER) {
+			buf.insert(buf.end(), p, p + n);
+			return;
+		}
+		flush();
+		while (n > 0 && ok) {
+			const size_t w = (size_t) std::min(n, (u64) 1 << 30);
+			ok = sink.write(p, w);
+			p += w;
+			n -= w;
+		}
+	}
+	void put_byte(u8 b) {
+		put(&b, 1);
+	}
+	void put_varint(u64 v) {
+		u8 b[10];
+		u32 n = 0;
+		while (v >= 0x80) {
+			b[n++] = (u8) (v | 0x80);
+			v >>= 7;
+		}
+		b[n++] = (u8) v;
+		put(b, n);
+	}
+	bool flush() {
+		if (!buf.empty() && ok)
+			ok = sink.write(buf.data(), buf.size());
+		buf.clear();
+		return ok;
+	}
+	u64 written() const { return total; }
+
+private:
+	Sink& sink;
+	std::vector<u8> buf;
+	bool ok;
+	u64 total;
+};
+
+static inline u64 zigzag(i64 v) {
+	return ((u64) v << 1) ^ (u64) (v >> 63);
+}
+
+static inline i64 unzigzag(u64 v) {
+	return (i64) (v >> 1) ^ -(i64) (v & 1);
+}
+
+/*** The source index. ***/
+
+BinDeltaIndex::BinDeltaIndex() {
+	src = nullptr;
+	src_len = 0;
+	avg = BINDELTA_CHUNK_DEFAULT;
+	nchunks = 0;
+	table_mask = 0;
+}
+
+void BinDeltaIndex::clear(void) {
+	src = nullptr;
+	src_len = 0;
+	nchunks = 0;
+	table.clear();
+	table.shrink_to_fit();
+	table_mask = 0;
+}
+
+void BinDeltaIndex::build(const u8* data, u64 len, u32 avg_chunk, ThreadPool* pool) {
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	std::vector<u64> ends, hashes;
+
+	clear();
+	avg = 64;
+	while (avg < avg_chunk && avg < (1 << 20))
+		avg <<= 1;
+	src = data;
+	src_len = len;
+	cdc_cuts(data, len, avg, ends, tp);
+	cdc_hashes(data, ends, hashes, tp);
+	nchunks = ends.size();
+
+	u64 size = 16;
+	while (size < nchunks * 2)
+		size <<= 1;
+	table.resize((size_t) size);
+	memset(table.data(), 0, (size_t) size * sizeof(Slot));
+	table_mask = size - 1;
+	// Where a chunk occurs more than once, the first is kept.
+	for (u64 i = 0; i < nchunks; ++i) {
+		const u64 a = (i > 0 ? ends[i - 1] : 0);
+		u64 j = hashes[i] & table_mask;
+		while (table[j].len != 0 && table[j].hash != hashes[i])
+			j = (j + 1) & table_mask;
+		if (table[j].len == 0) {
+			table[j].hash = hashes[i];
+			table[j].offset = a;
+			table[j].len = (u32) (ends[i] - a);
+		}
+	}
+}
+
+const BinDeltaIndex::Slot* BinDeltaIndex::lookup(u64 hash) const {
+	if (table.empty())
+		return nullptr;
+	u64 j = hash & table_mask;
+	while (table[j].len != 0) {
+		if (table[j].hash == hash)
+			return &table[j];
+		j = (j + 1) & table_mask;
+	}
+	return nullptr;
+}
+
+template <class Sink> bool BinDeltaIndex::encode_to(const u8* tgt, u64 len, Sink& sink, BinDeltaStats* stats, ThreadPool* pool) const {
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	BinDeltaWriter<Sink> w(sink);
+	BinDeltaStats st;
+	std::vector<u64> ends, hashes;
+	u8 hdr[BINDELTA_HEADER_SIZE];
+
+	memset(&st, 0, sizeof(st));
+	memcpy(hdr, __magic_bindelta, sizeof(__magic_bindelta));
+	put_le64(hdr + 8, src_len);
+	put_le64(hdr + 16, len);
+	w.put(hdr, sizeof(hdr));
+
+	cdc_cuts(tgt, len, avg, ends, tp);
+	cdc_hashes(tgt, ends, hashes, tp);
+
+	u64 pending = 0;	// the target bytes before this are written
+	u64 last_end = 0;	// the end of the last COPY, in the source
+	u64 a = 0;
+	for (size_t i = 0; i < ends.size(); a = ends[i], ++i) {
+		if (a < pending)
+			continue;
+		const Slot* s = lookup(hashes[i]);
+		if (is_null(s))
+			continue;
+		// See how far the bytes really match (at least as far as the hash went), then grow the match back into
+		// the bytes not yet written.
+		u64 so = s->offset, to = a;
+		u64 n = common_length(src + so, tgt + to, std::min(src_len - so, len - to));
+		if (n < std::min(ends[i] - a, (u64) BD_HEAD))
+			continue;
+		while (to > pending && so > 0 && src[so - 1] == tgt[to - 1]) {
+			--so;
+			--to;
+			++n;
+		}
+
+		if (to > pending) {
+			w.put_byte(BD_ADD);
+			w.put_varint(to - pending);
+			w.put(tgt + pending, to - pending);
+			st.added += to - pending;
+			++st.nadds;
+		}
+		w.put_byte(BD_COPY);
+		w.put_varint(zigzag((i64) (so - last_end)));
+		w.put_varint(n);
+		st.copied += n;
+		++st.ncopies;
+		last_end = so + n;
+		pending = to + n;
+	}
+	if (pending < len) {
+		w.put_byte(BD_ADD);
+		w.put_varint(len - pending);
+		w.put(tgt + pending, len - pending);
+		st.added += len - pending;
+		++st.nadds;
+	}
+
+	u8 trailer[8];
+	put_le64(trailer, SpookyHash::Hash64(tgt, (size_t) len, BD_HASH_SEED));
+	w.put_byte(BD_END);
+	w.put(trailer, 8);
+	st.delta_size = w.written();
+	if (not_null(stats))
+		*stats = st;
+	return w.flush();
+}
+
+bool BinDeltaIndex::encode(const u8* tgt, u64 len, RamFile* out, BinDeltaStats* stats, ThreadPool* pool) const {
+	BinDeltaRamFileSink sink = { out };
+	return encode_to(tgt, len, sink, stats, pool);
+}
+
+bool BinDeltaIndex::encode(const u8* tgt, u64 len, std::vector<u8>& out, BinDeltaStats* stats, ThreadPool* pool) const {
+	BinDeltaVectorSink sink = { &out };
+	out.clear();
+	return encode_to(tgt, len, sink, stats, pool);
+}
+
+bool BinDeltaIndex::encode(const u8* tgt, u64 len, FILE* out, BinDeltaStats* stats, ThreadPool* pool) const {
+	BinDeltaFileSink sink = { out };
+	return encode_to(tgt, len, sink, stats, pool);
+}
+
+bool bindelta_encode(const u8* src, u64 src_len, const u8* tgt, u64 tgt_len, RamFile* out, u32 avg_chunk,
+		     BinDeltaStats* stats, ThreadPool* pool) {
+	BinDeltaIndex idx;
+	idx.build(src, src_len, avg_chunk, pool);
+	return idx.encode(tgt, tgt_len, out, stats, pool);
+}
+
+bool bindelta_encode(const u8* src, u64 src_len, const u8* tgt, u64 tgt_len, std::vector<u8>& out, u32 avg_chunk,
+		     BinDeltaStats* stats, ThreadPool* pool) {
+	BinDeltaIndex idx;
+	idx.build(src, src_len, avg_chunk, pool);
+	return idx.encode(tgt, tgt_len, out, stats, pool);
+}
+
+bool bindelta_encode(RamFile* src, RamFile* tgt, RamFile* out, u32 avg_chunk, BinDeltaStats* stats, ThreadPool* pool) {
+	return bindelta_encode(src->buffer(), src->size(), tgt->buffer(), tgt->size(), out, avg_chunk, stats, pool);
+}
+
+bool bindelta_encode(const char* src_fn, const char* tgt_fn, const char* delta_fn, u32 avg_chunk,
+		     BinDeltaStats* stats, ThreadPool* pool) {
+	RamFile src, tgt;
+	BinDeltaIndex idx;
+	FILE* f;
+	bool ret;
+
+	if (src.open(src_fn, RAMFILE_READ | RAMFILE_MMAP) || tgt.open(tgt_fn, RAMFILE_READ | RAMFILE_MMAP))
+		return false;
+	src.advise(RAMFILE_ADVISE_SEQUENTIAL);
+	tgt.advise(RAMFILE_ADVISE_SEQUENTIAL);
+	idx.build(src.buffer(), src.size(), avg_chunk, pool);
+	// COPYs come from anywhere in the source.
+	src.advise(RAMFILE_ADVISE_RANDOM);
+	f = fopen(delta_fn, "wb");
+	if (is_null(f))
+		return false;
+	ret = idx.encode(tgt.buffer(), tgt.size(), f, stats, pool);
+	if (fclose(f) != 0)
+		ret = false;
+	return ret;
+}
+
+/*** Applying deltas. ***/
+
+bool is_bindelta(const u8* delta, u64 len) {
+	return len >= BINDELTA_HEADER_SIZE && memcmp(delta, __magic_bindelta, sizeof(__magic_bindelta)) == 0;
+}
+
+bool bindelta_lengths(const u8* delta, u64 len, u64& src_len, u64& tgt_len) {
+	if (!is_bindelta(delta, len))
+		return false;
+	src_len = get_le64(delta + 8);
+	tgt_len = get_le64(delta + 16);
+	return true;
+}
+
+static bool read_varint(const u8*& p, const u8* e, u64& v) {
+	v = 0;
+	for (u32 sh = 0; sh < 64 && p < e; sh += 7) {
+		const u8 b = *p++;
+		v |= (u64) (b & 0x7f) << sh;
+		if (b < 0x80)
+			return true;
+	}
+	return false;
+}
+
+template <class Sink> static bool bindelta_apply_to(const u8* src, u64 src_len, const u8* delta, u64 delta_len, Sink& sink) {
+	u64 want_src, tgt_len, made = 0, last_end = 0, v, n;
+	const u8* p = delta + BINDELTA_HEADER_SIZE;
+	const u8* e = delta + delta_len;
+	BinDeltaWriter<Sink> w(sink);
+	SpookyHash h;
+
+	if (!bindelta_lengths(delta, delta_len, want_src, tgt_len) || want_src != src_len)
+		return false;
+	h.Init(BD_HASH_SEED, BD_HASH_SEED);
+	while (p < e) {
+		switch (*p++) {
+		case BD_COPY:
+			{
+			if (!read_varint(p, e, v) || !read_varint(p, e, n))
+				return false;
+			const u64 off = last_end + (u64) unzigzag(v);
+			if (off > src_len || n > src_len - off || n > tgt_len - made)
+				return false;
+			w.put(src + off, n);
+			h.Update(src + off, (size_t) n);
+			made += n;
+			last_end = off + n;
+			}
+			break;
+		case BD_ADD:
+			if (!read_varint(p, e, n) || n > (u64) (e - p) || n > tgt_len - made)
+				return false;
+			w.put(p, n);
+			h.Update(p, (size_t) n);
+			made += n;
+			p += n;
+			break;
+		case BD_END:
+			{
+			u64 h1, h2;
+			if (e - p != 8 || made != tgt_len)
+				return false;
+			h.Final(&h1, &h2);
+			return h1 == get_le64(p) && w.flush();
+			}
+		default:
+			return false;
+		}
+	}
+	return false;
+}
+
+bool bindelta_apply(const u8* src, u64 src_len, const u8* delta, u64 delta_len, RamFile* out) {
+	BinDeltaRamFileSink sink = { out };
+	return bindelta_apply_to(src, src_len, delta, delta_len, sink);
+}
+
+bool bindelta_apply(const u8* src, u64 src_len, const u8* delta, u64 delta_len, std::vector<u8>& out) {
+	BinDeltaVectorSink sink = { &out };
+	u64 sl, tl;
+	out.clear();
+	if (bindelta_lengths(delta, delta_len, sl, tl) && tl <= delta_len + src_len)
+		out.reserve((size_t) tl);
+	return bindelta_apply_to(src, src_len, delta, delta_len, sink);
+}
+
+bool bindelta_apply(RamFile* src, RamFile* delta, RamFile* out) {
+	return bindelta_apply(src->buffer(), src->size(), delta->buffer(), delta->size(), out);
+}
+
+bool bindelta_apply(const char* src_fn, const char* delta_fn, const char* out_fn) {
+	RamFile src, delta;
+	FILE* f;
+	bool ret;
+
+	if (src.open(src_fn, RAMFILE_READ | RAMFILE_MMAP) || delta.open(delta_fn, RAMFILE_READ | RAMFILE_MMAP))
+		return false;
+	src.advise(RAMFILE_ADVISE_RANDOM);
+	delta.advise(RAMFILE_ADVISE_SEQUENTIAL);
+	f = fopen(out_fn, "wb");
+	if (is_null(f))
+		return false;
+	BinDeltaFileSink sink = { f };
+	ret = bindelta_apply_to(src.buffer(), src.size(), delta.buffer(), delta.size(), sink);
+	if (fclose(f) != 0)
+		ret = false;
+	return ret;
+}
+
+/* end bindelta.cpp */
@@ -746,4 +746,646 @@ void CsvFile::set_header(u32 col, ustring str) {
 	csv_set_header_ustr(data_, col, str);
 }
 
+/*** Streaming reader. ***/
+
+/*** read_columns() cuts the file into chunks at least this big. ***/
+#define	CSV_CHUNK_MIN	(1024 * 1024)
+
+static inline u32 csv_ctz(u64 x) {
+#ifdef CODEHAPPY_MSFT
+	return ntz(x);
+#else
+	return (u32) __builtin_ctzll(x);
+#endif
+}
+
+static inline u32 csv_popcount(u64 x) {
+#ifdef CODEHAPPY_MSFT
+	return count_bits(x);
+#else
+	return (u32) __builtin_popcountll(x);
+#endif
+}
+
+/*** Bit i of the result is the xor of bits 0 through i of x. When x marks the quotes, this marks
+	the bytes inside quotes (counting the opening quote but not the closing one.) ***/
+static inline u64 csv_prefix_xor(u64 x) {
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+/*** Bitmasks of the quotes, and of the delimiters and newlines, in 64 bytes. ***/
+static inline void csv_masks(const u8* p, u8 sep, u64& quotes, u64& structural) {
+#if defined(CODEHAPPY_AVX2)
+	const __m256i vq = _mm256_set1_epi8('\"');
+	const __m256i vs = _mm256_set1_epi8((char) sep);
+	const __m256i vn = _mm256_set1_epi8('\n');
+	__m256i a = _mm256_loadu_si256((const __m256i*) p);
+	__m256i b = _mm256_loadu_si256((const __m256i*) (p + 32));
+	quotes = (u64) (u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, vq))
+		| ((u64) (u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, vq)) << 32);
+	structural = (u64) (u32) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(a, vs), _mm256_cmpeq_epi8(a, vn)))
+		| ((u64) (u32) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(b, vs), _mm256_cmpeq_epi8(b, vn))) << 32);
+#elif defined(CODEHAPPY_SSE2)
+	const __m128i vq = _mm_set1_epi8('\"');
+	const __m128i vs = _mm_set1_epi8((char) sep);
+	const __m128i vn = _mm_set1_epi8('\n');
+	quotes = 0;
+	structural = 0;
+	for (int e = 0; e < 4; ++e) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (p + e * 16));
+		quotes |= (u64) (u32) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vq)) << (e * 16);
+		structural |= (u64) (u32) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vs), _mm_cmpeq_epi8(v, vn))) << (e * 16);
+	}
+#else
+	quotes = 0;
+	structural = 0;
+	for (int e = 0; e < 64; ++e) {
+		if (p[e] == '\"')
+			quotes |= 1ULL << e;
+		else if (p[e] == sep || p[e] == '\n')
+			structural |= 1ULL << e;
+	}
+#endif
+}
+
+/*** The masks for the 64 bytes at pos, the last block (past end) padded out with zeroes. ***/
+static inline void csv_block_masks(const u8* buf, u64 pos, u64 end, u8 sep, u64& quotes, u64& structural) {
+	if (end - pos >= 64) {
+		csv_masks(buf + pos, sep, quotes, structural);
+	} else {
+		u8 tail[64];
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, buf + pos, end - pos);
+		csv_masks(tail, sep, quotes, structural);
+	}
+}
+
+/*** The field in [begin, end) of the buffer. ***/
+static inline CsvField csv_field(const u8* buf, u64 begin, u64 end) {
+	CsvField f;
+	const char* s = (const char*) buf + begin;
+	u64 n = end - begin;
+
+	if (n > 0 && *s == '\"') {
+		// anything between the closing quote and the delimiter is dropped; an unclosed quote runs to the end.
+		const char* e = s + n;
+		while (e > s + 1 && e[-1] != '\"')
+			--e;
+		f.data = s + 1;
+		f.len = (u32) ((e > s + 1) ? (e - s - 2) : (n - 1));
+		f.quoted = true;
+	} else {
+		f.data = s;
+		f.len = (u32) n;
+		f.quoted = false;
+	}
+	return f;
+}
+
+/*** Visit the fields and rows in [begin, end), which must start at the beginning of a row. The visitor
+	has field(begin, end), nfields() (the number of fields so far in this row), and row(next), which
+	is given the offset of the next row and returns false to stop. Returns false if the visitor stopped. ***/
+template <class V>
+static bool csv_scan(const u8* buf, u64 begin, u64 end, u8 sep, V& v) {
+	u64 field_start = begin;
+	u64 inside = 0;
+
+	for (u64 pos = begin; pos < end; pos += 64) {
+		u64 quotes, structural;
+		csv_block_masks(buf, pos, end, sep, quotes, structural);
+		const u64 in_quotes = csv_prefix_xor(quotes) ^ inside;
+		inside = 0 - (in_quotes >> 63);
+		structural &= ~in_quotes;
+		while (structural != 0) {
+			const u64 at = pos + csv_ctz(structural);
+			structural &= structural - 1;
+			v.field(field_start, at);
+			field_start = at + 1;
+			if (buf[at] == '\n' && !v.row(at + 1))
+				return false;
+		}
+	}
+
+	// the last row needn't end with a newline.
+	if (field_start < end || v.nfields() > 0) {
+		v.field(field_start, end);
+		return v.row(end);
+	}
+	return true;
+}
+
+/*** The number of quotes in [begin, end). ***/
+static u64 csv_count_quotes(const u8* buf, u64 begin, u64 end, u8 sep) {
+	u64 count = 0;
+	for (u64 pos = begin; pos < end; pos += 64) {
+		u64 quotes, structural;
+		csv_block_masks(buf, pos, end, sep, quotes, structural);
+		count += csv_popcount(quotes);
+	}
+	return count;
+}
+
+/*** The start of the first row after from, given whether from is inside quotes. ***/
+static u64 csv_next_row(const u8* buf, u64 from, u64 end, u8 sep, bool in_quotes) {
+	u64 inside = in_quotes ? ~0ULL : 0;
+
+	for (u64 pos = from; pos < end; pos += 64) {
+		u64 quotes, structural;
+		csv_block_masks(buf, pos, end, sep, quotes, structural);
+		const u64 q = csv_prefix_xor(quotes) ^ inside;
+		inside = 0 - (q >> 63);
+		structural &= ~q;
+		while (structural != 0) {
+			const u64 at = pos + csv_ctz(structural);
+			structural &= structural - 1;
+			if (buf[at] == '\n')
+				return at + 1;
+		}
+	}
+	return end;
+}
+
+/*** Collects the fields of a row for csv_scan(). ***/
+struct CsvRowBuilder {
+	CsvRowBuilder(const u8* b) : buf(b) {}
+
+	void field(u64 begin, u64 end)	{ fields.push_back(csv_field(buf, begin, end)); }
+	u32 nfields() const		{ return (u32) fields.size(); }
+
+	// Drop a CR before the newline. Returns false for a blank line, which isn't a row.
+	bool finish() {
+		CsvField& last = fields.back();
+		if (!last.quoted && last.len > 0 && last.data[last.len - 1] == '\r')
+			--last.len;
+		return !(fields.size() == 1 && last.len == 0 && !last.quoted);
+	}
+
+	const u8* buf;
+	std::vector<CsvField> fields;
+};
+
+struct CsvHeaderVisitor : CsvRowBuilder {
+	CsvHeaderVisitor(const u8* b, std::vector<std::string>* h, u64 e) : CsvRowBuilder(b), hdrs(h), end(e) {}
+
+	bool row(u64 next) {
+		bool blank = !finish();
+		if (!blank) {
+			end = next;
+			for (const auto& f : fields)
+				hdrs->push_back(f.str());
+		}
+		fields.clear();
+		return blank;
+	}
+
+	std::vector<std::string>* hdrs;
+	u64 end;
+};
+
+struct CsvCallbackVisitor : CsvRowBuilder {
+	CsvCallbackVisitor(const u8* b, CsvRowFn* f) : CsvRowBuilder(b), fn(f), rows(0) {}
+
+	bool row(u64 /*next*/) {
+		bool go = true;
+		if (finish())
+			go = (*fn)(rows++, fields.data(), (u32) fields.size());
+		fields.clear();
+		return go;
+	}
+
+	CsvRowFn* fn;
+	u64 rows;
+};
+
+/*** Column types in order of width. ***/
+static const int csv_rank_type[4] = { CSV_VOID, CSV_INT, CSV_DOUBLE, CSV_STR };
+
+static int csv_type_rank(int typ) {
+	switch (typ) {
+	case CSV_INT:
+		return 1;
+	case CSV_DOUBLE:
+		return 2;
+	case CSV_STR:
+		return 3;
+	}
+	return 0;
+}
+
+/*** read_columns() first pass: count the rows, and find the type of each column. ***/
+struct CsvTypeVisitor : CsvRowBuilder {
+	CsvTypeVisitor(const u8* b) : CsvRowBuilder(b), rows(0) {}
+
+	bool row(u64 /*next*/) {
+		if (finish()) {
+			++rows;
+			if (fields.size() > rank.size())
+				rank.resize(fields.size(), 0);
+			for (u32 e = 0; e < fields.size(); ++e)
+				rank[e] = std::max(rank[e], csv_type_rank(fields[e].type()));
+		}
+		fields.clear();
+		return true;
+	}
+
+	u64 rows;
+	std::vector<int> rank;
+};
+
+/*** read_columns() second pass: fill in the columns from row 'first' on. Strings are coded against a
+	dictionary for this chunk, and recoded against the column's once all the chunks are done. ***/
+struct CsvFillVisitor : CsvRowBuilder {
+	CsvFillVisitor(const u8* b, std::vector<CsvColumn>* c, u64 first) : CsvRowBuilder(b), cols(c), r(first),
+		lookup(c->size()), strs(c->size()) {}
+
+	bool row(u64 /*next*/) {
+		if (finish()) {
+			u32 n = (u32) std::min(fields.size(), cols->size());
+			for (u32 e = 0; e < n; ++e)
+				fill((*cols)[e], e, fields[e]);
+			++r;
+		}
+		fields.clear();
+		return true;
+	}
+
+	void fill(CsvColumn& col, u32 e, const CsvField& f) {
+		switch (col.typ) {
+		case CSV_INT:
+			if (f.to_int(col.ints[r]))
+				col.valid[r] = 1;
+			break;
+		case CSV_DOUBLE:
+			if (f.to_double(col.doubles[r]))
+				col.valid[r] = 1;
+			break;
+		case CSV_STR:
+			if (f.len > 0 || f.quoted) {
+				std::string s = f.str();
+				auto it = lookup[e].find(s);
+				if (it == lookup[e].end()) {
+					it = lookup[e].insert(std::make_pair(s, (u32) strs[e].size())).first;
+					strs[e].push_back(std::move(s));
+				}
+				col.codes[r] = it->second;
+				col.valid[r] = 1;
+			}
+			break;
+		}
+	}
+
+	std::vector<CsvColumn>* cols;
+	u64 r;
+	std::vector< std::unordered_map<std::string, u32> > lookup;
+	std::vector< std::vector<std::string> > strs;
+};
+
+std::string CsvField::str() const {
+	if (!quoted)
+		return std::string(data, len);
+
+	std::string s;
+	s.reserve(len);
+	for (u32 e = 0; e < len; ++e) {
+		s += data[e];
+		if (data[e] == '\"' && e + 1 < len && data[e + 1] == '\"')
+			++e;
+	}
+	return s;
+}
+
+/*** Helper function: trim spaces and tabs from [s, e). ***/
+static void csv_trim(const char*& s, const char*& e) {
+	while (s < e && (*s == ' ' || *s == '\t'))
+		++s;
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t'))
+		--e;
+}
+
+bool CsvField::to_int(i64& val) const {
+	const char* s = data;
+	const char* e = data + len;
+	bool neg = false;
+	u64 v = 0;
+
+	csv_trim(s, e);
+	if (s < e && (*s == '+' || *s == '-')) {
+		neg = (*s == '-');
+		++s;
+	}
+	if (s == e)
+		return false;
+
+	const u64 limit = neg ? 9223372036854775808ULL : 9223372036854775807ULL;
+	for (; s < e; ++s) {
+		if (*s < '0' || *s > '9')
+			return false;
+		u32 d = *s - '0';
+		if (v > (limit - d) / 10)
+			return false;
+		v = v * 10 + d;
+	}
+	val = neg ? (i64) (0 - v) : (i64) v;
+	return true;
+}
+
+/*** Helper function: the syntax of a number in [s, e): [sign] digits [. digits] [e [sign] digits], with
+	at least one digit before the exponent. Gives CSV_INT, CSV_DOUBLE, or CSV_STR if it isn't one. The
+	mantissa digits (up to 19 of them, ignoring the decimal point) and the power of ten come back in
+	mant and exp10, with ndigits the number of significant digits. ***/
+static int csv_number_syntax(const char* s, const char* e, u64& mant, int& exp10, int& ndigits, bool& neg) {
+	bool dot = false, digit = false;
+	int dropped = 0;
+
+	mant = 0;
+	exp10 = 0;
+	ndigits = 0;
+	neg = false;
+	if (s < e && (*s == '+' || *s == '-')) {
+		neg = (*s == '-');
+		++s;
+	}
+	for (; s < e; ++s) {
+		if (*s >= '0' && *s <= '9') {
+			digit = true;
+			if (mant == 0 && *s == '0') {
+				// leading zeroes aren't significant
+			} else if (ndigits < 19) {
+				mant = mant * 10 + (*s - '0');
+				++ndigits;
+			} else {
+				++dropped;
+			}
+			if (dot)
+				--exp10;
+			continue;
+		}
+		if (*s == '.' && !dot) {
+			dot = true;
+			continue;
+		}
+		break;
+	}
+	if (!digit)
+		return CSV_STR;
+	exp10 += dropped;
+	if (s == e)
+		return dot ? CSV_DOUBLE : CSV_INT;
+	if (*s != 'e' && *s != 'E')
+		return CSV_STR;
+
+	bool eneg = false;
+	int ev = 0;
+	++s;
+	if (s < e && (*s == '+' || *s == '-')) {
+		eneg = (*s == '-');
+		++s;
+	}
+	if (s == e)
+		return CSV_STR;
+	for (; s < e; ++s) {
+		if (*s < '0' || *s > '9')
+			return CSV_STR;
+		if (ev < 100000)
+			ev = ev * 10 + (*s - '0');
+	}
+	exp10 += eneg ? -ev : ev;
+	return CSV_DOUBLE;
+}
+
+bool CsvField::to_double(double& val) const {
+	static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+					1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+	const char* s = data;
+	const char* e = data + len;
+	u64 mant;
+	int exp10, ndigits;
+	bool neg;
+
+	csv_trim(s, e);
+	if (csv_number_syntax(s, e, mant, exp10, ndigits, neg) == CSV_STR)
+		return false;
+
+	// A mantissa that fits in a double's 53 bits times or divided by an exact power of ten is correctly
+	// rounded; anything else goes to strtod().
+	if (mant < (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+		val = (exp10 < 0) ? (double) mant / pow10[-exp10] : (double) mant * pow10[exp10];
+		if (neg)
+			val = -val;
+		return true;
+	}
+
+	char tmp[64];
+	char* endp;
+	if (e - s >= (i64) sizeof(tmp))
+		return false;
+	memcpy(tmp, s, e - s);
+	tmp[e - s] = 0;
+	val = strtod(tmp, &endp);
+	return endp == tmp + (e - s);
+}
+
+int CsvField::type() const {
+	const char* s = data;
+	const char* e = data + len;
+	u64 mant;
+	int exp10, ndigits, typ;
+	bool neg;
+
+	if (quoted)
+		return CSV_STR;
+	csv_trim(s, e);
+	if (s == e)
+		return CSV_VOID;
+	typ = csv_number_syntax(s, e, mant, exp10, ndigits, neg);
+	if (typ == CSV_INT && ndigits >= 19) {
+		// integers too big for an i64 are read as doubles.
+		i64 i;
+		if (!to_int(i))
+			typ = CSV_DOUBLE;
+	}
+	return typ;
+}
+
+CsvReader::CsvReader() {
+	buf = nullptr;
+	len = 0;
+	body = 0;
+	sep = ',';
+}
+
+CsvReader::~CsvReader() {
+	close();
+}
+
+int CsvReader::open(const char* filename, bool has_headers) {
+	close();
+	if (rf.open(filename, RAMFILE_READONLY | RAMFILE_MMAP))
+		return 1;
+	buf = rf.buffer();
+	len = rf.size();
+	read_headers(has_headers);
+	return 0;
+}
+
+int CsvReader::open(const std::string& filename, bool has_headers) {
+	return open(filename.c_str(), has_headers);
+}
+
+void CsvReader::open(const char* data, u64 dlen, bool has_headers) {
+	close();
+	buf = (const u8*) data;
+	len = dlen;
+	read_headers(has_headers);
+}
+
+void CsvReader::close(void) {
+	rf.close();
+	buf = nullptr;
+	len = 0;
+	body = 0;
+	hdrs.clear();
+}
+
+void CsvReader::read_headers(bool has_headers) {
+	body = 0;
+	if (len >= 3 && buf[0] == 0xEF && buf[1] == 0xBB && buf[2] == 0xBF)
+		body = 3;	// UTF-8 byte order mark
+	if (!has_headers || is_null(buf))
+		return;
+
+	CsvHeaderVisitor hv(buf, &hdrs, len);
+	csv_scan(buf, body, len, (u8) sep, hv);
+	body = hv.end;
+}
+
+u64 CsvReader::for_each_row(CsvRowFn fn) {
+	if (is_null(buf))
+		return 0;
+	CsvCallbackVisitor cv(buf, &fn);
+	csv_scan(buf, body, len, (u8) sep, cv);
+	return cv.rows;
+}
+
+u64 CsvReader::read_columns(std::vector<CsvColumn>& cols, ThreadPool* pool) {
+	ThreadPool& tp = pool ? *pool : ThreadPool::shared();
+	const u64 data_len = len - body;
+	const u8 sp = (u8) sep;
+	u64 nchunks = data_len / CSV_CHUNK_MIN;
+
+	cols.clear();
+	nchunks = std::max(std::min(nchunks, (u64) tp.size() * 4), (u64) 1);
+
+	// Find where the rows start near each chunk boundary. A boundary is inside quotes if there's an odd
+	// number of quotes before it, so count each chunk's quotes (in parallel), then find the first newline
+	// outside quotes after each boundary (also in parallel.)
+	std::vector<u64> nominal(nchunks + 1), nquotes(nchunks), start(nchunks + 1);
+	for (u64 e = 0; e <= nchunks; ++e)
+		nominal[e] = body + data_len * e / nchunks;
+	tp.parallel_for(0, (i64) nchunks, [&](i64 c0, i64 c1) {
+		for (i64 c = c0; c < c1; ++c)
+			nquotes[c] = csv_count_quotes(buf, nominal[c], nominal[c + 1], sp);
+	});
+	std::vector<u8> in_quotes(nchunks);
+	u64 parity = 0;
+	for (u64 e = 0; e < nchunks; ++e) {
+		in_quotes[e] = (u8) (parity & 1);
+		parity += nquotes[e];
+	}
+	start[0] = body;
+	start[nchunks] = len;
+	tp.parallel_for(1, (i64) nchunks, [&](i64 c0, i64 c1) {
+		for (i64 c = c0; c < c1; ++c)
+			start[c] = csv_next_row(buf, nominal[c], len, sp, in_quotes[c] != 0);
+	});
+	for (u64 e = 1; e <= nchunks; ++e)
+		start[e] = std::max(start[e], start[e - 1]);
+
+	// First pass: the rows in each chunk, and the column types.
+	std::vector<CsvTypeVisitor> tv(nchunks, CsvTypeVisitor(buf));
+	tp.parallel_for(0, (i64) nchunks, [&](i64 c0, i64 c1) {
+		for (i64 c = c0; c < c1; ++c)
+			csv_scan(buf, start[c], start[c + 1], sp, tv[c]);
+	});
+
+	std::vector<u64> first_row(nchunks + 1, 0);
+	std::vector<int> rank;
+	for (u64 e = 0; e < nchunks; ++e) {
+		first_row[e + 1] = first_row[e] + tv[e].rows;
+		if (tv[e].rank.size() > rank.size())
+			rank.resize(tv[e].rank.size(), 0);
+		for (u32 f = 0; f < tv[e].rank.size(); ++f)
+			rank[f] = std::max(rank[f], tv[e].rank[f]);
+	}
+	const u64 nrows = first_row[nchunks];
+	const u32 ncols = hdrs.empty() ? (u32) rank.size() : (u32) hdrs.size();
+	rank.resize(ncols, 0);
+
+	cols.resize(ncols);
+	for (u32 f = 0; f < ncols; ++f) {
+		CsvColumn& col = cols[f];
+		if (f < hdrs.size())
+			col.name = hdrs[f];
+		col.typ = csv_rank_type[rank[f]];
+		col.valid.assign(nrows, 0);
+		switch (col.typ) {
+		case CSV_INT:
+			col.ints.assign(nrows, 0);
+			break;
+		case CSV_DOUBLE:
+			col.doubles.assign(nrows, 0.);
+			break;
+		case CSV_STR:
+			col.codes.assign(nrows, 0);
+			break;
+		}
+	}
+
+	// Second pass: fill in the values. Each chunk writes its own rows.
+	std::vector<CsvFillVisitor*> fv(nchunks);
+	for (u64 e = 0; e < nchunks; ++e)
+		fv[e] = new CsvFillVisitor(buf, &cols, first_row[e]);
+	tp.parallel_for(0, (i64) nchunks, [&](i64 c0, i64 c1) {
+		for (i64 c = c0; c < c1; ++c)
+			csv_scan(buf, start[c], start[c + 1], sp, *fv[c]);
+	});
+
+	// Merge the chunks' string dictionaries, then recode.
+	for (u32 f = 0; f < ncols; ++f) {
+		CsvColumn& col = cols[f];
+		if (col.typ != CSV_STR)
+			continue;
+
+		std::unordered_map<std::string, u32> lookup;
+		std::vector< std::vector<u32> > recode(nchunks);
+		for (u64 e = 0; e < nchunks; ++e) {
+			for (const auto& s : fv[e]->strs[f]) {
+				auto it = lookup.find(s);
+				if (it == lookup.end()) {
+					it = lookup.insert(std::make_pair(s, (u32) col.dict.size())).first;
+					col.dict.push_back(s);
+				}
+				recode[e].push_back(it->second);
+			}
+		}
+		tp.parallel_for(0, (i64) nchunks, [&](i64 c0, i64 c1) {
+			for (i64 c = c0; c < c1; ++c)
+				for (u64 r = first_row[c]; r < first_row[c + 1]; ++r)
+					if (col.valid[r])
+						col.codes[r] = recode[c][col.codes[r]];
+		});
+	}
+
+	for (u64 e = 0; e < nchunks; ++e)
+		delete fv[e];
+
+	return nrows;
+}
+
 /*** end __csv.c ***/
@@ -4,6 +4,12 @@
 
 	An entropy encoder/compressor.
 
+	The Huffman-style coder encodes from a table of per-symbol codes and decodes through a lookup table
+	that gives several whole symbols per probe; the format is the same as it has always been, and the
+	original bit-at-a-time decoder is kept as entropy_decompress_membuf_reference().
+
+	The rANS coder (rans_*) interleaves 4 or 8 coder states, with a static or an adaptive order-0 model.
+
 	Copyright (c) 2014-2022 C. M. Street
 
 ***/
@@ -119,50 +125,73 @@ static void print_tree(const treenode* tn, int lvl) {
 	print_tree(tn->right, lvl + 1);
 }
 
-static u32 start_from_c(int c, freqsymbol* symbs, u32 ns) {
-	u32 i;
-	// TODO: should be a lookup table built for this
-	for (i = 0; i < ns; ++i) {
-		if (symbs[i].symbol_idx == c)
-			return(symbs[i].start);
+/*** MSB-first bit output to a byte vector: the same bit order as bitfile_writebit(). ***/
+struct HuffBitWriter {
+	HuffBitWriter(std::vector<u8>& o) : out(o), acc(0), nbits(0) {}
+
+	// Write the low len bits of v (len <= 48), most significant first.
+	void put(u64 v, u32 len) {
+		acc = (acc << len) | v;
+		nbits += len;
+		while (nbits >= 8) {
+			nbits -= 8;
+			out.push_back(u8(acc >> nbits));
 		}
-//	check_or_die_msg(0, "error\n");
-	exit(1);
-	return(0xfffffffful);
-}
+	}
 
-static void output_entropy_code(int c, freqsymbol* symbs, u32 ns, treenode* tree, bitfile* bf) {
-	u32 start = start_from_c(c, symbs, ns);
+	// Pad out the last byte with zeroes.
+	void flush() {
+		if (nbits > 0)
+			out.push_back(u8(acc << (8 - nbits)));
+		nbits = 0;
+	}
 
-	forever
-		{
-		if (is_null(tree->left) && is_null(tree->right))
-			return;
-		if (not_null(tree->left) && start <= tree->left->hbound)
-			{
-			tree = tree->left;
-			bitfile_writebit(bf, false);
-			}
-		else
-			{
-			tree = tree->right;
-			bitfile_writebit(bf, true);
-//			check_or_die_msg(not_null(tree), "unexpected node\n");
-			}
+	std::vector<u8>& out;
+	u64 acc;
+	u32 nbits;
+};
+
+/*** MSB-first bit input from a byte buffer. Reading past the end gives zero bits. ***/
+struct HuffBitReader {
+	HuffBitReader(const u8* b, const u8* e) : p(b), pe(e), bits(0), nbits(0) {}
+
+	// Make sure there are at least 57 bits buffered.
+	void refill() {
+		while (nbits <= 56) {
+			u64 byte = (p < pe) ? *p++ : 0;
+			bits |= byte << (56 - nbits);
+			nbits += 8;
 		}
-}
+	}
+
+	// The next n bits (0 < n <= 32) without consuming them; call refill() first.
+	u32 peek(u32 n) const	{ return u32(bits >> (64 - n)); }
+	void skip(u32 n)	{ bits <<= n; nbits -= n; }
 
-static void tree_to_disk(const treenode* node, bitfile* bf) {
+	u32 get(u32 n) {
+		refill();
+		u32 v = peek(n);
+		skip(n);
+		return v;
+	}
+
+	const u8* p;
+	const u8* pe;
+	u64 bits;
+	u32 nbits;
+};
+
+static void tree_to_disk(const treenode* node, HuffBitWriter& bw) {
 	if (is_null(node->left) && is_null(node->right))
 		{
-		bitfile_writebit(bf, false);
-		bitfile_writebyte(bf, node->symbol_idx);
+		bw.put(0, 1);
+		bw.put(node->symbol_idx & 0xff, 8);
 		return;
 		}
 
-	bitfile_writebit(bf, true);
-	tree_to_disk(node->left, bf);
-	tree_to_disk(node->right, bf);
+	bw.put(1, 1);
+	tree_to_disk(node->left, bw);
+	tree_to_disk(node->right, bw);
 }
 
 static void tree_from_disk(treenode* node, bitfile* bf) {
@@ -192,20 +221,18 @@ static void free_tree(treenode* node) {
 	delete node;
 }
 
-static void entropy_encode_1(RamFile* file_in, bitfile* file_out, freqsymbol* symbs, treenode* tree)
-{
-	bitfile_write32(file_out, file_in->length());
-	tree_to_disk(tree, file_out);
-
-	forever {
-		int c;
-
-		c = file_in->getc();
-		if (c < 0)			/* EOF */
-			break;
+/*** The code for each symbol is its path from the root, 0 for left. The frequency tree halves the range of
+     starts at each level, so codes are at most 33 bits. ***/
+static void tree_codes(const treenode* node, u64 code, u32 len, u64* codes, u32* lens) {
+	if (is_null(node->left) && is_null(node->right))
+		{
+		codes[node->symbol_idx & 0xff] = code;
+		lens[node->symbol_idx & 0xff] = len;
+		return;
+		}
 
-		output_entropy_code(c, symbs, 256, tree, file_out);
-	}
+	tree_codes(node->left, code << 1, len + 1, codes, lens);
+	tree_codes(node->right, (code << 1) | 1, len + 1, codes, lens);
 }
 
 static int comp_freqsymbol(const void* v1, const void* v2) {
@@ -282,12 +309,25 @@ static void output_symbol_freq(const char* fname, freqsymbol* sym, u32 ns) {
 	fclose(f);
 }
 
-static void do_entropy_encoding(RamFile* file_in, bitfile* file_out, freqsymbol* sym, u32 ns) {
+/*** Encode a buffer: the length, the tree, then the code for each byte. An empty buffer encodes to nothing. ***/
+static void do_entropy_encoding(const u8* data, u32 len, std::vector<u8>& out) {
+	freqsymbol sym[256];
+	u64 codes[256];
+	u32 lens[256];
 	treenode* treetop;
 	u32 last_symbol;
+	u32 e;
+
+	out.clear();
+	init_symbols(sym, 256);
+	for (e = 0; e < len; ++e)
+		sym[data[e]].freq++;
+	total_symbols(sym, 256);
+	qsort(sym, 256, sizeof(freqsymbol), comp_freqsymbol);
+	start_symbols(sym, 256);
 
 	/*** eliminate symbols that have 0 frequency ***/
-	for (last_symbol = ns - 1; ; --last_symbol) {
+	for (last_symbol = 255; ; --last_symbol) {
 		if (sym[last_symbol].freq > 0)
 			break;
 		if (last_symbol == 0)
@@ -299,21 +339,172 @@ static void do_entropy_encoding(RamFile* file_in, bitfile* file_out, freqsymbol*
 #if 0
 	print_tree(treetop, 0);
 	printf("\n");
-	print_all_tree_codings(treetop, sym, ns);
+	print_all_tree_codings(treetop, sym, 256);
 	printf("\n");
 #endif
 
-	entropy_encode_1(file_in, file_out, sym, treetop);
+	tree_codes(treetop, 0, 0, codes, lens);
+
+	HuffBitWriter bw(out);
+	u64 nbits = 32;
+	for (e = 0; e < 256; ++e)
+		nbits += (u64) sym[e].freq * lens[sym[e].symbol_idx];
+	out.reserve(nbits / 8 + 600);
+
+	for (e = 0; e < 4; ++e)
+		bw.put((len >> (e * 8)) & 0xff, 8);
+	tree_to_disk(treetop, bw);
+	for (e = 0; e < len; ++e)
+		bw.put(codes[data[e]], lens[data[e]]);
+	bw.flush();
 
 	free_tree(treetop);
 }
 
+/*** Table-driven decoding. The tree is flattened into an array of nodes, and every HUFF_TABLE_BITS-bit prefix of
+     the input gets a table entry: the (up to HUFF_MULTI) whole symbols it decodes to and how many bits they take,
+     or, for the rare code longer than the table, the node to carry on walking the tree from. ***/
+#define	HUFF_TABLE_BITS		11
+#define	HUFF_MULTI		3
+#define	HUFF_MAX_NODES		511
+
+struct HuffNode {
+	i16 child[2];		// -1 for a leaf
+	u8 symbol;
+};
+
+struct HuffEntry {
+	u8 sym[HUFF_MULTI];
+	u8 nsym;		// 0 if the first code is longer than HUFF_TABLE_BITS
+	u8 nbits;
+	u8 pad;
+	u16 node;		// where to continue from, if nsym == 0
+};
+
+static int huff_read_tree(HuffBitReader& br, std::vector<HuffNode>& nodes, u32 depth) {
+	if (nodes.size() >= HUFF_MAX_NODES || depth > 64)
+		return -1;	// corrupt
+
+	int idx = (int) nodes.size();
+	HuffNode hn;
+	hn.child[0] = hn.child[1] = -1;
+	hn.symbol = 0;
+	nodes.push_back(hn);
+
+	if (br.get(1)) {
+		int l = huff_read_tree(br, nodes, depth + 1);
+		if (l < 0)
+			return -1;
+		int r = huff_read_tree(br, nodes, depth + 1);
+		if (r < 0)
+			return -1;
+		nodes[idx].child[0] = (i16) l;
+		nodes[idx].child[1] = (i16) r;
+	} else {
+		nodes[idx].symbol = (u8) br.get(8);
+	}
+	return idx;
+}
+
+static void huff_build_table(const std::vector<HuffNode>& nodes, HuffEntry* table) {
+	const u32 nent = 1 << HUFF_TABLE_BITS;
+
+	for (u32 prefix = 0; prefix < nent; ++prefix) {
+		HuffEntry& he = table[prefix];
+		u32 node = 0, used = 0, complete = 0;
+
+		he.nsym = 0;
+		he.pad = 0;
+		for (u32 b = 0; b < HUFF_TABLE_BITS; ++b) {
+			node = nodes[node].child[(prefix >> (HUFF_TABLE_BITS - 1 - b)) & 1];
+			++used;
+			if (nodes[node].child[0] < 0) {
+				he.sym[he.nsym++] = nodes[node].symbol;
+				complete = used;
+				node = 0;
+				if (he.nsym == HUFF_MULTI)
+					break;
+			}
+		}
+		if (he.nsym > 0) {
+			he.nbits = (u8) complete;
+			he.node = 0;
+		} else {
+			he.nbits = HUFF_TABLE_BITS;
+			he.node = (u16) node;
+		}
+	}
+}
+
+/*** Decode a whole buffer (length, tree, codes) into out. Returns false if it's corrupt. ***/
+static bool huff_decode_buffer(const u8* in, u64 in_len, std::vector<u8>& out) {
+	out.clear();
+	if (in_len < 4)
+		return in_len == 0;	// an empty buffer encodes to nothing
+
+	HuffBitReader br(in, in + in_len);
+	u32 file_len = 0;
+	for (u32 e = 0; e < 4; ++e)
+		file_len |= br.get(8) << (e * 8);
+
+	std::vector<HuffNode> nodes;
+	nodes.reserve(HUFF_MAX_NODES);
+	if (huff_read_tree(br, nodes, 0) < 0)
+		return false;
+	// each symbol takes at least one bit (or there's only one symbol); this catches a garbage length.
+	if (nodes.size() > 1 && file_len > (in_len + 1) * 8)
+		return false;
+
+	out.resize(file_len);
+	u8* op = out.data();
+	u8* oe = op + file_len;
+
+	if (nodes.size() == 1) {
+		// a single symbol, coded in zero bits.
+		memset(op, nodes[0].symbol, file_len);
+		return true;
+	}
+
+	std::vector<HuffEntry> table(1 << HUFF_TABLE_BITS);
+	huff_build_table(nodes, table.data());
+	const HuffEntry* tab = table.data();
+	const HuffNode* nd = nodes.data();
+
+	// the fast loop writes HUFF_MULTI bytes at a time, so stop short of the end.
+	while (oe - op >= HUFF_MULTI) {
+		br.refill();
+		const HuffEntry& he = tab[br.peek(HUFF_TABLE_BITS)];
+		if (he.nsym > 0) {
+			op[0] = he.sym[0];
+			op[1] = he.sym[1];
+			op[2] = he.sym[2];
+			op += he.nsym;
+			br.skip(he.nbits);
+		} else {
+			u32 node = he.node;
+			br.skip(HUFF_TABLE_BITS);
+			while (nd[node].child[0] >= 0)
+				node = nd[node].child[br.get(1)];
+			*op++ = nd[node].symbol;
+		}
+	}
+	while (op < oe) {
+		u32 node = 0;
+		while (nd[node].child[0] >= 0)
+			node = nd[node].child[br.get(1)];
+		*op++ = nd[node].symbol;
+	}
+
+	return true;
+}
+
+/*** The original decoder: walk the tree one bit at a time. ***/
 static void do_entropy_decoding(bitfile* file_in, RamFile* file_out, u32 file_len) {
 	treenode* treetop = new_treenode();
 	
 	tree_from_disk(treetop, file_in);
 
-	do {
+	while (file_len > 0) {
 		treenode* node;
 
 		node = treetop;
@@ -331,88 +522,92 @@ static void do_entropy_decoding(bitfile* file_in, RamFile* file_out, u32 file_le
 
 		file_out->putc(node->symbol_idx);
 		--file_len;
-	} while (file_len > 0);
+	}
 
 	free_tree(treetop);
 }
 
+/*** Write a buffer out to a file, replacing it. ***/
+static bool entropy_write_file(const char* fname, const u8* data, u64 len) {
+	FILE* f = fopen(fname, "wb");
+	NOT_NULL_OR_RETURN(f, false);
+	bool ret = (len == 0 || fwrite(data, 1, len, f) == len);
+	fclose(f);
+	return ret;
+}
+
 void entropy_compress_file(const char* fname_in, const char* fname_out) {
 	RamFile rf;
-	bitfile bf;
-	freqsymbol* sym;
-
-	rf.open(fname_in, RAMFILE_DEFAULT);
-	bitfile_open(&bf, fname_out, true);
-
-	sym = compile_symbol_freq_1(&rf);
-	do_entropy_encoding(&rf, &bf, sym, 256);
-
-	delete sym;
+	std::vector<u8> out;
 
+	rf.open(fname_in, RAMFILE_READONLY | RAMFILE_MMAP);
+	do_entropy_encoding(rf.buffer(), (u32) rf.size(), out);
 	rf.close();
-	bitfile_close(&bf);
+
+	entropy_write_file(fname_out, out.data(), out.size());
 }
 
 /*** Output buffer must be allocated and passed in. Returns TRUE if compression was successful (fits inside
 	the output buffer), FALSE otherwise. ***/
 bool entropy_compress_membuf(char* buf_in, u32 input_len, char* buf_out, u32 output_len, u32* compress_len) {
-	RamFile rf;
-	bitfile bf;
-	freqsymbol* sym;
+	std::vector<u8> out;
+	u32 clen;
 	bool ret;
 
-	rf.open_static(buf_in, input_len, RAMFILE_DEFAULT);
-	bitfile_open_mem(&bf, buf_out, output_len, true);
-
-	sym = compile_symbol_freq_1(&rf);
-	do_entropy_encoding(&rf, &bf, sym, 256);
+	do_entropy_encoding((const u8*) buf_in, input_len, out);
 
-	delete sym;
-
-	ret = (bf.buf < bf.bufe);
-
-	rf.close();
-	bitfile_close(&bf);
+	ret = (out.size() < output_len);
+	clen = (u32) std::min(out.size(), (size_t) output_len);
+	if (clen > 0)
+		memcpy(buf_out, out.data(), clen);
 
 	if (not_null(compress_len))
-		*compress_len = bf.buf - bf.bufs;
+		*compress_len = clen;
 
 	return(ret);
 }
 
 void entropy_decompress_file(const char* fname_in, const char* fname_out) {
 	RamFile rf;
-	bitfile bf;
-	freqsymbol* sym;
-	u32 file_len;
-
-	bitfile_open(&bf, fname_in, false);	
-	rf.open(fname_out, RAMFILE_DEFAULT);
-
-	file_len = bitfile_read32(&bf, NULL);
-	do_entropy_decoding(&bf, &rf, file_len);
+	std::vector<u8> out;
 
+	rf.open(fname_in, RAMFILE_READONLY | RAMFILE_MMAP);
+	huff_decode_buffer(rf.buffer(), rf.size(), out);
 	rf.close();
-	bitfile_close(&bf);
+
+	entropy_write_file(fname_out, out.data(), out.size());
 }
 
 void entropy_decompress_membuf(char* buf_in, u32 input_len, char** buf_out, u32* output_len) {
+	std::vector<u8> out;
+
+	huff_decode_buffer((const u8*) buf_in, input_len, out);
+	*buf_out = NEW_ARRAY(char, out.size() + 1);
+	*output_len = (u32) out.size();
+	if (!out.empty())
+		memcpy(*buf_out, out.data(), out.size());
+}
+
+void entropy_decompress_membuf_reference(char* buf_in, u32 input_len, char** buf_out, u32* output_len) {
 	RamFile rf;
 	bitfile bf;
-	u32 file_len;
+	u32 file_len = 0;
 
 //	check_or_die(not_null(buf_out) && not_null(output_len));
 
 	bitfile_open_mem(&bf, buf_in, input_len, false);
-	file_len = bitfile_read32(&bf, NULL);
+	if (input_len >= 4)
+		file_len = bitfile_read32(&bf, NULL);
 	*buf_out = NEW_ARRAY(char, file_len + 1);
 	*output_len = file_len;
-	
-	rf.open_static(*buf_out, file_len, RAMFILE_DEFAULT);
 
-	do_entropy_decoding(&bf, &rf, file_len);
+	if (file_len > 0) {
+		rf.open_static(*buf_out, file_len, RAMFILE_DEFAULT);
+		do_entropy_decoding(&bf, &rf, file_len);
+		// the RamFile owns a static buffer once it's opened on it; take it back.
+		rf.relinquish_buffer();
+	}
 
-	rf.close();
 	bitfile_close(&bf);
 }
 
@@ -499,4 +694,463 @@ bool entropy_decompress_file_full(const char* fname_in, const char* fname_out) {
 	return true;
 }
 
+/*** rANS. Each state is a u32 kept in [RANS_L, RANS_L << 8), renormalized a byte at a time; probabilities are
+     RANS_SCALE_BITS-bit. The encoder runs backwards through a block, symbol i going to state i % ways, then
+     writes the final states; the decoder runs forwards, and the independent states let the CPU overlap their
+     decode chains.
+
+     The format: a RANS_HEADER_SIZE-byte header (magic, version, model, ways, uncompressed length as a u64); for
+     the static model, the frequency table (a 32-byte bitmap of the symbols present, then a u16 frequency for each
+     of them); then blocks of up to RANS_BLOCK symbols, each a u32 length, the initial states, and the bytes. ***/
+#define	RANS_SCALE_BITS		12
+#define	RANS_SCALE		(1 << RANS_SCALE_BITS)
+#define	RANS_L			(1u << 23)
+#define	RANS_BLOCK		(256 * 1024)
+#define	RANS_HEADER_SIZE	16
+#define	RANS_VERSION		1
+#define	RANS_MAX_WAYS		8
+
+/*** The adaptive model bumps a symbol's count by RANS_ADAPT_INC each time it's seen, rebuilds its frequency table
+     every RANS_ADAPT_INTERVAL symbols, and halves its counts when they total more than RANS_ADAPT_LIMIT, so it
+     forgets old statistics. ***/
+#define	RANS_ADAPT_INC		24
+#define	RANS_ADAPT_INTERVAL	4096
+#define	RANS_ADAPT_LIMIT	(1 << 16)
+
+static const u8 rans_magic[4] = { 'r', 'A', 'N', 'S' };
+
+/*** For decoding, each slot has its symbol (bits 24-31), frequency - 1 (bits 0-11), and its offset from the
+     symbol's start (bits 12-23), so a decode step is one table lookup. ***/
+struct RansTables {
+	u16 freq[256];
+	u16 start[256];
+	u32 slot[RANS_SCALE];
+};
+
+/*** Scale counts to frequencies summing to RANS_SCALE, keeping every symbol that occurs at frequency >= 1. ***/
+static void rans_normalize(const u64* counts, u16* freq) {
+	u64 total = 0;
+	u32 sum = 0;
+	int maxs = -1;
+
+	for (u32 s = 0; s < 256; ++s)
+		total += counts[s];
+	for (u32 s = 0; s < 256; ++s) {
+		freq[s] = 0;
+		if (counts[s] == 0)
+			continue;
+		u32 f = (u32) ((counts[s] * RANS_SCALE) / total);
+		if (f == 0)
+			f = 1;
+		freq[s] = (u16) f;
+		sum += f;
+		if (maxs < 0 || counts[s] > counts[maxs])
+			maxs = s;
+	}
+	if (maxs < 0)
+		return;
+
+	// rounding down leaves us short (give it to the commonest symbol); rounding the rare symbols up to 1 can
+	// leave us over (take it from the biggest frequencies, a bit at a time.)
+	if (sum < RANS_SCALE)
+		freq[maxs] += RANS_SCALE - sum;
+	while (sum > RANS_SCALE) {
+		u32 big = 0;
+		for (u32 s = 1; s < 256; ++s)
+			if (freq[s] > freq[big])
+				big = s;
+		u32 take = std::min(sum - RANS_SCALE, (u32) freq[big] / 2);
+		freq[big] -= (u16) take;
+		sum -= take;
+	}
+}
+
+static void rans_build_tables(RansTables& t, bool decode) {
+	u32 cum = 0;
+	for (u32 s = 0; s < 256; ++s) {
+		t.start[s] = (u16) cum;
+		if (decode) {
+			for (u32 k = 0; k < t.freq[s]; ++k)
+				t.slot[cum + k] = (t.freq[s] - 1) | (k << 12) | (s << 24);
+		}
+		cum += t.freq[s];
+	}
+}
+
+/*** The adaptive model; the encoder and decoder update theirs identically. ***/
+struct RansAdaptive {
+	void init(bool dec) {
+		decode = dec;
+		for (u32 s = 0; s < 256; ++s)
+			counts[s] = 1;
+		total = 256;
+		since = 0;
+		rebuild();
+	}
+
+	void rebuild() {
+		rans_normalize(counts, t.freq);
+		rans_build_tables(t, decode);
+	}
+
+	void update(u8 s) {
+		counts[s] += RANS_ADAPT_INC;
+		total += RANS_ADAPT_INC;
+		if (++since < RANS_ADAPT_INTERVAL)
+			return;
+		since = 0;
+		if (total > RANS_ADAPT_LIMIT) {
+			total = 0;
+			for (u32 e = 0; e < 256; ++e) {
+				counts[e] = (counts[e] + 1) >> 1;
+				total += counts[e];
+			}
+		}
+		rebuild();
+	}
+
+	RansTables t;
+	u64 counts[256];
+	u64 total;
+	u32 since;
+	bool decode;
+};
+
+static inline u8 rans_dec_get(u32& x, const u32* slots) {
+	const u32 e = slots[x & (RANS_SCALE - 1)];
+	x = ((e & 0xfff) + 1) * (x >> RANS_SCALE_BITS) + ((e >> 12) & 0xfff);
+	return u8(e >> 24);
+}
+
+static inline void rans_enc_put(u32& x, u8*& p, u32 start, u32 freq) {
+	const u32 x_max = ((RANS_L >> RANS_SCALE_BITS) << 8) * freq;
+	while (x >= x_max) {
+		*--p = u8(x);
+		x >>= 8;
+	}
+	x = ((x / freq) << RANS_SCALE_BITS) + (x % freq) + start;
+}
+
+/*** Encode a block. With per_pos, start[] and freq[] are given for each position (the adaptive model); otherwise
+     they're indexed by symbol. Each symbol puts out at most two bytes. ***/
+static void rans_encode_block(const u8* data, u32 n, const u16* start, const u16* freq, bool per_pos, u32 ways,
+				std::vector<u8>& out) {
+	std::vector<u8> buf((size_t) n * 2 + 4 * RANS_MAX_WAYS + 16);
+	u8* end = buf.data() + buf.size();
+	u8* p = end;
+	u32 x[RANS_MAX_WAYS];
+
+	for (u32 w = 0; w < ways; ++w)
+		x[w] = RANS_L;
+	for (u32 i = n; i-- > 0; ) {
+		u32 idx = per_pos ? i : data[i];
+		rans_enc_put(x[i & (ways - 1)], p, start[idx], freq[idx]);
+	}
+	for (u32 w = ways; w-- > 0; ) {
+		p -= 4;
+		put_le32(p, x[w]);
+	}
+
+	out.resize(4 + (end - p));
+	put_le32(out.data(), (u32) (end - p));
+	memcpy(out.data() + 4, p, end - p);
+}
+
+/*** Decode a block with the static model. Returns false if it's corrupt. ***/
+template <u32 WAYS>
+static bool rans_decode_block_static(const u8* p, const u8* pe, u8* out, u32 n, const RansTables& t) {
+	const u32* slots = t.slot;
+	u32 x[WAYS];
+	u32 i = 0;
+
+	if (pe - p < 4 * (i64) WAYS)
+		return false;
+	for (u32 w = 0; w < WAYS; ++w, p += 4) {
+		x[w] = get_le32(p);
+		if (x[w] < RANS_L)
+			return false;
+	}
+
+	// a state that starts at or above RANS_L never needs more than two bytes per symbol, so while there are
+	// enough bytes left for a full round, there's no need to check for the end.
+	for (; i + WAYS <= n && pe - p >= 2 * (i64) WAYS; i += WAYS) {
+		for (u32 w = 0; w < WAYS; ++w) {
+			out[i + w] = rans_dec_get(x[w], slots);
+			while (x[w] < RANS_L)
+				x[w] = (x[w] << 8) | *p++;
+		}
+	}
+	for (; i < n; ++i) {
+		u32& xs = x[i & (WAYS - 1)];
+		out[i] = rans_dec_get(xs, slots);
+		while (xs < RANS_L) {
+			if (p >= pe)
+				return false;
+			xs = (xs << 8) | *p++;
+		}
+	}
+
+	// the encoder started every state at RANS_L, so that's where they end up.
+	for (u32 w = 0; w < WAYS; ++w)
+		if (x[w] != RANS_L)
+			return false;
+	return p == pe;
+}
+
+/*** Decode a block with the adaptive model, updating it as we go. ***/
+static bool rans_decode_block_adaptive(const u8* p, const u8* pe, u8* out, u32 n, u32 ways, RansAdaptive& model) {
+	u32 x[RANS_MAX_WAYS];
+
+	if (pe - p < 4 * (i64) ways)
+		return false;
+	for (u32 w = 0; w < ways; ++w, p += 4) {
+		x[w] = get_le32(p);
+		if (x[w] < RANS_L)
+			return false;
+	}
+
+	for (u32 i = 0; i < n; ++i) {
+		u32& xs = x[i & (ways - 1)];
+		const u8 s = rans_dec_get(xs, model.t.slot);
+		while (xs < RANS_L) {
+			if (p >= pe)
+				return false;
+			xs = (xs << 8) | *p++;
+		}
+		out[i] = s;
+		model.update(s);
+	}
+
+	for (u32 w = 0; w < ways; ++w)
+		if (x[w] != RANS_L)
+			return false;
+	return p == pe;
+}
+
+static u32 rans_ways(u32 ways) {
+	return (ways >= 8) ? 8 : 4;
+}
+
+void rans_compress(const u8* data, u64 len, std::vector<u8>& out, RansModel model, u32 ways, ThreadPool* pool) {
+	const u64 nblocks = (len + RANS_BLOCK - 1) / RANS_BLOCK;
+	std::vector< std::vector<u8> > blocks(nblocks);
+
+	ways = rans_ways(ways);
+	out.resize(RANS_HEADER_SIZE);
+	memcpy(out.data(), rans_magic, 4);
+	out[4] = RANS_VERSION;
+	out[5] = (u8) model;
+	out[6] = (u8) ways;
+	out[7] = 0;
+	put_le64(out.data() + 8, len);
+
+	if (model == RANS_ADAPTIVE) {
+		// the model carries over from block to block, so this is serial: a forward pass per block to find each
+		// symbol's frequency as the decoder will see it, then the backward encoding pass.
+		RansAdaptive* am = new RansAdaptive;
+		std::vector<u16> pstart(std::min(len, (u64) RANS_BLOCK)), pfreq(pstart.size());
+
+		am->init(false);
+		for (u64 b = 0; b < nblocks; ++b) {
+			const u8* src = data + b * RANS_BLOCK;
+			u32 n = (u32) std::min((u64) RANS_BLOCK, len - b * RANS_BLOCK);
+			for (u32 i = 0; i < n; ++i) {
+				pstart[i] = am->t.start[src[i]];
+				pfreq[i] = am->t.freq[src[i]];
+				am->update(src[i]);
+			}
+			rans_encode_block(src, n, pstart.data(), pfreq.data(), true, ways, blocks[b]);
+		}
+		delete am;
+	} else {
+		u64 counts[256];
+		RansTables t;
+		u8 bitmap[32];
+
+		memset(counts, 0, sizeof(counts));
+		for (u64 e = 0; e < len; ++e)
+			counts[data[e]]++;
+		rans_normalize(counts, t.freq);
+		rans_build_tables(t, false);
+
+		memset(bitmap, 0, sizeof(bitmap));
+		for (u32 s = 0; s < 256; ++s)
+			if (t.freq[s] > 0)
+				bitmap[s >> 3] |= (1 << (s & 7));
+		out.insert(out.end(), bitmap, bitmap + 32);
+		for (u32 s = 0; s < 256; ++s) {
+			if (t.freq[s] > 0) {
+				out.push_back(u8(t.freq[s]));
+				out.push_back(u8(t.freq[s] >> 8));
+			}
+		}
+
+		// with a fixed model the blocks are independent.
+		ThreadPool& tp = pool ? *pool : ThreadPool::shared();
+		tp.parallel_for(0, (i64) nblocks, [&](i64 b0, i64 b1) {
+			for (i64 b = b0; b < b1; ++b) {
+				u32 n = (u32) std::min((u64) RANS_BLOCK, len - b * RANS_BLOCK);
+				rans_encode_block(data + b * RANS_BLOCK, n, t.start, t.freq, false, ways, blocks[b]);
+			}
+		});
+	}
+
+	u64 total = out.size();
+	for (const auto& blk : blocks)
+		total += blk.size();
+	out.reserve(total);
+	for (const auto& blk : blocks)
+		out.insert(out.end(), blk.begin(), blk.end());
+}
+
+bool rans_decompress(const u8* data, u64 len, std::vector<u8>& out, ThreadPool* pool) {
+	out.clear();
+	if (len < RANS_HEADER_SIZE || memcmp(data, rans_magic, 4) != 0 || data[4] != RANS_VERSION)
+		return false;
+
+	const u32 model = data[5];
+	const u32 ways = data[6];
+	const u64 total = get_le64(data + 8);
+	const u8* p = data + RANS_HEADER_SIZE;
+	const u8* pe = data + len;
+	const u64 nblocks = (total + RANS_BLOCK - 1) / RANS_BLOCK;
+
+	if ((ways != 4 && ways != 8) || model > RANS_ADAPTIVE)
+		return false;
+	// every block is at least its length and states.
+	if (nblocks > (u64) (pe - p) / (4 + 4 * ways))
+		return false;
+
+	RansTables* t = new RansTables;
+	if (model == RANS_STATIC) {
+		if (pe - p < 32) {
+			delete t;
+			return false;
+		}
+		const u8* bitmap = p;
+		u32 sum = 0;
+		p += 32;
+		memset(t->freq, 0, sizeof(t->freq));
+		for (u32 s = 0; s < 256; ++s) {
+			if (!(bitmap[s >> 3] & (1 << (s & 7))))
+				continue;
+			if (pe - p < 2) {
+				sum = 0;
+				break;
+			}
+			t->freq[s] = u16(p[0] | (p[1] << 8));
+			sum += t->freq[s];
+			p += 2;
+		}
+		if (sum != RANS_SCALE && total > 0) {
+			delete t;
+			return false;
+		}
+		if (sum == RANS_SCALE)
+			rans_build_tables(*t, true);
+	}
+
+	// find the blocks.
+	std::vector<const u8*> bstart(nblocks), bend(nblocks);
+	for (u64 b = 0; b < nblocks; ++b) {
+		if (pe - p < 4) {
+			delete t;
+			return false;
+		}
+		u32 blen = get_le32(p);
+		p += 4;
+		if ((u64) (pe - p) < blen) {
+			delete t;
+			return false;
+		}
+		bstart[b] = p;
+		bend[b] = p + blen;
+		p += blen;
+	}
+
+	out.resize(total);
+	bool ok = true;
+	if (model == RANS_ADAPTIVE) {
+		RansAdaptive* am = new RansAdaptive;
+		am->init(true);
+		for (u64 b = 0; b < nblocks && ok; ++b) {
+			u32 n = (u32) std::min((u64) RANS_BLOCK, total - b * RANS_BLOCK);
+			ok = rans_decode_block_adaptive(bstart[b], bend[b], out.data() + b * RANS_BLOCK, n, ways, *am);
+		}
+		delete am;
+	} else {
+		std::atomic<bool> good(true);
+		ThreadPool& tp = pool ? *pool : ThreadPool::shared();
+		tp.parallel_for(0, (i64) nblocks, [&](i64 b0, i64 b1) {
+			for (i64 b = b0; b < b1; ++b) {
+				u32 n = (u32) std::min((u64) RANS_BLOCK, total - b * RANS_BLOCK);
+				u8* dest = out.data() + b * RANS_BLOCK;
+				bool r = (ways == 8) ? rans_decode_block_static<8>(bstart[b], bend[b], dest, n, *t)
+						: rans_decode_block_static<4>(bstart[b], bend[b], dest, n, *t);
+				if (!r)
+					good = false;
+			}
+		});
+		ok = good;
+	}
+	delete t;
+
+	if (!ok)
+		out.clear();
+	return ok;
+}
+
+bool rans_compress_membuf(const char* buf_in, u32 input_len, char* buf_out, u32 output_len, u32* compress_len,
+				RansModel model, u32 ways) {
+	std::vector<u8> out;
+	u32 clen;
+
+	rans_compress((const u8*) buf_in, input_len, out, model, ways);
+	clen = (u32) std::min(out.size(), (size_t) output_len);
+	if (clen > 0)
+		memcpy(buf_out, out.data(), clen);
+	if (not_null(compress_len))
+		*compress_len = clen;
+	return out.size() <= output_len;
+}
+
+bool rans_decompress_membuf(const char* buf_in, u32 input_len, char** buf_out, u32* output_len) {
+	std::vector<u8> out;
+	bool ret;
+
+	ret = rans_decompress((const u8*) buf_in, input_len, out);
+	*buf_out = NEW_ARRAY(char, out.size() + 1);
+	*output_len = (u32) out.size();
+	if (!out.empty())
+		memcpy(*buf_out, out.data(), out.size());
+	return ret;
+}
+
+bool rans_compress_file(const char* fname_in, const char* fname_out, RansModel model, u32 ways) {
+	RamFile rf;
+	std::vector<u8> out;
+
+	if (rf.open(fname_in, RAMFILE_READONLY | RAMFILE_MMAP))
+		return false;
+	rans_compress(rf.buffer(), rf.size(), out, model, ways);
+	rf.close();
+
+	return entropy_write_file(fname_out, out.data(), out.size());
+}
+
+bool rans_decompress_file(const char* fname_in, const char* fname_out) {
+	RamFile rf;
+	std::vector<u8> out;
+	bool ret;
+
+	if (rf.open(fname_in, RAMFILE_READONLY | RAMFILE_MMAP))
+		return false;
+	ret = rans_decompress(rf.buffer(), rf.size(), out);
+	rf.close();
+
+	if (!ret)
+		return false;
+	return entropy_write_file(fname_out, out.data(), out.size());
+}
+
 /* end entropy.cpp */
@@ -2490,71 +2490,13 @@ void
  *
  * See http://en.wikipedia.org/wiki/Levenshtein_distance
  * for more information.
+ *
+ * Computed with the bit-parallel edit_distance() in fuzzy.cpp.
  */
 
 unsigned int
 levenshtein(const char *a, const char *b) {
-    unsigned int length = strlen(a);
-    unsigned int bLength = strlen(b);
-    unsigned int *cache = (unsigned int *) calloc(length, sizeof(unsigned int));
-    unsigned int index = 0;
-    unsigned int bIndex = 0;
-    unsigned int distance;
-    unsigned int bDistance;
-    unsigned int result;
-    char code;
-
-    /*
-     * Shortcut optimizations / degenerate cases.
-     */
-
-    if (a == b) {
-        return 0;
-    }
-
-    if (length == 0) {
-        return bLength;
-    }
-
-    if (bLength == 0) {
-        return length;
-    }
-
-    /*
-     * initialize the vector.
-     */
-
-    while (index < length) {
-        cache[index] = index + 1;
-        index++;
-    }
-
-    /*
-     * Loop.
-     */
-
-    while (bIndex < bLength) {
-        code = b[bIndex];
-        result = distance = bIndex++;
-        index = -1;
-
-        while (++index < length) {
-            bDistance = code == a[index] ? distance : distance + 1;
-            distance = cache[index];
-
-            cache[index] = result = distance > result
-                ? bDistance > result
-                    ? result + 1
-                    : bDistance
-                : bDistance > distance
-                    ? distance + 1
-                    : bDistance;
-        }
-    }
-
-    free(cache);
-
-    return result;
+    return edit_distance(a, b);
 }
 
 /*
@@ -4461,6 +4403,8 @@ static void sb_discard(SB *sb, void **data_out, size_t *length_out) {
  */
 #define PT_LITERAL   10
 #define PT_CSI32     11
+/* Altered: PT_BINDELTA is followed by a delta from bindelta.h, for strings too different for diff_myers(). */
+#define PT_BINDELTA  12
 
 #define OP_COPY      1
 #define OP_SKIP      2
@@ -4942,8 +4886,16 @@ BDELTAcode bdelta_diff(
 	if (new_size == 0)
 		goto emit_new_literally;
 	
-	if (diff_myers((const char*)old, old_size, (const char*)new_, new_size, &patch) != BDELTA_OK)
-		goto emit_new_literally;
+	if (diff_myers((const char*)old, old_size, (const char*)new_, new_size, &patch) != BDELTA_OK) {
+		/* Altered: too many differences for Myers; try a chunked delta instead. */
+		std::vector<u8> bd(1, PT_BINDELTA), rest;
+		if (!bindelta_encode((const u8*)old, old_size, (const u8*)new_, new_size, rest) ||
+		    rest.size() + 1 > new_size)
+			goto emit_new_literally;
+		bd.insert(bd.end(), rest.begin(), rest.end());
+		if (sb_write(&patch, bd.data(), bd.size()) != 0)
+			goto out_of_memory;
+	}
 	
 	if (sb_size(&patch) > new_size) {
 		/*
@@ -5100,6 +5052,29 @@ BDELTAcode bdelta_patch(
 				goto discard;
 			break;
 		
+		case PT_BINDELTA:
+			{
+			std::vector<u8> out;
+			u64 src_len, tgt_len;
+			if (!bindelta_lengths(p, pe - p, src_len, tgt_len)) {
+				rc = BDELTA_PATCH_INVALID;
+				goto discard;
+			}
+			if (src_len != old_size) {
+				rc = BDELTA_PATCH_MISMATCH;
+				goto discard;
+			}
+			if (!bindelta_apply(o, old_size, p, pe - p, out)) {
+				rc = BDELTA_PATCH_INVALID;
+				goto discard;
+			}
+			if (sb_write(&result, out.data(), out.size()) != 0) {
+				rc = BDELTA_MEMORY;
+				goto discard;
+			}
+			}
+			break;
+		
 		default:
 			rc = BDELTA_PATCH_INVALID;
 			goto discard;
@@ -6512,7 +6487,15 @@ tuning have been made, but this is invariably a bit machine-specific.
  */
 #define NSUBEXP  32
 
+/*
+ * Altered: while regerror_quiet is set (RegexDFA compiling a pattern),
+ * errors are not reported and regcomp() just returns NULL.
+ */
+bool regerror_quiet = false;
+
 void regerror(const char* s) {
+    if (regerror_quiet)
+	return;
 #ifdef ERRAVAIL
     error("regexp: %s", s);
 #else
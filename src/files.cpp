@@ -12,6 +12,8 @@
 
 #ifndef CODEHAPPY_WINDOWS
 #define	_getcwd(X, Y)	getcwd(X, Y)
+#else
+#include <io.h>
 #endif  // !CODEHAPPY_WINDOWS
 
 /*** semi-portable file length function ***/
@@ -60,6 +62,55 @@ u64 flength_64(const char *fname) {
 #endif
 }
 
+/*** 64-bit file positioning. ***/
+int fseek_64(FILE* f, i64 offset, int whence) {
+#ifdef CODEHAPPY_WINDOWS
+	return _fseeki64(f, offset, whence);
+#else
+	return fseeko(f, (off_t) offset, whence);
+#endif
+}
+
+i64 ftell_64(FILE* f) {
+#ifdef CODEHAPPY_WINDOWS
+	return _ftelli64(f);
+#else
+	return (i64) ftello(f);
+#endif
+}
+
+/*** Truncate (or extend) an open file to the given length. Pending writes are flushed first. ***/
+bool truncate_file(FILE* f, u64 len) {
+	NOT_NULL_OR_RETURN(f, false);
+	fflush(f);
+#ifdef CODEHAPPY_WINDOWS
+	return _chsize_s(_fileno(f), (__int64) len) == 0;
+#else
+	return ftruncate(fileno(f), (off_t) len) == 0;
+#endif
+}
+
+/*** Flush an open file's buffers, and wait for the OS to write its data to the device. ***/
+bool sync_file(FILE* f) {
+	NOT_NULL_OR_RETURN(f, false);
+	if (fflush(f) != 0)
+		return false;
+#ifdef CODEHAPPY_WINDOWS
+	return _commit(_fileno(f)) == 0;
+#else
+	return fsync(fileno(f)) == 0;
+#endif
+}
+
+/*** Rename src over dest, replacing dest if it exists. dest is never removed before src takes its place. ***/
+bool replace_file(const char* src, const char* dest) {
+#ifdef CODEHAPPY_WINDOWS
+	return MoveFileExA(src, dest, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(src, dest) == 0;
+#endif
+}
+
 /*** Does the named file exist? ***/
 bool FileExists(const char* fname) {
 	struct stat info;
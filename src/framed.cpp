@@ -0,0 +1,459 @@
+/***
+
+	framed.cpp
+
+	A seekable, chunked compression container: independently compressed blocks plus an index.
+
+	2024, C. M. Street
+
+***/
+
+static const u8 __magic_framed[12] = {'R', 'A', 'M', 0x7e, 0x10, 0x89, 0x09, 0x19, 0x80, 0x09, 0x11, 0x58};
+
+bool is_framed(const u8* data, u64 len) {
+	return len >= FRAMED_HEADER_SIZE && memcmp(data, __magic_framed, sizeof(__magic_framed)) == 0;
+}
+
+u32 framed_compress_block(const u8* src, u32 len, std::vector<u8>& out, FramedCodec codec, int level) {
+	u32 method = FRAMED_METHOD_STORED, clen = len;
+
+	out.resize(std::max(len, 1U));
+	if (len > 16 && codec != FRAMED_STORE) {
+		if (codec == FRAMED_BEST || codec == FRAMED_LZF) {
+			unsigned int lz = lzf_compress(src, len, out.data(), len - 1);
+			if (lz > 0) {
+				method = FRAMED_METHOD_LZF;
+				clen = lz;
+			}
+		}
+		if (codec == FRAMED_BEST || codec == FRAMED_ZLIB) {
+			std::vector<u8> zb(len);
+			mz_ulong zlen = clen - 1;
+			if (mz_compress2(zb.data(), &zlen, src, len, level) == MZ_OK && zlen < clen) {
+				out.swap(zb);
+				method = FRAMED_METHOD_ZLIB;
+				clen = (u32) zlen;
+			}
+		}
+	}
+	if (method == FRAMED_METHOD_STORED)
+		memcpy(out.data(), src, len);
+	out.resize(clen);
+	return method;
+}
+
+bool framed_decompress_block(const u8* src, u32 clen, u32 method, u8* dest, u32 len) {
+	switch (method) {
+	case FRAMED_METHOD_STORED:
+		if (clen != len)
+			return false;
+		memcpy(dest, src, len);
+		return true;
+	case FRAMED_METHOD_LZF:
+		return lzf_decompress(src, clen, dest, len) == len;
+	case FRAMED_METHOD_ZLIB:
+		{
+		mz_ulong dlen = len;
+		return mz_uncompress(dest, &dlen, src, clen) == MZ_OK && dlen == len;
+		}
+	}
+	return false;
+}
+
+void framed_compress_blocks(const u8* data, u64 len, u32 block_size, const std::vector<u64>& which,
+				std::vector< std::vector<u8> >& out, std::vector<u32>& methods,
+				FramedCodec codec, int level, ThreadPool* pool) {
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	out.resize(which.size());
+	methods.resize(which.size());
+	tp.parallel_for(0, (i64) which.size(), [&](i64 i0, i64 i1) {
+		for (i64 e = i0; e < i1; ++e) {
+			u64 b0 = which[e] * (u64) block_size;
+			methods[e] = framed_compress_block(data + b0, (u32) (std::min(b0 + block_size, len) - b0), out[e], codec, level);
+		}
+	});
+}
+
+/* Decompress every block of a container (whose bytes are all at 'file') into dest, in parallel. */
+static bool framed_decompress_all(const u8* file, const std::vector<FramedChunk>& chunks, u32 block_size, u64 total,
+				  u8* dest, ThreadPool* pool) {
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	std::atomic<bool> ok(true);
+	tp.parallel_for(0, (i64) chunks.size(), [&](i64 i0, i64 i1) {
+		for (i64 c = i0; c < i1 && ok; ++c) {
+			u64 b0 = (u64) c * block_size;
+			if (!framed_decompress_block(file + chunks[c].offset, chunks[c].clen, chunks[c].method, dest + b0,
+						     (u32) (std::min(b0 + block_size, total) - b0)))
+				ok = false;
+		}
+	});
+	return ok;
+}
+
+void framed_build_header(u8* hdr, u32 block_size, u64 index_offset, u32 index_len) {
+	memcpy(hdr, __magic_framed, sizeof(__magic_framed));
+	put_le32(hdr + 12, block_size);
+	put_le64(hdr + 16, index_offset);
+	put_le32(hdr + 24, index_len);
+	put_le32(hdr + 28, (u32) mz_crc32(MZ_CRC32_INIT, hdr, 28));
+}
+
+bool framed_parse_header(const u8* hdr, u64 file_len, u32& block_size, u64& index_offset, u32& index_len) {
+	if (!is_framed(hdr, file_len) || (u32) mz_crc32(MZ_CRC32_INIT, hdr, 28) != get_le32(hdr + 28))
+		return false;
+	block_size = get_le32(hdr + 12);
+	index_offset = get_le64(hdr + 16);
+	index_len = get_le32(hdr + 24);
+	return block_size > 0 && index_offset <= file_len && index_len >= FRAMED_INDEX_SIZE(0) &&
+	       index_len <= file_len - index_offset;
+}
+
+void framed_build_index(const std::vector<FramedChunk>& chunks, u64 total_len, std::vector<u8>& out) {
+	out.resize((size_t) FRAMED_INDEX_SIZE(chunks.size()));
+	u8* p = out.data();
+	put_le64(p, total_len);
+	put_le32(p + 8, (u32) chunks.size());
+	p += 12;
+	for (const auto& c : chunks) {
+		put_le64(p, c.offset);
+		put_le32(p + 8, c.clen);
+		put_le32(p + 12, c.method);
+		p += FRAMED_INDEX_ENTRY;
+	}
+	put_le32(p, (u32) mz_crc32(MZ_CRC32_INIT, out.data(), out.size() - 4));
+}
+
+bool framed_parse_index(const u8* ix, u32 index_len, u32 block_size, u64 file_len, u64& total_len,
+			std::vector<FramedChunk>& chunks) {
+	if (index_len < FRAMED_INDEX_SIZE(0) || (u32) mz_crc32(MZ_CRC32_INIT, ix, index_len - 4) != get_le32(ix + index_len - 4))
+		return false;
+	total_len = get_le64(ix);
+	u32 n = get_le32(ix + 8);
+	if (index_len != FRAMED_INDEX_SIZE(n) || (total_len + block_size - 1) / block_size != n)
+		return false;
+	chunks.resize(n);
+	const u8* p = ix + 12;
+	for (u32 c = 0; c < n; ++c, p += FRAMED_INDEX_ENTRY) {
+		chunks[c].offset = get_le64(p);
+		chunks[c].clen = get_le32(p + 8);
+		chunks[c].method = get_le32(p + 12);
+		if (chunks[c].offset > file_len || chunks[c].clen > file_len - chunks[c].offset)
+			return false;
+	}
+	return true;
+}
+
+bool framed_compress(const u8* data, u64 len, Scratchpad& out, std::vector<FramedChunk>& chunks, u32 block_size,
+		     FramedCodec codec, int level, ThreadPool* pool) {
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	u64 n = (len + block_size - 1) / block_size;
+	// compress a batch of blocks at a time, so we're not holding every compressed block at once.
+	u64 batch = (u64) (tp.size() + 1) * 4;
+	std::vector< std::vector<u8> > cdata;
+	std::vector<u32> methods;
+	std::vector<u64> which;
+	std::vector<u8> idx;
+	u8 hdr[FRAMED_HEADER_SIZE] = { 0 };
+
+	if (block_size == 0)
+		return false;
+	out.clear();
+	chunks.resize(n);
+	if (out.memcat(hdr, sizeof(hdr)))
+		return false;
+	for (u64 b = 0; b < n; b += batch) {
+		which.clear();
+		for (u64 e = b; e < std::min(b + batch, n); ++e)
+			which.push_back(e);
+		framed_compress_blocks(data, len, block_size, which, cdata, methods, codec, level, &tp);
+		for (size_t e = 0; e < which.size(); ++e) {
+			chunks[which[e]].offset = out.length();
+			chunks[which[e]].clen = (u32) cdata[e].size();
+			chunks[which[e]].method = methods[e];
+			if ((u64) out.length() + cdata[e].size() > 0xFFFFFF00ULL || out.memcat(cdata[e].data(), (u32) cdata[e].size()))
+				return false;
+		}
+	}
+	framed_build_index(chunks, len, idx);
+	framed_build_header(out.buffer(), block_size, out.length(), (u32) idx.size());
+	return out.memcat(idx.data(), (u32) idx.size()) == 0;
+}
+
+bool framed_compress(const u8* data, u64 len, Scratchpad& out, u32 block_size, FramedCodec codec, int level, ThreadPool* pool) {
+	std::vector<FramedChunk> chunks;
+	return framed_compress(data, len, out, chunks, block_size, codec, level, pool);
+}
+
+bool framed_compress(const Scratchpad& in, Scratchpad& out, u32 block_size, FramedCodec codec, int level, ThreadPool* pool) {
+	return framed_compress(in.buffer(), in.length(), out, block_size, codec, level, pool);
+}
+
+bool framed_decompress(const u8* data, u64 len, Scratchpad& out, std::vector<FramedChunk>& chunks, u32& block_size,
+		       ThreadPool* pool) {
+	u64 ioff, total;
+	u32 ilen;
+
+	if (!framed_parse_header(data, len, block_size, ioff, ilen) ||
+	    !framed_parse_index(data + ioff, ilen, block_size, len, total, chunks) || total > 0xFFFFFF00ULL)
+		return false;
+	if (out.resize((u32) total))
+		return false;
+	return framed_decompress_all(data, chunks, block_size, total, out.buffer(), pool);
+}
+
+bool framed_decompress(const u8* data, u64 len, Scratchpad& out, ThreadPool* pool) {
+	std::vector<FramedChunk> chunks;
+	u32 block_size;
+	return framed_decompress(data, len, out, chunks, block_size, pool);
+}
+
+bool framed_decompress(const Scratchpad& in, Scratchpad& out, ThreadPool* pool) {
+	return framed_decompress(in.buffer(), in.length(), out, pool);
+}
+
+FramedReader::FramedReader(u32 cache_blocks) {
+	f = nullptr;
+	mem = nullptr;
+	mem_len = 0;
+	file_len = 0;
+	bsize = 0;
+	total = 0;
+	pos = 0;
+	max_cache = std::max(cache_blocks, 1U);
+	tick = 0;
+	hits = 0;
+	misses = 0;
+	pool = nullptr;
+}
+
+FramedReader::~FramedReader() {
+	close();
+}
+
+int FramedReader::open(const char* fn) {
+	close();
+	f = fopen(fn, "rb");
+	NOT_NULL_OR_RETURN(f, 1);
+	file_len = flength_64(fn);
+	if (load_index()) {
+		close();
+		return 1;
+	}
+	return 0;
+}
+
+int FramedReader::open(const std::string& fn) {
+	return open(fn.c_str());
+}
+
+int FramedReader::open(const u8* data, u64 len) {
+	close();
+	mem = data;
+	mem_len = len;
+	file_len = len;
+	if (load_index()) {
+		close();
+		return 1;
+	}
+	return 0;
+}
+
+int FramedReader::open(const Scratchpad& sp) {
+	return open(sp.buffer(), sp.length());
+}
+
+void FramedReader::close() {
+	if (not_null(f))
+		fclose(f);
+	f = nullptr;
+	mem = nullptr;
+	mem_len = 0;
+	file_len = 0;
+	bsize = 0;
+	total = 0;
+	pos = 0;
+	chunks.clear();
+	cache.clear();
+}
+
+int FramedReader::load_index(void) {
+	u8 hdrbuf[FRAMED_HEADER_SIZE];
+	const u8* hdr = mem;
+	std::vector<u8> ixbuf;
+	const u8* ix;
+	u64 ioff;
+	u32 ilen;
+
+	if (file_len < FRAMED_HEADER_SIZE)
+		return 1;
+	if (not_null(f)) {
+		if (fseek_64(f, 0, SEEK_SET) != 0 || fread(hdrbuf, 1, sizeof(hdrbuf), f) != sizeof(hdrbuf))
+			return 1;
+		hdr = hdrbuf;
+	}
+	if (!framed_parse_header(hdr, file_len, bsize, ioff, ilen))
+		return 1;
+	if (not_null(f)) {
+		ixbuf.resize(ilen);
+		if (fseek_64(f, (i64) ioff, SEEK_SET) != 0 || fread(ixbuf.data(), 1, ilen, f) != ilen)
+			return 1;
+		ix = ixbuf.data();
+	} else {
+		ix = mem + ioff;
+	}
+	if (!framed_parse_index(ix, ilen, bsize, file_len, total, chunks))
+		return 1;
+	pos = 0;
+	return 0;
+}
+
+u32 FramedReader::block_len(u32 b) const {
+	return (u32) std::min((u64) bsize, total - (u64) b * bsize);
+}
+
+/* Get the compressed bytes of block b: straight from memory, or read into buf from the file. */
+bool FramedReader::fetch_compressed(u32 b, std::vector<u8>& buf, const u8*& src) {
+	const FramedChunk& c = chunks[b];
+	if (not_null(mem)) {
+		src = mem + c.offset;
+		return true;
+	}
+	buf.resize(std::max(c.clen, 1U));
+	if (fseek_64(f, (i64) c.offset, SEEK_SET) != 0 || fread(buf.data(), 1, c.clen, f) != c.clen)
+		return false;
+	src = buf.data();
+	return true;
+}
+
+const u8* FramedReader::get_block(u32 b) {
+	CachedBlock* slot = nullptr;
+	std::vector<u8> cbuf;
+	const u8* src;
+
+	++tick;
+	for (auto& cb : cache) {
+		if (cb.block == b) {
+			++hits;
+			cb.last_used = tick;
+			return cb.data.data();
+		}
+	}
+	++misses;
+
+	// take a new slot, or evict the least recently used block.
+	if (cache.size() < max_cache) {
+		cache.push_back(CachedBlock());
+		slot = &cache.back();
+	} else {
+		slot = &cache[0];
+		for (auto& cb : cache)
+			if (cb.last_used < slot->last_used)
+				slot = &cb;
+	}
+	slot->block = b;
+	slot->last_used = tick;
+	slot->data.resize(std::max(block_len(b), 1U));
+	if (!fetch_compressed(b, cbuf, src) ||
+	    !framed_decompress_block(src, chunks[b].clen, chunks[b].method, slot->data.data(), block_len(b))) {
+		slot->block = ~0U;
+		return nullptr;
+	}
+	return slot->data.data();
+}
+
+void FramedReader::set_cache_size(u32 nblocks) {
+	max_cache = std::max(nblocks, 1U);
+	if (cache.size() > max_cache) {
+		std::sort(cache.begin(), cache.end(), [](const CachedBlock& a, const CachedBlock& b) { return a.last_used > b.last_used; });
+		cache.resize(max_cache);
+	}
+}
+
+bool FramedReader::seek(u64 offset) {
+	if (offset > total)
+		return false;
+	pos = offset;
+	return true;
+}
+
+/* Blocks the read covers completely that aren't cached are decompressed straight into dest, in parallel; the
+   rest (the partial blocks at either end, usually) go through the cache. */
+u64 FramedReader::read_at(u64 offset, void* dest, u64 nbytes) {
+	u8* out = (u8*) dest;
+
+	if (offset >= total || nbytes == 0)
+		return 0;
+	nbytes = std::min(nbytes, total - offset);
+	u32 b0 = (u32) (offset / bsize), b1 = (u32) ((offset + nbytes - 1) / bsize);
+
+	std::vector<u32> direct;
+	for (u32 b = b0; b <= b1; ++b) {
+		u64 s = (u64) b * bsize;
+		if (s < offset || s + block_len(b) > offset + nbytes)
+			continue;
+		bool cached = false;
+		for (const auto& cb : cache)
+			cached = cached || cb.block == b;
+		if (!cached)
+			direct.push_back(b);
+	}
+
+	std::vector<bool> failed(b1 - b0 + 1, false);
+	if (direct.size() >= 2) {
+		// the file reads are serial; the decompression isn't.
+		std::vector< std::vector<u8> > cbufs(direct.size());
+		std::vector<const u8*> srcs(direct.size(), nullptr);
+		std::vector<char> ok(direct.size(), 1);
+		for (size_t e = 0; e < direct.size(); ++e)
+			ok[e] = fetch_compressed(direct[e], cbufs[e], srcs[e]);
+		ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+		tp.parallel_for(0, (i64) direct.size(), [&](i64 i0, i64 i1) {
+			for (i64 e = i0; e < i1; ++e) {
+				u32 b = direct[e];
+				ok[e] = ok[e] && framed_decompress_block(srcs[e], chunks[b].clen, chunks[b].method,
+									   out + ((u64) b * bsize - offset), block_len(b));
+			}
+		});
+		misses += direct.size();
+		for (size_t e = 0; e < direct.size(); ++e)
+			failed[direct[e] - b0] = !ok[e];
+	} else {
+		direct.clear();
+	}
+
+	size_t di = 0;
+	for (u32 b = b0; b <= b1; ++b) {
+		u64 s = (u64) b * bsize;
+		u64 lo = std::max(s, offset), hi = std::min(s + block_len(b), offset + nbytes);
+		if (di < direct.size() && direct[di] == b) {
+			++di;
+			if (failed[b - b0])
+				return lo - offset;
+			continue;
+		}
+		const u8* data = get_block(b);
+		if (is_null(data))
+			return lo - offset;
+		memcpy(out + (lo - offset), data + (lo - s), (size_t) (hi - lo));
+	}
+	return nbytes;
+}
+
+u64 FramedReader::read(void* dest, u64 nbytes) {
+	u64 got = read_at(pos, dest, nbytes);
+	pos += got;
+	return got;
+}
+
+int FramedReader::getmem(u8* to, u32 nb) {
+	return (read(to, nb) == nb) ? 0 : -1;
+}
+
+int FramedReader::getc() {
+	u8 c;
+	if (read(&c, 1) != 1)
+		return -1;
+	return (int) c;
+}
+
+/*** end framed.cpp ***/
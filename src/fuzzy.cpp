@@ -0,0 +1,355 @@
+/***
+
+	fuzzy.cpp
+
+	Bit-parallel (Myers/Hyyrö) edit distance, banded for a maximum distance, and fuzzy dictionary search.
+
+	2024, C. M. Street
+
+***/
+
+/*** The kernels. Rows of the matrix are pattern characters, columns text characters; pv/mv hold the
+     vertical deltas (+1/-1) of the current column, one bit per row. ***/
+
+/* Pattern of at most 64 characters: one word per column. */
+static u32 lev_word(const u64* peq, u32 m, const u8* t, u32 n, u32 k) {
+	const u64 last = 1ULL << (m - 1);
+	u64 pv = ~0ULL, mv = 0ULL;
+	u32 score = m;
+
+	for (u32 j = 0; j < n; ++j) {
+		const u64 eq = peq[t[j]];
+		const u64 xv = eq | mv;
+		const u64 xh = (((eq & pv) + pv) ^ pv) | eq;
+		u64 ph = mv | ~(xh | pv);
+		u64 mh = pv & xh;
+		if (ph & last)
+			++score;
+		else if (mh & last)
+			--score;
+		// The top row of the matrix is 0, 1, 2, ...: a +1 horizontal delta shifts in.
+		ph = (ph << 1) | 1ULL;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+		// Each remaining column can lower the score by at most one.
+		if (score > k + (n - 1 - j))
+			return k + 1;
+	}
+	return score <= k ? score : k + 1;
+}
+
+/* One 64-row block of one column, given the horizontal delta into its top row; returns the delta out of
+   the row hbit. */
+static inline int lev_advance(u64& pv, u64& mv, u64 eq, int hin, u64 hbit) {
+	const u64 xv = eq | mv;
+	if (hin < 0)
+		eq |= 1ULL;
+	const u64 xh = (((eq & pv) + pv) ^ pv) | eq;
+	u64 ph = mv | ~(xh | pv);
+	u64 mh = pv & xh;
+	int hout = 0;
+	if (ph & hbit)
+		hout = 1;
+	else if (mh & hbit)
+		hout = -1;
+	ph <<= 1;
+	mh <<= 1;
+	if (hin < 0)
+		mh |= 1ULL;
+	else if (hin > 0)
+		ph |= 1ULL;
+	pv = mh | ~(xv | ph);
+	mv = ph & xv;
+	return hout;
+}
+
+/* Longer patterns, in blocks of 64 rows. Only the blocks that meet the band of rows j - k .. j + k are
+   advanced at column j: a cell outside the band is more than k from the corner, so nothing below the band
+   is computed until the band reaches it (a block enters with every vertical delta +1, an overestimate),
+   and a block that falls above the band stops feeding the block below it (which then sees a +1 delta in
+   from above, again an overestimate.) Overestimates only ever land on cells that are > k anyway, so any
+   distance <= k comes out exact. */
+static u32 lev_blocks(const u64* peq, u32 m, u32 nb, const u8* t, u32 n, u32 k) {
+	std::vector<u64> pv(nb, ~0ULL), mv(nb, 0ULL);
+	std::vector<i64> score(nb);
+	const u64 top = 1ULL << 63, lastbit = 1ULL << ((m - 1) & 63);
+	const i64 ik = (i64) k;
+	i64 first = 0, last = std::min((i64) nb - 1, ik / 64);
+
+	auto rows = [m](i64 b) -> i64 { return std::min((i64) 64, (i64) m - 64 * b); };
+	for (i64 b = 0; b <= last; ++b)
+		score[b] = (b > 0 ? score[b - 1] : 0) + rows(b);
+
+	for (u32 j = 1; j <= n; ++j) {
+		const u64* eqs = peq + (u64) t[j - 1] * nb;
+		int h = 1;
+		for (i64 b = first; b <= last; ++b) {
+			h = lev_advance(pv[b], mv[b], eqs[b], h, b + 1 == (i64) nb ? lastbit : top);
+			score[b] += h;
+		}
+
+		// Give up once everything in the band is over k. (Unlike the one-word case, the last row can't be used
+		// for a bound here: outside the band its values may be overestimates.)
+		bool over = true;
+		for (i64 b = first; b <= last && over; ++b)
+			over = (score[b] - rows(b) + 1 > ik);
+		if (over)
+			return k + 1;
+
+		// Move the band for column j + 1.
+		const i64 jn = (i64) j + 1;
+		while (last + 1 < (i64) nb && 64 * (last + 1) + 1 <= jn + ik) {
+			++last;
+			pv[last] = ~0ULL;
+			mv[last] = 0ULL;
+			score[last] = score[last - 1] + rows(last);
+		}
+		while (first < last && 64 * (first + 1) < jn - ik)
+			++first;
+	}
+
+	return score[nb - 1] <= ik ? (u32) score[nb - 1] : k + 1;
+}
+
+/* Distance with the pattern's match vectors built; the length difference and empty strings are dealt with
+   here. */
+static u32 lev_dispatch(const u64* peq, u32 m, u32 nb, const u8* t, u32 n, u32 k) {
+	k = std::min(k, std::max(m, n));
+	if ((m > n ? m - n : n - m) > k)
+		return k + 1;
+	if (m == 0 || n == 0)
+		return std::max(m, n);
+	if (nb == 1)
+		return lev_word(peq, m, t, n, k);
+	return lev_blocks(peq, m, nb, t, n, k);
+}
+
+u32 edit_distance(const char* a, u32 len_a, const char* b, u32 len_b, u32 max_dist) {
+	const u8* pa = (const u8*) a;
+	const u8* pb = (const u8*) b;
+
+	// Common prefixes and suffixes cost nothing.
+	while (len_a > 0 && len_b > 0 && *pa == *pb) {
+		++pa;
+		++pb;
+		--len_a;
+		--len_b;
+	}
+	while (len_a > 0 && len_b > 0 && pa[len_a - 1] == pb[len_b - 1]) {
+		--len_a;
+		--len_b;
+	}
+	// The shorter string is the pattern.
+	if (len_a > len_b) {
+		std::swap(pa, pb);
+		std::swap(len_a, len_b);
+	}
+	if (len_a == 0)
+		return len_b <= max_dist ? len_b : max_dist + 1;
+
+	if (len_a <= 64) {
+		u64 peq[256];
+		memset(peq, 0, sizeof(peq));
+		for (u32 i = 0; i < len_a; ++i)
+			peq[pa[i]] |= 1ULL << i;
+		return lev_dispatch(peq, len_a, 1, pb, len_b, max_dist);
+	}
+
+	const u32 nb = (len_a + 63) / 64;
+	std::vector<u64> peq((size_t) 256 * nb, 0ULL);
+	for (u32 i = 0; i < len_a; ++i)
+		peq[(size_t) pa[i] * nb + (i >> 6)] |= 1ULL << (i & 63);
+	return lev_dispatch(peq.data(), len_a, nb, pb, len_b, max_dist);
+}
+
+u32 edit_distance(const char* a, const char* b, u32 max_dist) {
+	return edit_distance(a, (u32) strlen(a), b, (u32) strlen(b), max_dist);
+}
+
+u32 edit_distance(const std::string& a, const std::string& b, u32 max_dist) {
+	return edit_distance(a.data(), (u32) a.size(), b.data(), (u32) b.size(), max_dist);
+}
+
+/*** LevenshteinPattern ***/
+
+LevenshteinPattern::LevenshteinPattern(const char* pattern) {
+	init(pattern, (u32) strlen(pattern));
+}
+
+LevenshteinPattern::LevenshteinPattern(const char* pattern, u32 len) {
+	init(pattern, len);
+}
+
+void LevenshteinPattern::init(const char* pattern, u32 len) {
+	const u8* p = (const u8*) pattern;
+	m = len;
+	nb = std::max((len + 63) / 64, 1U);
+	peq.assign((size_t) 256 * nb, 0ULL);
+	for (u32 i = 0; i < len; ++i)
+		peq[(size_t) p[i] * nb + (i >> 6)] |= 1ULL << (i & 63);
+}
+
+u32 LevenshteinPattern::distance(const char* text, u32 len, u32 max_dist) const {
+	return lev_dispatch(peq.data(), m, nb, (const u8*) text, len, max_dist);
+}
+
+/*** FuzzyDictionary ***/
+
+static inline u32 fuzzy_popcount(u64 x) {
+#ifdef CODEHAPPY_MSFT
+	return count_bits(x);
+#else
+	return (u32) __builtin_popcountll(x);
+#endif
+}
+
+/* Bit (c & 63) for each character c in the string. Every bit set for one string and not the other stands
+   for at least one character that needs an edit of its own, so the larger of the two counts is a lower
+   bound on the distance, and a cheap one to check before the real thing. */
+static u64 fuzzy_signature(const char* w, u32 len) {
+	u64 sig = 0;
+	for (u32 e = 0; e < len; ++e)
+		sig |= 1ULL << ((u8) w[e] & 63);
+	return sig;
+}
+
+u32 FuzzyDictionary::add(const char* word) {
+	return add(word, (u32) strlen(word));
+}
+
+u32 FuzzyDictionary::add(const std::string& word) {
+	return add(word.data(), (u32) word.size());
+}
+
+u32 FuzzyDictionary::add(const char* word, u32 len) {
+	const u32 id = (u32) offs.size();
+	offs.push_back((u32) text.size());
+	lens.push_back(len);
+	text.insert(text.end(), word, word + len);
+	text.push_back('\0');
+
+	if (buckets.size() <= len)
+		buckets.resize(len + 1);
+	LengthBucket& lb = buckets[len];
+	lb.chars.insert(lb.chars.end(), word, word + len);
+	lb.ids.push_back(id);
+	lb.sigs.push_back(fuzzy_signature(word, len));
+	return id;
+}
+
+void FuzzyDictionary::clear(void) {
+	text.clear();
+	offs.clear();
+	lens.clear();
+	buckets.clear();
+}
+
+/* Words i0 .. i1 of the bucket of length len. */
+void FuzzyDictionary::scan(const LevenshteinPattern& pat, u64 sig, u32 max_dist, u32 len, u32 i0, u32 i1,
+				std::vector<FuzzyMatch>& out) const {
+	const LengthBucket& lb = buckets[len];
+	const char* w = lb.chars.data() + (size_t) i0 * len;
+
+	for (u32 i = i0; i < i1; ++i, w += len) {
+		const u64 ws = lb.sigs[i];
+		if (fuzzy_popcount(sig & ~ws) > max_dist || fuzzy_popcount(ws & ~sig) > max_dist)
+			continue;
+		const u32 d = pat.distance(w, len, max_dist);
+		if (d <= max_dist)
+			out.push_back({ lb.ids[i], d });
+	}
+}
+
+static bool fuzzy_match_order(const FuzzyMatch& a, const FuzzyMatch& b) {
+	if (a.distance != b.distance)
+		return a.distance < b.distance;
+	return a.index < b.index;
+}
+
+void FuzzyDictionary::search(const char* query, u32 max_dist, std::vector<FuzzyMatch>& matches, ThreadPool* pool) const {
+	search(query, (u32) strlen(query), max_dist, matches, pool);
+}
+
+void FuzzyDictionary::search(const char* query, u32 len, u32 max_dist, std::vector<FuzzyMatch>& matches, ThreadPool* pool) const {
+	matches.clear();
+	if (buckets.empty())
+		return;
+
+	// The candidate lengths, and a running count of their words so the whole lot can be split evenly.
+	const u32 lo = len > max_dist ? len - max_dist : 0;
+	const u32 hi = (u32) std::min((u64) len + max_dist, (u64) buckets.size() - 1);
+	if (lo > hi)
+		return;
+	std::vector<u64> start(hi - lo + 2, 0);
+	for (u32 l = lo; l <= hi; ++l)
+		start[l - lo + 1] = start[l - lo] + buckets[l].ids.size();
+	const u64 total = start.back();
+	if (total == 0)
+		return;
+
+	LevenshteinPattern pat(query, len);
+	const u64 sig = fuzzy_signature(query, len);
+	auto scan_range = [&](i64 s, i64 e, std::vector<FuzzyMatch>& out) {
+		u32 l = (u32) (std::upper_bound(start.begin(), start.end(), (u64) s) - start.begin()) - 1;
+		while (s < e) {
+			const i64 bucket_end = std::min((i64) start[l + 1], e);
+			if (bucket_end > s)
+				scan(pat, sig, max_dist, lo + l, (u32) (s - start[l]), (u32) (bucket_end - start[l]), out);
+			s = bucket_end;
+			++l;
+		}
+	};
+
+	const i64 grain = 16384;
+	if ((i64) total <= grain) {
+		scan_range(0, (i64) total, matches);
+	} else {
+		ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+		std::mutex mtx;
+		tp.parallel_for(0, (i64) total, [&](i64 s, i64 e) {
+			std::vector<FuzzyMatch> local;
+			scan_range(s, e, local);
+			if (!local.empty()) {
+				ScopeMutex lock(mtx);
+				matches.insert(matches.end(), local.begin(), local.end());
+			}
+		}, grain);
+	}
+	std::sort(matches.begin(), matches.end(), fuzzy_match_order);
+}
+
+bool FuzzyDictionary::nearest(const char* query, u32 max_dist, FuzzyMatch& match, ThreadPool* pool) const {
+	std::vector<FuzzyMatch> matches;
+	search(query, max_dist, matches, pool);
+	if (matches.empty())
+		return false;
+	match = matches[0];
+	return true;
+}
+
+void FuzzyDictionary::search_many(const std::vector<std::string>& queries, u32 max_dist, std::vector<std::vector<FuzzyMatch>>& matches,
+				ThreadPool* pool) const {
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	matches.resize(queries.size());
+	// Split across the queries; each search runs serially within its thread.
+	tp.parallel_for(0, (i64) queries.size(), [&](i64 s, i64 e) {
+		for (i64 i = s; i < e; ++i) {
+			const std::string& q = queries[i];
+			std::vector<FuzzyMatch>& out = matches[i];
+			out.clear();
+			if (buckets.empty())
+				continue;
+			const u32 len = (u32) q.size();
+			const u32 lo = len > max_dist ? len - max_dist : 0;
+			const u32 hi = (u32) std::min((u64) len + max_dist, (u64) buckets.size() - 1);
+			LevenshteinPattern pat(q.data(), len);
+			const u64 sig = fuzzy_signature(q.data(), len);
+			for (u32 l = lo; l <= hi; ++l)
+				scan(pat, sig, max_dist, l, 0, (u32) buckets[l].ids.size(), out);
+			std::sort(out.begin(), out.end(), fuzzy_match_order);
+		}
+	});
+}
+
+/* end fuzzy.cpp */
@@ -36,6 +36,11 @@
 	You can re-run optimize*() to create more simulations, and sometimes achieve a
 	better solution, or reset() to free the generated solutions.
 
+	New organisms are evaluated in parallel, so the target function must be thread-safe
+	unless set_serial() is used; repeated input vectors are answered from a fitness cache.
+	set_islands() splits the population into islands that breed on their own threads and
+	exchange their best organisms periodically. See genetic.h.
+
 	Copyright (c) 2022 C. M. Street.
 
 ***/
@@ -52,41 +57,28 @@ GeneticOrganism::~GeneticOrganism() {
 	delete [] in;
 }
 
+GeneticIsland::~GeneticIsland() {
+	for (auto go : orgs)
+		delete go;
+}
+
 GeneticOptimizer::GeneticOptimizer(u32 n_inputs) {
-	best_in = new double [n_inputs];
-	lobound_in = nullptr;
-	hibound_in = nullptr;
-	mutation_chance = INITIAL_MUTATION;	// 1 in 256 mutation chance, to start
-	best_fitness = nan("");
-	target_fn = nullptr;
-	vs.quiet();
-	want_max = true;
-	ni = n_inputs;
-	user_data = nullptr;
-	constraint = false;
-	optimum_is_zero = false;
+	init(n_inputs, nullptr, nullptr);
 }
 
 GeneticOptimizer::GeneticOptimizer(u32 n_inputs, OptimizeCallback fn) {
-	best_in = new double [n_inputs];
-	lobound_in = nullptr;
-	hibound_in = nullptr;
-	mutation_chance = INITIAL_MUTATION;
-	best_fitness = nan("");
-	target_fn = fn;
-	vs.quiet();
-	want_max = true;
-	ni = n_inputs;
-	user_data = nullptr;
-	constraint = false;
-	optimum_is_zero = false;
+	init(n_inputs, fn, nullptr);
 }
 
 GeneticOptimizer::GeneticOptimizer(u32 n_inputs, OptimizeCallback fn, void* ud) {
+	init(n_inputs, fn, ud);
+}
+
+void GeneticOptimizer::init(u32 n_inputs, OptimizeCallback fn, void* ud) {
 	best_in = new double [n_inputs];
 	lobound_in = nullptr;
 	hibound_in = nullptr;
-	mutation_chance = INITIAL_MUTATION;
+	mutation_chance = INITIAL_MUTATION;	// 1 in 64 mutation chance, to start
 	best_fitness = nan("");
 	target_fn = fn;
 	vs.quiet();
@@ -95,13 +87,21 @@ GeneticOptimizer::GeneticOptimizer(u32 n_inputs, OptimizeCallback fn, void* ud)
 	user_data = ud;
 	constraint = false;
 	optimum_is_zero = false;
+	pool = nullptr;
+	serial = false;
+	use_cache = true;
+	n_islands = 1;
+	migration_interval = 10;
+	n_migrants = 16;
+	n_evals = 0;
+	n_hits = 0;
 }
 
 GeneticOptimizer::~GeneticOptimizer() {
 	delete [] best_in;
-	for (auto go : orgs)
-		delete go;
-	orgs.empty();
+	for (auto isl : islands)
+		delete isl;
+	islands.clear();
 	if (!is_null(lobound_in))
 		delete [] lobound_in;
 	if (!is_null(hibound_in))
@@ -140,6 +140,15 @@ void GeneticOptimizer::set_hibound(u32 input_idx, double max_val) {
 	hibound_in[input_idx] = max_val;
 }
 
+void GeneticOptimizer::set_islands(u32 n_isl, u32 interval, u32 migrants) {
+	n_isl = CLAMP(n_isl, 1, MAX_ISLANDS);
+	if (n_isl != n_islands && !islands.empty())
+		reset();
+	n_islands = n_isl;
+	migration_interval = interval;
+	n_migrants = migrants;
+}
+
 double* GeneticOptimizer::optimize_min(double accuracy) {
 	want_max = false;
 	return optimize(accuracy);
@@ -151,18 +160,23 @@ double* GeneticOptimizer::optimize_max(double accuracy) {
 }
 
 double* GeneticOptimizer::optimize(double accuracy) {
-	u32 e;
+	u32 e, i;
 	u32 g = 0, gl = 0;
 	if (target_fn == nullptr)
 		return nullptr;
 	if (accuracy > 0.9)
 		accuracy = 0.9;
-	if (orgs.empty()) {
-		for (e = 0; e < NUM_ORGANISMS; ++e) {
-			GeneticOrganism* go = new GeneticOrganism(ni);
-			fill_random_inputs(go->in);
-			enforce_sum_constraint(go->in);
-			orgs.push_back(go);
+	if (islands.empty()) {
+		const u32 per_island = NUM_ORGANISMS / n_islands;
+		for (i = 0; i < n_islands; ++i) {
+			GeneticIsland* isl = new GeneticIsland(RandU32());
+			for (e = 0; e < per_island; ++e) {
+				GeneticOrganism* go = new GeneticOrganism(ni);
+				fill_random_inputs(go->in, isl->rng);
+				enforce_sum_constraint(go->in);
+				isl->orgs.push_back(go);
+			}
+			islands.push_back(isl);
 		}
 	}
 	if (isnan(best_fitness)) {
@@ -178,7 +192,7 @@ double* GeneticOptimizer::optimize(double accuracy) {
 		double new_fit, fit_ratio;
 		/* Generational turnover. */
 		vs << "Creating new generation... ";
-		new_generation();
+		breed();
 		++g;
 
 		/* Calculate new fitness. */
@@ -188,6 +202,10 @@ double* GeneticOptimizer::optimize(double accuracy) {
 			vs << "Warning: new fitness is not a number, bailing.\n";
 			break;
 		}
+		if (islands.size() > 1 && migration_interval > 0 && 0 == g % migration_interval) {
+			migrate();
+			vs << "Migration between " << islands.size() << " islands.\n";
+		}
 		if (want_max) {
 			fit_ratio = new_fit / best_fitness;
 			if (fit_ratio < 0.) {
@@ -223,57 +241,95 @@ double* GeneticOptimizer::optimize(double accuracy) {
 		}
 	}
 
+	vs << n_evals << " evaluations, " << n_hits << " cache hits.\n";
+
 	return best_in;
 }
 
-void GeneticOptimizer::new_generation(void) {
-	GrabBag<u32> repro, dieoff;
-	GeneticOrganism* newgen[GENERATION_TURNOVER];
-	u32 e, sz;
+void GeneticOptimizer::breed(void) {
+	/* Each island breeds with its own random number generator, so they can do it at the same time. */
+	if (islands.size() == 1) {
+		new_generation(islands[0]);
+		return;
+	}
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	tp.parallel_for(0, (i64) islands.size(), [this](i64 i0, i64 i1) {
+		for (i64 i = i0; i < i1; ++i)
+			new_generation(islands[i]);
+	});
+}
+
+void GeneticOptimizer::new_generation(GeneticIsland* isl) const {
+	std::vector<GeneticOrganism *>& orgs = isl->orgs;
+	DetRand& rng = isl->rng;
+	std::vector<u32> repro_idx, repro_wt;
+	std::vector<std::pair<double, u32> > dieoff;
+	std::vector<GeneticOrganism *> newgen;
+	u32 e, sz, total = 0, turnover;
 	sz = orgs.size();
+	turnover = std::max(1U, (u32) ((u64) sz * GENERATION_TURNOVER / NUM_ORGANISMS));
+
 	for (e = 0; e < sz; ++e) {
 		GeneticOrganism* go = orgs[e];
+		double w;
 		++go->age;
 		if (isnan(go->fitness_raw)) {
 			// if the fitness is NaN, this organism should die but not reproduce.
-			dieoff.Insert(e, 1024);
-			continue;
+			w = 1024.;
+		} else {
+			/* organisms are chosen to reproduce based on fitness (normed into [0, 1]). */
+			total += weight_from_normed_fitness(go->fitness_norm);
+			repro_idx.push_back(e);
+			repro_wt.push_back(total);
+			/* organisms are chosen to perish based on the inverse of fitness. */
+			w = weight_from_normed_fitness(1.0 - go->fitness_norm);
 		}
-		/* organisms are chosen to reproduce based on fitness (normed into [0, 1]). */
-		repro.Insert(e, weight_from_normed_fitness(go->fitness_norm));
-		/* organisms are chosen to perish based on the inverse of fitness. */
-		dieoff.Insert(e, weight_from_normed_fitness(1.0 - go->fitness_norm));
+		/* Weighted sampling without replacement: keeping the organisms with the largest u ^ (1 / w),
+		   u uniform in [0, 1], is the same as drawing them one at a time in proportion to weight. */
+		dieoff.push_back(std::make_pair(log(rng.randd1()) / w, e));
 	}
 
 	/* First, create the new organisms. */
-	for (e = 0; e < GENERATION_TURNOVER; ++e) {
+	for (e = 0; e < turnover; ++e) {
 		GeneticOrganism* parent_1, * parent_2;
-		parent_1 = orgs[repro.Select()];
+		if (repro_idx.size() < 2) {
+			// nobody (or only one) to breed from: start afresh.
+			GeneticOrganism* go = new GeneticOrganism(ni);
+			fill_random_inputs(go->in, rng);
+			enforce_sum_constraint(go->in);
+			newgen.push_back(go);
+			continue;
+		}
+		auto select = [&]() -> GeneticOrganism* {
+			u32 r = rng.RandU32Range(0, total - 1);
+			return orgs[repro_idx[std::upper_bound(repro_wt.begin(), repro_wt.end(), r) - repro_wt.begin()]];
+		};
+		parent_1 = select();
 		do {
-			parent_2 = orgs[repro.Select()];
+			parent_2 = select();
 		} while (parent_2 == parent_1);
-		newgen[e] = couple(parent_1, parent_2);
+		newgen.push_back(couple(parent_1, parent_2, rng));
 	}
 
 	/* Now, replace the organisms that are chosen to die off this generation. */
-	dieoff.SetReplace(false);
-	dieoff.SetRemoveSelectedEntirely(true);
-	for (e = 0; e < GENERATION_TURNOVER; ++e) {
-		u32 unlucky_idx = dieoff.Select();
+	std::nth_element(dieoff.begin(), dieoff.begin() + (turnover - 1), dieoff.end(),
+		[](const std::pair<double, u32>& d1, const std::pair<double, u32>& d2) { return d1.first > d2.first; });
+	for (e = 0; e < turnover; ++e) {
+		u32 unlucky_idx = dieoff[e].second;
 		// Destroy the old and replace with the new.
 		delete orgs[unlucky_idx];
 		orgs[unlucky_idx] = newgen[e];
 	}
 }
 
-double GeneticOptimizer::random_input_in_range(u32 input_idx) const {
+double GeneticOptimizer::random_input_in_range(u32 input_idx, DetRand& rng) const {
 	double lo, hi;
 	const double GENERIC_LO = -1000., GENERIC_HI = 1000.;
 	if (input_idx >= ni) {
 		return nan("");
 	}
 	if (lobound_in == nullptr && hibound_in == nullptr) {
-		return RandDouble(GENERIC_LO, GENERIC_HI);
+		return rng.randd(GENERIC_LO, GENERIC_HI);
 	}
 	if (lobound_in == nullptr) {
 		lo = GENERIC_LO;
@@ -290,95 +346,200 @@ double GeneticOptimizer::random_input_in_range(u32 input_idx) const {
 	if (isnan(hi))
 		hi = GENERIC_HI;
 	SORT2(lo, hi, double);
-	return RandDouble(lo, hi);
+	return rng.randd(lo, hi);
 }
 
-void GeneticOptimizer::fill_random_inputs(double* v) const {
+void GeneticOptimizer::fill_random_inputs(double* v, DetRand& rng) const {
 	for (u32 e = 0; e < ni; ++e) {
-		v[e] = random_input_in_range(e);
+		v[e] = random_input_in_range(e, rng);
 	}
 }
 
 void GeneticOptimizer::reset() {
-	for (auto go : orgs)
-		delete go;
-	orgs.clear();
+	for (auto isl : islands)
+		delete isl;
+	islands.clear();
+	clear_cache();
 	mutation_chance = INITIAL_MUTATION;
 	best_fitness = nan("");
 }
 
-static bool __genorgsort(const GeneticOrganism* go1, const GeneticOrganism* go2) {
+/* Orders organisms from least to most fit, with the NaNs first. */
+static bool __genorgsort_max(const GeneticOrganism* go1, const GeneticOrganism* go2) {
+	if (isnan(go1->fitness_raw))
+		return !isnan(go2->fitness_raw);
+	if (isnan(go2->fitness_raw))
+		return false;
 	return go1->fitness_raw < go2->fitness_raw;
 }
 
+static bool __genorgsort_min(const GeneticOrganism* go1, const GeneticOrganism* go2) {
+	if (isnan(go1->fitness_raw))
+		return !isnan(go2->fitness_raw);
+	if (isnan(go2->fitness_raw))
+		return false;
+	return go1->fitness_raw > go2->fitness_raw;
+}
+
 double GeneticOptimizer::calc_fitness() {
 	/* Calculate fitness for every new organism, and return the best fitness we see. */
+	std::vector<GeneticOrganism *> eval;
+	GeneticOrganism* best = nullptr;
 	double ret = best_fitness;
-	bool first = true;
 
-	worst_fit = nan("");
-	for (auto go : orgs) {
-		if (0 == go->age) {
-			// A newborn, fill in fitness.
-			go->fitness_raw = target_fn(go->in, user_data);
-		}
-		if (isnan(go->fitness_raw))
-			continue;
-		if (first) {
-			if (isnan(ret) || (want_max && go->fitness_raw > ret) || (!want_max && go->fitness_raw < ret)) {
-				ret = go->fitness_raw;
+	for (auto isl : islands) {
+		for (auto go : isl->orgs) {
+			if (0 == go->age) {
+				// A newborn, fill in fitness.
+				eval.push_back(go);
 			}
-			worst_fit = go->fitness_raw;
-			first = false;
-		} else {
-			if ((want_max && go->fitness_raw > ret) || (!want_max && go->fitness_raw < ret)) {
-				ret = go->fitness_raw;
-				memcpy(best_in, go->in, sizeof(double) * ni);
-				// we only set best_fitness in the generational loop, so we can compare improvement.
-			}
-			if ((want_max && go->fitness_raw < worst_fit) || (!want_max && go->fitness_raw > worst_fit))
-				worst_fit = go->fitness_raw;
+		}
+	}
+	evaluate(eval);
+
+	for (auto isl : islands) {
+		for (auto go : isl->orgs) {
+			if (isnan(go->fitness_raw))
+				continue;
+			if (is_null(best) || better(go->fitness_raw, best->fitness_raw))
+				best = go;
 		}
 	}
 
-	if (first) {
+	if (is_null(best)) {
 		// There is no non-nan() fitness...
 		vs << "No numeric fitness found?\n";
 		return ret;
 	}
+	if (isnan(ret) || better(best->fitness_raw, ret)) {
+		ret = best->fitness_raw;
+		memcpy(best_in, best->in, sizeof(double) * ni);
+		// we only set best_fitness in the generational loop, so we can compare improvement.
+	}
 
 	/* We can now normalize fitness to [0, 1], by closeness to our objective. */
-	std::sort(orgs.begin(), orgs.end(), __genorgsort);
-	for (u32 e = 0; e < orgs.size(); ++e) {
-		GeneticOrganism* go = (GeneticOrganism *)orgs[e];
-		if (want_max) {
-			// from 0 to 1
-			go->fitness_norm = double(e) / double(orgs.size() - 1);
-		} else {
-			// from 1 to 0
-			go->fitness_norm = 1.0 - (double(e) / double(orgs.size() - 1));
+	for (auto isl : islands)
+		normalize_fitness(isl);
+
+	return ret;
+}
+
+void GeneticOptimizer::evaluate(std::vector<GeneticOrganism *>& eval) {
+	/* Answer what we can from the cache, and evaluate each distinct input vector only once. */
+	std::vector<GeneticOrganism *> todo;
+	std::vector<u64> todo_hash;
+	std::vector<std::pair<GeneticOrganism *, GeneticOrganism *> > same;
+	std::unordered_map<u64, GeneticOrganism *> pending;
+	const u32 nbytes = sizeof(double) * ni;
+
+	if (!use_cache) {
+		todo = eval;
+	} else {
+		for (auto go : eval) {
+			u64 h = hash_FNV1a(go->in, nbytes);
+			if (cache_lookup(h, go->in, &go->fitness_raw)) {
+				++n_hits;
+				continue;
+			}
+			auto it = pending.find(h);
+			if (it != pending.end()) {
+				if (0 == memcmp(it->second->in, go->in, nbytes)) {
+					same.push_back(std::make_pair(go, it->second));
+					++n_hits;
+					continue;
+				}
+			} else {
+				pending[h] = go;
+			}
+			todo.push_back(go);
+			todo_hash.push_back(h);
 		}
 	}
-#if 0
-	for (auto go : orgs) {
-		if (isnan(go->fitness_raw))
-			continue;
-		if (worst_fit == ret) {
-			// Just one valid fitness, or all are equally fit?
-			go->fitness_norm = 0.5;
-			continue;
+
+	if (serial || todo.size() < 2) {
+		for (auto go : todo)
+			go->fitness_raw = target_fn(go->in, user_data);
+	} else {
+		ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+		tp.parallel_for(0, (i64) todo.size(), [this, &todo](i64 i0, i64 i1) {
+			for (i64 i = i0; i < i1; ++i)
+				todo[i]->fitness_raw = target_fn(todo[i]->in, user_data);
+		});
+	}
+	n_evals += todo.size();
+
+	for (auto& s : same)
+		s.first->fitness_raw = s.second->fitness_raw;
+	for (u32 e = 0; e < todo_hash.size(); ++e)
+		cache_insert(todo_hash[e], todo[e]->in, todo[e]->fitness_raw);
+}
+
+void GeneticOptimizer::normalize_fitness(GeneticIsland* isl) const {
+	/* Sort from least to most fit; normalized fitness is then the rank, scaled into [0, 1]. */
+	std::vector<GeneticOrganism *>& orgs = isl->orgs;
+	std::sort(orgs.begin(), orgs.end(), want_max ? __genorgsort_max : __genorgsort_min);
+	for (u32 e = 0; e < orgs.size(); ++e) {
+		orgs[e]->fitness_norm = double(e) / double(std::max((u32) orgs.size() - 1, 1U));
+	}
+}
+
+void GeneticOptimizer::migrate(void) {
+	/* Copies of the fittest organisms on each island replace the least fit on the next island round the ring.
+	   The islands are sorted by fitness (normalize_fitness()), so these are at the ends. */
+	const u32 n = islands.size();
+	std::vector<std::vector<GeneticOrganism *> > emigrants(n);
+	u32 i, e;
+
+	for (i = 0; i < n; ++i) {
+		const std::vector<GeneticOrganism *>& orgs = islands[i]->orgs;
+		const u32 k = std::min(n_migrants, (u32) orgs.size() / 4);
+		for (e = 0; e < k; ++e) {
+			const GeneticOrganism* src = orgs[orgs.size() - 1 - e];
+			if (isnan(src->fitness_raw))
+				break;
+			GeneticOrganism* go = new GeneticOrganism(ni);
+			memcpy(go->in, src->in, sizeof(double) * ni);
+			go->fitness_raw = src->fitness_raw;
+			go->age = src->age;
+			emigrants[i].push_back(go);
 		}
-		if (want_max) {
-			// Translates the range [worst_fit, ret] to [0, 1]
-			go->fitness_norm = (go->fitness_norm - worst_fit) / (ret - worst_fit);
-		} else {
-			// Translates the range [ret, worst_fit] to [1, 0]
-			go->fitness_norm = 1.0 - (go->fitness_norm - ret) / (worst_fit - ret);
+	}
+
+	for (i = 0; i < n; ++i) {
+		GeneticIsland* dest = islands[(i + 1) % n];
+		for (e = 0; e < emigrants[i].size(); ++e) {
+			delete dest->orgs[e];
+			dest->orgs[e] = emigrants[i][e];
 		}
+		normalize_fitness(dest);
 	}
-#endif
+}
 
-	return ret;
+bool GeneticOptimizer::cache_lookup(u64 hash, const double* in, double* fit) const {
+	auto it = cache_map.find(hash);
+	if (it == cache_map.end())
+		return false;
+	if (memcmp(cache_in.data() + (u64) it->second * ni, in, sizeof(double) * ni) != 0)
+		return false;
+	*fit = cache_fit[it->second];
+	return true;
+}
+
+void GeneticOptimizer::cache_insert(u64 hash, const double* in, double fit) {
+	/* On a hash collision, the first input vector keeps the slot. When the cache is full, start over. */
+	if (cache_map.find(hash) != cache_map.end())
+		return;
+	if (cache_fit.size() >= std::max(CACHE_MAX_DOUBLES / std::max(ni, 1U), 4096U))
+		clear_cache();
+	cache_map[hash] = cache_fit.size();
+	cache_in.insert(cache_in.end(), in, in + ni);
+	cache_fit.push_back(fit);
+}
+
+void GeneticOptimizer::clear_cache(void) {
+	cache_map.clear();
+	cache_in.clear();
+	cache_fit.clear();
 }
 
 u32 GeneticOptimizer::weight_from_normed_fitness(double fit) const {
@@ -397,7 +558,7 @@ u32 GeneticOptimizer::weight_from_normed_fitness(double fit) const {
 	return (u32)(floor(v + 0.5));
 }
 
-GeneticOrganism* GeneticOptimizer::couple(GeneticOrganism* p1, GeneticOrganism* p2) const {
+GeneticOrganism* GeneticOptimizer::couple(GeneticOrganism* p1, GeneticOrganism* p2, DetRand& rng) const {
 	GeneticOrganism* ret = new GeneticOrganism(ni);
 
 	/* The options for each 'gene' (weight in our vector):
@@ -407,12 +568,12 @@ GeneticOrganism* GeneticOptimizer::couple(GeneticOrganism* p1, GeneticOrganism*
 		2 = a random weight between the two parent's genes.
 		3 = the average of the parent's genes. */
 	for (u32 e = 0; e < ni; ++e) {
-		if (OneIn(mutation_chance)) {
-			ret->in[e] = random_input_in_range(e);
+		if (rng.RandU32Range(1, mutation_chance) == mutation_chance) {
+			ret->in[e] = random_input_in_range(e, rng);
 			continue;
 		}
-		switch (RandU32Range(0, 3)) {
-		case 0:	
+		switch (rng.RandU32Range(0, 3)) {
+		case 0:
 			ret->in[e] = p1->in[e];
 			break;
 		case 1:
@@ -420,9 +581,9 @@ GeneticOrganism* GeneticOptimizer::couple(GeneticOrganism* p1, GeneticOrganism*
 			break;
 		case 2:
 			if (p1->in[e] < p2->in[e]) {
-				ret->in[e] = RandDouble(p1->in[e], p2->in[e]);
+				ret->in[e] = rng.randd(p1->in[e], p2->in[e]);
 			} else {
-				ret->in[e] = RandDouble(p2->in[e], p1->in[e]);
+				ret->in[e] = rng.randd(p2->in[e], p1->in[e]);
 			}
 			break;
 		case 3:
@@ -454,4 +615,4 @@ void GeneticOptimizer::enforce_sum_constraint(double* v) const {
 	}
 }
 
-/* end genetic.cpp */
\ No newline at end of file
+/* end genetic.cpp */
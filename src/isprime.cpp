@@ -3,7 +3,8 @@
 	isprime.cpp
 
 	Super fast functions isprime() and prime_factor(),
-	for 32-bit integer input.
+	for 32-bit integer input, and isprime64(), prime_factor64()
+	and factor64() for 64-bit input.
 
 	Copyright (c) 2014-2022 C. M. Street.
 
@@ -7663,3 +7664,208 @@ mod1:
 
 	return(0);
 }
+
+/*** 64-bit primality testing and factorization. ***/
+
+static inline u32 prime_ctz64(u64 x) {
+#ifdef CODEHAPPY_MSFT
+	return ntz(x);
+#else
+	return (u32) __builtin_ctzll(x);
+#endif
+}
+
+/*** Montgomery arithmetic modulo an odd n: residues are kept as a * 2^64 mod n, so a modular multiply
+	is a 64x64->128 multiply, one more high multiply, and a subtraction, with no division. All values
+	passed in and returned are in [0, n). ***/
+struct Mont64 {
+	u64 n;		// the modulus, odd
+	u64 ninv;	// n^-1 mod 2^64
+	u64 one;	// 1 in Montgomery form (2^64 mod n)
+	u64 r2;		// 2^128 mod n, for converting into Montgomery form
+
+	Mont64(u64 modulus) : n(modulus) {
+		// n * n == 1 mod 8 for any odd n, and each Newton step doubles the number of correct bits.
+		ninv = n;
+		for (int e = 0; e < 5; ++e)
+			ninv *= 2 - n * ninv;
+		one = (0 - n) % n;
+		r2 = one;
+		for (int e = 0; e < 64; ++e)
+			r2 = add(r2, r2);
+	}
+
+	u64 add(u64 a, u64 b) const {
+		return (a >= n - b) ? a - (n - b) : a + b;
+	}
+
+	u64 mul(u64 a, u64 b) const {
+		// a * b - m * n is a multiple of 2^64 with the low halves cancelling, so only the high halves matter.
+		const u64 hi = libdivide::libdivide_mullhi_u64(a, b);
+		const u64 m = a * b * ninv;
+		const u64 t = libdivide::libdivide_mullhi_u64(m, n);
+		return (hi >= t) ? hi - t : hi - t + n;
+	}
+
+	u64 to(u64 a) const {
+		return mul(a % n, r2);
+	}
+
+	u64 pow(u64 a, u64 ex) const {
+		u64 r = one;
+		while (ex != 0) {
+			if (ex & 1)
+				r = mul(r, a);
+			a = mul(a, a);
+			ex >>= 1;
+		}
+		return r;
+	}
+};
+
+/* Odd primes for trial division before the expensive tests. */
+static const u32 __small_odd_primes[] = { 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53 };
+
+/* Miller-Rabin for an odd n > 2^32. These seven bases (found by Jim Sinclair) give the right answer for every
+   n < 2^64, so the test is deterministic. */
+static bool miller_rabin64(u64 n) {
+	static const u64 bases[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+	const Mont64 m(n);
+	const u64 minus_one = n - m.one;
+	const u32 s = prime_ctz64(n - 1);
+	const u64 d = (n - 1) >> s;
+
+	for (u64 a : bases) {
+		u64 x = m.pow(m.to(a), d);
+		u32 r;
+
+		if (x == m.one || x == minus_one)
+			continue;
+		for (r = 1; r < s; ++r) {
+			x = m.mul(x, x);
+			if (x == minus_one)
+				break;
+		}
+		if (r >= s)
+			return false;
+	}
+
+	return true;
+}
+
+int isprime64(u64 i) {
+	if (i <= 0xFFFFFFFFULL)
+		return isprime((uint32_t) i);
+	if (0 == (i & 1))
+		return(0);
+	for (u32 p : __small_odd_primes)
+		if (0 == (i % p))
+			return(0);
+	return miller_rabin64(i) ? 1 : 0;
+}
+
+static u64 gcd64(u64 a, u64 b) {
+	u32 sh;
+
+	if (a == 0)
+		return b;
+	if (b == 0)
+		return a;
+	sh = prime_ctz64(a | b);
+	a >>= prime_ctz64(a);
+	do {
+		b >>= prime_ctz64(b);
+		if (a > b)
+			std::swap(a, b);
+		b -= a;
+	} while (b != 0);
+
+	return a << sh;
+}
+
+/* Find a nontrivial factor of the odd composite n with Brent's variant of Pollard's rho, iterating
+   x^2 + c in Montgomery form. The differences are multiplied together 128 at a time between gcds;
+   if a batch overshoots (the product is 0 mod n), the batch is replayed one step at a time. A cycle
+   that finds no factor is retried with the next c. */
+static u64 pollard_brent64(u64 n) {
+	const Mont64 m(n);
+	const u64 BATCH = 128;
+
+	for (u64 c = 1; ; ++c) {
+		const u64 cm = m.to(c);
+		u64 x, y = m.to(2), ys = y, q = m.one, g = 1, r = 1;
+
+		do {
+			x = y;
+			for (u64 e = 0; e < r; ++e)
+				y = m.add(m.mul(y, y), cm);
+			for (u64 k = 0; k < r && g == 1; k += BATCH) {
+				ys = y;
+				const u64 lim = std::min(BATCH, r - k);
+				for (u64 e = 0; e < lim; ++e) {
+					y = m.add(m.mul(y, y), cm);
+					q = m.mul(q, x > y ? x - y : y - x);
+				}
+				// q is (product) * 2^64 mod n, and 2^64 is coprime to n, so the gcd is the same.
+				g = gcd64(q, n);
+			}
+			r <<= 1;
+		} while (g == 1);
+
+		if (g == n) {
+			do {
+				ys = m.add(m.mul(ys, ys), cm);
+				g = gcd64(x > ys ? x - ys : ys - x, n);
+			} while (g == 1);
+		}
+		if (g != n)
+			return g;
+	}
+}
+
+static void factor64_rec(u64 n, std::vector<u64>& factors) {
+	if (n <= 0xFFFFFFFFULL) {
+		while (n > 1) {
+			const u32 p = prime_factor((uint32_t) n);
+			factors.push_back(p);
+			n /= p;
+		}
+		return;
+	}
+	if (isprime64(n)) {
+		factors.push_back(n);
+		return;
+	}
+	const u64 d = pollard_brent64(n);
+	factor64_rec(d, factors);
+	factor64_rec(n / d, factors);
+}
+
+void factor64(u64 i, std::vector<u64>& factors) {
+	factors.clear();
+	if (i < 2)
+		return;
+
+	const u32 twos = prime_ctz64(i);
+	factors.assign(twos, 2);
+	i >>= twos;
+	for (u32 p : __small_odd_primes) {
+		while (0 == (i % p)) {
+			factors.push_back(p);
+			i /= p;
+		}
+	}
+	factor64_rec(i, factors);
+	std::sort(factors.begin(), factors.end());
+}
+
+u64 prime_factor64(u64 i) {
+	std::vector<u64> factors;
+
+	if (i <= 0xFFFFFFFFULL)
+		return prime_factor((uint32_t) i);
+	factor64(i, factors);
+	return factors[0];
+}
+
+/* end isprime.cpp */
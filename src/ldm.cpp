@@ -49,8 +49,6 @@ static void validate_wh(u32& w, u32& h) {
 	ship_assert((w != 0) && (h != 0));
 }
 
-static std::mutex __ldm_mtx;
-
 SDServer::SDServer() {
 	sd_model = nullptr;
 	nthreads = std::max((int) std::thread::hardware_concurrency() / 2, 1);
@@ -59,6 +57,8 @@ SDServer::SDServer() {
 	variation_seed = 43;
 	sampler = sd_euler;
 	scheduler = sd_karras;
+	rng = sd_rng_std;
+	cache_enabled = true;
 }
 
 SDServer::~SDServer() {
@@ -75,8 +75,10 @@ SBitmap** SDServer::txt2img(const std::string& prompt, const std::string& neg_pr
 	i64 seed;
 
 	validate_wh(w, h);
+	ScopeMutex sm(mtx);
 	if (!ensure_model())
 		return ret;
+	apply_gen_settings();
 
 	if (rng_seed > -1) {
 		seed = rng_seed;
@@ -122,6 +124,80 @@ SBitmap** SDServer::txt2img(const std::string& prompt, const std::string& neg_pr
 	return ret;
 }
 
+SBitmap** SDServer::generate_batch(const std::vector<SDRequest>& reqs) {
+	std::vector<sd_batch_item_t> items;
+	std::vector<sd_image_t*> init_imgs;
+	sd_image_t* output;
+	SBitmap** ret = nullptr;
+
+	if (reqs.empty())
+		return ret;
+	const SDRequest& req0 = reqs[0];
+	for (const SDRequest& req : reqs) {
+		if (!req0.batches_with(req)) {
+			codehappy_cerr << "generate_batch: the requests can't share a run\n";
+			return ret;
+		}
+		if (not_null(req.init_img) && !legal_img2img(req.init_img)) {
+			codehappy_cerr << "invalid input image for img2img -- dimensions must be multiples of 64\n";
+			return ret;
+		}
+	}
+	u32 w = req0.w, h = req0.h;
+	if (not_null(req0.init_img)) {
+		w = req0.init_img->width();
+		h = req0.init_img->height();
+	} else {
+		validate_wh(w, h);
+	}
+
+	ScopeMutex sm(mtx);
+	if (!ensure_model())
+		return ret;
+	apply_gen_settings();
+
+	for (const SDRequest& req : reqs) {
+		sd_image_t* in_img = nullptr;
+		if (not_null(req.init_img)) {
+			in_img = bmp_to_sdimg(req.init_img);
+			init_imgs.push_back(in_img);
+		}
+		for (int e = 0; e < req.n_images; ++e) {
+			sd_batch_item_t item;
+			item.prompt = (req.prompt.empty() ? nullptr : req.prompt.c_str());
+			item.negative_prompt = (req.neg_prompt.empty() ? nullptr : req.neg_prompt.c_str());
+			item.seed = req.seed + e;
+			item.init_image = in_img;
+			items.push_back(item);
+		}
+	}
+	const int n = (int) items.size();
+	if (n == 0)
+		return ret;
+
+	output = ::generate_batch(sd_model,
+		items.data(),
+		n,
+		0, /* clip skip */
+		req0.cfg_scale,
+		w,
+		h,
+		(sample_method_t) (req0.sampler >= 0 ? req0.sampler : (int) sampler),
+		(req0.steps > 0 ? req0.steps : steps),
+		(float) req0.img_strength);
+	for (sd_image_t* in_img : init_imgs)
+		free_sdimg(in_img, 1);
+	NOT_NULL_OR_RETURN(output, ret);
+
+	ret = new SBitmap * [n];
+	for (int e = 0; e < n; ++e) {
+		ret[e] = sdimg_to_bmp(output, e);
+	}
+	free_sdimg(output, n);
+	last_seed = items[n - 1].seed;
+
+	return ret;
+}
 
 SBitmap** SDServer::txt2img_slerp(int n_steps, const std::string& prompt_1, const std::string& prompt_2, const std::string& neg_prompt_1,
 		const std::string& neg_prompt_2, i64 rng_seed_1, i64 rng_seed_2, u32 w, u32 h, double cfg_scale_1, double cfg_scale_2,
@@ -147,6 +223,10 @@ SBitmap** SDServer::txt2img_slerp(SDInterpolationData* interp_data, const std::s
 	int bs_use, i = 0;
 
 	ship_assert(interp_data != nullptr);
+	ScopeMutex sm(mtx);
+	if (!ensure_model())
+		return nullptr;
+	apply_gen_settings();
 	if (rng_seed_1 > -1) {
 		seed1 = rng_seed_1;
 	} else {
@@ -236,8 +316,6 @@ SBitmap** SDServer::img2img(SBitmap* init_img, double img_strength, const std::s
 	i64 seed;
 	u32 w, h;
 
-	if (!ensure_model())
-		return ret;
 	NOT_NULL_OR_RETURN(init_img, nullptr);
 	if (!legal_img2img(init_img)) {
 		codehappy_cerr << "invalid input image for img2img -- dimensions must be multiples of 64\n";
@@ -254,8 +332,11 @@ SBitmap** SDServer::img2img(SBitmap* init_img, double img_strength, const std::s
 			seed = -seed;
 	}
 
+	ScopeMutex sm(mtx);
+	if (!ensure_model())
+		return ret;
 	in_img = bmp_to_sdimg(init_img);
-
+	apply_gen_settings();
 	output = ::img2img(sd_model,
 			*in_img,
 			(prompt.empty() ? nullptr : prompt.c_str()),
@@ -296,7 +377,14 @@ SBitmap** SDServer::img2img(SBitmap* init_img, double img_strength, const std::s
 bool SDServer::ensure_model() {
 	if (sd_model != nullptr)
 		return true;
-	return load_default_model();
+	return load_default_locked(0, false);
+}
+
+void SDServer::apply_gen_settings() {
+	sd_ctx_set_n_threads(sd_model, (int) nthreads);
+	sd_ctx_set_schedule(sd_model, (schedule_t) scheduler);
+	sd_ctx_set_rng_type(sd_model, (rng_type_t) rng);
+	sd_ctx_set_gen_cache(sd_model, cache_enabled ? &gen_cache : nullptr);
 }
 
 static ggml_type wtype_from_path(const std::string& path, ggml_type wtype) {
@@ -358,7 +446,11 @@ sd_type_t sdtype_from_wtype(ggml_type wtype) {
 }
 
 bool SDServer::load_from_file(const std::string& model_path, const std::string& vae_path, ggml_type wtype) {
-	ScopeMutex sm(__ldm_mtx);
+	ScopeMutex sm(mtx);
+	return load_locked(model_path, vae_path, wtype);
+}
+
+bool SDServer::load_locked(const std::string& model_path, const std::string& vae_path, ggml_type wtype) {
 	const char * model_path_cstr, * vae_path_cstr = nullptr;
 	if (sd_model != nullptr) {
 		free_sd_ctx(sd_model);
@@ -372,8 +464,9 @@ bool SDServer::load_from_file(const std::string& model_path, const std::string&
 	if (!vae_p.empty())
 		vae_path_cstr = vae_p.c_str();
 
+	gen_cache.clear();
 	sd_model = new_sd_ctx(model_path_cstr, vae_path_cstr, nullptr, nullptr, nullptr, nullptr, nullptr, false, false, false,
-				(int) nthreads, mtype, STD_DEFAULT_RNG,
+				(int) nthreads, mtype, (rng_type_t) rng,
 				(schedule_t) scheduler, false, false, false);
 
 	return (sd_model != nullptr);
@@ -385,6 +478,11 @@ bool SDServer::load_from_file(const std::string& path, ggml_type wtype) {
 }
 
 bool SDServer::load_default_model(int sd_version, bool download_if_missing) {
+	ScopeMutex sm(mtx);
+	return load_default_locked(sd_version, download_if_missing);
+}
+
+bool SDServer::load_default_locked(int sd_version, bool download_if_missing) {
 	std::string URI;
 	bool default_exists[2], check_ckpt = false;
 
@@ -401,7 +499,7 @@ bool SDServer::load_default_model(int sd_version, bool download_if_missing) {
 		dirent* entry;
 		while (entry = readdir(di)) {
 			if (strstr(entry->d_name, ".ckpt") != nullptr) {
-				if (load_from_file(entry->d_name)) {
+				if (load_locked(entry->d_name, std::string(), GGML_TYPE_UNK)) {
 					closedir(di);
 					return true;
 				}
@@ -412,8 +510,8 @@ bool SDServer::load_default_model(int sd_version, bool download_if_missing) {
 
 	switch (sd_version) {
 	case 0:
-		if (!load_default_model(2, download_if_missing))
-			return load_default_model(1, download_if_missing);
+		if (!load_default_locked(2, download_if_missing))
+			return load_default_locked(1, download_if_missing);
 		break;
 	case 1:
 		if (!FileExists(sd_default_model_names[0])) {
@@ -424,7 +522,7 @@ bool SDServer::load_default_model(int sd_version, bool download_if_missing) {
 			if (!FetchURIToFile(URI, sd_default_model_names[0]))
 				return false;
 		}
-		return load_from_file(sd_default_model_names[0]);
+		return load_locked(sd_default_model_names[0], std::string(), GGML_TYPE_UNK);
 	case 2:
 		if (!FileExists(sd_default_model_names[1])) {
 			if (!download_if_missing)
@@ -434,7 +532,7 @@ bool SDServer::load_default_model(int sd_version, bool download_if_missing) {
 			if (!FetchURIToFile(URI, sd_default_model_names[1]))
 				return false;
 		}
-		return load_from_file(sd_default_model_names[1]);
+		return load_locked(sd_default_model_names[1], std::string(), GGML_TYPE_UNK);
 	default:
 		codehappy_cerr << "*** Error: unknown default model version: " << sd_version << "?\n";
 		return false;
@@ -444,12 +542,7 @@ bool SDServer::load_default_model(int sd_version, bool download_if_missing) {
 }
 
 void SDServer::set_nthreads(u32 nt) {
-	bool reload = false;
-	if (nt != nthreads && sd_model != nullptr)
-		reload = true;
-	nthreads = nt;
-	if (reload)
-		load_from_file(model_p, vae_p);
+	nthreads = std::max(nt, 1U);
 }
 
 void SDServer::set_sampler_type(SDSamplerType sampler_type) {
@@ -460,6 +553,40 @@ void SDServer::set_scheduler_type(SDSchedulerType scheduler_type) {
 	scheduler = scheduler_type;
 }
 
+void SDServer::set_rng_type(SDRNGType rng_type) {
+	rng = rng_type;
+}
+
+void SDServer::set_cache_enabled(bool enabled) {
+	cache_enabled = enabled;
+}
+
+void SDServer::set_cache_size(u32 max_conds, u32 max_noise) {
+	ScopeMutex sm(mtx);
+	gen_cache.max_conds = max_conds;
+	gen_cache.max_noise = max_noise;
+	gen_cache.clear();
+}
+
+void SDServer::clear_cache() {
+	ScopeMutex sm(mtx);
+	gen_cache.clear();
+}
+
+static double hit_rate(u64 hits, u64 misses) {
+	if (hits + misses == 0)
+		return 0.;
+	return double(hits) / double(hits + misses);
+}
+
+double SDServer::cond_cache_hit_rate() const {
+	return hit_rate(gen_cache.cond_hits, gen_cache.cond_misses);
+}
+
+double SDServer::noise_cache_hit_rate() const {
+	return hit_rate(gen_cache.noise_hits, gen_cache.noise_misses);
+}
+
 void SDServer::set_steps(u32 st) {
 	steps = st;
 }
@@ -468,6 +595,138 @@ void SDServer::set_variation_seed(i64 seed) {
 	variation_seed = seed;
 }
 
+SDRequest::SDRequest() {
+	w = 512;
+	h = 512;
+	cfg_scale = 7.0;
+	seed = -1;
+	n_images = 1;
+	steps = 0;
+	sampler = -1;
+	init_img = nullptr;
+	img_strength = 0.75;
+}
+
+bool SDRequest::batches_with(const SDRequest& req) const {
+	if (cfg_scale != req.cfg_scale || steps != req.steps || sampler != req.sampler)
+		return false;
+	if (is_null(init_img) || is_null(req.init_img)) {
+		return is_null(init_img) && is_null(req.init_img) && w == req.w && h == req.h;
+	}
+	return init_img->width() == req.init_img->width() && init_img->height() == req.init_img->height() &&
+		img_strength == req.img_strength;
+}
+
+SDJobQueue::SDJobQueue(SDServer* server, int max_batch) {
+	std::vector<SDServer*> servers;
+	servers.push_back(server);
+	max_imgs = std::max(max_batch, 1);
+	start(servers);
+}
+
+SDJobQueue::SDJobQueue(const std::vector<SDServer*>& servers, int max_batch) {
+	max_imgs = std::max(max_batch, 1);
+	start(servers);
+}
+
+SDJobQueue::~SDJobQueue() {
+	close();
+}
+
+void SDJobQueue::start(const std::vector<SDServer*>& servers) {
+	closing = false;
+	n_requests = 0;
+	n_runs = 0;
+	for (SDServer* server : servers) {
+		workers.push_back(std::thread([this, server]() { worker_main(server); }));
+	}
+}
+
+std::future<SDResult> SDJobQueue::submit(const SDRequest& req) {
+	Job* job = new Job;
+	job->req = req;
+	job->req.n_images = std::max(job->req.n_images, 1);
+	validate_wh(job->req.w, job->req.h);
+	if (job->req.seed < 0) {
+		job->req.seed = RandI64();
+		if (job->req.seed < 0)
+			job->req.seed = -job->req.seed;
+	}
+	std::future<SDResult> ret = job->result.get_future();
+	if (not_null(job->req.init_img) && !legal_img2img(job->req.init_img)) {
+		codehappy_cerr << "invalid input image for img2img -- dimensions must be multiples of 64\n";
+		SDResult empty;
+		empty.seed = job->req.seed;
+		job->result.set_value(empty);
+		delete job;
+		return ret;
+	}
+
+	ScopeMutex sm(mtx);
+	ship_assert(!closing);
+	pending.push_back(job);
+	cv.notify_one();
+	return ret;
+}
+
+void SDJobQueue::close() {
+	{
+		ScopeMutex sm(mtx);
+		closing = true;
+		cv.notify_all();
+	}
+	for (auto& th : workers)
+		th.join();
+	workers.clear();
+}
+
+void SDJobQueue::worker_main(SDServer* server) {
+	forever {
+		std::vector<Job*> run;
+		int n_imgs;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [this]() { return closing || !pending.empty(); });
+			if (pending.empty())
+				return;
+			// the oldest request, and whatever else can share its run.
+			run.push_back(pending.front());
+			pending.pop_front();
+			n_imgs = run[0]->req.n_images;
+			for (auto it = pending.begin(); it != pending.end() && n_imgs < max_imgs; ) {
+				if (run[0]->req.batches_with((*it)->req) && n_imgs + (*it)->req.n_images <= max_imgs) {
+					n_imgs += (*it)->req.n_images;
+					run.push_back(*it);
+					it = pending.erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+
+		std::vector<SDRequest> reqs;
+		for (Job* job : run)
+			reqs.push_back(job->req);
+		SBitmap** bmps = server->generate_batch(reqs);
+		// counted before the results are handed out, so a caller who has them all sees every run.
+		n_requests += run.size();
+		++n_runs;
+
+		int i = 0;
+		for (Job* job : run) {
+			SDResult res;
+			res.seed = job->req.seed;
+			for (int e = 0; e < job->req.n_images; ++e, ++i) {
+				if (not_null(bmps))
+					res.imgs.push_back(bmps[i]);
+			}
+			job->result.set_value(res);
+			delete job;
+		}
+		delete [] bmps;
+	}
+}
+
 SBitmap* single_bmp_from_u8array(uint8_t* data, u32 w, u32 h) {
 	SBitmap* ret = nullptr;
 	u32 i = 0;
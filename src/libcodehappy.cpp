@@ -982,6 +982,7 @@ bool is_codehappy_verbose() {
 #include "bits.cpp"
 #include "unicode.cpp"
 #include "scratchpad.cpp"
+#include "threadpool.cpp"
 #include "external/miniz.h"
 #include "rand.cpp"
 #include "misc.cpp"
@@ -992,8 +993,10 @@ bool is_codehappy_verbose() {
 #include "drawing.cpp"
 #include "gif.cpp"
 #include "quantize.cpp"
+#include "framed.cpp"
 #include "ramfiles.cpp"
 #include "wavrender.cpp"
+#include "wavfilter.cpp"
 #include "parser.cpp"
 #include "input.cpp"
 #include "kb.cpp"
@@ -1002,6 +1005,9 @@ bool is_codehappy_verbose() {
 #include "wget.cpp"
 #include "calendar.cpp"
 #include "extern.cpp"
+#include "fuzzy.cpp"
+#include "regexdfa.cpp"
+#include "bindelta.cpp"
 #include "csv.cpp"
 #include "pcx.cpp"
 #include "rotate.cpp"
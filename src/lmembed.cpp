@@ -9,31 +9,211 @@
 
 ***/
 
+/*** IEEE half precision conversions (these don't need ggml to be initialized.) ***/
+static float f16_to_f32(u16 h) {
+	u32 sign = (u32) (h & 0x8000) << 16;
+	u32 ex = (h >> 10) & 0x1f, man = h & 0x3ff;
+	u32 bits;
+	float f;
+
+	if (ex == 0x1f) {
+		bits = sign | 0x7f800000 | (man << 13);
+	} else if (ex != 0) {
+		bits = sign | ((ex + 112) << 23) | (man << 13);
+	} else if (man != 0) {
+		// subnormal: the value is man * 2^-24.
+		f = (float) man * (1.f / 16777216.f);
+		return sign ? -f : f;
+	} else {
+		bits = sign;
+	}
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static u16 f32_to_f16(float f) {
+	u32 bits;
+	memcpy(&bits, &f, sizeof(bits));
+	u32 sign = (bits >> 16) & 0x8000;
+	i32 ex = (i32) ((bits >> 23) & 0xff) - 112;
+	u32 man = bits & 0x7fffff;
+
+	if (((bits >> 23) & 0xff) == 0xff)
+		return (u16) (sign | 0x7c00 | (man ? 0x200 : 0));
+	if (ex >= 0x1f)
+		return (u16) (sign | 0x7c00);
+	if (ex <= 0) {
+		if (ex < -10)
+			return (u16) sign;
+		// subnormal result, round to nearest even.
+		man |= 0x800000;
+		u32 shift = (u32) (14 - ex);
+		u32 hm = man >> shift, rem = man & ((1 << shift) - 1), half = 1 << (shift - 1);
+		if (rem > half || (rem == half && (hm & 1)))
+			++hm;
+		return (u16) (sign | hm);
+	}
+	u32 h = sign | ((u32) ex << 10) | (man >> 13);
+	u32 rem = man & 0x1fff;
+	// round to nearest even; a carry out of the mantissa correctly bumps the exponent.
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+		++h;
+	return (u16) h;
+}
+
+/*** SIMD kernels for embedding dot products. ***/
+
+// Returns the dot product of a and b; the sum of squares of b is returned in *bsq (if non-null.)
+static double dot_f32(const float* a, const float* b, int n, double* bsq) {
+	int e = 0;
+	double dot = 0., sq = 0.;
+#if defined(CODEHAPPY_AVX2)
+	__m256 vd = _mm256_setzero_ps(), vs = _mm256_setzero_ps();
+	for (; e + 8 <= n; e += 8) {
+		__m256 va = _mm256_loadu_ps(a + e), vb = _mm256_loadu_ps(b + e);
+		vd = _mm256_add_ps(vd, _mm256_mul_ps(va, vb));
+		vs = _mm256_add_ps(vs, _mm256_mul_ps(vb, vb));
+	}
+	float td[8], ts[8];
+	_mm256_storeu_ps(td, vd);
+	_mm256_storeu_ps(ts, vs);
+	for (int i = 0; i < 8; ++i) {
+		dot += td[i];
+		sq += ts[i];
+	}
+#elif defined(CODEHAPPY_SSE2)
+	__m128 vd = _mm_setzero_ps(), vs = _mm_setzero_ps();
+	for (; e + 4 <= n; e += 4) {
+		__m128 va = _mm_loadu_ps(a + e), vb = _mm_loadu_ps(b + e);
+		vd = _mm_add_ps(vd, _mm_mul_ps(va, vb));
+		vs = _mm_add_ps(vs, _mm_mul_ps(vb, vb));
+	}
+	float td[4], ts[4];
+	_mm_storeu_ps(td, vd);
+	_mm_storeu_ps(ts, vs);
+	for (int i = 0; i < 4; ++i) {
+		dot += td[i];
+		sq += ts[i];
+	}
+#endif
+	for (; e < n; ++e) {
+		dot += a[e] * b[e];
+		sq += b[e] * b[e];
+	}
+	if (bsq != nullptr)
+		*bsq = sq;
+	return dot;
+}
+
+static double dot_f32_f16(const float* a, const u16* b, int n) {
+	int e = 0;
+	double dot = 0.;
+#if defined(CODEHAPPY_AVX2) && defined(CODEHAPPY_F16C)
+	__m256 vd = _mm256_setzero_ps();
+	for (; e + 8 <= n; e += 8) {
+		__m256 vb = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*) (b + e)));
+		vd = _mm256_add_ps(vd, _mm256_mul_ps(_mm256_loadu_ps(a + e), vb));
+	}
+	float td[8];
+	_mm256_storeu_ps(td, vd);
+	for (int i = 0; i < 8; ++i)
+		dot += td[i];
+#endif
+	for (; e < n; ++e)
+		dot += a[e] * f16_to_f32(b[e]);
+	return dot;
+}
+
+static i64 dot_i8(const i8* a, const i8* b, int n) {
+	int e = 0;
+	i64 dot = 0;
+#if defined(CODEHAPPY_AVX2)
+	__m256i vd = _mm256_setzero_si256();
+	for (; e + 16 <= n; e += 16) {
+		__m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*) (a + e)));
+		__m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*) (b + e)));
+		vd = _mm256_add_epi32(vd, _mm256_madd_epi16(va, vb));
+	}
+	i32 td[8];
+	_mm256_storeu_si256((__m256i*) td, vd);
+	for (int i = 0; i < 8; ++i)
+		dot += td[i];
+#elif defined(CODEHAPPY_SSE2)
+	__m128i vd = _mm_setzero_si128();
+	const __m128i zero = _mm_setzero_si128();
+	for (; e + 16 <= n; e += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i*) (a + e));
+		__m128i vb = _mm_loadu_si128((const __m128i*) (b + e));
+		// sign-extend the bytes to 16 bits, then multiply and add adjacent pairs into 32 bits.
+		__m128i sa = _mm_cmpgt_epi8(zero, va), sb = _mm_cmpgt_epi8(zero, vb);
+		vd = _mm_add_epi32(vd, _mm_madd_epi16(_mm_unpacklo_epi8(va, sa), _mm_unpacklo_epi8(vb, sb)));
+		vd = _mm_add_epi32(vd, _mm_madd_epi16(_mm_unpackhi_epi8(va, sa), _mm_unpackhi_epi8(vb, sb)));
+	}
+	i32 td[4];
+	_mm_storeu_si128((__m128i*) td, vd);
+	for (int i = 0; i < 4; ++i)
+		dot += td[i];
+#endif
+	for (; e < n; ++e)
+		dot += (i32) a[e] * (i32) b[e];
+	return dot;
+}
+
+static float quantize_i8(const float* v, int n, i8* out) {
+	float mx = 0.f;
+	for (int e = 0; e < n; ++e)
+		mx = std::max(mx, (float) fabs(v[e]));
+	float scale = (mx > 0.f) ? mx / 127.f : 1.f;
+	float inv = 1.f / scale;
+	for (int e = 0; e < n; ++e)
+		out[e] = (i8) lrintf(v[e] * inv);
+	return scale;
+}
+
 LMEmbedding::LMEmbedding() {
 	n_embed = 0;
 	embed_data = nullptr;
 	text = nullptr;
+	embed_type = LMEMBED_F32;
+	qdata = nullptr;
+	qscale = 1.f;
+	qmag = 0.f;
 }
 
 LMEmbedding::~LMEmbedding() {
 	free();
 }
 
+static void free_qdata(LMEmbedding* le) {
+	if (le->qdata != nullptr) {
+		if (le->embed_type == LMEMBED_F16)
+			delete [] (u16*) le->qdata;
+		else
+			delete [] (i8*) le->qdata;
+	}
+	le->qdata = nullptr;
+	le->embed_type = LMEMBED_F32;
+	le->qscale = 1.f;
+}
+
 void LMEmbedding::free() {
 	if (embed_data != nullptr)
-		delete embed_data;
+		delete [] embed_data;
 	if (text != nullptr)
-		delete text;
+		delete [] text;
+	free_qdata(this);
 	n_embed = 0;
 	embed_data = nullptr;
 	text = nullptr;
+	qmag = 0.f;
 }
 
 double LMEmbedding::cosine_similarity(const LMEmbedding* le) const {
 	double cos_val;
 
-	NOT_NULL_OR_RETURN(embed_data, -2.0);
 	NOT_NULL_OR_RETURN(le, -2.0);
+	if (embed_data == nullptr && qdata == nullptr)
+		return -2.0;
 
 	cos_val = dot_product(le) / (magnitude() * le->magnitude());
 	return cos_val;
@@ -41,33 +221,57 @@ double LMEmbedding::cosine_similarity(const LMEmbedding* le) const {
 
 double LMEmbedding::magnitude() const {
 	double ret = 0.;
-	NOT_NULL_OR_RETURN(embed_data, 0.0);
-
-	for (int e = 0; e < n_embed; ++e) {
-		ret += (embed_data[e] * embed_data[e]);
-	}
+	if (embed_data == nullptr)
+		return qmag;
 
+	dot_f32(embed_data, embed_data, n_embed, &ret);
 	return sqrt(ret);
 }
 
 double LMEmbedding::dot_product(const LMEmbedding* le) const {
-	double ret = 0.;
-
-	NOT_NULL_OR_RETURN(embed_data, 0.0);
 	ship_assert(!is_null(le));
 	ship_assert(n_embed == le->n_embed);
 
-	for (int e = 0; e < n_embed; ++e) {
-		ret += (embed_data[e] * le->embed_data[e]);
-	}
+	if (le->embed_data != nullptr)
+		return dot_product(le->embed_data);
+	if (embed_data != nullptr)
+		return le->dot_product(embed_data);
+	if (embed_type == LMEMBED_I8 && le->embed_type == LMEMBED_I8)
+		return (double) dot_i8((const i8*) qdata, (const i8*) le->qdata, n_embed) * qscale * le->qscale;
 
-	return ret;
+	std::vector<float> v(n_embed);
+	le->to_float_array(v.data());
+	return dot_product(v.data());
+}
+
+double LMEmbedding::dot_product(const float* v) const {
+	NOT_NULL_OR_RETURN(v, 0.0);
+	if (embed_data != nullptr)
+		return dot_f32(v, embed_data, n_embed, nullptr);
+
+	switch (embed_type) {
+	case LMEMBED_F16:
+		return dot_f32_f16(v, (const u16*) qdata, n_embed);
+	case LMEMBED_I8:
+		{
+		const i8* q = (const i8*) qdata;
+		double ret = 0.;
+		for (int e = 0; e < n_embed; ++e)
+			ret += v[e] * q[e];
+		return ret * qscale;
+		}
+	default:
+		break;
+	}
+	return 0.0;
 }
 
 void LMEmbedding::copy_from_array(int n_el, const float* array) {
 	ship_assert(n_el >= 0);
 	ship_assert(array != nullptr);
-	free();
+	if (embed_data != nullptr)
+		delete [] embed_data;
+	free_qdata(this);
 	embed_data = new float [n_el];
 	for (int e = 0; e < n_el; ++e) {
 		embed_data[e] = array[e];
@@ -75,10 +279,75 @@ void LMEmbedding::copy_from_array(int n_el, const float* array) {
 	n_embed = n_el;
 }
 
+void LMEmbedding::to_float_array(float* out) const {
+	if (embed_data != nullptr) {
+		memcpy(out, embed_data, sizeof(float) * n_embed);
+		return;
+	}
+	switch (embed_type) {
+	case LMEMBED_F16:
+		for (int e = 0; e < n_embed; ++e)
+			out[e] = f16_to_f32(((const u16*) qdata)[e]);
+		break;
+	case LMEMBED_I8:
+		for (int e = 0; e < n_embed; ++e)
+			out[e] = ((const i8*) qdata)[e] * qscale;
+		break;
+	default:
+		memset(out, 0, sizeof(float) * n_embed);
+		break;
+	}
+}
+
+void LMEmbedding::quantize(LMEmbedType type, bool keep_f32) {
+	if (n_embed <= 0)
+		return;
+	if (embed_data == nullptr) {
+		if (type == embed_type)
+			return;
+		// requantizing: go through the float values.
+		float* v = new float [n_embed];
+		to_float_array(v);
+		embed_data = v;
+	}
+	free_qdata(this);
+	qmag = (float) magnitude();
+	switch (type) {
+	case LMEMBED_F16:
+		qdata = new u16 [n_embed];
+		for (int e = 0; e < n_embed; ++e)
+			((u16*) qdata)[e] = f32_to_f16(embed_data[e]);
+		break;
+	case LMEMBED_I8:
+		qdata = new i8 [n_embed];
+		qscale = quantize_i8(embed_data, n_embed, (i8*) qdata);
+		break;
+	default:
+		return;
+	}
+	embed_type = type;
+	if (!keep_f32) {
+		delete [] embed_data;
+		embed_data = nullptr;
+	}
+}
+
+size_t LMEmbedding::embed_bytes() const {
+	size_t ret = 0;
+	if (embed_data != nullptr)
+		ret += sizeof(float) * n_embed;
+	if (qdata != nullptr)
+		ret += (embed_type == LMEMBED_F16 ? sizeof(u16) : sizeof(i8)) * n_embed;
+	return ret;
+}
+
 void LMEmbedding::out_to_ramfile(RamFile* rf) {
+	// always saved as float32, so the file format doesn't depend on the in-memory storage.
+	std::vector<float> v(n_embed);
+	to_float_array(v.data());
 	rf->put32(n_embed);
 	for (int e = 0; e < n_embed; ++e)
-		rf->putfloat(embed_data[e]);
+		rf->putfloat(v[e]);
 	rf->putstring(text);
 }
 
@@ -95,9 +364,11 @@ void LMEmbedding::in_from_ramfile(RamFile* rf) {
 }
 
 void LMEmbedding::out_to_stream_fmt(std::ostream& o) {
+	std::vector<float> v(n_embed);
+	to_float_array(v.data());
 	o << n_embed << std::endl;
 	for (int e = 0; e < n_embed; ++e) {
-		o << embed_data[e] << std::endl;
+		o << v[e] << std::endl;
 	}
 	std::string tout = text;
 	p_replace(tout, "\n", " ");
@@ -113,91 +384,211 @@ std::string LMEmbedding::original_text() const {
 
 LMBestMatch::LMBestMatch(int max_matches) {
 	n_matches = 0;
-	n_matches_max = std::min(max_matches, MAX_EMBED_MATCHES);
-	n_matches_max = std::max(n_matches_max, 1);
-	for (int i = 0; i < MAX_EMBED_MATCHES; ++i) {
+	n_matches_max = std::max(max_matches, 1);
+	min_cos_sim = -2.0;
+	i_own_this_memory = false;
+	is_sorted = false;
+}
+
+LMBestMatch::~LMBestMatch() {
+	clear();
+}
+
+void LMBestMatch::clear() {
+	for (int e = 0; e < n_matches; ++e)
+		free_entry(e);
+	matches.clear();
+	cos_sim.clear();
+	filename.clear();
+	offset.clear();
+	owned.clear();
+	n_matches = 0;
+	is_sorted = false;
+}
+
+void LMBestMatch::free_entry(int i) {
+	if (!owned[i])
+		return;
+	if (matches[i] != nullptr) {
+		matches[i]->free();
+		delete matches[i];
 		matches[i] = nullptr;
-		cos_sim[i] = -2.0;
+	}
+	if (filename[i] != nullptr) {
+		delete [] filename[i];
 		filename[i] = nullptr;
-		offset[i] = 0UL;
 	}
-	min_cos_sim = 2.0;
-	i_min = 0;
-	i_own_this_memory = false;
 }
 
-LMBestMatch::~LMBestMatch() {
-	if (i_own_this_memory) {
-		for (int e = 0; e < MAX_EMBED_MATCHES; ++e) {
-			if (matches[e] != nullptr) {
-				matches[e]->free();
-				delete matches[e];
-				matches[e] = nullptr;
-			}
-			if (filename[e] != nullptr) {
-				delete filename[e];
-				filename[e] = nullptr;
-			}
-		}
+void LMBestMatch::swap_entries(int i, int j) {
+	std::swap(matches[i], matches[j]);
+	std::swap(cos_sim[i], cos_sim[j]);
+	std::swap(filename[i], filename[j]);
+	std::swap(offset[i], offset[j]);
+	std::swap(owned[i], owned[j]);
+}
+
+void LMBestMatch::sift_up(int i) {
+	while (i > 0) {
+		int p = (i - 1) >> 1;
+		if (cos_sim[p] <= cos_sim[i])
+			break;
+		swap_entries(i, p);
+		i = p;
+	}
+}
+
+void LMBestMatch::sift_down(int i) {
+	forever {
+		int c = i * 2 + 1;
+		if (c >= n_matches)
+			break;
+		if (c + 1 < n_matches && cos_sim[c + 1] < cos_sim[c])
+			++c;
+		if (cos_sim[i] <= cos_sim[c])
+			break;
+		swap_entries(i, c);
+		i = c;
 	}
 }
 
+void LMBestMatch::heapify() {
+	for (int i = n_matches / 2 - 1; i >= 0; --i)
+		sift_down(i);
+	is_sorted = false;
+}
+
+bool LMBestMatch::would_accept(double score) const {
+	if (score < min_cos_sim)
+		return false;
+	if (n_matches < n_matches_max)
+		return true;
+	// once sorted, the worst match is at the end rather than the heap root.
+	return score > (is_sorted ? cos_sim[n_matches - 1] : cos_sim[0]);
+}
+
 bool LMBestMatch::check_match(LMEmbedding* lme, double score, const char* fname, u32 offs) {
-	if (n_matches == n_matches_max && score <= min_cos_sim) {
+	return insert_match(lme, score, fname, offs, i_own_this_memory);
+}
+
+bool LMBestMatch::insert_match(LMEmbedding* lme, double score, const char* fname, u32 offs, bool own) {
+	if (!would_accept(score))
 		return false;
-	}
+	if (is_sorted)
+		heapify();
 
 	if (n_matches < n_matches_max) {
-		matches[n_matches] = lme;
-		cos_sim[n_matches] = score;
-		filename[n_matches] = fname;
-		offset[n_matches] = offs;
-		if (score < min_cos_sim) {
-			min_cos_sim = score;
-			i_min = n_matches;
-		}
+		matches.push_back(lme);
+		cos_sim.push_back(score);
+		filename.push_back(fname);
+		offset.push_back(offs);
+		owned.push_back(own);
 		n_matches++;
+		sift_up(n_matches - 1);
 		return true;
 	}
 
-	// the match array is full, but this has a better cosine similarity than the worst, so replace that.
-	if (i_own_this_memory) {
-		matches[i_min]->free();
-		delete matches[i_min];
-		delete filename[i_min];
-	}
-	matches[i_min] = lme;
-	cos_sim[i_min] = score;
-	filename[i_min] = fname;
-	offset[i_min] = offs;
-	i_min = 0;
-	min_cos_sim = cos_sim[0];
-	for (int e = 1; e < n_matches; ++e) {
-		if (cos_sim[e] < min_cos_sim) {
-			min_cos_sim = cos_sim[e];
-			i_min = e;
-		}
-	}
+	// the heap is full, but this has a better cosine similarity than the worst (at the root), so replace that.
+	free_entry(0);
+	matches[0] = lme;
+	cos_sim[0] = score;
+	filename[0] = fname;
+	offset[0] = offs;
+	owned[0] = own;
+	sift_down(0);
 	return true;
 }
 
+void LMBestMatch::merge(LMBestMatch& other) {
+	for (int e = 0; e < other.n_matches; ++e) {
+		// an entry that is kept goes on being freed (or not) as it was in other.
+		if (insert_match(other.matches[e], other.cos_sim[e], other.filename[e], other.offset[e], other.owned[e] != 0))
+			other.owned[e] = false;
+	}
+	other.clear();
+}
+
 void LMBestMatch::sort_matches() {
-	for (int i = 0; i < MAX_EMBED_MATCHES; ++i) {
-		for (int j = i + 1; j < MAX_EMBED_MATCHES; ++j) {
-			if (matches[j] == nullptr) {
-				continue;
-			}
-			if (cos_sim[i] < cos_sim[j]) {
-				SWAP(matches[i], matches[j], LMEmbedding*);
-				SWAP(cos_sim[i], cos_sim[j], double);
-				SWAP(filename[i], filename[j], const char*);
-				SWAP(offset[i], offset[j], u32);
-				--j;
-			}
-		}
+	std::vector<int> idx(n_matches);
+	for (int e = 0; e < n_matches; ++e)
+		idx[e] = e;
+	std::sort(idx.begin(), idx.end(), [this](int i, int j) { return cos_sim[i] > cos_sim[j]; });
+
+	std::vector<LMEmbedding*> m(n_matches);
+	std::vector<double> cs(n_matches);
+	std::vector<const char*> fn(n_matches);
+	std::vector<u32> of(n_matches);
+	std::vector<u8> ow(n_matches);
+	for (int e = 0; e < n_matches; ++e) {
+		m[e] = matches[idx[e]];
+		cs[e] = cos_sim[idx[e]];
+		fn[e] = filename[idx[e]];
+		of[e] = offset[idx[e]];
+		ow[e] = owned[idx[e]];
 	}
+	matches.swap(m);
+	cos_sim.swap(cs);
+	filename.swap(fn);
+	offset.swap(of);
+	owned.swap(ow);
+	is_sorted = true;
 }
 
+/* A search query, prepared once: its magnitude and quantized form are reused for every candidate. */
+struct LMEmbedQuery {
+	LMEmbedQuery(const LMEmbedding* le) {
+		n_embed = le->n_embed;
+		v.resize(n_embed);
+		le->to_float_array(v.data());
+		double sq;
+		dot_f32(v.data(), v.data(), n_embed, &sq);
+		mag = sqrt(sq);
+		q8.resize(n_embed);
+		q8scale = quantize_i8(v.data(), n_embed, q8.data());
+	}
+
+	// Fast (possibly approximate, for I8 storage) cosine similarity.
+	double scan_score(const LMEmbedding* le) const {
+		double dot, sq;
+		if (le->n_embed != n_embed)
+			return -2.0;
+		switch (le->embed_type) {
+		case LMEMBED_F16:
+			dot = dot_f32_f16(v.data(), (const u16*) le->qdata, n_embed);
+			return dot / (mag * le->qmag);
+		case LMEMBED_I8:
+			dot = (double) dot_i8(q8.data(), (const i8*) le->qdata, n_embed) * q8scale * le->qscale;
+			return dot / (mag * le->qmag);
+		default:
+			break;
+		}
+		if (le->embed_data == nullptr)
+			return -2.0;
+		dot = dot_f32(v.data(), le->embed_data, n_embed, &sq);
+		return dot / (mag * sqrt(sq));
+	}
+
+	// Cosine similarity using the full precision query.
+	double exact_score(const LMEmbedding* le) const {
+		if (le->n_embed != n_embed)
+			return -2.0;
+		if (le->embed_data != nullptr) {
+			double sq, dot = dot_f32(v.data(), le->embed_data, n_embed, &sq);
+			return dot / (mag * sqrt(sq));
+		}
+		return le->dot_product(v.data()) / (mag * le->qmag);
+	}
+
+	int n_embed;
+	std::vector<float> v;
+	double mag;
+	std::vector<i8> q8;
+	float q8scale;
+};
+
+// The number of candidates to collect from a scan over I8 embeddings, for each requested match.
+const int I8_RESCORE_FACTOR = 4;
+
 LMEmbeddingFile::LMEmbeddingFile() {
 }
 
@@ -217,7 +608,7 @@ void LMEmbeddingFile::out_to_ramfile(RamFile* rf) {
 	rf->putstring(pathname);
 	ship_assert(embeds.size() == offsets.size());
 	rf->put32((i32) embeds.size());
-	for (int e = 0; e < embeds.size(); ++e) {
+	for (size_t e = 0; e < embeds.size(); ++e) {
 		embeds[e]->out_to_ramfile(rf);
 		rf->put32(offsets[e]);
 	}
@@ -237,7 +628,7 @@ void LMEmbeddingFile::in_from_ramfile(RamFile* rf) {
 }
 
 void LMEmbeddingFile::out_to_stream_fmt(std::ostream& o) {
-	for (int e = 0; e < embeds.size(); ++e) {
+	for (size_t e = 0; e < embeds.size(); ++e) {
 		o << pathname << std::endl;
 		o << offsets[e] << std::endl;
 		embeds[e]->out_to_stream_fmt(o);
@@ -248,7 +639,7 @@ int LMEmbeddingFile::best_match(const LMEmbedding* le, double* score) {
 	double best_sc = -2.;
 	int iret = -1;
 	
-	for (int e = 0; e < embeds.size(); ++e) {
+	for (size_t e = 0; e < embeds.size(); ++e) {
 		double sc = embeds[e]->cosine_similarity(le);
 		if (sc > best_sc) {
 			best_sc = sc;
@@ -261,11 +652,41 @@ int LMEmbeddingFile::best_match(const LMEmbedding* le, double* score) {
 	return iret;
 }
 
+static void file_scan(LMEmbeddingFile* lef, const LMEmbedQuery& q, LMBestMatch& best_matches, bool* saw_i8) {
+	for (size_t e = 0; e < lef->embeds.size(); ++e) {
+		const LMEmbedding* lme = lef->embeds[e];
+		if (lme->embed_type == LMEMBED_I8)
+			*saw_i8 = true;
+		best_matches.check_match(lef->embeds[e], q.scan_score(lme), lef->pathname.c_str(), lef->offsets[e]);
+	}
+}
+
+/* I8 scores are approximate, so we gather extra candidates, score them again against the full
+   precision query, and keep the best of those. The candidates' heap order is lost, but merge()
+   only walks the entries (passing on whether each is owned) before clearing them. */
+static void rescore_matches(LMBestMatch& candidates, const LMEmbedQuery& q, LMBestMatch& best_matches) {
+	for (int e = 0; e < candidates.n_matches; ++e)
+		candidates.cos_sim[e] = q.exact_score(candidates.matches[e]);
+	best_matches.merge(candidates);
+}
+
 void LMEmbeddingFile::best_matches(LMBestMatch& best_matches, const LMEmbedding* le) {
-	for (int e = 0; e < embeds.size(); ++e) {
-		double sc = embeds[e]->cosine_similarity(le);
-		best_matches.check_match(embeds[e], sc, pathname.c_str(), offsets[e]);
+	LMEmbedQuery q(le);
+	LMBestMatch cand(best_matches.n_matches_max * I8_RESCORE_FACTOR);
+	bool saw_i8 = false;
+
+	cand.set_min_cosine_similarity(-2.0);
+	file_scan(this, q, cand, &saw_i8);
+	if (saw_i8) {
+		rescore_matches(cand, q, best_matches);
+		return;
 	}
+	best_matches.merge(cand);
+}
+
+void LMEmbeddingFile::quantize(LMEmbedType type, bool keep_f32) {
+	for (auto le : embeds)
+		le->quantize(type, keep_f32);
 }
 
 int LMEmbeddingFile::count_embeddings() const {
@@ -314,6 +735,12 @@ void LMEmbeddingFolder::in_from_ramfile(RamFile* rf) {
 }
 
 void LMEmbeddingFolder::in_from_file(const char* path) {
+	if (LMEmbeddingLog::is_log_file(path)) {
+		free();
+		known_files.clear();
+		LMEmbeddingLog::read(path, this);
+		return;
+	}
 	RamFile rf(path, RAMFILE_READONLY);
 	in_from_ramfile(&rf);
 	rf.close();
@@ -367,10 +794,77 @@ int LMEmbeddingFolder::best_match(int file_idx, const LMEmbedding* le, double* s
 	return files[file_idx]->best_match(le, score);
 }
 
-void LMEmbeddingFolder::best_matches(LMBestMatch& best_matches, const LMEmbedding* le) {
-	for (auto file : files) {
-		file->best_matches(best_matches, le);
+// Below this many embeddings, a single-threaded search is faster than starting threads.
+const int MIN_EMBEDS_PER_SEARCH_THREAD = 4096;
+
+void LMEmbeddingFolder::best_matches(LMBestMatch& best_matches, const LMEmbedding* le, int nthreads) {
+	LMEmbedQuery q(le);
+	int n_embeds = count_embeddings();
+	int k = best_matches.n_matches_max * I8_RESCORE_FACTOR;
+
+	if (nthreads <= 0)
+		nthreads = std::max((int) std::thread::hardware_concurrency(), 1);
+	nthreads = std::min(nthreads, std::max(n_embeds / MIN_EMBEDS_PER_SEARCH_THREAD, 1));
+	nthreads = std::min(nthreads, std::max((int) files.size(), 1));
+
+	// split the files into contiguous runs of about n_embeds / nthreads embeddings each.
+	std::vector<int> first_file(nthreads + 1, (int) files.size());
+	first_file[0] = 0;
+	int t = 1, seen = 0;
+	for (int f = 0; f < files.size() && t < nthreads; ++f) {
+		seen += files[f]->count_embeddings();
+		if ((i64) seen * nthreads >= (i64) n_embeds * t)
+			first_file[t++] = f + 1;
 	}
+
+	std::vector<LMBestMatch*> thread_best(nthreads);
+	std::vector<char> saw_i8(nthreads, 0);
+	std::vector<std::thread*> th(nthreads, nullptr);
+	for (t = 0; t < nthreads; ++t) {
+		thread_best[t] = new LMBestMatch(k);
+		thread_best[t]->set_min_cosine_similarity(-2.0);
+		auto fn = [this, &q, &thread_best, &saw_i8, &first_file, t]() {
+			bool si8 = false;
+			for (int f = first_file[t]; f < first_file[t + 1]; ++f)
+				file_scan(files[f], q, *thread_best[t], &si8);
+			saw_i8[t] = si8;
+		};
+		if (t + 1 == nthreads)
+			fn();
+		else
+			th[t] = new std::thread(fn);
+	}
+
+	LMBestMatch cand(k);
+	bool any_i8 = false;
+	cand.set_min_cosine_similarity(-2.0);
+	for (t = 0; t < nthreads; ++t) {
+		if (th[t] != nullptr) {
+			th[t]->join();
+			delete th[t];
+		}
+		cand.merge(*thread_best[t]);
+		delete thread_best[t];
+		any_i8 = any_i8 || saw_i8[t];
+	}
+
+	if (any_i8)
+		rescore_matches(cand, q, best_matches);
+	else
+		best_matches.merge(cand);
+}
+
+void LMEmbeddingFolder::quantize(LMEmbedType type, bool keep_f32) {
+	for (auto f : files)
+		f->quantize(type, keep_f32);
+}
+
+size_t LMEmbeddingFolder::count_embed_bytes() const {
+	size_t ret = 0;
+	for (const auto* f : files)
+		for (const auto* le : f->embeds)
+			ret += le->embed_bytes();
+	return ret;
 }
 
 char* cpp_strdup(const std::string& str) {
@@ -433,6 +927,7 @@ bool LMEmbeddingStream::read_embedding(LMEmbedding& lme_out, std::string* path_o
 	text = cpp_strdup(line);
 	NOT_NULL_OR_RETURN(text, false);
 
+	lme_out.free();
 	lme_out.n_embed = n_em;
 	lme_out.embed_data = em;
 	lme_out.text = text;
@@ -443,8 +938,10 @@ bool LMEmbeddingStream::read_embedding(LMEmbedding& lme_out, std::string* path_o
 void LMEmbeddingStream::best_matches(LMBestMatch& best_matches, const LMEmbedding* le) {
 	LMEmbedding* lme = new LMEmbedding;
 	bool ok = false;
+	const bool was_owner = best_matches.i_own_this_memory;
 
-	// let the LMBestMatch object know it can free matches that are bumped.
+	// let the LMBestMatch object know it can free the matches we add, if they are bumped; any it
+	// already holds are left alone.
 	best_matches.i_own_this_memory = true;
 
 	rewind();
@@ -456,14 +953,583 @@ void LMEmbeddingStream::best_matches(LMBestMatch& best_matches, const LMEmbeddin
 		if (!ok)
 			break;
 
-		if (best_matches.check_match(lme, lme->cosine_similarity(le), cpp_strdup(path), offs)) {
+		double sc = lme->cosine_similarity(le);
+		if (!best_matches.would_accept(sc))
+			continue;
+		if (best_matches.check_match(lme, sc, cpp_strdup(path), offs)) {
 			// we have saved that match, so create a new LMEmbedding object.
 			lme = new LMEmbedding;
-			NOT_NULL_OR_RETURN_VOID(lme);
+			NOT_NULL_OR_BREAK(lme);
 		}
 	}
 
 	delete lme;
+	best_matches.i_own_this_memory = was_owner;
+}
+
+/*** The append-only embedding log.
+
+	Layout (all integers little-endian):
+		header:		"LMEMBLOG", u32 version, u32 reserved
+		records:	u32 LOG_REC_MAGIC, u32 flags, u32 stored length, u32 raw length, u32 CRC-32 of the stored
+				bytes, then the stored bytes: an LMEmbeddingFile as written by out_to_ramfile(), zlib
+				compressed if (flags & LOG_REC_ZLIB).
+		index:		u32 LOG_IDX_MAGIC, u32 record count, then for each record: u64 offset, u32 size, u32 pathname
+				length, the pathname; then a u32 CRC-32 of the entries
+		footer:		u64 offset of the index, "LMEMBIDX"
+	The index and footer are only present after a clean close(); opening the log for appending drops them.
+	With them, opening the log needn't decompress the superseded records. ***/
+
+static const char LOG_MAGIC[8] = { 'L', 'M', 'E', 'M', 'B', 'L', 'O', 'G' };
+static const char LOG_FOOTER_MAGIC[8] = { 'L', 'M', 'E', 'M', 'B', 'I', 'D', 'X' };
+const u32 LOG_VERSION = 1;
+const u32 LOG_HEADER_SIZE = 16;
+const u32 LOG_REC_MAGIC = 0x4345524c;	// "LREC"
+const u32 LOG_IDX_MAGIC = 0x5844494c;	// "LIDX"
+const u32 LOG_REC_HEADER_SIZE = 20;
+const u32 LOG_REC_ZLIB = 1;
+
+static void le32_to_buf(u8* buf, u32 v) {
+	for (int e = 0; e < 4; ++e)
+		buf[e] = (u8) (v >> (e * 8));
+}
+
+static u32 buf_to_le32(const u8* buf) {
+	return (u32) buf[0] | ((u32) buf[1] << 8) | ((u32) buf[2] << 16) | ((u32) buf[3] << 24);
+}
+
+static void le64_to_buf(u8* buf, u64 v) {
+	for (int e = 0; e < 8; ++e)
+		buf[e] = (u8) (v >> (e * 8));
+}
+
+static u64 buf_to_le64(const u8* buf) {
+	return (u64) buf_to_le32(buf) | ((u64) buf_to_le32(buf + 4) << 32);
+}
+
+// Serialize an LMEmbeddingFile as a complete log record (header and payload.)
+static void make_log_record(LMEmbeddingFile* lef, std::vector<u8>& rec) {
+	RamFile rf;
+	// a RamFile that isn't backed by a file has no write mode until we give it one.
+	rf.option_on(RAMFILE_WRITE_OVERWRITE);
+	lef->out_to_ramfile(&rf);
+	u32 raw_len = rf.length();
+	const u8* raw = rf.buffer();
+	mz_ulong clen = mz_compressBound(raw_len);
+	u32 flags = 0;
+
+	rec.resize(LOG_REC_HEADER_SIZE + std::max((u32) clen, raw_len));
+	if (mz_compress2(rec.data() + LOG_REC_HEADER_SIZE, &clen, raw, raw_len, MZ_BEST_SPEED) == MZ_OK && clen < raw_len) {
+		flags |= LOG_REC_ZLIB;
+	} else {
+		memcpy(rec.data() + LOG_REC_HEADER_SIZE, raw, raw_len);
+		clen = raw_len;
+	}
+	rec.resize(LOG_REC_HEADER_SIZE + clen);
+	le32_to_buf(&rec[0], LOG_REC_MAGIC);
+	le32_to_buf(&rec[4], flags);
+	le32_to_buf(&rec[8], (u32) clen);
+	le32_to_buf(&rec[12], raw_len);
+	le32_to_buf(&rec[16], (u32) mz_crc32(MZ_CRC32_INIT, rec.data() + LOG_REC_HEADER_SIZE, clen));
+}
+
+/* Read the record at the current file position. Returns false at the end of the records: EOF, the index,
+   or a torn/corrupt record. On success, the record is in rec, and lef (if non-null) is filled from it. */
+static bool read_log_record(FILE* f, std::vector<u8>& rec, LMEmbeddingFile* lef, std::string* pathname) {
+	u8 hdr[LOG_REC_HEADER_SIZE];
+	if (fread(hdr, 1, LOG_REC_HEADER_SIZE, f) != LOG_REC_HEADER_SIZE)
+		return false;
+	if (buf_to_le32(hdr) != LOG_REC_MAGIC)
+		return false;
+	u32 flags = buf_to_le32(hdr + 4), slen = buf_to_le32(hdr + 8), raw_len = buf_to_le32(hdr + 12);
+	rec.resize(LOG_REC_HEADER_SIZE + slen);
+	memcpy(rec.data(), hdr, LOG_REC_HEADER_SIZE);
+	if (fread(rec.data() + LOG_REC_HEADER_SIZE, 1, slen, f) != slen)
+		return false;
+	if ((u32) mz_crc32(MZ_CRC32_INIT, rec.data() + LOG_REC_HEADER_SIZE, slen) != buf_to_le32(hdr + 16))
+		return false;
+
+	// the RamFile takes ownership of the payload buffer.
+	char* raw = new char [raw_len + 1];
+	if ((flags & LOG_REC_ZLIB) != 0) {
+		mz_ulong dlen = raw_len;
+		if (mz_uncompress((u8*) raw, &dlen, rec.data() + LOG_REC_HEADER_SIZE, slen) != MZ_OK || dlen != raw_len) {
+			delete [] raw;
+			return false;
+		}
+	} else {
+		memcpy(raw, rec.data() + LOG_REC_HEADER_SIZE, raw_len);
+	}
+	RamFile rf;
+	rf.open_static(raw, raw_len, RAMFILE_READONLY);
+	if (not_null(lef)) {
+		lef->in_from_ramfile(&rf);
+		*pathname = lef->pathname;
+	} else {
+		*pathname = rf.getstring();
+	}
+	return true;
+}
+
+/* Read a log's index. Returns the offset of the index (just past the last record), or 0 if there's no
+   index or it doesn't check out. */
+static u64 read_log_index(FILE* f, std::vector<u64>& offsets, std::vector<u32>& sizes, std::vector<std::string>& paths) {
+	u8 footer[16];
+	fseek_64(f, 0, SEEK_END);
+	i64 flen = ftell_64(f);
+	if (flen < (i64) (LOG_HEADER_SIZE + 12 + sizeof(footer)))
+		return 0;
+	fseek_64(f, flen - sizeof(footer), SEEK_SET);
+	if (fread(footer, 1, sizeof(footer), f) != sizeof(footer) || memcmp(footer + 8, LOG_FOOTER_MAGIC, sizeof(LOG_FOOTER_MAGIC)))
+		return 0;
+	u64 idx_offs = buf_to_le64(footer);
+	if (idx_offs < LOG_HEADER_SIZE || idx_offs + 12 + sizeof(footer) > (u64) flen)
+		return 0;
+
+	std::vector<u8> idx((size_t) ((u64) flen - sizeof(footer) - idx_offs));
+	fseek_64(f, idx_offs, SEEK_SET);
+	if (fread(idx.data(), 1, idx.size(), f) != idx.size() || buf_to_le32(&idx[0]) != LOG_IDX_MAGIC)
+		return 0;
+	u32 count = buf_to_le32(&idx[4]);
+	size_t p = 8, ent_end = idx.size() - 4;
+	u64 offs = LOG_HEADER_SIZE;
+	for (u32 e = 0; e < count; ++e) {
+		if (p + 16 > ent_end)
+			return 0;
+		u64 ro = buf_to_le64(&idx[p]);
+		u32 rs = buf_to_le32(&idx[p + 8]), plen = buf_to_le32(&idx[p + 12]);
+		p += 16;
+		// the records are back to back, from the header to the index.
+		if (ro != offs || rs < LOG_REC_HEADER_SIZE || plen > ent_end - p)
+			return 0;
+		offsets.push_back(ro);
+		sizes.push_back(rs);
+		paths.push_back(std::string((const char*) &idx[p], plen));
+		p += plen;
+		offs += rs;
+	}
+	if (p != ent_end || offs != idx_offs || (u32) mz_crc32(MZ_CRC32_INIT, &idx[8], p - 8) != buf_to_le32(&idx[p]))
+		return 0;
+	return idx_offs;
+}
+
+// Decode just the latest record for each pathname, at the offsets from the index.
+static bool read_indexed_files(FILE* f, const std::vector<u64>& offsets, const std::vector<std::string>& paths, std::vector<LMEmbeddingFile*>& files) {
+	std::unordered_map<std::string, size_t> latest;
+	std::vector<u8> rec;
+	for (size_t e = 0; e < paths.size(); ++e)
+		latest[paths[e]] = e;
+	for (size_t e = 0; e < offsets.size(); ++e) {
+		if (latest[paths[e]] != e)
+			continue;
+		LMEmbeddingFile* lef = new LMEmbeddingFile;
+		std::string path;
+		fseek_64(f, offsets[e], SEEK_SET);
+		if (!read_log_record(f, rec, lef, &path) || path != paths[e]) {
+			delete lef;
+			return false;
+		}
+		files.push_back(lef);
+	}
+	return true;
+}
+
+/* Scan a log from just after the header. Returns the offset just past the last good record. */
+static u64 scan_log(FILE* f, std::vector<u64>& offsets, std::vector<u32>& sizes, std::vector<std::string>& paths, std::vector<LMEmbeddingFile*>* files) {
+	std::vector<u8> rec;
+	u64 offs = LOG_HEADER_SIZE;
+
+	fseek_64(f, offs, SEEK_SET);
+	forever {
+		LMEmbeddingFile* lef = (is_null(files) ? nullptr : new LMEmbeddingFile);
+		std::string path;
+		if (!read_log_record(f, rec, lef, &path)) {
+			delete lef;
+			break;
+		}
+		offsets.push_back(offs);
+		sizes.push_back((u32) rec.size());
+		paths.push_back(path);
+		if (not_null(files))
+			files->push_back(lef);
+		offs += rec.size();
+	}
+	return offs;
+}
+
+/* Find a log's records: from the index if the log was closed cleanly, otherwise by scanning them all. If files
+   is non-null, the live records are decoded into it. Returns the offset just past the last good record. */
+static u64 load_log(FILE* f, std::vector<u64>& offsets, std::vector<u32>& sizes, std::vector<std::string>& paths, std::vector<LMEmbeddingFile*>* files) {
+	u64 end = read_log_index(f, offsets, sizes, paths);
+	if (end != 0 && (is_null(files) || read_indexed_files(f, offsets, paths, *files)))
+		return end;
+	if (not_null(files)) {
+		for (auto lef : *files)
+			delete lef;
+		files->clear();
+	}
+	offsets.clear();
+	sizes.clear();
+	paths.clear();
+	return scan_log(f, offsets, sizes, paths, files);
+}
+
+static bool check_log_header(FILE* f) {
+	u8 hdr[LOG_HEADER_SIZE];
+	fseek_64(f, 0, SEEK_SET);
+	if (fread(hdr, 1, LOG_HEADER_SIZE, f) != LOG_HEADER_SIZE)
+		return false;
+	return !memcmp(hdr, LOG_MAGIC, sizeof(LOG_MAGIC)) && buf_to_le32(hdr + 8) <= LOG_VERSION;
+}
+
+// Put the live files into lef: when a pathname has several records, only the latest counts.
+static void add_live_files(std::vector<LMEmbeddingFile*>& files, LMEmbeddingFolder* lef) {
+	std::unordered_map<std::string, size_t> latest;
+	for (size_t e = 0; e < files.size(); ++e)
+		latest[files[e]->pathname] = e;
+	for (size_t e = 0; e < files.size(); ++e) {
+		if (latest[files[e]->pathname] != e) {
+			delete files[e];
+			continue;
+		}
+		lef->files.push_back(files[e]);
+		lef->known_files.insert(files[e]->pathname);
+	}
+	files.clear();
+}
+
+LMEmbeddingLog::LMEmbeddingLog() {
+	f = nullptr;
+	end_offset = 0;
+	n_written = 0;
+	n_dead = 0;
+	auto_compact = 0.5;
+	compactor = nullptr;
+	compact_done = false;
+}
+
+LMEmbeddingLog::~LMEmbeddingLog() {
+	close();
+}
+
+bool LMEmbeddingLog::is_log_file(const char* path) {
+	FILE* fi = fopen(path, "rb");
+	NOT_NULL_OR_RETURN(fi, false);
+	bool ret = check_log_header(fi);
+	fclose(fi);
+	return ret;
+}
+
+bool LMEmbeddingLog::read(const char* path, LMEmbeddingFolder* lef) {
+	std::vector<u64> offsets;
+	std::vector<u32> sizes;
+	std::vector<std::string> paths;
+	std::vector<LMEmbeddingFile*> files;
+	FILE* fi = fopen(path, "rb");
+
+	NOT_NULL_OR_RETURN(fi, false);
+	if (!check_log_header(fi)) {
+		fclose(fi);
+		return false;
+	}
+	load_log(fi, offsets, sizes, paths, &files);
+	fclose(fi);
+	add_live_files(files, lef);
+	return true;
+}
+
+void LMEmbeddingLog::note_pathname(const std::string& pathname) {
+	auto it = latest.find(pathname);
+	if (it != latest.end())
+		++n_dead;
+	latest[pathname] = (int) records.size() - 1;
+}
+
+bool LMEmbeddingLog::open(const char* path, LMEmbeddingFolder* lef) {
+	close();
+	log_path = path;
+	n_written = 0;
+
+	if (FileExists(path) && !is_log_file(path)) {
+		// an embedding folder in the whole-file format: convert it to a log. The log is built alongside,
+		// and only replaces the folder file once it's complete and on disk.
+		LMEmbeddingFolder old;
+		std::string tmp_path = log_path + ".tmp";
+		old.in_from_file(path);
+		f = fopen(tmp_path.c_str(), "w+b");
+		NOT_NULL_OR_RETURN(f, false);
+		u8 ver[8] = { 0 };
+		le32_to_buf(ver, LOG_VERSION);
+		bool ok = fwrite(LOG_MAGIC, 1, sizeof(LOG_MAGIC), f) == sizeof(LOG_MAGIC) && fwrite(ver, 1, sizeof(ver), f) == sizeof(ver);
+		end_offset = LOG_HEADER_SIZE;
+		n_written += LOG_HEADER_SIZE;
+		// a compaction now would work on the folder file, not the log we're building.
+		double ac = auto_compact;
+		auto_compact = 0.;
+		for (auto file : old.files)
+			ok = ok && append(file);
+		auto_compact = ac;
+		ok = ok && sync_file(f);
+		ok = (fclose(f) == 0) && ok;
+		f = nullptr;
+		if (!ok || !replace_file(tmp_path.c_str(), path)) {
+			remove(tmp_path.c_str());
+			close();
+			return false;
+		}
+		f = fopen(path, "r+b");
+		NOT_NULL_OR_RETURN(f, false);
+		if (not_null(lef)) {
+			for (auto file : old.files) {
+				lef->files.push_back(file);
+				lef->known_files.insert(file->pathname);
+			}
+			old.files.clear();
+		}
+		return true;
+	}
+
+	if (!FileExists(path)) {
+		f = fopen(path, "w+b");
+		NOT_NULL_OR_RETURN(f, false);
+		fwrite(LOG_MAGIC, 1, sizeof(LOG_MAGIC), f);
+		u8 ver[8] = { 0 };
+		le32_to_buf(ver, LOG_VERSION);
+		fwrite(ver, 1, sizeof(ver), f);
+		fflush(f);
+		end_offset = LOG_HEADER_SIZE;
+		n_written += LOG_HEADER_SIZE;
+		return true;
+	}
+
+	f = fopen(path, "r+b");
+	NOT_NULL_OR_RETURN(f, false);
+
+	std::vector<u64> offsets;
+	std::vector<u32> sizes;
+	std::vector<std::string> paths;
+	std::vector<LMEmbeddingFile*> files;
+	end_offset = load_log(f, offsets, sizes, paths, not_null(lef) ? &files : nullptr);
+	for (size_t e = 0; e < offsets.size(); ++e) {
+		Record r;
+		r.offset = offsets[e];
+		r.size = sizes[e];
+		r.pathname = paths[e];
+		records.push_back(r);
+		note_pathname(r.pathname);
+	}
+	if (not_null(lef))
+		add_live_files(files, lef);
+
+	// drop the index (if the log was closed cleanly) or anything torn (if it wasn't); new records go here.
+	truncate_file(f, end_offset);
+	return true;
+}
+
+bool LMEmbeddingLog::write_record(FILE* fo, const u8* rec, u32 size) {
+	return fwrite(rec, 1, size, fo) == size;
+}
+
+bool LMEmbeddingLog::append(LMEmbeddingFile* lef) {
+	std::vector<u8> rec;
+	NOT_NULL_OR_RETURN(lef, false);
+	make_log_record(lef, rec);
+
+	ScopeMutex sm(mtx);
+	NOT_NULL_OR_RETURN(f, false);
+	fseek_64(f, end_offset, SEEK_SET);
+	if (!write_record(f, rec.data(), (u32) rec.size()))
+		return false;
+	fflush(f);
+	n_written += rec.size();
+
+	Record r;
+	r.offset = end_offset;
+	r.size = (u32) rec.size();
+	r.pathname = lef->pathname;
+	records.push_back(r);
+	note_pathname(r.pathname);
+	end_offset += rec.size();
+
+	reap_compactor();
+	bool start_compaction = (auto_compact > 0. && is_null(compactor) && records.size() >= 64 &&
+			n_dead > auto_compact * records.size());
+	sm.unlock();
+	if (start_compaction)
+		compact_async();
+	return true;
+}
+
+bool LMEmbeddingLog::write_index(FILE* fo, const std::vector<Record>& recs, u64 index_offset) {
+	size_t p = 8;
+	for (const auto& r : recs)
+		p += 16 + r.pathname.size();
+	std::vector<u8> idx(p + 4 + 16);
+	le32_to_buf(&idx[0], LOG_IDX_MAGIC);
+	le32_to_buf(&idx[4], (u32) recs.size());
+	p = 8;
+	for (const auto& r : recs) {
+		le64_to_buf(&idx[p], r.offset);
+		le32_to_buf(&idx[p + 8], r.size);
+		le32_to_buf(&idx[p + 12], (u32) r.pathname.size());
+		memcpy(&idx[p + 16], r.pathname.data(), r.pathname.size());
+		p += 16 + r.pathname.size();
+	}
+	le32_to_buf(&idx[p], (u32) mz_crc32(MZ_CRC32_INIT, &idx[8], p - 8));
+	le64_to_buf(&idx[p + 4], index_offset);
+	memcpy(&idx[p + 12], LOG_FOOTER_MAGIC, sizeof(LOG_FOOTER_MAGIC));
+	fseek_64(fo, index_offset, SEEK_SET);
+	if (fwrite(idx.data(), 1, idx.size(), fo) != idx.size())
+		return false;
+	n_written += idx.size();
+	fflush(fo);
+	return truncate_file(fo, index_offset + idx.size());
+}
+
+void LMEmbeddingLog::close() {
+	wait_compaction();
+	// f may be null after a compaction that couldn't reopen the log; there's still state to clear.
+	if (not_null(f)) {
+		write_index(f, records, end_offset);
+		fclose(f);
+		f = nullptr;
+	}
+	records.clear();
+	latest.clear();
+	n_dead = 0;
+}
+
+void LMEmbeddingLog::compact_async() {
+	ScopeMutex sm(mtx);
+	reap_compactor();
+	if (not_null(compactor) || is_null(f))
+		return;
+	size_t n_snapshot = records.size();
+	compact_done = false;
+	compactor = new std::thread([this, n_snapshot]() { compact_thread(n_snapshot); });
+}
+
+/* Join a compaction thread that has finished, so another may be started. Call with the lock held. */
+void LMEmbeddingLog::reap_compactor() {
+	if (is_null(compactor) || !compact_done)
+		return;
+	compactor->join();
+	delete compactor;
+	compactor = nullptr;
+}
+
+void LMEmbeddingLog::wait_compaction() {
+	std::thread* th;
+	{
+		ScopeMutex sm(mtx);
+		th = compactor;
+	}
+	if (is_null(th))
+		return;
+	th->join();
+	delete th;
+	ScopeMutex sm(mtx);
+	compactor = nullptr;
+}
+
+void LMEmbeddingLog::compact_thread(size_t n_snapshot) {
+	compact_records(n_snapshot);
+	// set once the lock is released, so reap_compactor() can join us while holding it.
+	compact_done = true;
+}
+
+/* Copy the live records among the first n_snapshot into a new file, without holding the lock. Then, with the
+   lock held, copy the records appended since, write the index, and swap the new file in. If anything fails
+   before the swap, the new file is deleted and the log carries on as it was. */
+void LMEmbeddingLog::compact_records(size_t n_snapshot) {
+	std::string tmp_path = log_path + ".compact";
+	std::vector<Record> snap, out_recs;
+	std::unordered_map<std::string, size_t> snap_latest;
+	std::vector<u8> rec;
+
+	{
+		ScopeMutex sm(mtx);
+		snap.assign(records.begin(), records.begin() + n_snapshot);
+	}
+	for (size_t e = 0; e < snap.size(); ++e)
+		snap_latest[snap[e].pathname] = e;
+
+	FILE* fi = fopen(log_path.c_str(), "rb");
+	FILE* fo = fopen(tmp_path.c_str(), "w+b");
+	if (is_null(fi) || is_null(fo)) {
+		if (not_null(fi))
+			fclose(fi);
+		if (not_null(fo)) {
+			fclose(fo);
+			remove(tmp_path.c_str());
+		}
+		return;
+	}
+	u8 ver[8] = { 0 };
+	le32_to_buf(ver, LOG_VERSION);
+	bool ok = fwrite(LOG_MAGIC, 1, sizeof(LOG_MAGIC), fo) == sizeof(LOG_MAGIC) && fwrite(ver, 1, sizeof(ver), fo) == sizeof(ver);
+	u64 offs = LOG_HEADER_SIZE;
+
+	for (size_t e = 0; ok && e < snap.size(); ++e) {
+		if (snap_latest[snap[e].pathname] != e)
+			continue;
+		rec.resize(snap[e].size);
+		fseek_64(fi, snap[e].offset, SEEK_SET);
+		ok = fread(rec.data(), 1, rec.size(), fi) == rec.size() && write_record(fo, rec.data(), (u32) rec.size());
+		Record r = snap[e];
+		r.offset = offs;
+		out_recs.push_back(r);
+		offs += rec.size();
+	}
+	fclose(fi);
+	if (!ok) {
+		fclose(fo);
+		remove(tmp_path.c_str());
+		return;
+	}
+
+	ScopeMutex sm(mtx);
+	n_written += offs;
+	// the records appended while we worked.
+	fflush(f);
+	for (size_t e = n_snapshot; ok && e < records.size(); ++e) {
+		rec.resize(records[e].size);
+		fseek_64(f, records[e].offset, SEEK_SET);
+		ok = fread(rec.data(), 1, rec.size(), f) == rec.size() && write_record(fo, rec.data(), (u32) rec.size());
+		n_written += rec.size();
+		Record r = records[e];
+		r.offset = offs;
+		out_recs.push_back(r);
+		offs += rec.size();
+	}
+	ok = ok && write_index(fo, out_recs, offs) && sync_file(fo);
+	ok = (fclose(fo) == 0) && ok;
+	if (!ok) {
+		remove(tmp_path.c_str());
+		return;
+	}
+
+	// Windows won't replace a file that's open, so let go of the log for the swap.
+	fclose(f);
+	if (!replace_file(tmp_path.c_str(), log_path.c_str())) {
+		// couldn't swap the compacted log in; carry on with the original.
+		remove(tmp_path.c_str());
+		f = fopen(log_path.c_str(), "r+b");
+		return;
+	}
+
+	records.clear();
+	latest.clear();
+	n_dead = 0;
+	for (const auto& r : out_recs) {
+		records.push_back(r);
+		note_pathname(r.pathname);
+	}
+	end_offset = offs;
+	// if this fails, the compacted log is complete on disk, but there's nothing more to append to.
+	f = fopen(log_path.c_str(), "r+b");
+	if (not_null(f))
+		truncate_file(f, end_offset);
 }
 
 /*** end lmembed.cpp ***/
@@ -671,7 +671,7 @@ u64 hash_FNV1a(const void* data, u32 data_size) {
 	
 	while (w + 7 < we) {
 		vll = *((u64*)w);
-		hash = hash ^ v;
+		hash = hash ^ vll;
 		hash *= 1099511628211ULL;
 		w += 8;
 	}
@@ -693,12 +693,12 @@ u64 hash_FNV1a(const void* data, u32 data_size) {
 		break;
 	case 2:
 		vs = *((u16*)w);
-		hash = hash ^ vc;
+		hash = hash ^ vs;
 		hash *= 1099511628211ULL;
 		break;
 	case 3:
 		vs = *((u16*)w);
-		hash = hash ^ vc;
+		hash = hash ^ vs;
 		hash *= 1099511628211ULL;
 		w += 2;
 		vc = *w;
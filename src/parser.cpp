@@ -88,6 +88,151 @@ char* advance_to_next_alpha(char* ptr) {
 	return(ptr);
 }
 
+/*** Bounded scans. ***/
+
+static inline bool parser_is_space(u8 c) {
+	return c == ' ' || (u8) (c - '\t') < 5;
+}
+
+u32 mask_ctz(u64 m) {
+#ifdef CODEHAPPY_MSFT
+	return ntz(m);
+#else
+	return (u32) __builtin_ctzll(m);
+#endif
+}
+
+u64 char_mask64(const char* p, char c) {
+#if defined(CODEHAPPY_AVX2)
+	const __m256i vc = _mm256_set1_epi8(c);
+	__m256i a = _mm256_loadu_si256((const __m256i*) p);
+	__m256i b = _mm256_loadu_si256((const __m256i*) (p + 32));
+	return (u64) (u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, vc))
+		| ((u64) (u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, vc)) << 32);
+#elif defined(CODEHAPPY_SSE2)
+	const __m128i vc = _mm_set1_epi8(c);
+	u64 m = 0;
+	for (int e = 0; e < 4; ++e) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (p + e * 16));
+		m |= (u64) (u32) _mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)) << (e * 16);
+	}
+	return m;
+#else
+	u64 m = 0;
+	for (int e = 0; e < 64; ++e)
+		if (p[e] == c)
+			m |= 1ULL << e;
+	return m;
+#endif
+}
+
+/*** A byte is whitespace if it's a space, or (less 9) an unsigned 0 to 4: \t \n \v \f \r. ***/
+u64 whitespace_mask64(const char* p) {
+#if defined(CODEHAPPY_AVX2)
+	const __m256i vsp = _mm256_set1_epi8(' ');
+	const __m256i vtab = _mm256_set1_epi8('\t');
+	const __m256i v4 = _mm256_set1_epi8(4);
+	u64 m = 0;
+	for (int e = 0; e < 2; ++e) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (p + e * 32));
+		__m256i x = _mm256_sub_epi8(v, vtab);
+		__m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, vsp), _mm256_cmpeq_epi8(_mm256_min_epu8(x, v4), x));
+		m |= (u64) (u32) _mm256_movemask_epi8(ws) << (e * 32);
+	}
+	return m;
+#elif defined(CODEHAPPY_SSE2)
+	const __m128i vsp = _mm_set1_epi8(' ');
+	const __m128i vtab = _mm_set1_epi8('\t');
+	const __m128i v4 = _mm_set1_epi8(4);
+	u64 m = 0;
+	for (int e = 0; e < 4; ++e) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (p + e * 16));
+		__m128i x = _mm_sub_epi8(v, vtab);
+		__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, vsp), _mm_cmpeq_epi8(_mm_min_epu8(x, v4), x));
+		m |= (u64) (u32) _mm_movemask_epi8(ws) << (e * 16);
+	}
+	return m;
+#else
+	u64 m = 0;
+	for (int e = 0; e < 64; ++e)
+		if (parser_is_space((u8) p[e]))
+			m |= 1ULL << e;
+	return m;
+#endif
+}
+
+/*** The first byte in [ptr, end) whose bit is set in mask_fn's mask (xor invert), or end. The last partial block
+	is copied out and padded, so nothing past end is read. ***/
+template <class MaskFn> static inline const char* scan_mask(const char* ptr, const char* end, u64 invert, MaskFn mask_fn) {
+	while (end - ptr >= 64) {
+		const u64 m = mask_fn(ptr) ^ invert;
+		if (m != 0)
+			return ptr + mask_ctz(m);
+		ptr += 64;
+	}
+	if (ptr < end) {
+		char tail[64];
+		const size_t rem = end - ptr;
+		memcpy(tail, ptr, rem);
+		memset(tail + rem, 0, 64 - rem);
+		const u64 m = (mask_fn(tail) ^ invert) & ((1ULL << rem) - 1);
+		if (m != 0)
+			return ptr + mask_ctz(m);
+	}
+	return end;
+}
+
+const char* advance_past_whitespace(const char* ptr, const char* end) {
+	return scan_mask(ptr, end, ~0ULL, whitespace_mask64);
+}
+
+const char* advance_to_whitespace(const char* ptr, const char* end) {
+	return scan_mask(ptr, end, 0, whitespace_mask64);
+}
+
+const char* advance_to_next_word(const char* ptr, const char* end) {
+	return advance_past_whitespace(advance_to_whitespace(ptr, end), end);
+}
+
+const char* advance_to_char(const char* ptr, const char* end, char c) {
+	// memchr() is vectorized in any reasonable C library
+	const char* p = (ptr < end) ? (const char*) memchr(ptr, c, end - ptr) : nullptr;
+	return is_null(p) ? end : p;
+}
+
+/*** As advance_to_next_line(char*): \n, \n\r and \r\n end a line; a lone \r doesn't. ***/
+const char* advance_to_next_line(const char* ptr, const char* end) {
+	const char* nl = advance_to_char(ptr, end, '\n');
+	if (nl == end)
+		return end;
+	if (nl > ptr && nl[-1] == '\r')
+		return nl + 1;
+	if (nl + 1 < end && nl[1] == '\r')
+		return nl + 2;
+	return nl + 1;
+}
+
+const char* advance_to_next_matching_char(const char* ptr, const char* end, const char* candidates) {
+	const size_t nc = strlen(candidates);
+	if (nc == 0)
+		return end;
+	if (nc == 1)
+		return advance_to_char(ptr, end, candidates[0]);
+	if (nc <= 4) {
+		const char c0 = candidates[0], c1 = candidates[1], c2 = candidates[nc > 2 ? 2 : 1], c3 = candidates[nc - 1];
+		return scan_mask(ptr, end, 0, [c0, c1, c2, c3](const char* p) {
+			return char_mask64(p, c0) | char_mask64(p, c1) | char_mask64(p, c2) | char_mask64(p, c3);
+		});
+	}
+	bool is_cand[256];
+	memset(is_cand, 0, sizeof(is_cand));
+	for (size_t e = 0; e < nc; ++e)
+		is_cand[(u8) candidates[e]] = true;
+	while (ptr < end && !is_cand[(u8) *ptr])
+		++ptr;
+	return ptr;
+}
+
 /*** parse a (32-bit) integer at the current pointer position and advance
 	past it -- behavior undefined for integers larger than MAX_INT ***/
 char* advance_and_parse_integer(char* ptr, int* i) {
@@ -4299,4 +4299,460 @@ mod1:
 	return(0);
 }
 
-// end pifunc.cpp
\ No newline at end of file
+/*** 64-bit next and previous primes. ***/
+
+#define	LARGEST_PRIME_32	4294967291ULL
+
+u64 next_prime64(u64 i) {
+	if (i < LARGEST_PRIME_32)
+		return next_prime((u32) i);
+	// the next odd number past i; stepping past 2^64 - 1 wraps to 1, which ends the search.
+	for (i = (i + 1) | 1; i > LARGEST_PRIME_32; i += 2)
+		if (isprime64(i))
+			return(i);
+	return(0);
+}
+
+u64 previous_prime64(u64 i) {
+	u64 j;
+
+	if (i <= 0xFFFFFFFFULL)
+		return previous_prime((u32) i);
+	j = (i - 1) | 1;
+	if (j == i)
+		j -= 2;
+	for (; j > LARGEST_PRIME_32; j -= 2)
+		if (isprime64(j))
+			return(j);
+	return(LARGEST_PRIME_32);
+}
+
+/*** The segmented sieve of Eratosthenes. ***/
+
+/* A segment is a bit per odd number, sized to stay in L1 cache while every base prime crosses it. */
+#define	SIEVE_SEGMENT_WORDS	4096
+#define	SIEVE_SEGMENT_BITS	((u64) SIEVE_SEGMENT_WORDS * 64)
+
+static inline u32 prime_popcount64(u64 x) {
+#ifdef CODEHAPPY_MSFT
+	return count_bits(x);
+#else
+	return (u32) __builtin_popcountll(x);
+#endif
+}
+
+static u64 isqrt64(u64 x) {
+	u64 r = (u64) sqrt((double) x);
+	while (r > 0xFFFFFFFFULL || r * r > x)
+		--r;
+	while (r < 0xFFFFFFFFULL && (r + 1) * (r + 1) <= x)
+		++r;
+	return r;
+}
+
+static u64 icbrt64(u64 x) {
+	// 2642245 is the largest cube root that fits: its cube is just under 2^64.
+	u64 r = (u64) cbrt((double) x);
+	while (r > 2642245ULL || r * r * r > x)
+		--r;
+	while (r < 2642245ULL && (r + 1) * (r + 1) * (r + 1) <= x)
+		++r;
+	return r;
+}
+
+/* The odd primes up to 13 are crossed off by copying a repeating pattern rather than one multiple at a time:
+   they would otherwise do nearly half the work, hitting the same word many times over. The pattern repeats
+   every 3 * 5 * 7 * 11 * 13 odd numbers, and is that many words long so it also repeats on word boundaries. */
+#define	PRESIEVE_PERIOD		15015
+#define	PRESIEVE_PRIMES		5
+
+struct Presieve {
+	std::vector<u64> words;		// an extra word on the end, so an unaligned read can run past the last
+
+	Presieve() : words(PRESIEVE_PERIOD + 1, 0) {
+		for (u64 b = 0; b < (u64) PRESIEVE_PERIOD * 64; ++b) {
+			const u64 n = 2 * b + 1;
+			if (n % 3 && n % 5 && n % 7 && n % 11 && n % 13)
+				words[b >> 6] |= 1ULL << (b & 63);
+		}
+		words[PRESIEVE_PERIOD] = words[0];
+	}
+
+	// Fill nwords words of sieve with the pattern for the odd numbers starting at 2 * index + 1.
+	void fill(u64* bits, u64 nwords, u64 index) const {
+		index %= (u64) PRESIEVE_PERIOD * 64;
+		u64 k = index >> 6;
+		const u32 sh = (u32) (index & 63);
+		for (u64 w = 0; w < nwords; ++w) {
+			bits[w] = (sh == 0) ? words[k] : (words[k] >> sh) | (words[k + 1] << (64 - sh));
+			if (++k == PRESIEVE_PERIOD)
+				k = 0;
+		}
+	}
+};
+
+/* Sieves consecutive segments of the odd numbers, starting at a given odd number, by a list of odd base primes
+   (which must include every odd prime up to the square root of the last number sieved.) Each prime's next
+   multiple is carried from one segment to the next, so it's only found by division once. */
+class SegmentSieve {
+public:
+	SegmentSieve(const std::vector<u32>& base_primes, u64 first_odd) : primes(base_primes), first(first_odd), pos(0) {
+		static const Presieve ps;
+		presieve = &ps;
+		next.reserve(primes.size());
+	}
+
+	// Sieve the next nbits (at most SIEVE_SEGMENT_BITS) odd numbers: bit i of bits is set iff the odd number
+	// first + 2 * (pos + i) is prime. The bits past nbits in the last word are cleared.
+	void sieve(u64* bits, u64 nbits) {
+		const u64 nwords = (nbits + 63) >> 6;
+		const u64 bottom = first + 2 * pos;
+		const u64 top = bottom + 2 * (nbits - 1);
+
+		presieve->fill(bits, nwords, (bottom - 1) / 2);
+		if (bottom <= 13) {
+			// the pattern crossed off the presieved primes themselves, and left 1.
+			for (u64 n = 3; n <= 13 && n <= top; n += 2)
+				if (n >= bottom && n != 9)
+					bits[(n - bottom) >> 7] |= 1ULL << (((n - bottom) >> 1) & 63);
+			if (bottom == 1)
+				bits[0] &= ~1ULL;
+		}
+		if (nbits & 63)
+			bits[nwords - 1] &= (1ULL << (nbits & 63)) - 1;
+
+		// primes start crossing off at their squares, so bring them in as the segments reach those.
+		while (next.size() < primes.size() && (u64) primes[next.size()] * primes[next.size()] <= top)
+			next.push_back(first_multiple(primes[next.size()]));
+
+		for (size_t k = PRESIEVE_PRIMES; k < next.size(); ++k) {
+			const u64 p = primes[k];
+			u64 j = next[k];
+			if (j >= pos + nbits)
+				continue;
+			for (j -= pos; j < nbits; j += p)
+				bits[j >> 6] &= ~(1ULL << (j & 63));
+			next[k] = j + pos;
+		}
+		pos += nbits;
+	}
+
+private:
+	// The index (counting odd numbers from first) of the first odd multiple of p to cross off: p^2, or the
+	// first odd multiple at or past first. Solves first + 2k == 0 (mod p), with 2^-1 == (p + 1) / 2.
+	u64 first_multiple(u64 p) const {
+		if (p * p >= first)
+			return (p * p - first) / 2;
+		const u64 r = first % p;
+		return ((p - r) % p) * ((p + 1) / 2) % p;
+	}
+
+	const std::vector<u32>& primes;
+	const Presieve* presieve;
+	u64 first;
+	u64 pos;
+	std::vector<u64> next;
+};
+
+/* The odd primes up to lim: a plain sieve up to its square root, then the rest by segments. */
+static void odd_primes_upto(u64 lim, std::vector<u32>& primes) {
+	std::vector<u32> base;
+	std::vector<u64> bits(SIEVE_SEGMENT_WORDS);
+	const u64 r = isqrt64(lim);
+	std::vector<u8> comp(r + 1, 0);
+
+	primes.clear();
+	for (u64 i = 3; i <= r; i += 2) {
+		if (comp[i])
+			continue;
+		base.push_back((u32) i);
+		for (u64 j = i * i; j <= r; j += 2 * i)
+			comp[j] = 1;
+	}
+
+	primes = base;
+	const u64 first = (r + 1) | 1;
+	if (lim < first)
+		return;
+	SegmentSieve ss(base, first);
+	for (u64 done = 0, nodd = (lim - first) / 2 + 1; done < nodd; done += SIEVE_SEGMENT_BITS) {
+		const u64 nbits = std::min(SIEVE_SEGMENT_BITS, nodd - done);
+		ss.sieve(bits.data(), nbits);
+		for (u64 w = 0; w < (nbits + 63) >> 6; ++w)
+			for (u64 b = bits[w]; b != 0; b &= b - 1)
+				primes.push_back((u32) (first + 2 * (done + w * 64 + prime_ctz64(b))));
+	}
+}
+
+/* The number of segments needed to sieve [lo, hi], after moving lo up to the first odd number (at least 1.) */
+static u64 sieve_segment_count(u64& lo, u64 hi) {
+	if (lo < 1)
+		lo = 1;
+	lo |= 1;
+	if (lo > hi)
+		return 0;
+	return ((hi - lo) / 2 + SIEVE_SEGMENT_BITS) / SIEVE_SEGMENT_BITS;
+}
+
+/* Sieve the odd numbers in [lo, hi] (lo odd, as set by sieve_segment_count()) in parallel, calling
+   fn(seg, first, bits, nbits) for each segment: bit i is set iff first + 2i is prime. Each task sieves a
+   run of consecutive segments, with its own L1-sized buffer, so the base primes are only divided into the
+   start of each run. */
+template <class Fn>
+static void sieve_range(u64 lo, u64 hi, u64 nseg, const std::vector<u32>& primes, ThreadPool* pool, Fn fn) {
+	ThreadPool& tp = (pool != nullptr) ? *pool : ThreadPool::shared();
+	const u64 nodd = (hi - lo) / 2 + 1;
+
+	tp.parallel_for(0, (i64) nseg, [&](i64 s0, i64 s1) {
+		std::vector<u64> bits(SIEVE_SEGMENT_WORDS);
+		SegmentSieve ss(primes, lo + 2 * SIEVE_SEGMENT_BITS * s0);
+		for (i64 s = s0; s < s1; ++s) {
+			const u64 nbits = std::min(SIEVE_SEGMENT_BITS, nodd - SIEVE_SEGMENT_BITS * s);
+			ss.sieve(bits.data(), nbits);
+			fn((u64) s, lo + 2 * SIEVE_SEGMENT_BITS * s, (const u64*) bits.data(), nbits);
+		}
+	}, 4);
+}
+
+/* Is [lo, hi] so narrow, and so high up, that testing each number beats finding the base primes? */
+static bool sieve_range_narrow(u64 lo, u64 hi) {
+	return hi > 0xFFFFFFFFULL && hi - lo < isqrt64(hi) / 64;
+}
+
+void prime_sieve(u64 lo, u64 hi, std::vector<u64>& primes, ThreadPool* pool) {
+	std::vector<u32> base;
+
+	primes.clear();
+	if (hi < lo || hi < 2)
+		return;
+	if (lo <= 2)
+		primes.push_back(2);
+	if (sieve_range_narrow(lo, hi)) {
+		for (u64 i = lo | 1; i <= hi && i >= lo; i += 2)
+			if (isprime64(i))
+				primes.push_back(i);
+		return;
+	}
+
+	const u64 nseg = sieve_segment_count(lo, hi);
+	std::vector< std::vector<u64> > found(nseg);
+	odd_primes_upto(isqrt64(hi), base);
+	sieve_range(lo, hi, nseg, base, pool, [&](u64 seg, u64 first, const u64* bits, u64 nbits) {
+		std::vector<u64>& out = found[seg];
+		for (u64 w = 0; w < (nbits + 63) >> 6; ++w)
+			for (u64 b = bits[w]; b != 0; b &= b - 1)
+				out.push_back(first + 2 * (w * 64 + prime_ctz64(b)));
+	});
+
+	size_t total = primes.size();
+	for (const auto& f : found)
+		total += f.size();
+	primes.reserve(total);
+	for (const auto& f : found)
+		primes.insert(primes.end(), f.begin(), f.end());
+}
+
+u64 prime_count(u64 lo, u64 hi, ThreadPool* pool) {
+	std::vector<u32> base;
+	u64 count = 0;
+
+	if (hi < lo || hi < 2)
+		return 0;
+	if (lo <= 2)
+		count = 1;
+	if (sieve_range_narrow(lo, hi)) {
+		for (u64 i = lo | 1; i <= hi && i >= lo; i += 2)
+			count += isprime64(i);
+		return count;
+	}
+
+	const u64 nseg = sieve_segment_count(lo, hi);
+	std::vector<u64> counts(nseg, 0);
+	odd_primes_upto(isqrt64(hi), base);
+	sieve_range(lo, hi, nseg, base, pool, [&](u64 seg, u64 /*first*/, const u64* bits, u64 nbits) {
+		u64 c = 0;
+		for (u64 w = 0; w < (nbits + 63) >> 6; ++w)
+			c += prime_popcount64(bits[w]);
+		counts[seg] = c;
+	});
+	for (u64 c : counts)
+		count += c;
+	return count;
+}
+
+/*** The pi function for 64-bit input. ***/
+
+/* Below this, pi_function64() just counts the primes with the sieve. */
+#define	PI_SIEVE_MAX		(1ULL << 24)
+
+/* The split point y is PI_ALPHA times the cube root of x. A larger y makes the pi table smaller and phi() slower;
+   1 is the fastest through 10^14. */
+#define	PI_ALPHA		1
+
+/* pi(n) for every n up to a limit by lookup: a bit per odd number, and the count of odd primes before each
+   64-bit word. */
+struct PiTable {
+	std::vector<u64> bits;
+	std::vector<u32> counts;
+	u64 limit;
+
+	void build(u64 lim, ThreadPool* pool) {
+		std::vector<u32> base;
+		u64 lo = 1;
+		const u64 nseg = sieve_segment_count(lo, lim);
+		u32 c = 0;
+
+		limit = lim;
+		bits.assign(nseg * SIEVE_SEGMENT_WORDS, 0);
+		odd_primes_upto(isqrt64(lim), base);
+		sieve_range(lo, lim, nseg, base, pool, [&](u64 seg, u64 /*first*/, const u64* sb, u64 nbits) {
+			memcpy(bits.data() + seg * SIEVE_SEGMENT_WORDS, sb, ((nbits + 63) >> 6) * sizeof(u64));
+		});
+		counts.resize(bits.size());
+		for (size_t w = 0; w < bits.size(); ++w) {
+			counts[w] = c;
+			c += prime_popcount64(bits[w]);
+		}
+	}
+
+	// n must be at most the limit.
+	u64 pi(u64 n) const {
+		if (n < 2)
+			return 0;
+		const u64 i = (n - 1) / 2;
+		return 1 + counts[i >> 6] + prime_popcount64(bits[i >> 6] & ((2ULL << (i & 63)) - 1));
+	}
+};
+
+/* phi(x, a) for a up to PHI_SMALL_A, from tables: phi(x, a) = (x / P) * totient(P) + phi(x mod P, a), where P is
+   the product of the first a primes. */
+#define	PHI_SMALL_A		6
+
+struct PhiSmall {
+	u64 prod[PHI_SMALL_A + 1];
+	u64 totient[PHI_SMALL_A + 1];
+	std::vector<u16> table[PHI_SMALL_A + 1];
+
+	PhiSmall() {
+		static const u32 small_primes[PHI_SMALL_A] = { 2, 3, 5, 7, 11, 13 };
+		prod[0] = 1;
+		totient[0] = 1;
+		table[0].assign(1, 0);
+		for (u32 a = 1; a <= PHI_SMALL_A; ++a) {
+			const u32 p = small_primes[a - 1];
+			prod[a] = prod[a - 1] * p;
+			totient[a] = totient[a - 1] * (p - 1);
+			table[a].resize(prod[a]);
+			u16 c = 0;
+			for (u64 r = 0; r < prod[a]; ++r) {
+				bool coprime = (r != 0);
+				for (u32 e = 0; e < a && coprime; ++e)
+					coprime = (r % small_primes[e]) != 0;
+				if (coprime)
+					++c;
+				table[a][r] = c;
+			}
+		}
+	}
+
+	u64 phi(u64 x, u32 a) const {
+		return (x / prod[a]) * totient[a] + table[a][x % prod[a]];
+	}
+};
+
+struct PhiContext {
+	const std::vector<u32>* primes;	// every prime up to sqrt(x), from 2
+	const PiTable* pt;
+	PhiSmall ps;
+};
+
+/* phi(x, a), the count of integers in [1, x] with no prime factor among the first a primes. The recurrence
+   phi(x, a) = phi(x, a - 1) - phi(x / p_a, a - 1) is unrolled into a sum over p_a, with shortcuts: small a comes
+   from the tables; if x < p_(a+1)^2, the numbers left are 1 and the primes past p_a, which the pi table counts;
+   and once x / p_i < p_i, each remaining term is 1 (if p_i <= x) or 0. */
+static i64 phi_rec(u64 x, u32 a, const PhiContext& ctx) {
+	const std::vector<u32>& pr = *ctx.primes;
+	const PiTable& pt = *ctx.pt;
+
+	if (a <= PHI_SMALL_A)
+		return (i64) ctx.ps.phi(x, a);
+	if (x <= pt.limit && a < pr.size() && x < (u64) pr[a] * pr[a]) {
+		if (x == 0)
+			return 0;
+		const u64 pix = pt.pi(x);
+		return (pix >= a) ? (i64) (pix - a + 1) : 1;
+	}
+
+	i64 sum = (i64) ctx.ps.phi(x, PHI_SMALL_A);
+	for (u32 i = PHI_SMALL_A + 1; i <= a; ++i) {
+		const u64 p = pr[i - 1];
+		const u64 xp = x / p;
+		if (xp < p) {
+			const u64 last = (x <= pt.limit) ? std::min((u64) a, pt.pi(x)) : (u64) a;
+			if (last >= i)
+				sum -= (i64) (last - i + 1);
+			break;
+		}
+		sum -= phi_rec(xp, i - 1, ctx);
+	}
+	return sum;
+}
+
+/* The same, with the terms of the outer sum spread over the pool. They're handed out one at a time, since
+   the first few (the smallest primes) are much the largest. */
+static i64 phi_parallel(u64 x, u32 a, const PhiContext& ctx, ThreadPool& tp) {
+	std::atomic<u32> next_term(PHI_SMALL_A + 1);
+	std::mutex mtx;
+	i64 sum;
+
+	if (a <= PHI_SMALL_A)
+		return (i64) ctx.ps.phi(x, a);
+	sum = (i64) ctx.ps.phi(x, PHI_SMALL_A);
+	tp.parallel_for(0, tp.size() + 1, [&](i64, i64) {
+		i64 local = 0;
+		forever {
+			const u32 i = next_term++;
+			if (i > a)
+				break;
+			local -= phi_rec(x / (*ctx.primes)[i - 1], i - 1, ctx);
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		sum += local;
+	});
+	return sum;
+}
+
+/* Meissel-Lehmer, with the split point y >= x^(1/3) that Lagarias, Miller and Odlyzko use:
+	pi(x) = phi(x, a) + a - 1 - P2(x, a),  a = pi(y),
+	P2(x, a) = sum over y < p <= sqrt(x) of (pi(x / p) - pi(p) + 1),
+   which counts the numbers up to x with exactly two prime factors past y (there can't be three.) Every pi()
+   needed is at most x / y, so one sieve up to there answers them all by lookup. */
+u64 pi_function64(u64 x, ThreadPool* pool) {
+	ThreadPool& tp = (pool != nullptr) ? *pool : ThreadPool::shared();
+	std::vector<u32> primes;
+	PiTable pt;
+	PhiContext ctx;
+
+	if (x < PI_SIEVE_MAX)
+		return prime_count(0, x, &tp);
+
+	const u64 sqrtx = isqrt64(x);
+	const u64 y = std::min(icbrt64(x) * PI_ALPHA, sqrtx);
+	pt.build(x / y, &tp);
+	odd_primes_upto(sqrtx, primes);
+	primes.insert(primes.begin(), 2);
+
+	const u64 a = pt.pi(y);
+	const u64 b = pt.pi(sqrtx);
+	ctx.primes = &primes;
+	ctx.pt = &pt;
+	const i64 phi = phi_parallel(x, (u32) a, ctx, tp);
+
+	i64 p2 = 0;
+	for (u64 i = a + 1; i <= b; ++i)
+		p2 += (i64) pt.pi(x / primes[i - 1]) - (i64) (i - 1);
+
+	return (u64) (phi + (i64) a - 1 - p2);
+}
+
+/* end pifunc.cpp */
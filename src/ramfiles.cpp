@@ -19,19 +19,26 @@
 
 	* RAM files can be compressed and decompressed completely transparently.
 
+	* Flushes are incremental: only the bytes changed since the last flush are written. Compressed RAM files are
+	stored as independently compressed chunks, so only the changed chunks are recompressed. Writes that overwrite
+	bytes already in the file go through a small journal first, so a crash mid-flush can be recovered from.
+
 	Disadvantages of RAM files:
 
-	* Very large files will eat up a lot of RAM, and most platforms will be unable to open a file 2 GB in size
-	or larger.
+	* Very large files will eat up a lot of RAM, unless they are opened read-only and memory-mapped.
 
-	* No incremental writes (at least currently) -- you have to manually flush or close the file to write data to disk,
-	at which point the entire file is written.
+	* Nothing is written until you manually flush or close the file.
 
 	Copyright (c) 2014-2022 Chris Street
 
 ***/
 
 #include "libcodehappy.h"
+#ifndef CODEHAPPY_WINDOWS
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define	RAMFILE_WRITE_OPTIONS		(RAMFILE_WRITE_APPEND | RAMFILE_WRITE_OVERWRITE | RAMFILE_WRITE_INSERT)
 
@@ -41,12 +48,28 @@
 /*** the RAM file is made from an embedded RAM file; we didn't allocate the scratchpad buffer ***/
 #define	RAMFILE_EMBEDDED		512
 
+/*** the scratchpad buffer is a memory mapping of the file ***/
+#define	RAMFILE_MAPPED			2048
+
+/*** the largest file we'll read into a scratchpad ***/
+#define	RAMFILE_MAX_BUFFERED		0xFFFFFF00ULL
+
 /*** magic numbers to designate compressed ramfiles ***/
 static unsigned char __magic_compress_ramfiles[12] =
 	{'R', 'A', 'M', '\004', 0x10, 0x89, 0x09, 0x19, 0x80, 0x09, 0x11, 0x58};
 
 #define VERSION_LZ	1
 #define VERSION_ZLIB	2
+#define VERSION_FRAMED	3
+
+/*** what we know about the format of the file on disk ***/
+#define	RAMFILE_DISK_NONE	0
+#define	RAMFILE_DISK_RAW	1
+#define	RAMFILE_DISK_FRAMED	2
+
+/*** Compressed files are written in the chunked format of framed.h. A flush appends the changed chunks and a
+	new index, and only then rewrites the header (through the journal) to point at it. Until then the file
+	reads exactly as it did before the flush. ***/
 
 static int compress_version_from_magic(char* buf) {
 	if (!strncmp(buf, (char *)__magic_compress_ramfiles, sizeof(__magic_compress_ramfiles))) {
@@ -55,38 +78,165 @@ static int compress_version_from_magic(char* buf) {
 	if (strncmp(buf, "RAM", 3)) {
 		return 0;
 	}
-	if (buf[3] == 0x7f) {
+	if (buf[3] == 0x7f || buf[3] == 0x7e) {
 		if (!strncmp(buf + 4, (char *)(&__magic_compress_ramfiles[4]), sizeof(__magic_compress_ramfiles) - 4)) {
-			return VERSION_ZLIB;
+			return (buf[3] == 0x7f) ? VERSION_ZLIB : VERSION_FRAMED;
 		}
 	}
 	return 0;
 }
 
-static void write_magic_version(FILE* f, int version) {
-	switch (version) {
-	default:
-	case VERSION_LZ:
-		fwrite(__magic_compress_ramfiles, sizeof(char), sizeof(__magic_compress_ramfiles), f);
-		break;
-	case VERSION_ZLIB:
-		fwrite(__magic_compress_ramfiles, sizeof(char), 3, f);
-		fputc(0x7f, f);
-		fwrite(__magic_compress_ramfiles + 4, sizeof(char), sizeof(__magic_compress_ramfiles) - 4, f);
-		break;
+/*** A run of bytes to write at a given offset in a file. ***/
+struct RamFileExtent {
+	u64 offset;
+	const u8* data;
+	u64 len;
+};
+
+static std::string journal_name(const char* fn) {
+	return std::string(fn) + ".rfj";
+}
+
+static const u8 __magic_journal[8] = {'R', 'A', 'M', 'J', 'R', 'N', 'L', 0};
+
+/* Write len bytes at offset in an open file. */
+static bool write_at(FILE* f, u64 offset, const u8* data, u64 len) {
+#ifdef CODEHAPPY_WINDOWS
+	if (fseek_64(f, (i64) offset, SEEK_SET) != 0)
+		return false;
+	return fwrite(data, 1, (size_t) len, f) == len;
+#else
+	int fd = fileno(f);
+	while (len > 0) {
+		ssize_t nw = pwrite(fd, data, (size_t) len, (off_t) offset);
+		if (nw < 0 && errno == EINTR)
+			continue;
+		if (nw <= 0)
+			return false;
+		data += nw;
+		offset += nw;
+		len -= nw;
+	}
+	return true;
+#endif
+}
+
+/* The journal holds the extents a flush is about to write and the file's final size, with a CRC at the end, so a
+   torn journal (we crashed before the file was touched) can be told from a complete one. */
+static bool write_journal(const char* fn, const std::vector<RamFileExtent>& ext, u64 final_size) {
+	std::string jn = journal_name(fn);
+	FILE* f = fopen(jn.c_str(), "wb");
+	NOT_NULL_OR_RETURN(f, false);
+
+	u8 hdr[20], eh[16], tail[4];
+	memcpy(hdr, __magic_journal, 8);
+	put_le64(hdr + 8, final_size);
+	put_le32(hdr + 16, (u32) ext.size());
+	mz_ulong crc = mz_crc32(MZ_CRC32_INIT, hdr + 8, 12);
+	bool ok = (fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr));
+	for (const auto& e : ext) {
+		put_le64(eh, e.offset);
+		put_le64(eh + 8, e.len);
+		crc = mz_crc32(crc, eh, sizeof(eh));
+		crc = mz_crc32(crc, e.data, (size_t) e.len);
+		ok = ok && fwrite(eh, 1, sizeof(eh), f) == sizeof(eh) && fwrite(e.data, 1, (size_t) e.len, f) == e.len;
 	}
+	put_le32(tail, (u32) crc);
+	ok = ok && fwrite(tail, 1, sizeof(tail), f) == sizeof(tail);
+	ok = sync_file(f) && ok;
+	fclose(f);
+	if (!ok)
+		remove(jn.c_str());
+	return ok;
+}
+
+/* If a complete journal was left behind for this file, finish the writes it describes. A torn journal means
+   we crashed before the file was touched, so it's simply discarded. */
+static void recover_journal(const char* fn) {
+	std::string jn = journal_name(fn);
+	if (!FileExists(jn.c_str()))
+		return;
+
+	u64 jlen = flength_64(jn.c_str());
+	std::vector<u8> j;
+	FILE* f = fopen(jn.c_str(), "rb");
+	bool ok = not_null(f) && jlen >= 24;
+	if (ok) {
+		j.resize((size_t) jlen);
+		ok = (fread(j.data(), 1, (size_t) jlen, f) == jlen);
+	}
+	if (not_null(f))
+		fclose(f);
+	ok = ok && memcmp(j.data(), __magic_journal, 8) == 0 &&
+	     (u32) mz_crc32(MZ_CRC32_INIT, j.data() + 8, (size_t) jlen - 12) == get_le32(j.data() + jlen - 4);
+
+	if (ok) {
+		u64 final_size = get_le64(j.data() + 8);
+		u32 n = get_le32(j.data() + 16);
+		const u8* p = j.data() + 20, * pe = j.data() + jlen - 4;
+		FILE* fo = fopen(fn, "r+b");
+		if (is_null(fo))
+			return;
+		for (u32 e = 0; ok && e < n; ++e) {
+			if (pe - p < 16) {
+				ok = false;
+				break;
+			}
+			u64 off = get_le64(p), len = get_le64(p + 8);
+			p += 16;
+			if ((u64) (pe - p) < len) {
+				ok = false;
+				break;
+			}
+			ok = write_at(fo, off, p, len);
+			p += len;
+		}
+		ok = ok && truncate_file(fo, final_size) && sync_file(fo);
+		fclose(fo);
+		if (!ok)
+			// try again next time.
+			return;
+	}
+	remove(jn.c_str());
+}
+
+/* Write extents to an open file, then set its size and sync it. If journal is set, the extents are journaled
+   first, so they land all or nothing. */
+static bool commit_extents(FILE* f, const char* fn, const std::vector<RamFileExtent>& ext, u64 final_size, bool journal) {
+	if (journal && !write_journal(fn, ext, final_size))
+		return false;
+	bool ok = true;
+	for (const auto& e : ext)
+		ok = ok && write_at(f, e.offset, e.data, e.len);
+	ok = ok && truncate_file(f, final_size) && sync_file(f);
+	// if we failed part way, the journal stays, and is replayed on the next open.
+	if (journal && ok)
+		remove(journal_name(fn).c_str());
+	return ok;
 }
 
 RamFile::RamFile() {
 	fname = nullptr;
 	readp = nullptr;
 	options = 0UL;
+	map_base = nullptr;
+	map_len = 0;
+	chunk_size = RAMFILE_CHUNK_DEFAULT;
+	codec = FRAMED_BEST;
+	level = 6;
+	clear_disk_state();
 }
 
 RamFile::RamFile(const char* fn, u32 opt) {
 	fname = nullptr;
 	readp = nullptr;
 	options = 0UL;
+	map_base = nullptr;
+	map_len = 0;
+	chunk_size = RAMFILE_CHUNK_DEFAULT;
+	codec = FRAMED_BEST;
+	level = 6;
+	clear_disk_state();
 	open(fn, opt);
 }
 
@@ -94,12 +244,24 @@ RamFile::RamFile(const std::string& fn, u32 opt) {
 	fname = nullptr;
 	readp = nullptr;
 	options = 0UL;
+	map_base = nullptr;
+	map_len = 0;
+	chunk_size = RAMFILE_CHUNK_DEFAULT;
+	codec = FRAMED_BEST;
+	level = 6;
+	clear_disk_state();
 	open(fn, opt);
 }
 
 RamFile::RamFile(const EmbeddedRamFile erf) {
 	const u64* bufst = &erf[1];
 	u32 len = u32(erf[0]);
+	map_base = nullptr;
+	map_len = 0;
+	chunk_size = RAMFILE_CHUNK_DEFAULT;
+	codec = FRAMED_BEST;
+	level = 6;
+	clear_disk_state();
 	fname = nullptr;
 	options = RAMFILE_READONLY | RAMFILE_EMBEDDED;
 	sp.clear();
@@ -119,13 +281,23 @@ int RamFile::open(const std::string& fn, u32 opt) {
 int RamFile::open(const char* fn, u32 opt) {
 	FILE* f;
 	bool exists = FileExists(fn);
-	u32 flen;
+	u64 flen;
 
-	if (fname != nullptr || sp.length() > 0) {
+	if (fname != nullptr || sp.length() > 0 || mapped()) {
 		close();
 	}
+	clear_disk_state();
+	// finish any flush we crashed in the middle of.
+	if (exists)
+		recover_journal(fn);
 	
-	options = opt;
+	options = opt & (~RAMFILE_MAPPED);
+	if (truth(options & RAMFILE_MMAP)) {
+		// mapped files are read-only, and must exist.
+		options |= RAMFILE_READONLY;
+		if (!exists)
+			return(1);
+	}
 	if (!exists && falsity(options & RAMFILE_CREATE_IF_MISSING))
 		return(1);
 	if ((options & (RAMFILE_WRITE_OPTIONS)) == 0)
@@ -147,10 +319,21 @@ int RamFile::open(const char* fn, u32 opt) {
 		return(1);
 	strcpy(fname, fn);
 
+	if (truth(options & RAMFILE_MMAP) && map_file(fname)) {
+		readp = sp.buffer();
+		return(0);
+	}
+
 	if (exists) {
+		flen = flength_64(fname);
+		if (flen > RAMFILE_MAX_BUFFERED) {
+			// too large to buffer; this can only be opened memory-mapped.
+			delete [] fname;
+			fname = nullptr;
+			return 1;
+		}
 		f = fopen(fname, "rb");
-		flen = filelen(f);
-		if (sp.realloc(flen + 2)) {
+		if (sp.realloc((u32) flen + 2)) {
 			fclose(f);
 			delete [] fname;
 			return 1;
@@ -159,6 +342,8 @@ int RamFile::open(const char* fn, u32 opt) {
 		sp.cend = sp.buf + flen;
 		*sp.cend = '\000';
 		fclose(f);
+		disk_format = RAMFILE_DISK_RAW;
+		disk_len = flen;
 	} else {
 		sp.realloc(32);
 	}
@@ -174,6 +359,19 @@ int RamFile::open(const char* fn, u32 opt) {
 
 void RamFile::decompress(void) {
 	int version = compress_version_from_magic((char *)sp.buf);
+	if (version == VERSION_FRAMED) {
+		options |= RAMFILE_WAS_COMPRESSED;
+		options |= RAMFILE_COMPRESS;
+		if (!decompress_framed()) {
+			sp.free();
+			if (not_null(fname))
+				delete [] fname;
+			fname = nullptr;
+			readp = nullptr;
+			clear_disk_state();
+		}
+		return;
+	}
 	if (version > 0) {
 		Scratchpad* sp2;
 		u32 needed;
@@ -197,6 +395,7 @@ LDecompErr:			delete sp2;
 				sp.free();
 				if (not_null(fname))
 					delete [] fname;
+				fname = nullptr;
 				return;
 			}
 			break;
@@ -204,10 +403,15 @@ LDecompErr:			delete sp2;
 		case VERSION_ZLIB:
 			if (is_null(sp2))
 				goto LDecompErr;
-			if (mz_uncompress((unsigned char*)sp2->buf, (mz_ulong *)&needed, 
+			{
+			// mz_ulong is 64 bits on LP64 platforms.
+			mz_ulong dest_len = needed;
+			if (mz_uncompress((unsigned char*)sp2->buf, &dest_len, 
 					  (const unsigned char*)compress_data_start, (mz_ulong)(length() - (sizeof(__magic_compress_ramfiles) + sizeof(uint32_t)))) != MZ_OK) {
 				goto LDecompErr;
 			}
+			needed = (u32) dest_len;
+			}
 			break;
 		}
 
@@ -216,17 +420,186 @@ LDecompErr:			delete sp2;
 		sp.swap(sp2);
 		delete sp2;
 		readp = sp.buffer();
+		// the whole-file formats are rewritten in the chunked format on the next flush.
+		clear_disk_state();
+	}
+}
+
+/* Read a file in the chunked format. The whole file is in the scratchpad; the chunks are decompressed in
+   parallel. */
+bool RamFile::decompress_framed(void) {
+	u64 flen = size();
+	u32 cs;
+	std::vector<FramedChunk> nc;
+	Scratchpad* sp2 = new Scratchpad;
+
+	if (!framed_decompress(sp.buf, flen, *sp2, nc, cs, nullptr)) {
+		delete sp2;
+		return false;
+	}
+	u64 used = FRAMED_HEADER_SIZE + FRAMED_INDEX_SIZE(nc.size());
+	for (const auto& c : nc)
+		used += c.clen;
+
+	sp.swap(sp2);
+	delete sp2;
+	readp = sp.buffer();
+
+	chunks.swap(nc);
+	chunk_size = cs;
+	disk_format = RAMFILE_DISK_FRAMED;
+	disk_len = size();
+	disk_size = flen;
+	disk_garbage = (flen > used) ? flen - used : 0;
+	return true;
+}
+
+/* Map the file into memory. Pages are mapped copy-on-write, so code that pokes at the buffer (getline()
+   briefly does) can't touch the file. Returns false if the file can't or shouldn't be mapped: empty, or
+   compressed (unless we're ignoring compression), in which case it's read normally. */
+bool RamFile::map_file(const char* fn) {
+	u64 flen = flength_64(fn);
+	u8* base;
+
+	if (flen == 0)
+		return false;
+#ifdef CODEHAPPY_WINDOWS
+	HANDLE fh = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fh == INVALID_HANDLE_VALUE)
+		return false;
+	HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(fh);
+	if (mh == NULL)
+		return false;
+	// the view keeps the mapping alive.
+	base = (u8*) MapViewOfFile(mh, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mh);
+	if (base == NULL)
+		return false;
+#else
+	int fd = ::open(fn, O_RDONLY);
+	if (fd < 0)
+		return false;
+	base = (u8*) mmap(NULL, (size_t) flen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (base == (u8*) MAP_FAILED)
+		return false;
+#endif
+
+	map_base = base;
+	map_len = flen;
+	if (falsity(options & RAMFILE_IGNORE_COMPRESSION) && flen >= sizeof(__magic_compress_ramfiles) &&
+	    compress_version_from_magic((char*) base) > 0) {
+		unmap_file();
+		return false;
+	}
+
+	sp.buf = base;
+	sp.cend = sp.bend = base + flen;
+	sp.ialloc = 0;
+	options |= RAMFILE_MAPPED;
+	return true;
+}
+
+void RamFile::unmap_file(void) {
+	if (is_null(map_base))
+		return;
+#ifdef CODEHAPPY_WINDOWS
+	UnmapViewOfFile(map_base);
+#else
+	munmap(map_base, (size_t) map_len);
+#endif
+	if (truth(options & RAMFILE_MAPPED)) {
+		// the scratchpad doesn't own this buffer.
+		sp.buf = sp.cend = sp.bend = nullptr;
+		sp.ialloc = 0;
+		options &= (~RAMFILE_MAPPED);
+	}
+	map_base = nullptr;
+	map_len = 0;
+}
+
+bool RamFile::mapped(void) const {
+	return truth(options & RAMFILE_MAPPED);
+}
+
+void RamFile::advise(RamFileAdvice advice, u64 offset, u64 len) {
+	if (!mapped() || offset >= map_len)
+		return;
+	if (len == 0 || offset + len > map_len)
+		len = map_len - offset;
+#ifndef CODEHAPPY_WINDOWS
+	// madvise() wants a page-aligned start.
+	u64 page = (u64) sysconf(_SC_PAGESIZE);
+	u64 start = offset - (offset % page);
+	int adv;
+	switch (advice) {
+	default:
+	case RAMFILE_ADVISE_NORMAL:
+		adv = MADV_NORMAL;
+		break;
+	case RAMFILE_ADVISE_SEQUENTIAL:
+		adv = MADV_SEQUENTIAL;
+		break;
+	case RAMFILE_ADVISE_RANDOM:
+		adv = MADV_RANDOM;
+		break;
+	case RAMFILE_ADVISE_WILLNEED:
+		adv = MADV_WILLNEED;
+		break;
+	case RAMFILE_ADVISE_DONTNEED:
+		adv = MADV_DONTNEED;
+		break;
 	}
+	madvise((u8*) map_base + start, (size_t) (offset + len - start), adv);
+#endif
 }
 
 void RamFile::close(void)
 {
 	flush();
+	unmap_file();
 	sp.free();
 	if (not_null(fname))
 		delete [] fname;
 	fname = nullptr;
 	readp = nullptr;
+	clear_disk_state();
+}
+
+void RamFile::clear_disk_state(void) {
+	disk_format = RAMFILE_DISK_NONE;
+	disk_len = 0;
+	dirty_lo = ~0ULL;
+	dirty_hi = 0;
+	disk_size = 0;
+	disk_garbage = 0;
+	chunks.clear();
+}
+
+void RamFile::mark_dirty(u64 lo, u64 hi) {
+	// anything at or past disk_len is written anyway.
+	if (lo >= disk_len || hi <= lo)
+		return;
+	dirty_lo = std::min(dirty_lo, lo);
+	dirty_hi = std::max(dirty_hi, hi);
+}
+
+void RamFile::modified(u64 offset, u64 nbytes) {
+	mark_dirty(offset, offset + nbytes);
+}
+
+void RamFile::set_codec(FramedCodec c, int lvl) {
+	codec = c;
+	level = lvl;
+}
+
+void RamFile::set_chunk_size(u32 nbytes) {
+	if (nbytes == 0 || nbytes == chunk_size)
+		return;
+	chunk_size = nbytes;
+	if (disk_format == RAMFILE_DISK_FRAMED)
+		disk_format = RAMFILE_DISK_NONE;
 }
 
 void RamFile::rewind(void) {
@@ -236,12 +609,13 @@ void RamFile::rewind(void) {
 void RamFile::truncate() {
 	sp.clear();
 	rewind();
+	mark_dirty(0, disk_len);
 }
 
 bool RamFile::seek(u64 pos) {
 	if (sp.buffer() == nullptr)
 		return false;
-	if (pos >= length())
+	if (pos >= size())
 		return(false);
 
 	readp = sp.buf + pos;
@@ -280,76 +654,176 @@ bool RamFile::seek_from_here(i64 pos) {
 
 
 u32 RamFile::length(void) const {
+	return (u32) size();
+}
+
+u64 RamFile::size(void) const {
 	if (sp.buffer() == nullptr)
-		return 0UL;
-	return (sp.cend - sp.buf);
+		return 0ULL;
+	return (u64) (sp.cend - sp.buf);
+}
+
+u64 RamFile::tell(void) const {
+	if (is_null(sp.buffer()) || is_null(readp))
+		return 0ULL;
+	return (u64) (readp - sp.buf);
 }
 
 void RamFile::flush(void)
 {
 	FILE* f;
+	bool ok;
 	if (is_null(fname))
 		return;
 
 	if ((options & (RAMFILE_READONLY | RAMFILE_STATIC)) != 0)
 		return;
 
-	if ((options & RAMFILE_COMPRESS) != 0)
-		{
-		/* compress the buffer and write it out */
-		/* if we fail to allocate a buffer for the compressed data, or the data doesn't compress,
-			just write it out raw. */
-		char* compress_buffer, *cb2;
-		u32 cbuf_len = length() - sizeof(__magic_compress_ramfiles) - sizeof(uint32_t) - 1;
-		unsigned int out_len;
-		u32 endian;
-		int version = 0;
-		
-		compress_buffer = new char [cbuf_len];
-		if (is_null(compress_buffer))
-			goto LRaw;
-		out_len = lzf_compress(sp.buf, length(), compress_buffer, cbuf_len);
-		if (out_len > 0) {
-			version = VERSION_LZ;
-		}
-
-		/* Try zLib compression, too. */
-		cb2 = new char [cbuf_len];
-		if (!is_null(cb2)) {
-			mz_ulong dest_len = cbuf_len;
-			if (mz_compress((unsigned char*)cb2, &dest_len, (const unsigned char*)sp.buf, (mz_ulong)length()) == MZ_OK) {
-				if (version == 0 || dest_len < out_len) {
-					delete [] compress_buffer;
-					compress_buffer = cb2;
-					cb2 = nullptr;
-					out_len = dest_len;
-					version = VERSION_ZLIB;
-				}
+	if ((options & RAMFILE_COMPRESS) != 0) {
+		/* append the changed chunks if we can, otherwise rewrite the file in the chunked format */
+		ok = (disk_format == RAMFILE_DISK_FRAMED && FileExists(fname) && flush_framed());
+		if (!ok)
+			ok = write_framed();
+	} else {
+		/* write the changed extents if we can, otherwise write out the raw buffer */
+		ok = (disk_format == RAMFILE_DISK_RAW && FileExists(fname) && flush_raw());
+		if (!ok) {
+			f = fopen(fname, "wb");
+			NOT_NULL_OR_RETURN_VOID(f);
+			ok = (fwrite(sp.buf, sizeof(char), sp.cend - sp.buf, f) == (size_t) (sp.cend - sp.buf));
+			fclose(f);
+			if (ok) {
+				chunks.clear();
+				disk_format = RAMFILE_DISK_RAW;
+				// a journal from a failed incremental flush would now be out of date.
+				remove(journal_name(fname).c_str());
 			}
 		}
-		if (!is_null(cb2)) {
-			delete [] cb2;
-		}
-		if (0 == version) {
-			/* Neither LZF nor zLib successfully compressed the buffer. */
-			delete [] compress_buffer;
-			goto LRaw;
-		}
+	}
 
-		/* output the compressed payload. Write the length of the uncompressed data as a little-endian 32 bit integer. */
-		f = fopen(fname, "wb");
-		write_magic_version(f, version);
-		endian = CPU_TO_LE32(length());
-		fwrite(&endian, sizeof(endian), 1, f);
-		fwrite(compress_buffer, sizeof(char), out_len, f);
-		fclose(f);
-		delete [] compress_buffer;
-	} else {
-LRaw:		/* write out the raw buffer */
-		f = fopen(fname, "wb");
-		fwrite(sp.buf, sizeof(char), sp.cend - sp.buf, f);
-		fclose(f);
+	if (ok) {
+		disk_len = size();
+		dirty_lo = ~0ULL;
+		dirty_hi = 0;
+	}
+}
+
+/* Write the changed extents of an uncompressed file. Appending only adds to the end of the file, so that's
+   done directly; anything that overwrites or shrinks the file goes through the journal. */
+bool RamFile::flush_raw(void) {
+	u64 sz = size(), keep = std::min(disk_len, sz);
+	std::vector<RamFileExtent> ext;
+	bool overwrite = (sz < disk_len);
+
+	if (dirty_lo < std::min(dirty_hi, keep)) {
+		ext.push_back(RamFileExtent { dirty_lo, sp.buf + dirty_lo, std::min(dirty_hi, keep) - dirty_lo });
+		overwrite = true;
+	}
+	if (sz > disk_len)
+		ext.push_back(RamFileExtent { disk_len, sp.buf + disk_len, sz - disk_len });
+	if (ext.empty() && sz == disk_len)
+		return true;
+
+	FILE* f = fopen(fname, "r+b");
+	NOT_NULL_OR_RETURN(f, false);
+	bool ok = commit_extents(f, fname, ext, sz, overwrite);
+	fclose(f);
+	return ok;
+}
+
+/* Recompress the chunks that changed, and append them and a new index to the file. The header is only
+   switched over to the new index (through the journal) once they're safely on disk. If too much of the file
+   would be dead chunks and old indices, rewrite the whole thing instead. */
+bool RamFile::flush_framed(void) {
+	u64 sz = size(), keep = std::min(disk_len, sz);
+	u64 dlo = dirty_lo, dhi = std::min(dirty_hi, keep);
+	u64 cs = chunk_size;
+	u64 n = (sz + cs - 1) / cs;
+	u64 garbage = disk_garbage + FRAMED_INDEX_SIZE(chunks.size());
+	std::vector<FramedChunk> nc(n);
+	std::vector<u64> changed;
+
+	for (u64 c = 0; c < n; ++c) {
+		u64 c0 = c * cs, new_end = std::min(c0 + cs, sz);
+		bool same = (c < chunks.size() && std::min(c0 + cs, disk_len) == new_end && !(dlo < dhi && dlo < new_end && dhi > c0));
+		if (same) {
+			nc[c] = chunks[c];
+		} else {
+			changed.push_back(c);
+			if (c < chunks.size())
+				garbage += chunks[c].clen;
 		}
+	}
+	for (u64 c = n; c < chunks.size(); ++c)
+		garbage += chunks[c].clen;
+	if (changed.empty() && n == chunks.size())
+		return true;
+
+	std::vector< std::vector<u8> > cdata;
+	std::vector<u32> methods;
+	std::vector<RamFileExtent> ext;
+	u64 off = disk_size;
+	framed_compress_blocks(sp.buf, sz, chunk_size, changed, cdata, methods, codec, level);
+	for (size_t e = 0; e < changed.size(); ++e) {
+		u64 c = changed[e];
+		nc[c].method = methods[e];
+		nc[c].offset = off;
+		nc[c].clen = (u32) cdata[e].size();
+		ext.push_back(RamFileExtent { off, cdata[e].data(), cdata[e].size() });
+		off += cdata[e].size();
+	}
+	std::vector<u8> idx;
+	framed_build_index(nc, sz, idx);
+	ext.push_back(RamFileExtent { off, idx.data(), idx.size() });
+	u64 index_offset = off, final_size = off + idx.size();
+
+	if (garbage > final_size / 2)
+		return write_framed();
+
+	FILE* f = fopen(fname, "r+b");
+	NOT_NULL_OR_RETURN(f, false);
+	// nothing refers to the new chunks and index until the header changes, so they needn't be journaled.
+	bool ok = commit_extents(f, fname, ext, final_size, false);
+	u8 hdr[FRAMED_HEADER_SIZE];
+	framed_build_header(hdr, chunk_size, index_offset, (u32) idx.size());
+	std::vector<RamFileExtent> hext(1, RamFileExtent { 0, hdr, sizeof(hdr) });
+	ok = ok && commit_extents(f, fname, hext, final_size, true);
+	fclose(f);
+	if (!ok)
+		return false;
+
+	chunks.swap(nc);
+	disk_size = final_size;
+	disk_garbage = garbage;
+	return true;
+}
+
+/* Write the whole file in the chunked format, compressing the chunks in parallel. This goes to a temporary file
+   that's then renamed over the original, so a crash leaves either the old file or the new one. */
+bool RamFile::write_framed(void) {
+	Scratchpad out;
+	std::vector<FramedChunk> nc;
+	std::string tn = std::string(fname) + ".tmp";
+
+	if (!framed_compress(sp.buf, size(), out, nc, chunk_size, codec, level, nullptr))
+		return false;
+	FILE* f = fopen(tn.c_str(), "wb");
+	NOT_NULL_OR_RETURN(f, false);
+	bool ok = (fwrite(out.buffer(), 1, out.length(), f) == out.length());
+	ok = sync_file(f) && ok;
+	fclose(f);
+	ok = ok && replace_file(tn.c_str(), fname);
+	if (!ok) {
+		remove(tn.c_str());
+		return false;
+	}
+	remove(journal_name(fname).c_str());
+
+	chunks.swap(nc);
+	disk_format = RAMFILE_DISK_FRAMED;
+	disk_size = out.length();
+	disk_garbage = 0;
+	return true;
 }
 
 void RamFile::open_static(char* data, uint dlen, uint32_t opt) {
@@ -406,6 +880,7 @@ int RamFile::putc(int c)
 	switch (options & RAMFILE_WRITE_OPTIONS) {
 	case RAMFILE_WRITE_OVERWRITE:
 		if (likely(not_null(sp.cend) && readp < sp.cend)) {
+			mark_dirty(readp - sp.buf, readp - sp.buf + 1);
 			*(readp) = c;
 			++readp;
 		} else {
@@ -488,34 +963,72 @@ int RamFile::gets(char* str_dest, u32 buflen) {
 
 int RamFile::putmem(const char* data, u32 nbytes)
 {
-	char *datap = (char *)data;
-	const char* datae = data + nbytes;
-	int ret;
+	return (write(data, nbytes) == nbytes) ? 0 : -1;
+}
 
-	ret = 0;
-	while (datap < datae) {
-		ret = putc(*datap);
-		if (ret)
-			break;
-		++datap;
-	}
+int RamFile::getmem(u8* to, u32 nb) {
+	return (read(to, nb) == nb) ? 0 : -1;
+}
 
-	return(ret);
+u64 RamFile::read(void* dest, u64 nbytes) {
+	if (is_null(readp) || readp >= sp.cend)
+		return 0;
+	u64 avail = (u64) (sp.cend - readp);
+	if (nbytes > avail)
+		nbytes = avail;
+	memcpy(dest, readp, (size_t) nbytes);
+	readp += nbytes;
+	return nbytes;
 }
 
-int RamFile::getmem(u8* to, u32 nb) {
-	u8* datae = to + nb;
-	int ret;
+u64 RamFile::write(const void* src, u64 nbytes) {
+	const u8* data = (const u8*) src;
+	u64 ret = 0, n;
+	u64 offset;
+
+	if (truth(options & RAMFILE_READONLY))
+		return 0;
 
-	while (to < datae) {
-		ret = getc();
-		if (ret < 0)
-			return ret;
-		*to = u8(ret);
-		++to;
+	switch (options & RAMFILE_WRITE_OPTIONS) {
+	case RAMFILE_WRITE_OVERWRITE:
+		// overwrite what's there, then extend the file with whatever's left.
+		if (not_null(readp) && readp < sp.cend) {
+			n = std::min(nbytes, (u64) (sp.cend - readp));
+			mark_dirty(tell(), tell() + n);
+			memcpy(readp, data, (size_t) n);
+			readp += n;
+			ret += n;
+		}
+		if (ret < nbytes) {
+			if (truth(options & RAMFILE_STATIC) || size() + (nbytes - ret) > RAMFILE_MAX_BUFFERED)
+				return ret;
+			offset = tell();
+			if (sp.memcat(data + ret, (u32) (nbytes - ret)) != 0)
+				return ret;
+			readp = sp.buf + offset + (nbytes - ret);
+			ret = nbytes;
+		}
+		break;
+	case RAMFILE_WRITE_APPEND:
+		// note that a write in append mode doesn't change the read pointer
+		if (truth(options & RAMFILE_STATIC) || size() + nbytes > RAMFILE_MAX_BUFFERED)
+			return 0;
+		offset = tell();
+		if (sp.memcat(data, (u32) nbytes) != 0)
+			return 0;
+		readp = sp.buf + offset;
+		ret = nbytes;
+		break;
+	case RAMFILE_WRITE_INSERT:
+		while (ret < nbytes) {
+			if (putc(data[ret]))
+				break;
+			++ret;
+		}
+		break;
 	}
 
-	return 0;
+	return ret;
 }
 
 int RamFile::putsp(const Scratchpad& sp1)
@@ -550,6 +1063,8 @@ u32 RamFile::setname(const char* newname)
 		return(1);
 
 	strcpy(fname, newname);
+	// a different file: write all of it on the next flush.
+	clear_disk_state();
 	return(0);
 }
 
@@ -601,23 +1116,20 @@ int RamFile::getline(Scratchpad& sp_out) {
 		return(-1);
 	
 	u8* next_line, *ws;
-	char sv;
 	/* don't use advance_to_next_line() here, since there may be zero bytes in
 		the scratchpad buffer. */
 	// TODO: shouldn't there be a scratchpad_to_next_line() function?
 	next_line = readp;
-	if (readp >= sp.cend)
-		return(-1);
 	while (next_line < sp.cend)
 		{
 		if (*next_line == '\n') {
 			++next_line;
-			if (*next_line == '\r')
+			if (next_line < sp.cend && *next_line == '\r')
 				++next_line;
 			break;
 		} else if (*next_line == '\r') {
 			++next_line;
-			if (*next_line == '\n')
+			if (next_line < sp.cend && *next_line == '\n')
 				++next_line;
 			break;
 		}
@@ -628,12 +1140,10 @@ int RamFile::getline(Scratchpad& sp_out) {
 	while (ws >= readp && (*ws == '\n' || *ws == '\r'))
 		--ws;
 	++ws;
-	sv = *ws;
-	*ws = 0;
 
-	sp_out.strcpy((const char*)readp);
+	// don't poke a terminator into the buffer: at the end of a mapped file, there's no room for it.
+	sp_out.strncpy((const char*)readp, (u32) (ws - readp));
 
-	*ws = sv;
 	readp = next_line;
 
 	return(0);
@@ -946,11 +1456,21 @@ void RamFile::write_to_file(const char* fname) const {
 u8* RamFile::relinquish_buffer() {
 	flush();
 
-	u8* ret = sp.relinquish_buffer();
+	u8* ret;
+	if (mapped()) {
+		// the caller gets a buffer it can free.
+		ret = new u8 [size() + 1];
+		memcpy(ret, sp.buf, (size_t) size());
+		ret[size()] = 0;
+		unmap_file();
+	} else {
+		ret = sp.relinquish_buffer();
+	}
 	if (not_null(fname))
 		delete [] fname;
 	fname = nullptr;
 	readp = nullptr;
+	clear_disk_state();
 
 	return ret;
 }
@@ -0,0 +1,817 @@
+/***
+
+	regexdfa.cpp
+
+	Lazy DFA regular expression matching over regcomp()'s parsed programs.
+
+	2024, C. M. Street
+
+***/
+
+/* Opcodes of a regcomp() program (extern.cpp); a node is an opcode, a two-byte offset to the next node
+   (backward for BACK), then the operand. */
+enum {
+	RP_END = 0, RP_BOL = 1, RP_EOL = 2, RP_ANY = 3, RP_ANYOF = 4, RP_ANYBUT = 5, RP_BRANCH = 6, RP_BACK = 7,
+	RP_EXACTLY = 8, RP_NOTHING = 9, RP_STAR = 10, RP_PLUS = 11, RP_OPEN = 20, RP_CLOSE = 30
+};
+
+/* Thompson NFA nodes. */
+enum {
+	RN_CHAR, RN_CLASS, RN_SPLIT, RN_EMPTY, RN_BOL, RN_EOL, RN_MATCH, RN_FAIL
+};
+
+/* A scan that has to flush a full state cache more than this often continues as an NFA simulation. */
+#define	REGEX_MAX_FLUSHES	4
+
+/* In a leftmost-longest scan's state: the end of a group of NFA nodes, and (last) that a match has been seen. */
+#define	REGEX_GROUP		0xfffffffeU
+#define	REGEX_MATCHED		0xffffffffU
+
+/* In extern.cpp: while set, regerror() reports nothing and regcomp() just returns NULL. */
+extern bool regerror_quiet;
+static std::mutex regcomp_mtx;
+
+static const char* rp_next(const char* p) {
+	const int off = ((int) (u8) p[1] << 8) + (u8) p[2];
+	if (off == 0)
+		return nullptr;
+	return (p[0] == RP_BACK) ? p - off : p + off;
+}
+
+RegexAutomaton::RegexAutomaton() {
+	npatterns = 0;
+	start_node = 0;
+	rev_start = 0;
+	multiline = false;
+	memset(byte_class, 0, sizeof(byte_class));
+	nbc = 1;
+	budget = 2000;
+	flushes = 0;
+	epoch = 0;
+	nfa_mode = false;
+	gen = 0;
+	lgen = 0;
+	for (u32 a = 0; a < RUN_MODES; ++a)
+		cache[a].start[0] = cache[a].start[1] = -1;
+}
+
+void RegexAutomaton::reset(void) {
+	nodes.clear();
+	classes.clear();
+	npatterns = 0;
+	for (u32 a = 0; a < RUN_MODES; ++a)
+		flush(a);
+	prefix.clear();
+}
+
+void RegexAutomaton::set_state_budget(u32 max_states) {
+	budget = std::max(max_states, 16U);
+	for (u32 a = 0; a < RUN_MODES; ++a)
+		flush(a);
+}
+
+u32 RegexAutomaton::cached_states(void) const {
+	u32 n = 0;
+	for (u32 a = 0; a < RUN_MODES; ++a)
+		n += (u32) cache[a].states.size();
+	return n;
+}
+
+/*** Compiling: regcomp(), then flatten its program into the NFA. ***/
+
+bool RegexAutomaton::add_program(const char* pattern, u32 id, u32& entry) {
+	regexp* re;
+	{
+		ScopeMutex lock(regcomp_mtx);
+		regerror_quiet = true;
+		re = regcomp((char*) pattern);
+		regerror_quiet = false;
+	}
+	if (is_null(re))
+		return false;
+
+	// NFA node for each program node, built from a worklist since BACK makes loops.
+	std::unordered_map<const char*, u32> memo;
+	std::vector<std::pair<const char*, u32>> work;
+	auto add_node = [this](u8 type, u8 ch, u32 out, u32 arg) -> u32 {
+		nodes.push_back({ type, ch, out, arg });
+		return (u32) nodes.size() - 1;
+	};
+	auto node_for = [&](const char* p) -> u32 {
+		if (is_null(p))
+			return add_node(RN_FAIL, 0, 0, 0);
+		auto it = memo.find(p);
+		if (it != memo.end())
+			return it->second;
+		const u32 idx = add_node(RN_FAIL, 0, 0, 0);
+		memo[p] = idx;
+		work.push_back(std::make_pair(p, idx));
+		return idx;
+	};
+	// The node consuming one byte for a simple program node (one that STAR and PLUS can take.)
+	auto simple = [&](const char* p, u32 out) -> NfaNode {
+		const char* opnd = p + 3;
+		u64 cls[4] = { 0, 0, 0, 0 };
+		switch (p[0]) {
+		case RP_EXACTLY:
+			return { RN_CHAR, (u8) opnd[0], out, 0 };
+		case RP_ANY:
+			cls[0] = cls[1] = cls[2] = cls[3] = ~0ULL;
+			break;
+		case RP_ANYOF:
+		case RP_ANYBUT:
+			for (const u8* c = (const u8*) opnd; *c; ++c)
+				cls[*c >> 6] |= 1ULL << (*c & 63);
+			if (p[0] == RP_ANYBUT)
+				for (int e = 0; e < 4; ++e)
+					cls[e] = ~cls[e];
+			break;
+		default:
+			return { RN_FAIL, 0, 0, 0 };
+		}
+		const u32 ci = (u32) classes.size() / 4;
+		classes.insert(classes.end(), cls, cls + 4);
+		return { RN_CLASS, 0, out, ci };
+	};
+
+	entry = node_for(re->program + 1);
+	while (!work.empty()) {
+		const char* p = work.back().first;
+		const u32 idx = work.back().second;
+		work.pop_back();
+		const u8 op = (u8) p[0];
+		const char* nx = rp_next(p);
+		const char* opnd = p + 3;
+		NfaNode nn = { RN_EMPTY, 0, 0, 0 };
+
+		switch (op) {
+		case RP_END:
+			nn.type = RN_MATCH;
+			nn.arg = id;
+			break;
+		case RP_BOL:
+		case RP_EOL:
+			nn.type = (op == RP_BOL) ? RN_BOL : RN_EOL;
+			nn.out = node_for(nx);
+			break;
+		case RP_ANY:
+		case RP_ANYOF:
+		case RP_ANYBUT:
+			nn = simple(p, node_for(nx));
+			break;
+		case RP_EXACTLY: {
+			u32 o = node_for(nx);
+			const u32 n = (u32) strlen(opnd);
+			for (u32 e = n - 1; e >= 1; --e)
+				o = add_node(RN_CHAR, (u8) opnd[e], o, 0);
+			nn.type = RN_CHAR;
+			nn.ch = (u8) opnd[0];
+			nn.out = o;
+			}
+			break;
+		case RP_BRANCH:
+			// A lone branch is just its operand; otherwise, this alternative or the rest.
+			if (is_null(nx) || nx[0] != RP_BRANCH) {
+				nn.out = node_for(opnd);
+			} else {
+				nn.type = RN_SPLIT;
+				nn.out = node_for(opnd);
+				nn.arg = node_for(nx);
+			}
+			break;
+		case RP_STAR: {
+			// idx: either the operand, which loops back here, or on.
+			const u32 o = node_for(nx);
+			const NfaNode c = simple(opnd, idx);
+			nn.type = RN_SPLIT;
+			nn.arg = o;
+			nn.out = add_node(c.type, c.ch, c.out, c.arg);
+			}
+			break;
+		case RP_PLUS: {
+			// idx: the operand once, then the loop.
+			const u32 o = node_for(nx);
+			const u32 loop = add_node(RN_SPLIT, 0, idx, o);
+			nn = simple(opnd, loop);
+			}
+			break;
+		default:
+			// OPEN and CLOSE (whose numbers overlap past 9) only mark submatches.
+			if (op == RP_NOTHING || op == RP_BACK || (op >= RP_OPEN && op < RP_CLOSE + 32))
+				nn.out = node_for(nx);
+			else
+				nn.type = RN_FAIL;
+			break;
+		}
+		nodes[idx] = nn;
+	}
+
+	free(re);
+	return true;
+}
+
+/* The pattern run backwards, for finding where a match starts from where it ends. Each node gets a twin
+   with an edge to each of the twins of the nodes that led to it; a byte is consumed on the way from the
+   twin of the node after it, and ^ and $ swap places. The twin of the start node leads to the match. */
+void RegexAutomaton::add_reverse(void) {
+	const u32 nf = (u32) nodes.size();
+	std::vector<std::vector<u32>> into(nf);
+	std::vector<u32> ends;
+	auto add_node = [this](u8 type, u8 ch, u32 out, u32 arg) -> u32 {
+		nodes.push_back({ type, ch, out, arg });
+		return (u32) nodes.size() - 1;
+	};
+
+	// the twin of node v is nf + v.
+	nodes.resize(2 * nf);
+	const u32 rmatch = add_node(RN_MATCH, 0, 0, 0);
+	for (u32 u = 0; u < nf; ++u) {
+		const NfaNode nd = nodes[u];
+		switch (nd.type) {
+		case RN_CHAR:
+		case RN_CLASS:
+			into[nd.out].push_back(add_node(nd.type, nd.ch, nf + u, nd.arg));
+			break;
+		case RN_BOL:
+		case RN_EOL:
+			into[nd.out].push_back(add_node(nd.type == RN_BOL ? RN_EOL : RN_BOL, 0, nf + u, 0));
+			break;
+		case RN_EMPTY:
+			into[nd.out].push_back(nf + u);
+			break;
+		case RN_SPLIT:
+			into[nd.out].push_back(nf + u);
+			into[nd.arg].push_back(nf + u);
+			break;
+		case RN_MATCH:
+			ends.push_back(nf + u);
+			break;
+		}
+	}
+	into[start_node].push_back(rmatch);
+
+	auto fan_out = [&](const std::vector<u32>& to) -> NfaNode {
+		if (to.empty())
+			return { RN_FAIL, 0, 0, 0 };
+		if (to.size() == 1)
+			return { RN_EMPTY, 0, to[0], 0 };
+		u32 rest = to.back();
+		for (size_t e = to.size() - 2; e >= 1; --e)
+			rest = add_node(RN_SPLIT, 0, to[e], rest);
+		return { RN_SPLIT, 0, to[0], rest };
+	};
+	for (u32 v = 0; v < nf; ++v)
+		nodes[nf + v] = fan_out(into[v]);
+	if (ends.size() == 1) {
+		rev_start = ends[0];
+	} else {
+		const NfaNode nd = fan_out(ends);
+		rev_start = add_node(nd.type, nd.ch, nd.out, nd.arg);
+	}
+}
+
+bool RegexAutomaton::build(const std::vector<std::string>& patterns, u32 flags, bool reverse) {
+	reset();
+	if (patterns.empty())
+		return false;
+	multiline = (flags & REGEX_MULTILINE) != 0;
+
+	std::vector<u32> entries(patterns.size());
+	for (u32 e = 0; e < patterns.size(); ++e) {
+		if (!add_program(patterns[e].c_str(), e, entries[e])) {
+			reset();
+			return false;
+		}
+	}
+	npatterns = (u32) patterns.size();
+	start_node = entries.back();
+	for (u32 e = npatterns - 1; e-- > 0; ) {
+		nodes.push_back({ RN_SPLIT, 0, entries[e], start_node });
+		start_node = (u32) nodes.size() - 1;
+	}
+	if (reverse)
+		add_reverse();
+
+	// Bytes that every node treats alike share a column of the transition tables.
+	std::unordered_map<std::string, u8> sigs;
+	nbc = 0;
+	for (u32 b = 0; b < 256; ++b) {
+		std::string sig;
+		sig += (char) (multiline && b == '\n');
+		for (const NfaNode& nd : nodes) {
+			if (nd.type == RN_CHAR)
+				sig += (char) (nd.ch == b);
+			else if (nd.type == RN_CLASS)
+				sig += (char) ((classes[nd.arg * 4 + (b >> 6)] >> (b & 63)) & 1);
+		}
+		auto it = sigs.find(sig);
+		if (it == sigs.end()) {
+			sigs[sig] = (u8) nbc;
+			byte_class[b] = (u8) nbc++;
+		} else {
+			byte_class[b] = it->second;
+		}
+	}
+
+	mark.assign(nodes.size(), 0);
+	gen = 0;
+	lmark.assign(nodes.size(), 0);
+	lgen = 0;
+	for (u32 a = 0; a < RUN_MODES; ++a)
+		flush(a);
+	find_prefix();
+	return true;
+}
+
+/*** The NFA, one set of states at a time. ***/
+
+/* Everything reachable from the seeds without consuming a byte: the result holds the nodes that consume a
+   byte, $s not yet satisfied, and matches. */
+void RegexAutomaton::closure(const std::vector<u32>& seeds, bool bol, bool eol, std::vector<u32>& out) {
+	if (++gen == 0) {
+		std::fill(mark.begin(), mark.end(), 0);
+		gen = 1;
+	}
+	out.clear();
+	stack.assign(seeds.begin(), seeds.end());
+	while (!stack.empty()) {
+		const u32 n = stack.back();
+		stack.pop_back();
+		if (mark[n] == gen)
+			continue;
+		mark[n] = gen;
+		const NfaNode& nd = nodes[n];
+		switch (nd.type) {
+		case RN_CHAR:
+		case RN_CLASS:
+		case RN_MATCH:
+			out.push_back(n);
+			break;
+		case RN_EMPTY:
+			stack.push_back(nd.out);
+			break;
+		case RN_SPLIT:
+			stack.push_back(nd.arg);
+			stack.push_back(nd.out);
+			break;
+		case RN_BOL:
+			if (bol)
+				stack.push_back(nd.out);
+			break;
+		case RN_EOL:
+			if (eol)
+				stack.push_back(nd.out);
+			else
+				out.push_back(n);
+			break;
+		}
+	}
+	std::sort(out.begin(), out.end());
+}
+
+void RegexAutomaton::step(const std::vector<u32>& set, u8 c, bool anchored, std::vector<u32>& out) {
+	const bool nl = multiline && c == '\n';
+	auto consume = [&](u32 n) {
+		const NfaNode& nd = nodes[n];
+		if ((nd.type == RN_CHAR && nd.ch == c) ||
+		    (nd.type == RN_CLASS && ((classes[nd.arg * 4 + (c >> 6)] >> (c & 63)) & 1)))
+			tmp_seeds.push_back(nd.out);
+	};
+
+	tmp_seeds.clear();
+	if (nl) {
+		// A $ waiting on this newline is satisfied; whatever follows it may then consume the newline.
+		std::vector<u32> eols, after;
+		for (u32 n : set)
+			if (nodes[n].type == RN_EOL)
+				eols.push_back(nodes[n].out);
+		if (!eols.empty()) {
+			closure(eols, false, true, after);
+			for (u32 n : after)
+				consume(n);
+		}
+	}
+	for (u32 n : set)
+		consume(n);
+	if (!anchored)
+		tmp_seeds.push_back(start_node);
+	closure(tmp_seeds, nl, false, out);
+}
+
+/* The leftmost-longest scan's step. Its sets are groups of NFA nodes, each ended by REGEX_GROUP, in the
+   order of where the matches they would make start (the newest group last); a node reached from more than
+   one group is kept only in the earliest. Once a group matches, the groups after it are dropped, and no new
+   ones are started (REGEX_MATCHED ends the set): so the last match the scan sees ends the leftmost-longest. */
+void RegexAutomaton::step_leftmost(const std::vector<u32>& set, u8 c, std::vector<u32>& out) {
+	const bool nl = multiline && c == '\n';
+	bool matched = !set.empty() && set.back() == REGEX_MATCHED;
+	auto consume = [&](u32 n) {
+		const NfaNode& nd = nodes[n];
+		if ((nd.type == RN_CHAR && nd.ch == c) ||
+		    (nd.type == RN_CLASS && ((classes[nd.arg * 4 + (c >> 6)] >> (c & 63)) & 1)))
+			tmp_seeds.push_back(nd.out);
+	};
+	// Add the group's nodes that no earlier group has; returns true if it matches.
+	auto add_group = [&](const std::vector<u32>& g) -> bool {
+		const size_t n0 = out.size();
+		bool m = false;
+		for (u32 n : g) {
+			if (lmark[n] == lgen)
+				continue;
+			lmark[n] = lgen;
+			out.push_back(n);
+			m = m || nodes[n].type == RN_MATCH;
+		}
+		if (out.size() > n0)
+			out.push_back(REGEX_GROUP);
+		return m;
+	};
+
+	if (++lgen == 0) {
+		std::fill(lmark.begin(), lmark.end(), 0);
+		lgen = 1;
+	}
+	out.clear();
+	for (size_t i = 0; i < set.size() && set[i] != REGEX_MATCHED; ) {
+		size_t j = i;
+		while (set[j] != REGEX_GROUP)
+			++j;
+		tmp_seeds.clear();
+		// a match waiting on this newline for its $ ended just before it.
+		bool ended = false;
+		if (nl) {
+			leols.clear();
+			for (size_t e = i; e < j; ++e)
+				if (nodes[set[e]].type == RN_EOL)
+					leols.push_back(nodes[set[e]].out);
+			if (!leols.empty()) {
+				closure(leols, false, true, lafter);
+				for (u32 n : lafter) {
+					ended = ended || nodes[n].type == RN_MATCH;
+					consume(n);
+				}
+			}
+		}
+		for (size_t e = i; e < j; ++e)
+			consume(set[e]);
+		closure(tmp_seeds, nl, false, lgroup);
+		i = j + 1;
+		if (add_group(lgroup) || ended) {
+			matched = true;
+			break;
+		}
+	}
+	if (!matched) {
+		tmp_seeds.assign(1, start_node);
+		closure(tmp_seeds, nl, false, lgroup);
+		matched = add_group(lgroup);
+	}
+	if (matched)
+		out.push_back(REGEX_MATCHED);
+}
+
+void RegexAutomaton::advance(u32 a, const std::vector<u32>& set, u8 c, std::vector<u32>& out) {
+	if (a == RUN_LEFTMOST)
+		step_leftmost(set, c, out);
+	else
+		step(set, c, a != RUN_UNANCHORED, out);
+}
+
+/* The set has no NFA nodes left: can the scan stop? An unanchored scan (or a leftmost one that hasn't matched
+   yet) may still find a match starting on a later line. */
+bool RegexAutomaton::dead_end(u32 a, const std::vector<u32>& set) const {
+	if (a == RUN_ANCHORED || a == RUN_REVERSE || !multiline)
+		return true;
+	return !set.empty();
+}
+
+/* The patterns matched in a state, now and at the end of the text (or line.) */
+void RegexAutomaton::describe(DState& ds) {
+	std::vector<u32> eols, after;
+	ds.ids.clear();
+	ds.eol_ids.clear();
+	for (u32 n : ds.set) {
+		if (n >= REGEX_GROUP)
+			continue;
+		if (nodes[n].type == RN_MATCH)
+			ds.ids.push_back(nodes[n].arg);
+		else if (nodes[n].type == RN_EOL)
+			eols.push_back(nodes[n].out);
+	}
+	if (!eols.empty()) {
+		closure(eols, false, true, after);
+		for (u32 n : after)
+			if (nodes[n].type == RN_MATCH && std::find(ds.ids.begin(), ds.ids.end(), nodes[n].arg) == ds.ids.end())
+				ds.eol_ids.push_back(nodes[n].arg);
+	}
+	std::sort(ds.ids.begin(), ds.ids.end());
+	ds.ids.erase(std::unique(ds.ids.begin(), ds.ids.end()), ds.ids.end());
+	std::sort(ds.eol_ids.begin(), ds.eol_ids.end());
+	ds.eol_ids.erase(std::unique(ds.eol_ids.begin(), ds.eol_ids.end()), ds.eol_ids.end());
+}
+
+/*** The DFA cache. ***/
+
+void RegexAutomaton::flush(u32 a) {
+	Cache& ch = cache[a];
+	ch.states.clear();
+	ch.flags.clear();
+	ch.next.clear();
+	ch.index.clear();
+	ch.start[0] = ch.start[1] = -1;
+	++epoch;
+}
+
+/* The state for this set of NFA nodes, added if it's new; -1 if the cache is full. */
+i32 RegexAutomaton::intern(u32 a, std::vector<u32>& set) {
+	Cache& ch = cache[a];
+	std::string key((const char*) set.data(), set.size() * sizeof(u32));
+	auto it = ch.index.find(key);
+	if (it != ch.index.end())
+		return it->second;
+	if (ch.states.size() >= budget)
+		return -1;
+
+	const i32 id = (i32) ch.states.size();
+	ch.states.emplace_back();
+	DState& ds = ch.states.back();
+	ds.set = set;
+	describe(ds);
+	u8 f = 0;
+	if (!ds.ids.empty())
+		f |= 1;
+	if (!ds.eol_ids.empty())
+		f |= 2;
+	if (ds.set.empty() || ds.set[0] == REGEX_MATCHED)
+		f |= 4;
+	ch.flags.push_back(f);
+	ch.next.resize(ch.next.size() + nbc, -1);
+	ch.index[key] = id;
+	return id;
+}
+
+i32 RegexAutomaton::start_state(u32 a, bool bol) {
+	Cache& ch = cache[a];
+	if (ch.start[bol] < 0) {
+		tmp_seeds.assign(1, a == RUN_REVERSE ? rev_start : start_node);
+		closure(tmp_seeds, bol, false, tmp_set);
+		if (a == RUN_LEFTMOST && !tmp_set.empty()) {
+			bool m = false;
+			for (u32 n : tmp_set)
+				m = m || nodes[n].type == RN_MATCH;
+			tmp_set.push_back(REGEX_GROUP);
+			if (m)
+				tmp_set.push_back(REGEX_MATCHED);
+		}
+		i32 s = intern(a, tmp_set);
+		if (s < 0) {
+			flush(a);
+			s = intern(a, tmp_set);
+		}
+		ch.start[bol] = s;
+	}
+	return ch.start[bol];
+}
+
+/* Build the transition out of state s on byte c. If the cache is full it's flushed (so any other state
+   numbers the caller holds are stale); returns -2 if it's been flushed too often in this scan. */
+i32 RegexAutomaton::transition(u32 a, i32 s, u8 c) {
+	Cache& ch = cache[a];
+	advance(a, ch.states[s].set, c, tmp_set);
+	i32 r = intern(a, tmp_set);
+	if (r >= 0) {
+		ch.next[(size_t) s * nbc + byte_class[c]] = r;
+		return r;
+	}
+	if (++flushes > REGEX_MAX_FLUSHES)
+		return -2;
+	flush(a);
+	return intern(a, tmp_set);
+}
+
+/*** The literal prefix. ***/
+
+/* Only used when the start state doesn't depend on being at the beginning of a line, and consists of a
+   single byte to match, then another, ... */
+void RegexAutomaton::find_prefix(void) {
+	std::vector<u32> seeds(1, start_node), set, bol_set;
+	prefix.clear();
+	closure(seeds, false, false, set);
+	closure(seeds, true, false, bol_set);
+	if (set != bol_set)
+		return;
+	while (prefix.size() < 64 && set.size() == 1 && nodes[set[0]].type == RN_CHAR) {
+		const u8 c = nodes[set[0]].ch;
+		if (multiline && c == '\n')
+			break;
+		prefix += (char) c;
+		seeds.assign(1, nodes[set[0]].out);
+		closure(seeds, false, false, set);
+	}
+}
+
+/* The next occurrence of the prefix at or after 'from', or len. */
+size_t RegexAutomaton::next_prefix(const u8* t, size_t from, size_t len) const {
+	const size_t m = prefix.size();
+	const u8* p = t + from;
+	const u8* end = t + len;
+	while ((size_t) (end - p) >= m) {
+		p = (const u8*) memchr(p, (u8) prefix[0], (size_t) (end - p) - m + 1);
+		if (is_null(p))
+			return len;
+		if (memcmp(p + 1, prefix.data() + 1, m - 1) == 0)
+			return (size_t) (p - t);
+		++p;
+	}
+	return len;
+}
+
+/*** Scanning. ***/
+
+template <class Hit> size_t RegexAutomaton::run(u32 mode, const u8* t, size_t from, size_t len, bool bol, Hit hit) {
+	const u32 a = mode;
+	Cache& ch = cache[a];
+	const bool skip = (a == RUN_UNANCHORED || a == RUN_LEFTMOST) && !prefix.empty();
+	size_t p = from;
+
+	flushes = 0;
+	nfa_mode = false;
+	// (Looking up a start state can flush the cache, but only once: so look up s0 again after s.)
+	i32 s0 = skip ? start_state(a, false) : -1;
+	i32 s = start_state(a, bol);
+	if (skip)
+		s0 = start_state(a, false);
+	u32 ep = epoch;
+
+	forever {
+		if (s == s0 && p < len) {
+			// Nothing under way: skip to where a match could start.
+			p = next_prefix(t, p, len);
+		}
+		const u8 f = ch.flags[s];
+		if (f) {
+			if (f & 4) {
+				// No match can be extended, nor (unless a new line begins) start.
+				if (dead_end(a, ch.states[s].set))
+					return p;
+				const u8* nl = (const u8*) memchr(t + p, '\n', len - p);
+				if (is_null(nl))
+					return len;
+				p = (size_t) (nl - t);
+			}
+			if ((f & 1) && !hit(p, ch.states[s].ids))
+				return p;
+			if ((f & 2) && (p == len || (multiline && t[p] == '\n')) && !hit(p, ch.states[s].eol_ids))
+				return p;
+		}
+		if (p >= len)
+			return p;
+
+		i32 nx = ch.next[(size_t) s * nbc + byte_class[t[p]]];
+		if (nx < 0) {
+			nx = transition(a, s, t[p]);
+			if (nx == -2)
+				break;
+			if (epoch != ep) {
+				// flushed: renumber the start state
+				s0 = skip ? start_state(a, false) : -1;
+				ep = epoch;
+			}
+		}
+		s = nx;
+		++p;
+	}
+
+	// The cache keeps overflowing: carry on without it.
+	nfa_mode = true;
+	DState cur, nxt;
+	cur.set = ch.states[s].set;
+	bool first = true;
+	forever {
+		if (!first) {
+			describe(cur);
+			if ((cur.set.empty() || cur.set[0] == REGEX_MATCHED) && dead_end(a, cur.set))
+				return p;
+			if (!cur.ids.empty() && !hit(p, cur.ids))
+				return p;
+			if (!cur.eol_ids.empty() && (p == len || (multiline && t[p] == '\n')) && !hit(p, cur.eol_ids))
+				return p;
+		}
+		first = false;
+		if (p >= len)
+			return p;
+		advance(a, cur.set, t[p], nxt.set);
+		std::swap(cur.set, nxt.set);
+		++p;
+	}
+}
+
+/*** RegexDFA ***/
+
+bool RegexDFA::compile(const char* pattern, u32 flags) {
+	std::vector<std::string> pats(1, std::string(pattern));
+	return build(pats, flags, true);
+}
+
+bool RegexDFA::search(const char* text, size_t len) {
+	bool found = false;
+	if (!ok())
+		return false;
+	run(RUN_UNANCHORED, (const u8*) text, 0, len, true, [&found](size_t, const std::vector<u32>&) {
+		found = true;
+		return false;
+	});
+	return found;
+}
+
+bool RegexDFA::find(const char* text, size_t len, size_t& start, size_t& end, size_t from) {
+	const u8* t = (const u8*) text;
+	if (!ok() || from > len)
+		return false;
+
+	// Where the leftmost-longest match ends.
+	size_t e = 0;
+	bool found = false;
+	run(RUN_LEFTMOST, t, from, len, at_bol(t, from), [&](size_t p, const std::vector<u32>&) {
+		e = p;
+		found = true;
+		return true;
+	});
+	if (!found)
+		return false;
+
+	// Back from there to the earliest start, reading the text reversed: a window of it at a time, each four
+	// times the last, until the reverse scan dies inside one. The byte before 'from' goes too, for a ^ at
+	// 'from', but no match may start there.
+	const size_t lo = (from > 0) ? from - 1 : 0;
+	const size_t span = e - from;
+	size_t back = 0;
+	for (size_t w = 256; ; w *= 4) {
+		const size_t n = std::min(w, e - lo);
+		const bool whole = (n == e - lo);
+		rtext.resize(n);
+		std::reverse_copy(t + e - n, t + e, rtext.begin());
+		found = false;
+		// (the end of a partial window isn't the beginning of the text or a line, so a hit there doesn't count.)
+		const size_t stop = run(RUN_REVERSE, rtext.data(), 0, n, at_eol(t, e, len), [&](size_t q, const std::vector<u32>&) {
+			if (q > span || (!whole && q >= n))
+				return false;
+			back = q;
+			found = true;
+			return true;
+		});
+		if (whole || stop < n)
+			break;
+	}
+	if (!found)
+		return false;
+	start = e - back;
+	end = e;
+	return true;
+}
+
+void RegexDFA::find_all(const char* text, size_t len, std::vector<std::pair<size_t, size_t>>& matches) {
+	size_t pos = 0, s, e;
+	matches.clear();
+	while (pos <= len && find(text, len, s, e, pos)) {
+		matches.push_back(std::make_pair(s, e));
+		pos = (e > s) ? e : e + 1;
+	}
+}
+
+/*** RegexSet ***/
+
+int RegexSet::add(const char* pattern) {
+	RegexDFA test;
+	if (!test.compile(pattern))
+		return -1;
+	patterns.push_back(pattern);
+	return (int) patterns.size() - 1;
+}
+
+bool RegexSet::compile(u32 flags) {
+	return build(patterns, flags);
+}
+
+bool RegexSet::match(const char* text, size_t len, std::vector<u32>& which) {
+	which.clear();
+	if (!ok())
+		return false;
+	std::vector<u8> seen(npatterns, 0);
+	u32 nseen = 0;
+	run(RUN_UNANCHORED, (const u8*) text, 0, len, true, [&](size_t, const std::vector<u32>& ids) {
+		for (u32 id : ids) {
+			if (!seen[id]) {
+				seen[id] = 1;
+				++nseen;
+			}
+		}
+		return nseen < npatterns;
+	});
+	for (u32 e = 0; e < npatterns; ++e)
+		if (seen[e])
+			which.push_back(e);
+	return !which.empty();
+}
+
+/* end regexdfa.cpp */
@@ -352,6 +352,14 @@ void Scratchpad::clear() {
 	cend = buf;
 }
 
+int Scratchpad::resize(u32 nbytes) {
+	if (realloc(nbytes + 1))
+		return(1);
+	cend = buf + nbytes;
+	*cend = '\000';
+	return(0);
+}
+
 void Scratchpad::give_static_buffer(u8* buf_in, u32 buflen) {
 	buf = buf_in;
 	ialloc = buflen;
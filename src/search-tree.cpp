@@ -33,13 +33,19 @@ SRTNode::~SRTNode() {
 			children[i] = nullptr;
 		}
 	if (replace != nullptr) {
-		delete replace;
+		delete [] replace;
 		replace = nullptr;
 	}
 }
 
 SearchReplaceTree::SearchReplaceTree() {
 	tree = new SRTNode;
+	sptr = sstr.c_str();
+	match_len = 0;
+	pool = nullptr;
+	compiled = false;
+	for (int c = 0; c < 256; ++c)
+		char_idx[c] = (u8) srtnode_idx_from_char(c);
 }
 
 SearchReplaceTree::~SearchReplaceTree() {
@@ -55,11 +61,10 @@ void SearchReplaceTree::add_searchable(const std::string& term, const std::strin
 }
 
 void SearchReplaceTree::add_searchable(const char * term, const char * replace) {
-	// Make sure that replacement text doesn't contain the original (or other) tags, this can lead to an infinite loop.
 	SRTNode * node = this->tree;
 	const char *w = term;
 	while (*w) {
-		int idx = srtnode_idx_from_char(*w);
+		int idx = srtnode_idx_from_char((u8) *w);
 		if (node->children[idx] == nullptr) {
 			node->children[idx] = new SRTNode;
 			ship_assert(node->children[idx] != nullptr);
@@ -70,9 +75,11 @@ void SearchReplaceTree::add_searchable(const char * term, const char * replace)
 
 	node->v = true;
 	if (replace != nullptr) {
+		delete [] node->replace;
 		node->replace = new char [ strlen(replace) + 1 ];
 		strcpy(node->replace, replace);
 	}
+	compiled = false;
 }
 
 void SearchReplaceTree::search_string(const std::string& search_str) {
@@ -89,44 +96,206 @@ void SearchReplaceTree::reset_search() {
 	sptr = sstr.c_str();
 }
 
-SRTNode * SearchReplaceTree::search_at() {
-	SRTNode * ret = tree;
-	const char * w = sptr;
-	match_len = 1;
-	while (*w) {
-		int idx = srtnode_idx_from_char(*w);
-		if (ret->children[idx] == nullptr) {
-			return nullptr;
+/* Build the automaton. The states are numbered breadth-first, so a state's failure link (to a shallower state) is
+   always complete by the time the state's own missing transitions are filled in from it. */
+void SearchReplaceTree::compile() {
+	std::vector<i32> fail;
+
+	state_node.assign(1, tree);
+	depth.assign(1, 0);
+	delta.clear();
+	for (size_t q = 0; q < state_node.size(); ++q) {
+		for (int c = 0; c < SRTNODE_COUNT; ++c) {
+			SRTNode* ch = state_node[q]->children[c];
+			if (ch != nullptr) {
+				delta.push_back((i32) state_node.size());
+				state_node.push_back(ch);
+				depth.push_back(depth[q] + 1);
+			} else {
+				delta.push_back(-1);
+			}
 		}
-		ret = ret->children[idx];
-		if (ret->v) {
-			return ret;
+	}
+
+	const size_t n = state_node.size();
+	fail.assign(n, 0);
+	out.assign(n, -1);
+	for (size_t q = 0; q < n; ++q) {
+		i32* row = delta.data() + q * SRTNODE_COUNT;
+		const i32* frow = delta.data() + (size_t) fail[q] * SRTNODE_COUNT;
+		if (q > 0)
+			out[q] = state_node[q]->v ? (i32) q : out[fail[q]];
+		for (int c = 0; c < SRTNODE_COUNT; ++c) {
+			if (row[c] < 0)
+				row[c] = (q == 0 ? 0 : frow[c]);
+			else
+				fail[row[c]] = (q == 0 ? 0 : frow[c]);
 		}
-		++w;
-		++match_len;
 	}
-	return nullptr;
+	compiled = true;
 }
 
-const char * SearchReplaceTree::next_searchable(SRTNode ** node_ret) {
-	SRTNode * ret = nullptr;
-	while (*sptr) {
-		ret = search_at();
-		if (ret != nullptr) {
-			if (node_ret != nullptr) {
-				(*node_ret) = ret;
+/* The leftmost-longest match starting in [from, limit) of s[0, len), if there is one. The scan stops as soon as no
+   term in progress could start at or before the best match so far. */
+bool SearchReplaceTree::find_match(const char * s, size_t len, size_t from, size_t limit, SRTMatch& m) const {
+	const i32* dt = delta.data();
+	i32 q = 0;
+	bool found = false;
+
+	for (size_t i = from; i < len; ++i) {
+		q = dt[(size_t) q * SRTNODE_COUNT + char_idx[(u8) s[i]]];
+		const i32 o = out[q];
+		if (o >= 0) {
+			const size_t st = i + 1 - (size_t) depth[o];
+			if (st < limit && (!found || st <= m.start)) {
+				found = true;
+				m.start = st;
+				m.len = i + 1 - st;
+				m.node = state_node[o];
 			}
-			++sptr;
-			return sptr - 1;
 		}
-		++sptr;
+		if (found) {
+			if ((size_t) depth[q] < i + 1 - m.start)
+				break;
+		} else if (i + 1 - (size_t) depth[q] >= limit) {
+			break;
+		}
 	}
-	if (node_ret != nullptr) {
-		*node_ret = nullptr;
+	return found;
+}
+
+/* The matches starting in [from, limit), as a search from 'from' would find them. */
+void SearchReplaceTree::find_range(const char * s, size_t len, size_t from, size_t limit, std::vector<SRTMatch>& matches) const {
+	SRTMatch m;
+	while (from < limit && find_match(s, len, from, limit, m)) {
+		matches.push_back(m);
+		from = m.start + m.len;
+	}
+}
+
+const char * SearchReplaceTree::next_searchable(SRTNode ** node_ret) {
+	SRTMatch m;
+	const size_t from = (size_t) (sptr - sstr.c_str());
+
+	if (!compiled)
+		compile();
+	if (find_match(sstr.c_str(), sstr.size(), from, sstr.size(), m)) {
+		if (node_ret != nullptr)
+			*node_ret = m.node;
+		match_len = (int) m.len;
+		sptr = sstr.c_str() + m.start + m.len;
+		return sstr.c_str() + m.start;
 	}
+	sptr = sstr.c_str() + sstr.size();
+	if (node_ret != nullptr)
+		*node_ret = nullptr;
 	return nullptr;
 }
 
+/* Long strings are cut into chunks, each searched on its own from its start. A chunk's matches are right unless the
+   last match of the chunk before runs into it: then the search picks up sequentially after that match, until it gets
+   to a position the chunk's own search also carried on from, after which the two agree. */
+void SearchReplaceTree::find_all(std::vector<SRTMatch>& matches) {
+	const char * s = sstr.c_str();
+	const size_t len = sstr.size();
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+
+	if (!compiled)
+		compile();
+	matches.clear();
+	if (len < SRT_PARALLEL_MIN || tp.size() < 2) {
+		find_range(s, len, 0, len, matches);
+		return;
+	}
+
+	const size_t nchunks = std::min((size_t) tp.size() * 4, len / (SRT_PARALLEL_MIN / 16));
+	std::vector<size_t> bounds(nchunks + 1);
+	std::vector< std::vector<SRTMatch> > found(nchunks);
+	for (size_t k = 0; k <= nchunks; ++k)
+		bounds[k] = len * k / nchunks;
+	tp.parallel_for(0, (i64) nchunks, [&](i64 k0, i64 k1) {
+		for (i64 k = k0; k < k1; ++k)
+			find_range(s, len, bounds[k], bounds[k + 1], found[k]);
+	});
+
+	size_t pos = 0;
+	for (size_t k = 0; k < nchunks; ++k) {
+		const std::vector<SRTMatch>& f = found[k];
+		size_t j = 0;
+		if (pos > bounds[k]) {
+			SRTMatch m;
+			forever {
+				// has the chunk's search been here?
+				while (j < f.size() && f[j].start + f[j].len < pos)
+					++j;
+				if (j < f.size() && f[j].start + f[j].len == pos) {
+					++j;
+					break;
+				}
+				if (pos >= bounds[k + 1] || !find_match(s, len, pos, bounds[k + 1], m)) {
+					j = f.size();
+					break;
+				}
+				matches.push_back(m);
+				pos = m.start + m.len;
+			}
+		}
+		for (; j < f.size(); ++j) {
+			matches.push_back(f[j]);
+			pos = f[j].start + f[j].len;
+		}
+	}
+}
+
+/* Rebuild the string with each match replaced (or deleted), in one pass. The output position of every match is
+   known up front, so for long strings the copying is split across the pool too. */
+void SearchReplaceTree::splice(const std::vector<SRTMatch>& matches, const char * replace, bool del) {
+	const size_t nm = matches.size();
+	std::vector<const char*> rp(nm);
+	std::vector<size_t> rlen(nm), opos(nm + 1);
+	size_t o = 0, prev = 0;
+
+	for (size_t i = 0; i < nm; ++i) {
+		const SRTMatch& m = matches[i];
+		if (del)
+			rp[i] = "";
+		else if (replace != nullptr && *replace)
+			rp[i] = replace;
+		else if (m.node->replace != nullptr && *m.node->replace)
+			rp[i] = m.node->replace;
+		else
+			rp[i] = sstr.c_str() + m.start;	// no replacement: keep the match (use delete_all_searchable() to delete)
+		rlen[i] = (rp[i] == sstr.c_str() + m.start ? m.len : strlen(rp[i]));
+		o += m.start - prev;
+		opos[i] = o;
+		o += rlen[i];
+		prev = m.start + m.len;
+	}
+	opos[nm] = o + (sstr.size() - prev);
+
+	std::string ns(opos[nm], '\0');
+	const char * s = sstr.c_str();
+	char * d = &ns[0];
+	// entry i copies the text between match i - 1 and match i, then match i's replacement; entry nm, the tail.
+	auto fill = [&](i64 i0, i64 i1) {
+		for (i64 i = i0; i < i1; ++i) {
+			const size_t gap0 = (i > 0 ? matches[i - 1].start + matches[i - 1].len : 0);
+			const size_t gap1 = ((size_t) i < nm ? matches[i].start : sstr.size());
+			const size_t dst = ((size_t) i < nm ? opos[i] : opos[nm]) - (gap1 - gap0);
+			memcpy(d + dst, s + gap0, gap1 - gap0);
+			if ((size_t) i < nm)
+				memcpy(d + opos[i], rp[i], rlen[i]);
+		}
+	};
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	if (sstr.size() < SRT_PARALLEL_MIN || tp.size() < 2)
+		fill(0, (i64) nm + 1);
+	else
+		tp.parallel_for(0, (i64) nm + 1, fill, 256);
+	sstr.swap(ns);
+	sptr = sstr.c_str() + sstr.size();
+}
+
 void SearchReplaceTree::do_all_replace(const std::string& replace) {
 	if (replace.empty())
 		do_all_replace(nullptr);
@@ -135,43 +304,15 @@ void SearchReplaceTree::do_all_replace(const std::string& replace) {
 }
 
 void SearchReplaceTree::do_all_replace(const char * replace) {
-	const char * w;
-	SRTNode * node;
-	forever {
-		std::string rp;
-		int idx;
-		w = next_searchable(&node);
-		NOT_NULL_OR_BREAK(w);
-		idx = (w - sstr.c_str());
-		if (replace == nullptr) {
-			if (node->replace != nullptr)
-				rp = node->replace;
-		} else {
-			rp = replace;
-		}
-		if (rp.empty()) {
-			// no replacement if replace is nullptr & node has no suggested replacement.
-			// if you want deletion use delete_all_searchable().
-			continue;
-		}
-		sstr.erase(idx, (size_t) match_len);
-		sstr.insert(idx, rp);
-		// string may have reallocated, so reset the pointer here
-		sptr = sstr.c_str() + idx;
-	}
+	std::vector<SRTMatch> matches;
+	find_all(matches);
+	splice(matches, replace, false);
 }
 
 void SearchReplaceTree::delete_all_searchable() {
-	const char * w;
-	SRTNode * node;
-	forever {
-		size_t idx;
-		w = next_searchable(&node);
-		NOT_NULL_OR_BREAK(w);
-		idx = (w - sstr.c_str());
-		sstr.erase(idx, (size_t) match_len);
-		sptr = sstr.c_str() + idx;
-	}
+	std::vector<SRTMatch> matches;
+	find_all(matches);
+	splice(matches, nullptr, true);
 }
 
 /*** end search-tree.cpp ***/
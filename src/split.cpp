@@ -125,3 +125,91 @@ void SplitString::split_on_whitespace(const std::string& str) {
 	split_on_whitespace(str.c_str());
 }
 
+
+/*** SplitView. ***/
+
+SplitView::SplitView(const char* str, size_t len, char split_char, bool keep_empty) : sc(split_char), keep(keep_empty) {
+	split(str, len);
+}
+
+SplitView::SplitView(const std::string& str, char split_char, bool keep_empty) : sc(split_char), keep(keep_empty) {
+	split(str);
+}
+
+SplitView::SplitView(const Scratchpad* sp, char split_char, bool keep_empty) : sc(split_char), keep(keep_empty) {
+	split(sp);
+}
+
+void SplitView::split(const char* str, size_t len) {
+	fields.clear();
+	add_splits(str, len);
+}
+
+void SplitView::add_splits(const char* str, size_t len) {
+	const char* field = str;
+	size_t pos = 0;
+
+	while (pos < len) {
+		u64 m;
+		if (len - pos >= 64) {
+			m = char_mask64(str + pos, sc);
+		} else {
+			// the last partial block, padded out; the padding never matches
+			char tail[64];
+			memcpy(tail, str + pos, len - pos);
+			memset(tail + (len - pos), 0, 64 - (len - pos));
+			m = char_mask64(tail, sc) & ((1ULL << (len - pos)) - 1);
+		}
+		while (m != 0) {
+			const char* at = str + pos + mask_ctz(m);
+			add_field(field, at);
+			field = at + 1;
+			m &= m - 1;
+		}
+		pos += 64;
+	}
+	add_field(field, str + len);
+}
+
+void SplitView::split_on_whitespace(const char* str, size_t len) {
+	const char* start = str;
+	u64 carry = 1;	// is the byte before the block whitespace? (the start of the string counts as whitespace)
+	size_t pos = 0;
+
+	fields.clear();
+	while (pos < len) {
+		u64 ws;
+		if (len - pos >= 64) {
+			ws = whitespace_mask64(str + pos);
+		} else {
+			// the padding counts as whitespace, so a field running to the end is closed here
+			char tail[64];
+			memcpy(tail, str + pos, len - pos);
+			memset(tail + (len - pos), 0, 64 - (len - pos));
+			ws = whitespace_mask64(tail) | ~((1ULL << (len - pos)) - 1);
+		}
+		// the bits where whitespace starts or stops: the field starts and ends
+		u64 t = ws ^ ((ws << 1) | carry);
+		while (t != 0) {
+			const u32 i = mask_ctz(t);
+			if (ws & (1ULL << i))
+				fields.push_back(StrSpan { start, (size_t) (str + pos + i - start) });
+			else
+				start = str + pos + i;
+			t &= t - 1;
+		}
+		carry = ws >> 63;
+		pos += 64;
+	}
+	if (carry == 0)
+		fields.push_back(StrSpan { start, (size_t) (str + len - start) });
+}
+
+void SplitView::to_strings(std::vector<std::string>& out) const {
+	out.clear();
+	out.reserve(fields.size());
+	for (const auto& f : fields)
+		out.push_back(f.str());
+}
+
+/* end split.cpp */
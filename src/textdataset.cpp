@@ -11,90 +11,111 @@
 
 ***/
 
-Paragraph::Paragraph() {
-	length = 0;
-}
+#define GPT4ALL
 
-void Paragraph::add_line(std::string& line, const std::string& src_label) {
-	SplitString ss;
-	ss.split_on_whitespace(line);
-	content += ss;
-	src = src_label;
-	length += ss.nstrs();
+/* The json for the words [i1, i3] of a paragraph, split into prompt [i1, i2) and response [i2, i3]. Words is
+   a vector of std::string, or of StrSpan for the streaming functions. */
+static inline void json_word(const std::string& w, std::string& out) {
+	append_json_escaped_text(w.data(), w.size(), out);
 }
 
-void Paragraph::output_all_splits(std::ostream &o) const {
-	if (length < Paragraph::max_two_splits) {
-		output_range_splits(0, length / 2, length - 1, o);
-	}
-	if (length >= Paragraph::min_three_splits && length <= Paragraph::max_three_splits) {
-		output_range_splits(0, length / 3, (2 * length) / 3, o);
-		output_range_splits(length / 3, (2 * length) / 3, length - 1, o);
-	}
-	if (length >= Paragraph::min_four_splits && length <= Paragraph::max_four_splits) {
-		output_range_splits(0, length / 4, length / 2, o);
-		output_range_splits(length / 4, length / 2, (3 * length) / 4, o);
-		output_range_splits(length / 2, (3 * length) / 4, length - 1, o);
-	}
-	if (length > Paragraph::max_four_splits) {
-		int e = 0;
-		forever {
-			if (e + 200 >= length) {
-				int v = (length - e) / 2;
-				if (v >= 10) {
-					output_range_splits(e, e + v, length - 1, o);
-				}
-				break;
-			}
-			output_range_splits(e, e + 100, e + 200, o);
-			e += 200;
-		}
-	}
+static inline void json_word(const StrSpan& w, std::string& out) {
+	append_json_escaped_text(w.data, w.len, out);
 }
 
-#define GPT4ALL
-
-void Paragraph::output_range_splits(int i1, int i2, int i3, std::ostream& o) const {
+template <class Words> static void json_range_splits(const Words& strs, const std::string& src, int i1, int i2, int i3, std::string& o) {
 	// we were using the gpt4all .jsonl format, which looks something like:
 	// {"prompt": "this is the prompt", "response": "this is the response", "source": "this is the source"}
 	// or are we using the Alpaca format, which is "instruction", "input", "output".
-	const std::vector<std::string>& strs = content.strs_const();
 	i1 = std::min(std::max(i1, 0), (int) (strs.size()));
 	i2 = std::min(std::max(i2, 0), (int) (strs.size()));
 	i3 = std::min(std::max(i3, 0), (int) (strs.size()));
 #ifdef GPT4ALL
-	o << "{\"prompt\": \"";
-#else	
-	o << "{\"instruction\": \"Complete the provided text.\", \"input\": \"";
-#endif	
+	o += "{\"prompt\": \"";
+#else
+	o += "{\"instruction\": \"Complete the provided text.\", \"input\": \"";
+#endif
 	for (int i = i1; i < i2; ++i) {
-		output_json_escaped_text(strs[i], o);
-		o << " ";
+		json_word(strs[i], o);
+		o += ' ';
 	}
 #ifdef GPT4ALL
-	o << "\", \"response\": \"";
-#else	
-	o << "\", \"output\": \"";
+	o += "\", \"response\": \"";
+#else
+	o += "\", \"output\": \"";
 #endif
 	for (int i = i2; i <= i3; ++i) {
-		output_json_escaped_text(strs[i], o);
+		json_word(strs[i], o);
 		if (i == i3) {
 			if (i3 + 1 >= strs.size()) {
-				o << "\\n";
+				o += "\\n";
 			}
 		} else {
-			o << " ";
+			o += ' ';
 		}
 	}
 #ifdef GPT4ALL
-	o << "\", \"source\": \"";
-	output_json_escaped_text(src, o);
-#endif	
-	o << "\"}\n";
+	o += "\", \"source\": \"";
+	append_json_escaped_text(src.data(), src.size(), o);
+#endif
+	o += "\"}\n";
 }
 
 #undef GPT4ALL
 
+template <class Words> static void json_all_splits(const Words& strs, int length, const std::string& src, std::string& o) {
+	if (length < Paragraph::max_two_splits) {
+		json_range_splits(strs, src, 0, length / 2, length - 1, o);
+	}
+	if (length >= Paragraph::min_three_splits && length <= Paragraph::max_three_splits) {
+		json_range_splits(strs, src, 0, length / 3, (2 * length) / 3, o);
+		json_range_splits(strs, src, length / 3, (2 * length) / 3, length - 1, o);
+	}
+	if (length >= Paragraph::min_four_splits && length <= Paragraph::max_four_splits) {
+		json_range_splits(strs, src, 0, length / 4, length / 2, o);
+		json_range_splits(strs, src, length / 4, length / 2, (3 * length) / 4, o);
+		json_range_splits(strs, src, length / 2, (3 * length) / 4, length - 1, o);
+	}
+	if (length > Paragraph::max_four_splits) {
+		int e = 0;
+		forever {
+			if (e + 200 >= length) {
+				int v = (length - e) / 2;
+				if (v >= 10) {
+					json_range_splits(strs, src, e, e + v, length - 1, o);
+				}
+				break;
+			}
+			json_range_splits(strs, src, e, e + 100, e + 200, o);
+			e += 200;
+		}
+	}
+}
+
+Paragraph::Paragraph() {
+	length = 0;
+}
+
+void Paragraph::add_line(std::string& line, const std::string& src_label) {
+	SplitString ss;
+	ss.split_on_whitespace(line);
+	content += ss;
+	src = src_label;
+	length += ss.nstrs();
+}
+
+void Paragraph::output_all_splits(std::ostream &o) const {
+	std::string json;
+	json_all_splits(content.strs_const(), length, src, json);
+	o << json;
+}
+
+void Paragraph::output_range_splits(int i1, int i2, int i3, std::ostream& o) const {
+	std::string json;
+	json_range_splits(content.strs_const(), src, i1, i2, i3, json);
+	o << json;
+}
+
 void Paragraph::clear() {
 	content.clear();
 	src.clear();
@@ -103,13 +124,14 @@ void Paragraph::clear() {
 
 TextDataset::TextDataset() {
 	total_length = 0;
+	n_streamed = 0;
 }
 
 void TextDataset::add_from_file(const char* filename) {
 	Paragraph para_in_progress;
 	std::ifstream i;
 	std::string line;
-	
+
 	i.open(filename);
 	forever {
 		std::getline(i, line);
@@ -127,7 +149,7 @@ void TextDataset::add_from_file(const char* filename) {
 	}
 	i.close();
 	i.clear();
-	
+
 	if (para_in_progress.length >= TextDataset::min_len_paragraph) {
 		paras.push_back(para_in_progress);
 		total_length += para_in_progress.length;
@@ -161,49 +183,244 @@ void TextDataset::output_training_json(const char* pathname_out) const {
 }
 
 void TextDataset::show_stats() const {
-	std::cout << "Contents of dataset: " << paras.size() << " paragraphs, " << total_length << " word-equivalents.\n";
+	std::cout << "Contents of dataset: " << paras.size() + n_streamed << " paragraphs, " << total_length << " word-equivalents.\n";
 }
 
-void output_json_escaped_text(const std::string& str, std::ostream& o) {
-	for (unsigned char c : str) {
-		u32 i = (u32)c;
-		switch (i) {
+/*** The streaming pipeline. ***/
+
+/* A text file on its way through: read and formatted by a reader thread, then written by the writer. */
+struct TdFileJob {
+	u64 idx;
+	std::string filename;
+	std::string json;
+	u64 nparas;
+	u64 nwords;
+};
+
+struct TdPipeline {
+	TdPipeline(u32 in_flight, int n_readers) : slots(in_flight) {
+		for (u32 e = 0; e < in_flight; ++e)
+			slots.push(0);
+		n_readers_live = n_readers;
+	}
+
+	WorkQueue<int> slots;			// a file must take one of these to be read; the writer returns it
+	WorkQueue<TdFileJob*> todo_q;		// feeder -> readers
+	WorkQueue<TdFileJob*> done_q;		// readers -> writer, in any order
+	std::mutex mtx;
+	int n_readers_live;
+};
+
+/* Read the file and format its paragraphs' json, exactly as add_from_file() and output_training_json() would:
+   lines are read as by getline() (so an unterminated last line is dropped), a line starting with whitespace
+   begins a new paragraph once the current one is long enough, and words are split on whitespace (up to any
+   NUL in the line.) The words are spans of the file's text. */
+static void td_format_file(TdFileJob* job, int min_len_paragraph) {
+	std::string text;
+	FILE* f = fopen(job->filename.c_str(), "r");
+	if (not_null(f)) {
+		char buf[65536];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			text.append(buf, n);
+		fclose(f);
+	}
+
+	SplitView words;
+	std::vector<StrSpan> para;
+	const char* p = text.data(), * end = p + text.size();
+	job->nparas = 0;
+	job->nwords = 0;
+	forever {
+		const char* eol = advance_to_char(p, end, '\n');
+		if (eol == end)
+			break;
+		if (eol > p) {
+			if (isspace(*p) && (int) para.size() >= min_len_paragraph) {
+				json_all_splits(para, (int) para.size(), job->filename, job->json);
+				++job->nparas;
+				job->nwords += para.size();
+				para.clear();
+			}
+			words.split_on_whitespace(p, advance_to_char(p, eol, '\0') - p);
+			para.insert(para.end(), words.begin(), words.end());
+		}
+		p = eol + 1;
+	}
+	if ((int) para.size() >= min_len_paragraph) {
+		json_all_splits(para, (int) para.size(), job->filename, job->json);
+		++job->nparas;
+		job->nwords += para.size();
+	}
+}
+
+bool TextDataset::stream_files_json(const std::vector<std::string>& filenames, const char* pathname_out, int n_threads,
+					u32 max_files_in_flight) {
+	FILE* fo = fopen(pathname_out, "w");
+	if (is_null(fo))
+		return false;
+	const size_t OUT_BUFFER = 1 << 20;
+	std::vector<char> obuf(OUT_BUFFER);
+	setvbuf(fo, obuf.data(), _IOFBF, OUT_BUFFER);
+
+	const int n_readers = std::max(n_threads > 0 ? n_threads : (int) std::thread::hardware_concurrency(), 1);
+	const u32 in_flight = std::max(max_files_in_flight, (u32) 1);
+	const int min_len = min_len_paragraph;
+	TdPipeline pl(in_flight, n_readers);
+
+	// feeder: hand out the files in order, each once it has a slot.
+	std::thread feeder([&filenames, &pl]() {
+		int slot;
+		for (u64 e = 0; e < filenames.size(); ++e) {
+			if (!pl.slots.pop(slot))
+				break;
+			TdFileJob* job = new TdFileJob;
+			job->idx = e;
+			job->filename = filenames[e];
+			if (!pl.todo_q.push(job)) {
+				delete job;
+				break;
+			}
+		}
+		pl.todo_q.close();
+	});
+
+	// readers: load, segment and format files.
+	std::vector<std::thread> readers;
+	for (int w = 0; w < n_readers; ++w) {
+		readers.push_back(std::thread([&pl, min_len]() {
+			TdFileJob* job;
+			while (pl.todo_q.pop(job)) {
+				td_format_file(job, min_len);
+				pl.done_q.push(job);
+			}
+			ScopeMutex sm(pl.mtx);
+			if (--pl.n_readers_live == 0)
+				pl.done_q.close();
+		}));
+	}
+
+	// and write the files' json here, in order: a file finished early waits for those before it.
+	std::vector<TdFileJob*> pending(in_flight, nullptr);
+	u64 next = 0;
+	bool ok = true;
+	TdFileJob* job;
+	while (pl.done_q.pop(job)) {
+		pending[job->idx % in_flight] = job;
+		while (not_null(pending[next % in_flight])) {
+			TdFileJob* j = pending[next % in_flight];
+			pending[next % in_flight] = nullptr;
+			if (ok && !j->json.empty() && fwrite(j->json.data(), 1, j->json.size(), fo) != j->json.size()) {
+				// stop feeding; the readers finish what they have, and we drain it
+				ok = false;
+				pl.slots.close();
+				pl.todo_q.close();
+			}
+			n_streamed += j->nparas;
+			total_length += j->nwords;
+			delete j;
+			++next;
+			pl.slots.push(0);
+		}
+	}
+
+	feeder.join();
+	for (auto& th : readers)
+		th.join();
+	ok = (fclose(fo) == 0) && ok;
+	return ok;
+}
+
+bool TextDataset::stream_folder_json(const char* path, const char* pathname_out, int n_threads, u32 max_files_in_flight) {
+	std::vector<std::string> filenames;
+	DIR* di = opendir(path);
+	dirent* entry;
+
+	while (not_null(di) && (entry = readdir(di))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (strstr(entry->d_name, ".txt") != nullptr) {
+			std::string pathname;
+			make_pathname(path, entry->d_name, pathname);
+			filenames.push_back(pathname);
+		}
+	}
+	if (not_null(di))
+		closedir(di);
+	return stream_files_json(filenames, pathname_out, n_threads, max_files_in_flight);
+}
+
+/*** The length of the run at p that json-escaping leaves as it is: everything but the control characters,
+	quotes, backslashes and bytes >= 0x80. ***/
+static size_t json_plain_run(const char* p, size_t len) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i sp = _mm_set1_epi8(' '), q = _mm_set1_epi8('\"'), bs = _mm_set1_epi8('\\');
+	for (; i + 16 <= len; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		// a signed compare: below a space catches the controls and every byte >= 0x80
+		const u32 m = (u32) _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, sp),
+				_mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, bs))));
+		if (m != 0)
+			return i + mask_ctz(m);
+	}
+#endif
+	while (i < len && (i8) p[i] >= ' ' && p[i] != '\"' && p[i] != '\\')
+		++i;
+	return i;
+}
+
+void append_json_escaped_text(const char* str, size_t len, std::string& o) {
+	size_t i = 0;
+	forever {
+		const size_t n = json_plain_run(str + i, len - i);
+		o.append(str + i, n);
+		i += n;
+		if (i >= len)
+			break;
+		u32 c = (u8) str[i++];
+		switch (c) {
 		default:
-			if (i < 128)
-				o << char(c);
+			if (c < 128)
+				o += char(c);
 			break;
 		case 150:
 		case 151:
-			o << "-";
+			o += "-";
 			break;
 		case 146:
 		case 147:
-			o << "'";
+			o += "'";
 			break;
 		case '\t':
-			o << "\\t";
+			o += "\\t";
 			break;
 		case '\b':
-			o << "\\b";
+			o += "\\b";
 			break;
 		case '\f':
-			o << "\\f";
+			o += "\\f";
 			break;
 		case '\n':
-			o << "\\n";
+			o += "\\n";
 			break;
 		case '\r':
-			o << "\\r";
+			o += "\\r";
 			break;
 		case '\\':
-			o << "\\\\";
+			o += "\\\\";
 			break;
 		case '\"':
 		case 145:
 		case 148:
-			o << "\\\"";
+			o += "\\\"";
 			break;
 		}
 	}
 }
 
+void output_json_escaped_text(const std::string& str, std::ostream& o) {
+	std::string esc;
+	append_json_escaped_text(str.data(), str.size(), esc);
+	o << esc;
+}
@@ -0,0 +1,126 @@
+/***
+
+	threadpool.cpp
+
+	A simple fixed-size thread pool.
+
+	2024, C. M. Street
+
+***/
+
+ThreadPool::ThreadPool(int nthreads) {
+	if (nthreads <= 0)
+		nthreads = std::max((int) std::thread::hardware_concurrency(), 1);
+	n_pending = 0;
+	stopping = false;
+	for (int e = 0; e < nthreads; ++e)
+		workers.push_back(std::thread([this]() { worker_main(); }));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		stopping = true;
+		cv_task.notify_all();
+	}
+	for (auto& th : workers)
+		th.join();
+}
+
+void ThreadPool::worker_main() {
+	forever {
+		std::function<void()> fn;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv_task.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			fn = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		fn();
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			if (--n_pending == 0)
+				cv_done.notify_all();
+		}
+	}
+}
+
+void ThreadPool::run(std::function<void()> fn) {
+	std::unique_lock<std::mutex> lock(mtx);
+	tasks.push_back(std::move(fn));
+	++n_pending;
+	cv_task.notify_one();
+}
+
+void ThreadPool::wait() {
+	std::unique_lock<std::mutex> lock(mtx);
+	cv_done.wait(lock, [this]() { return n_pending == 0; });
+}
+
+/* The chunks of a parallel_for() are handed out from a shared counter, and the calling thread takes
+   chunks too. So this is safe to call from inside a pool task: if every worker is busy, the caller
+   simply does all the work itself. Helper tasks that start after the work is gone exit at once, which
+   is why the shared state is reference counted rather than living on the caller's stack. */
+struct ParallelForState {
+	std::function<void(i64, i64)> fn;
+	i64 begin, end, grain, n_chunks;
+	std::atomic<i64> next_chunk;
+	i64 n_done;
+	std::mutex mtx;
+	std::condition_variable cv;
+
+	// Process chunks until none are left.
+	void work() {
+		forever {
+			i64 c = next_chunk++;
+			if (c >= n_chunks)
+				return;
+			i64 i0 = begin + c * grain;
+			fn(i0, std::min(i0 + grain, end));
+			std::unique_lock<std::mutex> lock(mtx);
+			if (++n_done == n_chunks)
+				cv.notify_all();
+		}
+	}
+};
+
+void ThreadPool::parallel_for(i64 begin, i64 end, std::function<void(i64, i64)> fn, i64 grain) {
+	if (end <= begin)
+		return;
+	grain = std::max(grain, (i64) 1);
+	// aim for a few chunks per thread, for load balancing.
+	i64 n = end - begin;
+	i64 target = (i64) (workers.size() + 1) * 4;
+	grain = std::max(grain, (n + target - 1) / target);
+	i64 n_chunks = (n + grain - 1) / grain;
+	if (n_chunks == 1) {
+		fn(begin, end);
+		return;
+	}
+
+	std::shared_ptr<ParallelForState> st(new ParallelForState);
+	st->fn = fn;
+	st->begin = begin;
+	st->end = end;
+	st->grain = grain;
+	st->n_chunks = n_chunks;
+	st->next_chunk = 0;
+	st->n_done = 0;
+
+	i64 n_helpers = std::min(n_chunks - 1, (i64) workers.size());
+	for (i64 e = 0; e < n_helpers; ++e)
+		run([st]() { st->work(); });
+	st->work();
+
+	std::unique_lock<std::mutex> lock(st->mtx);
+	st->cv.wait(lock, [&st]() { return st->n_done == st->n_chunks; });
+}
+
+ThreadPool& ThreadPool::shared() {
+	static ThreadPool pool;
+	return pool;
+}
+
+/*** end threadpool.cpp ***/
@@ -256,16 +256,211 @@ static u32 utf8_4byte(uchar* w) {
 	return(ret);
 }
 
+/*** SIMD helpers: the lengths of runs that convert trivially, and the conversions of those runs. ***/
+
+static inline u32 utf_ctz(u32 x) {
+#ifdef CODEHAPPY_MSFT
+	return ntz(x);
+#else
+	return (u32) __builtin_ctz(x);
+#endif
+}
+
+static inline u32 utf_popcount(u32 x) {
+#ifdef CODEHAPPY_MSFT
+	return count_bits(x);
+#else
+	return (u32) __builtin_popcount(x);
+#endif
+}
+
+/*** The number of ASCII bytes at the start of p[0, len). ***/
+static size_t ascii_run(const u8* p, size_t len) {
+	size_t i = 0;
+#if defined(CODEHAPPY_AVX2)
+	for (; i + 32 <= len; i += 32) {
+		const u32 m = (u32) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) (p + i)));
+		if (m != 0)
+			return i + utf_ctz(m);
+	}
+#endif
+#if defined(CODEHAPPY_SSE2)
+	for (; i + 16 <= len; i += 16) {
+		const u32 m = (u32) _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (p + i)));
+		if (m != 0)
+			return i + utf_ctz(m);
+	}
+#endif
+	while (i < len && p[i] < 0x80)
+		++i;
+	return i;
+}
+
+/*** The number of UTF-16 units < 0x80 at the start of p[0, len). ***/
+static size_t utf16_ascii_run(const u16ch* p, size_t len) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i hi = _mm_set1_epi16((short) 0xFF80), z = _mm_setzero_si128();
+	for (; i + 8 <= len; i += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		const u32 m = (u32) _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, hi), z)) ^ 0xFFFF;
+		if (m != 0)
+			return i + utf_ctz(m) / 2;
+	}
+#endif
+	while (i < len && p[i] < 0x80)
+		++i;
+	return i;
+}
+
+/*** The number of UTF-16 units at the start of p[0, len) that aren't surrogates. ***/
+static size_t utf16_bmp_run(const u16ch* p, size_t len) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i mask = _mm_set1_epi16((short) 0xF800), sur = _mm_set1_epi16((short) 0xD800);
+	for (; i + 8 <= len; i += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		const u32 m = (u32) _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), sur));
+		if (m != 0)
+			return i + utf_ctz(m) / 2;
+	}
+#endif
+	while (i < len && (p[i] & 0xF800) != 0xD800)
+		++i;
+	return i;
+}
+
+/*** The number of codepoints < 0x80 at the start of p[0, len). ***/
+static size_t utf32_ascii_run(const uch* p, size_t len) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i hi = _mm_set1_epi32((int) 0xFFFFFF80), z = _mm_setzero_si128();
+	for (; i + 4 <= len; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		const u32 m = (u32) _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, hi), z)) ^ 0xFFFF;
+		if (m != 0)
+			return i + utf_ctz(m) / 4;
+	}
+#endif
+	while (i < len && p[i] < 0x80)
+		++i;
+	return i;
+}
+
+/*** The number of codepoints at the start of p[0, len) that are one unit of UTF-16: <= 0xFFFF, not surrogates. ***/
+static size_t utf32_bmp_run(const uch* p, size_t len) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i hi = _mm_set1_epi32((int) 0xFFFF0000), smask = _mm_set1_epi32((int) 0xFFFFF800);
+	const __m128i sur = _mm_set1_epi32(0xD800), z = _mm_setzero_si128(), ones = _mm_set1_epi32(-1);
+	for (; i + 4 <= len; i += 4) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		const __m128i big = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(v, hi), z), ones);
+		const u32 m = (u32) _mm_movemask_epi8(_mm_or_si128(big, _mm_cmpeq_epi32(_mm_and_si128(v, smask), sur)));
+		if (m != 0)
+			return i + utf_ctz(m) / 4;
+	}
+#endif
+	while (i < len && p[i] <= 0xFFFF && (p[i] & 0xF800) != 0xD800)
+		++i;
+	return i;
+}
+
+/*** Widen n bytes to UTF-32 codepoints. ***/
+static void widen_8_32(const u8* p, size_t n, uch* o) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i z = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		const __m128i lo = _mm_unpacklo_epi8(v, z), hi = _mm_unpackhi_epi8(v, z);
+		_mm_storeu_si128((__m128i*) (o + i), _mm_unpacklo_epi16(lo, z));
+		_mm_storeu_si128((__m128i*) (o + i + 4), _mm_unpackhi_epi16(lo, z));
+		_mm_storeu_si128((__m128i*) (o + i + 8), _mm_unpacklo_epi16(hi, z));
+		_mm_storeu_si128((__m128i*) (o + i + 12), _mm_unpackhi_epi16(hi, z));
+	}
+#endif
+	for (; i < n; ++i)
+		o[i] = p[i];
+}
+
+/*** Widen n bytes to UTF-16 units. ***/
+static void widen_8_16(const u8* p, size_t n, u16ch* o) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i z = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		_mm_storeu_si128((__m128i*) (o + i), _mm_unpacklo_epi8(v, z));
+		_mm_storeu_si128((__m128i*) (o + i + 8), _mm_unpackhi_epi8(v, z));
+	}
+#endif
+	for (; i < n; ++i)
+		o[i] = p[i];
+}
+
+/*** Widen n UTF-16 units (no surrogates) to codepoints. ***/
+static void widen_16_32(const u16ch* p, size_t n, uch* o) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i z = _mm_setzero_si128();
+	for (; i + 8 <= n; i += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		_mm_storeu_si128((__m128i*) (o + i), _mm_unpacklo_epi16(v, z));
+		_mm_storeu_si128((__m128i*) (o + i + 4), _mm_unpackhi_epi16(v, z));
+	}
+#endif
+	for (; i < n; ++i)
+		o[i] = p[i];
+}
+
+/*** Narrow n UTF-16 units < 0x80 to bytes. ***/
+static void narrow_16_8(const u16ch* p, size_t n, u8* o) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	for (; i + 8 <= n; i += 8) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		_mm_storel_epi64((__m128i*) (o + i), _mm_packus_epi16(v, v));
+	}
+#endif
+	for (; i < n; ++i)
+		o[i] = (u8) p[i];
+}
+
+/*** Narrow n codepoints < 0x80 to bytes. ***/
+static void narrow_32_8(const uch* p, size_t n, u8* o) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	for (; i + 8 <= n; i += 8) {
+		const __m128i a = _mm_loadu_si128((const __m128i*) (p + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*) (p + i + 4));
+		const __m128i w = _mm_packs_epi32(a, b);
+		_mm_storel_epi64((__m128i*) (o + i), _mm_packus_epi16(w, w));
+	}
+#endif
+	for (; i < n; ++i)
+		o[i] = (u8) p[i];
+}
+
+/*** Narrow n codepoints <= 0xFFFF to UTF-16 units. (SSE2 packs with signed saturation, so they're packed
+	less 0x8000, then it's added back.) ***/
+static void narrow_32_16(const uch* p, size_t n, u16ch* o) {
+	size_t i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i bias32 = _mm_set1_epi32(0x8000), bias16 = _mm_set1_epi16((short) 0x8000);
+	for (; i + 8 <= n; i += 8) {
+		const __m128i a = _mm_sub_epi32(_mm_loadu_si128((const __m128i*) (p + i)), bias32);
+		const __m128i b = _mm_sub_epi32(_mm_loadu_si128((const __m128i*) (p + i + 4)), bias32);
+		_mm_storeu_si128((__m128i*) (o + i), _mm_add_epi16(_mm_packs_epi32(a, b), bias16));
+	}
+#endif
+	for (; i < n; ++i)
+		o[i] = (u16ch) p[i];
+}
+
 /*** Is the C string passed in ASCII? ***/
 bool is_ascii(const char* str) {
-	const uchar* w = (const uchar*)str;
-	until (iszero(*w))
-		{
-		if ((*w) > 0x7f)
-			return(false);
-		++w;
-		}
-	return(true);
+	return ascii_valid(str, strlen(str));
 }
 
 /*** Is the C string passed in UTF-8? ***/
@@ -282,8 +477,16 @@ uint utf8_strlen(const utf8string str) {
 	uint ex;
 	uint e;
 	const uchar* w = (const uchar*)str;
+	const uchar* end = w + strlen((const char*)str);
 	until (iszero(*w))
 		{
+		if ((*w) < 0x80)
+			{
+			const size_t n = ascii_run(w, end - w);
+			w += n;
+			l += n;
+			continue;
+			}
 		ex = expected_continuation_bytes(*w);
 		if (ex == UTF_INVALID)
 			return(UTF_INVALID);
@@ -310,11 +513,21 @@ ustring utf8_to_utf32(const utf8string str) {
 		return(NULL);
 	ustring ret = NEW_USTR(len);
 	uchar* w = (uchar*)str;
+	uchar* end = w + strlen((const char*)str);
 	uch* c = ret;
 	NOT_NULL_OR_RETURN(ret, NULL);
 	while (*w)
 		{
 		uint ex;
+		if ((*w) < 0x80)
+			{
+			// a run of ASCII, widened a block at a time
+			const size_t n = ascii_run(w, end - w);
+			widen_8_32(w, n, c);
+			w += n;
+			c += n;
+			continue;
+			}
 		ex = expected_continuation_bytes(*w);
 		switch (ex)
 			{
@@ -372,15 +585,17 @@ utf8string utf32_to_utf8(const ustring str) {
 	NOT_NULL_OR_RETURN(ret, NULL);
 
 	// now encode
+	const uch* end = w;
 	w = str;
 	x = (char*)ret;
 	while (*w) {
 		if ((*w) < 0x80)
 			{
-			// easy case
-			*x = *w;
-			++x;
-			++w;
+			// easy case: a run of ASCII
+			const size_t n = utf32_ascii_run(w, end - w);
+			narrow_32_8(w, n, (u8*)x);
+			x += n;
+			w += n;
 			continue;
 			}
 		if ((*w) < 0x800)
@@ -448,11 +663,8 @@ bool is_surrogate(u16ch c) {
 uint utf16_strlen(utf16string str) {
 	uint l = 0UL;
 	while (*str) {
-		if (is_surrogate_high(*str)) {
+		if (is_surrogate_high(*str) && is_surrogate_low(*(str + 1)))
 			++str;
-			if (!is_surrogate_low(*str))
-				++l;
-		}
 		++l;
 		++str;
 	}
@@ -480,11 +692,11 @@ ustring utf16_to_utf32(utf16string str) {
 			}
 		else
 			{
-			nc = (*from) - 0xD800;
+			nc = (*from);
 			++from;
 			if (is_surrogate_low(*from))
 				{
-				nc <<= 10;
+				nc = 0x10000 + ((nc - 0xD800) << 10);
 				nc += ((*from) - 0xDC00);
 				*to = nc;
 				++to;
@@ -524,7 +736,7 @@ utf16string utf32_to_utf16(ustring str) {
 	w = str;
 	to = ret;
 	while (*w) {
-		if (is_surrogate((u16ch)*w))
+		if ((*w) <= 0xFFFF && is_surrogate((u16ch)*w))
 			{
 			// UTF-32 strings can contain UTF-16 surrogate codepoints, but don't encode
 			// them as UTF-16.
@@ -555,6 +767,438 @@ utf16string utf32_to_utf16(ustring str) {
 	return(ret);
 }
 
+/*** Strict validation and transcoding over buffers with lengths. ***/
+
+/*** Decode the (non-ASCII) UTF-8 sequence at p. Returns its length, or 0 if it's invalid or cut off by end. ***/
+static inline u32 utf8_decode_strict(const u8* p, const u8* end, uch& cp) {
+	const u32 c = p[0];
+	const size_t left = end - p;
+	if (c >= 0xC2 && c <= 0xDF) {
+		if (left < 2 || (p[1] & 0xC0) != 0x80)
+			return 0;
+		cp = ((c & 0x1F) << 6) | (p[1] & 0x3F);
+		return 2;
+	}
+	if (c >= 0xE0 && c <= 0xEF) {
+		if (left < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80)
+			return 0;
+		cp = ((c & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+		if (cp < 0x800 || (cp & 0xFFFFF800) == 0xD800)
+			return 0;
+		return 3;
+	}
+	if (c >= 0xF0 && c <= 0xF4) {
+		if (left < 4 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80)
+			return 0;
+		cp = ((c & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+		if (cp < 0x10000 || cp > 0x10FFFF)
+			return 0;
+		return 4;
+	}
+	return 0;
+}
+
+/*** Encode a valid codepoint as UTF-8; returns the number of bytes. ***/
+static inline u32 utf8_encode(uch c, u8* o) {
+	if (c < 0x80) {
+		o[0] = (u8) c;
+		return 1;
+	}
+	if (c < 0x800) {
+		o[0] = (u8) (0xC0 | (c >> 6));
+		o[1] = (u8) (0x80 | (c & 0x3F));
+		return 2;
+	}
+	if (c < 0x10000) {
+		o[0] = (u8) (0xE0 | (c >> 12));
+		o[1] = (u8) (0x80 | ((c >> 6) & 0x3F));
+		o[2] = (u8) (0x80 | (c & 0x3F));
+		return 3;
+	}
+	o[0] = (u8) (0xF0 | (c >> 18));
+	o[1] = (u8) (0x80 | ((c >> 12) & 0x3F));
+	o[2] = (u8) (0x80 | ((c >> 6) & 0x3F));
+	o[3] = (u8) (0x80 | (c & 0x3F));
+	return 4;
+}
+
+static inline bool utf32_ok(uch c) {
+	return c <= 0x10FFFF && (c & 0xFFFFF800) != 0xD800;
+}
+
+#if defined(CODEHAPPY_AVX2)
+/*** UTF-8 validation after Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte" (2021.)
+	Every error that can be seen in two consecutive bytes gets a bit; three lookups, on the high and low nibbles
+	of the first byte and the high nibble of the second, each give the errors that nibble could be part of, and
+	the errors present are those all three agree on. The third and fourth bytes of 3 and 4 byte sequences are
+	checked separately. ***/
+#define	U8_TOO_SHORT		(1 << 0)	// a lead byte not followed by a continuation
+#define	U8_TOO_LONG		(1 << 1)	// a continuation after ASCII
+#define	U8_OVERLONG_3		(1 << 2)	// E0 80..9F
+#define	U8_TOO_LARGE		(1 << 3)	// F4 90..BF, or F5..FF 90..BF
+#define	U8_SURROGATE		(1 << 4)	// ED A0..BF
+#define	U8_OVERLONG_2		(1 << 5)	// C0 or C1
+#define	U8_TOO_LARGE_1000	(1 << 6)	// F5..FF 80..8F
+#define	U8_OVERLONG_4		(1 << 6)	// F0 80..8F
+#define	U8_TWO_CONTS		(1 << 7)	// a continuation after a continuation (fine, in the right places)
+#define	U8_CARRY		(U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+static const u8 u8_byte1_high[16] = {
+	U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+	U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+	U8_TOO_SHORT | U8_OVERLONG_2,
+	U8_TOO_SHORT,
+	U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+	U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4
+};
+
+static const u8 u8_byte1_low[16] = {
+	U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+	U8_CARRY | U8_OVERLONG_2,
+	U8_CARRY,
+	U8_CARRY,
+	U8_CARRY | U8_TOO_LARGE,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+	U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000
+};
+
+static const u8 u8_byte2_high[16] = {
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+	U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+	U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT
+};
+
+/* The 32 bytes ending n bytes before the block in, given the block before it. */
+#define	U8_PREV(in, prev, n)	_mm256_alignr_epi8((in), _mm256_permute2x128_si256((prev), (in), 0x21), 16 - (n))
+
+static inline __m256i u8_lookup(const u8* table, __m256i nibbles) {
+	return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) table)), nibbles);
+}
+
+/*** The errors in the block in (non-zero bytes where there are any.) ***/
+static inline __m256i u8_block_errors(__m256i in, __m256i prev) {
+	const __m256i nib = _mm256_set1_epi8(0x0F);
+	const __m256i prev1 = U8_PREV(in, prev, 1);
+	const __m256i special = _mm256_and_si256(_mm256_and_si256(
+		u8_lookup(u8_byte1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nib)),
+		u8_lookup(u8_byte1_low, _mm256_and_si256(prev1, nib))),
+		u8_lookup(u8_byte2_high, _mm256_and_si256(_mm256_srli_epi16(in, 4), nib)));
+	// bytes 2 or 3 after a lead of 1110____ or 1111____ must be continuations; there, TWO_CONTS is expected
+	const __m256i third = _mm256_subs_epu8(U8_PREV(in, prev, 2), _mm256_set1_epi8((char) (0xE0 - 0x80)));
+	const __m256i fourth = _mm256_subs_epu8(U8_PREV(in, prev, 3), _mm256_set1_epi8((char) (0xF0 - 0x80)));
+	const __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char) 0x80));
+	return _mm256_xor_si256(must23, special);
+}
+
+/*** The number of continuation bytes (10______) in the block. ***/
+static inline u32 u8_continuations(__m256i in) {
+	return utf_popcount((u32) _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8(-64), in)));
+}
+#endif  // CODEHAPPY_AVX2
+
+size_t utf8_count(const char* buf, size_t len) {
+	const u8* p = (const u8*) buf;
+#if defined(CODEHAPPY_AVX2)
+	// a block ending in a lead byte, or 3-byte lead one back, or 4-byte lead two back, is unfinished
+	const __m256i incomplete_max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+	__m256i err = _mm256_setzero_si256(), prev = err, prev_incomplete = err;
+	size_t conts = 0, i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		const __m256i in = _mm256_loadu_si256((const __m256i*) (p + i));
+		if (_mm256_movemask_epi8(in) == 0) {
+			// all ASCII: only an unfinished sequence in the block before is an error
+			err = _mm256_or_si256(err, prev_incomplete);
+		} else {
+			err = _mm256_or_si256(err, u8_block_errors(in, prev));
+			prev_incomplete = _mm256_subs_epu8(in, incomplete_max);
+			conts += u8_continuations(in);
+		}
+		prev = in;
+	}
+	// the rest, padded out with NULs: checked even if there's nothing left, to catch a sequence cut off at the end
+	u8 tail[32];
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, p + i, len - i);
+	const __m256i in = _mm256_loadu_si256((const __m256i*) tail);
+	err = _mm256_or_si256(err, u8_block_errors(in, prev));
+	conts += u8_continuations(in);
+	if (!_mm256_testz_si256(err, err))
+		return UTF_ERROR;
+	return len - conts;
+#else
+	const u8* end = p + len;
+	size_t n = 0;
+	while (p < end) {
+		if (*p < 0x80) {
+			const size_t r = ascii_run(p, end - p);
+			p += r;
+			n += r;
+			continue;
+		}
+		uch cp;
+		const u32 l = utf8_decode_strict(p, end, cp);
+		if (l == 0)
+			return UTF_ERROR;
+		p += l;
+		++n;
+	}
+	return n;
+#endif
+}
+
+bool ascii_valid(const char* buf, size_t len) {
+	return ascii_run((const u8*) buf, len) == len;
+}
+
+bool utf8_valid(const char* buf, size_t len) {
+	return utf8_count(buf, len) != UTF_ERROR;
+}
+
+bool utf16_valid(const u16ch* buf, size_t len) {
+	size_t i = 0;
+	while (i < len) {
+		i += utf16_bmp_run(buf + i, len - i);
+		if (i == len)
+			break;
+		// a high surrogate, then a low one
+		if (buf[i] > 0xDBFF || i + 1 == len || (buf[i + 1] & 0xFC00) != 0xDC00)
+			return false;
+		i += 2;
+	}
+	return true;
+}
+
+bool utf32_valid(const uch* buf, size_t len) {
+	for (size_t i = 0; i < len; ++i)
+		if (!utf32_ok(buf[i]))
+			return false;
+	return true;
+}
+
+/*** Count the bytes in buf[0, len) for which the SSE2 compare (v > gt) is true, and that are negative
+	as well if neg. ***/
+static size_t utf8_count_bytes(const u8* p, size_t len, i8 gt, bool neg) {
+	size_t n = 0, i = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i vgt = _mm_set1_epi8(gt);
+	for (; i + 16 <= len; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i*) (p + i));
+		u32 m = (u32) _mm_movemask_epi8(_mm_cmpgt_epi8(v, vgt));
+		if (neg)
+			m &= (u32) _mm_movemask_epi8(v);
+		n += utf_popcount(m);
+	}
+#endif
+	for (; i < len; ++i)
+		if ((i8) p[i] > gt && (!neg || p[i] >= 0x80))
+			++n;
+	return n;
+}
+
+size_t utf32_length_from_utf8(const char* buf, size_t len) {
+	// everything but the continuation bytes: signed, those are the bytes -128 to -65
+	return utf8_count_bytes((const u8*) buf, len, -65, false);
+}
+
+size_t utf16_length_from_utf8(const char* buf, size_t len) {
+	// and a second unit for every 4 byte sequence: the leads are 0xF0 and up, signed -16 to -1
+	return utf8_count_bytes((const u8*) buf, len, -65, false) + utf8_count_bytes((const u8*) buf, len, -17, true);
+}
+
+size_t utf8_length_from_utf16(const u16ch* buf, size_t len) {
+	size_t n = 0;
+	for (size_t i = 0; i < len; ++i) {
+		const u32 c = buf[i];
+		// each half of a surrogate pair is 2 of the 4 bytes
+		n += (c < 0x80) ? 1 : ((c < 0x800 || (c & 0xF800) == 0xD800) ? 2 : 3);
+	}
+	return n;
+}
+
+size_t utf32_length_from_utf16(const u16ch* buf, size_t len) {
+	size_t n = len;
+	for (size_t i = 0; i < len; ++i)
+		n -= ((buf[i] & 0xFC00) == 0xDC00);
+	return n;
+}
+
+size_t utf8_length_from_utf32(const uch* buf, size_t len) {
+	size_t n = len;
+	for (size_t i = 0; i < len; ++i) {
+		const uch c = buf[i];
+		n += (c >= 0x80) + (c >= 0x800) + (c >= 0x10000);
+	}
+	return n;
+}
+
+size_t utf16_length_from_utf32(const uch* buf, size_t len) {
+	size_t n = len;
+	for (size_t i = 0; i < len; ++i)
+		n += (buf[i] >= 0x10000);
+	return n;
+}
+
+size_t utf8_to_utf32(const char* in, size_t len, uch* out) {
+	const u8* p = (const u8*) in, * end = p + len;
+	uch* o = out;
+	while (p < end) {
+		if (*p < 0x80) {
+			const size_t n = ascii_run(p, end - p);
+			widen_8_32(p, n, o);
+			p += n;
+			o += n;
+			continue;
+		}
+		const u32 l = utf8_decode_strict(p, end, *o);
+		if (l == 0)
+			return UTF_ERROR;
+		p += l;
+		++o;
+	}
+	return o - out;
+}
+
+size_t utf8_to_utf16(const char* in, size_t len, u16ch* out) {
+	const u8* p = (const u8*) in, * end = p + len;
+	u16ch* o = out;
+	while (p < end) {
+		if (*p < 0x80) {
+			const size_t n = ascii_run(p, end - p);
+			widen_8_16(p, n, o);
+			p += n;
+			o += n;
+			continue;
+		}
+		uch cp;
+		const u32 l = utf8_decode_strict(p, end, cp);
+		if (l == 0)
+			return UTF_ERROR;
+		if (cp >= 0x10000) {
+			cp -= 0x10000;
+			*o++ = (u16ch) (0xD800 + (cp >> 10));
+			*o++ = (u16ch) (0xDC00 + (cp & 1023));
+		} else {
+			*o++ = (u16ch) cp;
+		}
+		p += l;
+	}
+	return o - out;
+}
+
+size_t utf16_to_utf8(const u16ch* in, size_t len, char* out) {
+	const u16ch* p = in, * end = in + len;
+	u8* o = (u8*) out;
+	while (p < end) {
+		if (*p < 0x80) {
+			const size_t n = utf16_ascii_run(p, end - p);
+			narrow_16_8(p, n, o);
+			p += n;
+			o += n;
+			continue;
+		}
+		uch c = *p++;
+		if ((c & 0xF800) == 0xD800) {
+			if (c > 0xDBFF || p == end || (*p & 0xFC00) != 0xDC00)
+				return UTF_ERROR;
+			c = 0x10000 + ((c - 0xD800) << 10) + (*p++ - 0xDC00);
+		}
+		o += utf8_encode(c, o);
+	}
+	return o - (u8*) out;
+}
+
+size_t utf16_to_utf32(const u16ch* in, size_t len, uch* out) {
+	const u16ch* p = in, * end = in + len;
+	uch* o = out;
+	forever {
+		const size_t n = utf16_bmp_run(p, end - p);
+		widen_16_32(p, n, o);
+		p += n;
+		o += n;
+		if (p == end)
+			break;
+		if (*p > 0xDBFF || p + 1 == end || (p[1] & 0xFC00) != 0xDC00)
+			return UTF_ERROR;
+		*o++ = 0x10000 + ((p[0] - 0xD800) << 10) + (p[1] - 0xDC00);
+		p += 2;
+	}
+	return o - out;
+}
+
+size_t utf32_to_utf8(const uch* in, size_t len, char* out) {
+	const uch* p = in, * end = in + len;
+	u8* o = (u8*) out;
+	while (p < end) {
+		if (*p < 0x80) {
+			const size_t n = utf32_ascii_run(p, end - p);
+			narrow_32_8(p, n, o);
+			p += n;
+			o += n;
+			continue;
+		}
+		if (!utf32_ok(*p))
+			return UTF_ERROR;
+		o += utf8_encode(*p++, o);
+	}
+	return o - (u8*) out;
+}
+
+size_t utf32_to_utf16(const uch* in, size_t len, u16ch* out) {
+	const uch* p = in, * end = in + len;
+	u16ch* o = out;
+	forever {
+		const size_t n = utf32_bmp_run(p, end - p);
+		narrow_32_16(p, n, o);
+		p += n;
+		o += n;
+		if (p == end)
+			break;
+		if (*p > 0x10FFFF || *p < 0x10000)
+			return UTF_ERROR;	// past the end of Unicode, or a surrogate
+		const uch c = *p++ - 0x10000;
+		*o++ = (u16ch) (0xD800 + (c >> 10));
+		*o++ = (u16ch) (0xDC00 + (c & 1023));
+	}
+	return o - out;
+}
+
+bool utf8_to_utf32(const char* in, size_t len, std::vector<uch>& out) {
+	// the count assumes valid input, but invalid input never converts to more than it counts
+	out.resize(utf32_length_from_utf8(in, len));
+	const size_t n = utf8_to_utf32(in, len, out.data());
+	if (n == UTF_ERROR) {
+		out.clear();
+		return false;
+	}
+	out.resize(n);
+	return true;
+}
+
+bool utf32_to_utf8(const uch* in, size_t len, std::string& out) {
+	out.resize(utf8_length_from_utf32(in, len));
+	const size_t n = utf32_to_utf8(in, len, &out[0]);
+	if (n == UTF_ERROR) {
+		out.clear();
+		return false;
+	}
+	out.resize(n);
+	return true;
+}
+
 /***
 	Table of Unicode lowercase codepoints. Shamelessly lifted (with permission)
 	from Leigh Brasington, http://www.leighb.com/tounicupper.htm
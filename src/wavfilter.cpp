@@ -0,0 +1,665 @@
+/***
+
+	wavfilter.cpp
+
+	FFT convolution (uniformly partitioned overlap-save), and reverb, EQ and resampling filters on MixBus
+	and WavBuild audio.
+
+	2024, C. M. Street
+
+***/
+#include <random>
+
+/* Impulse responses up to this long are applied directly; past it, FFT convolution wins. */
+#define	CONVOLVE_DIRECT_MAX	64
+
+/*** Small float kernels. ***/
+
+/* y += a * x. */
+static void filt_axpy(float* y, const float* x, u32 n, float a) {
+	u32 e = 0;
+#if defined(CODEHAPPY_AVX2)
+	const __m256 va = _mm256_set1_ps(a);
+	for (; e + 8 <= n; e += 8)
+		_mm256_storeu_ps(y + e, _mm256_add_ps(_mm256_loadu_ps(y + e), _mm256_mul_ps(_mm256_loadu_ps(x + e), va)));
+#elif defined(CODEHAPPY_SSE2)
+	const __m128 va = _mm_set1_ps(a);
+	for (; e + 4 <= n; e += 4)
+		_mm_storeu_ps(y + e, _mm_add_ps(_mm_loadu_ps(y + e), _mm_mul_ps(_mm_loadu_ps(x + e), va)));
+#endif
+	for (; e < n; ++e)
+		y[e] += a * x[e];
+}
+
+static float filt_dot(const float* a, const float* b, u32 n) {
+	float sum = 0.0f;
+	u32 e = 0;
+#if defined(CODEHAPPY_AVX2)
+	__m256 acc = _mm256_setzero_ps();
+	for (; e + 8 <= n; e += 8)
+		acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + e), _mm256_loadu_ps(b + e)));
+	float t[8];
+	_mm256_storeu_ps(t, acc);
+	sum = ((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7]));
+#elif defined(CODEHAPPY_SSE2)
+	__m128 acc = _mm_setzero_ps();
+	for (; e + 4 <= n; e += 4)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + e), _mm_loadu_ps(b + e)));
+	float t[4];
+	_mm_storeu_ps(t, acc);
+	sum = (t[0] + t[1]) + (t[2] + t[3]);
+#endif
+	for (; e < n; ++e)
+		sum += a[e] * b[e];
+	return sum;
+}
+
+/* Complex multiply-accumulate on split arrays: acc += x * h. The inner loop of the convolver. */
+static void filt_cmac(float* acc_re, float* acc_im, const float* x_re, const float* x_im, const float* h_re,
+			const float* h_im, u32 n) {
+	u32 e = 0;
+#if defined(CODEHAPPY_AVX2)
+	for (; e + 8 <= n; e += 8) {
+		__m256 xr = _mm256_loadu_ps(x_re + e), xi = _mm256_loadu_ps(x_im + e);
+		__m256 hr = _mm256_loadu_ps(h_re + e), hi = _mm256_loadu_ps(h_im + e);
+		__m256 ar = _mm256_add_ps(_mm256_loadu_ps(acc_re + e), _mm256_sub_ps(_mm256_mul_ps(xr, hr), _mm256_mul_ps(xi, hi)));
+		__m256 ai = _mm256_add_ps(_mm256_loadu_ps(acc_im + e), _mm256_add_ps(_mm256_mul_ps(xr, hi), _mm256_mul_ps(xi, hr)));
+		_mm256_storeu_ps(acc_re + e, ar);
+		_mm256_storeu_ps(acc_im + e, ai);
+	}
+#elif defined(CODEHAPPY_SSE2)
+	for (; e + 4 <= n; e += 4) {
+		__m128 xr = _mm_loadu_ps(x_re + e), xi = _mm_loadu_ps(x_im + e);
+		__m128 hr = _mm_loadu_ps(h_re + e), hi = _mm_loadu_ps(h_im + e);
+		__m128 ar = _mm_add_ps(_mm_loadu_ps(acc_re + e), _mm_sub_ps(_mm_mul_ps(xr, hr), _mm_mul_ps(xi, hi)));
+		__m128 ai = _mm_add_ps(_mm_loadu_ps(acc_im + e), _mm_add_ps(_mm_mul_ps(xr, hi), _mm_mul_ps(xi, hr)));
+		_mm_storeu_ps(acc_re + e, ar);
+		_mm_storeu_ps(acc_im + e, ai);
+	}
+#endif
+	for (; e < n; ++e) {
+		const float xr = x_re[e], xi = x_im[e], hr = h_re[e], hi = h_im[e];
+		acc_re[e] += xr * hr - xi * hi;
+		acc_im[e] += xr * hi + xi * hr;
+	}
+}
+
+/*** FftPlan. The real transform of size n is a complex transform of size n/2 on the even samples as the real
+     parts and the odd samples as the imaginary parts, then one pass to separate the two. ***/
+
+void FftPlan::init(u32 size) {
+	n = std::max(size, 4U);
+	ship_assert((n & (n - 1)) == 0);
+	const u32 h = n / 2;
+	u32 lg = 0;
+	while ((1U << lg) < h)
+		++lg;
+
+	rev.resize(h);
+	for (u32 e = 0; e < h; ++e) {
+		u32 r = 0;
+		for (u32 b = 0; b < lg; ++b)
+			r |= ((e >> b) & 1) << (lg - 1 - b);
+		rev[e] = r;
+	}
+
+	// Twiddles for the complex transform, stage by stage, so each butterfly loop reads them contiguously:
+	// the stage with span 'half' starts at index half - 1.
+	tw_re.resize(std::max(h, 1U));
+	tw_im.resize(std::max(h, 1U));
+	for (u32 half = 1; half < h; half <<= 1) {
+		for (u32 j = 0; j < half; ++j) {
+			const double a = -M_PI * (double) j / (double) half;
+			tw_re[half - 1 + j] = (float) cos(a);
+			tw_im[half - 1 + j] = (float) sin(a);
+		}
+	}
+
+	// Twiddles for separating the real transform: exp(-2 pi i k / n), k up to n/4.
+	rtw_re.resize(h / 2 + 1);
+	rtw_im.resize(h / 2 + 1);
+	for (u32 k = 0; k <= h / 2; ++k) {
+		const double a = -2.0 * M_PI * (double) k / (double) n;
+		rtw_re[k] = (float) cos(a);
+		rtw_im[k] = (float) sin(a);
+	}
+}
+
+/* In-place radix-2 transform of size n/2 on data already in bit-reversed order. The inverse is the forward
+   transform with the real and imaginary parts swapped (and is unscaled.) */
+void FftPlan::complex_fft(float* re, float* im, bool inv) const {
+	if (inv)
+		std::swap(re, im);
+	const u32 h = n / 2;
+	for (u32 half = 1; half < h; half <<= 1) {
+		const float* wr = tw_re.data() + half - 1;
+		const float* wi = tw_im.data() + half - 1;
+		for (u32 i = 0; i < h; i += 2 * half) {
+			float* ar = re + i, * ai = im + i;
+			float* br = re + i + half, * bi = im + i + half;
+			for (u32 j = 0; j < half; ++j) {
+				const float tr = br[j] * wr[j] - bi[j] * wi[j];
+				const float ti = br[j] * wi[j] + bi[j] * wr[j];
+				br[j] = ar[j] - tr;
+				bi[j] = ai[j] - ti;
+				ar[j] += tr;
+				ai[j] += ti;
+			}
+		}
+	}
+}
+
+void FftPlan::forward(const float* in, float* re, float* im) const {
+	const u32 h = n / 2;
+	for (u32 m = 0; m < h; ++m) {
+		re[rev[m]] = in[2 * m];
+		im[rev[m]] = in[2 * m + 1];
+	}
+	complex_fft(re, im, false);
+
+	// X[k] = E[k] + W^k O[k] and X[h - k] = conj(E[k] - W^k O[k]), where E and O are the transforms of the
+	// even and odd samples, recovered from Z[k] and Z[h - k].
+	const float z0r = re[0], z0i = im[0];
+	re[0] = z0r + z0i;
+	im[0] = 0.0f;
+	re[h] = z0r - z0i;
+	im[h] = 0.0f;
+	for (u32 k = 1; k <= h / 2; ++k) {
+		const u32 j = h - k;
+		const float ar = re[k], ai = im[k], br = re[j], bi = im[j];
+		const float er = 0.5f * (ar + br), ei = 0.5f * (ai - bi);
+		const float orr = 0.5f * (ai + bi), oi = -0.5f * (ar - br);
+		const float wr = rtw_re[k], wi = rtw_im[k];
+		const float tr = wr * orr - wi * oi, ti = wr * oi + wi * orr;
+		re[k] = er + tr;
+		im[k] = ei + ti;
+		re[j] = er - tr;
+		im[j] = -(ei - ti);
+	}
+}
+
+void FftPlan::inverse(float* re, float* im, float* out) const {
+	const u32 h = n / 2;
+	const float sc = 1.0f / (float) h;
+
+	// Rebuild Z[k] = E[k] + i O[k], with E[k] = (X[k] + conj(X[h - k])) / 2 and
+	// O[k] = (X[k] - conj(X[h - k])) conj(W^k) / 2; the 1/h of the inverse is folded in.
+	const float x0 = re[0], xh = re[h];
+	re[0] = 0.5f * sc * (x0 + xh);
+	im[0] = 0.5f * sc * (x0 - xh);
+	for (u32 k = 1; k <= h / 2; ++k) {
+		const u32 j = h - k;
+		const float ar = re[k], ai = im[k], br = re[j], bi = im[j];
+		const float er = ar + br, ei = ai - bi;
+		const float dr = ar - br, di = ai + bi;
+		const float wr = rtw_re[k], wi = -rtw_im[k];
+		const float orr = dr * wr - di * wi, oi = dr * wi + di * wr;
+		// Z[k] = E + iO, Z[j] = conj(E) + i conj(O).
+		re[k] = 0.5f * sc * (er - oi);
+		im[k] = 0.5f * sc * (ei + orr);
+		re[j] = 0.5f * sc * (er + oi);
+		im[j] = 0.5f * sc * (orr - ei);
+	}
+
+	for (u32 m = 0; m < h; ++m) {
+		const u32 r = rev[m];
+		if (r > m) {
+			std::swap(re[m], re[r]);
+			std::swap(im[m], im[r]);
+		}
+	}
+	complex_fft(re, im, true);
+	for (u32 m = 0; m < h; ++m) {
+		out[2 * m] = re[m];
+		out[2 * m + 1] = im[m];
+	}
+}
+
+/*** PartitionedConvolver. ***/
+
+PartitionedConvolver::PartitionedConvolver() {
+	B = 0;
+	P = 0;
+	ir_len = 0;
+	fdl_pos = 0;
+	fifo_pos = 0;
+}
+
+bool PartitionedConvolver::init(const float* ir, u32 ir_length, u32 block_size) {
+	if (0 == ir_length)
+		return false;
+	B = 16;
+	while (B < block_size)
+		B <<= 1;
+	ir_len = ir_length;
+	P = (ir_len + B - 1) / B;
+	fft.init(2 * B);
+
+	// Each partition's spectrum: B samples of the response, zero-padded to 2B.
+	const u32 nb = fft.bins();
+	std::vector<float> buf(2 * B);
+	h_re.resize(size_t(P) * nb);
+	h_im.resize(size_t(P) * nb);
+	for (u32 p = 0; p < P; ++p) {
+		const u32 len = std::min(B, ir_len - p * B);
+		std::fill(buf.begin(), buf.end(), 0.0f);
+		memcpy(buf.data(), ir + size_t(p) * B, len * sizeof(float));
+		fft.forward(buf.data(), h_re.data() + size_t(p) * nb, h_im.data() + size_t(p) * nb);
+	}
+
+	x_re.resize(size_t(P) * nb);
+	x_im.resize(size_t(P) * nb);
+	window.resize(2 * B);
+	acc_re.resize(nb);
+	acc_im.resize(nb);
+	y.resize(2 * B);
+	in_fifo.resize(B);
+	out_fifo.resize(B);
+	reset();
+	return true;
+}
+
+void PartitionedConvolver::reset(void) {
+	std::fill(x_re.begin(), x_re.end(), 0.0f);
+	std::fill(x_im.begin(), x_im.end(), 0.0f);
+	std::fill(window.begin(), window.end(), 0.0f);
+	std::fill(out_fifo.begin(), out_fifo.end(), 0.0f);
+	fdl_pos = 0;
+	fifo_pos = 0;
+}
+
+void PartitionedConvolver::process_block(const float* in, float* out) {
+	const u32 nb = fft.bins();
+
+	// Overlap-save: transform the last two blocks of input, and the newest spectrum goes into the delay line.
+	memmove(window.data(), window.data() + B, B * sizeof(float));
+	memcpy(window.data() + B, in, B * sizeof(float));
+	fdl_pos = (fdl_pos + 1) % P;
+	fft.forward(window.data(), x_re.data() + size_t(fdl_pos) * nb, x_im.data() + size_t(fdl_pos) * nb);
+
+	// Partition p meets the input spectrum from p blocks ago.
+	std::fill(acc_re.begin(), acc_re.end(), 0.0f);
+	std::fill(acc_im.begin(), acc_im.end(), 0.0f);
+	u32 slot = fdl_pos;
+	for (u32 p = 0; p < P; ++p) {
+		filt_cmac(acc_re.data(), acc_im.data(), x_re.data() + size_t(slot) * nb, x_im.data() + size_t(slot) * nb,
+			h_re.data() + size_t(p) * nb, h_im.data() + size_t(p) * nb, nb);
+		slot = (slot == 0) ? P - 1 : slot - 1;
+	}
+
+	// The first half of the circular result is wrapped around; the second half is the output.
+	fft.inverse(acc_re.data(), acc_im.data(), y.data());
+	memcpy(out, y.data() + B, B * sizeof(float));
+}
+
+void PartitionedConvolver::process(const float* in, float* out, u32 n) {
+	NOT_NULL_OR_RETURN_VOID(in);
+	NOT_NULL_OR_RETURN_VOID(out);
+	while (n > 0) {
+		const u32 take = std::min(n, B - fifo_pos);
+		memcpy(in_fifo.data() + fifo_pos, in, take * sizeof(float));
+		memcpy(out, out_fifo.data() + fifo_pos, take * sizeof(float));
+		fifo_pos += take;
+		in += take;
+		out += take;
+		n -= take;
+		if (fifo_pos == B) {
+			process_block(in_fifo.data(), out_fifo.data());
+			fifo_pos = 0;
+		}
+	}
+}
+
+void convolve_direct(const float* x, u32 n, const float* h, u32 m, float* y) {
+	NOT_NULL_OR_RETURN_VOID(x);
+	NOT_NULL_OR_RETURN_VOID(h);
+	NOT_NULL_OR_RETURN_VOID(y);
+	if (0 == n || 0 == m)
+		return;
+	std::fill(y, y + n + m - 1, 0.0f);
+	for (u32 j = 0; j < m; ++j)
+		filt_axpy(y + j, x, n, h[j]);
+}
+
+/*** Whole-buffer filtering on a MixBus, a channel per thread. ***/
+
+static void bus_get_channel(const MixBus& bus, u32 c, std::vector<float>& out, u32 len) {
+	const u32 nc = bus.num_channels(), ns = bus.num_samples();
+	const float* d = bus.data() + c;
+	out.assign(len, 0.0f);
+	for (u32 e = 0; e < std::min(len, ns); ++e)
+		out[e] = d[size_t(e) * nc];
+}
+
+static void bus_put_channel(MixBus& bus, u32 c, const float* in, u32 len) {
+	const u32 nc = bus.num_channels();
+	float* d = bus.data() + c;
+	len = std::min(len, bus.num_samples());
+	for (u32 e = 0; e < len; ++e)
+		d[size_t(e) * nc] = in[e];
+}
+
+/* Full convolution of x (n samples) with h (m samples) into y (n + m - 1 samples.) */
+static void convolve_channel(const float* x, u32 n, const float* h, u32 m, float* y, u32 block_size) {
+	if (m <= CONVOLVE_DIRECT_MAX) {
+		convolve_direct(x, n, h, m, y);
+		return;
+	}
+	if (0 == block_size) {
+		// For whole buffers latency doesn't matter, and about a quarter of the response (within reason) is fastest.
+		block_size = 64;
+		while (block_size < m / 4 && block_size < 4096)
+			block_size <<= 1;
+	}
+	PartitionedConvolver pc;
+	pc.init(h, m, block_size);
+	const u32 B = pc.block_size();
+	const u32 len = n + m - 1;
+	std::vector<float> xb(B), yb(B);
+	for (u32 s = 0; s < len; s += B) {
+		const u32 nin = (s < n) ? std::min(B, n - s) : 0;
+		if (nin == B) {
+			pc.process_block(x + s, yb.data());
+		} else {
+			std::fill(xb.begin(), xb.end(), 0.0f);
+			if (nin > 0)
+				memcpy(xb.data(), x + s, nin * sizeof(float));
+			pc.process_block(xb.data(), yb.data());
+		}
+		memcpy(y + s, yb.data(), std::min(B, len - s) * sizeof(float));
+	}
+}
+
+bool bus_convolve(MixBus& bus, const MixBus& ir, float wet, float dry, bool keep_tail, ThreadPool* pool, u32 block_size) {
+	const u32 nc = bus.num_channels(), n = bus.num_samples(), m = ir.num_samples();
+	if (ir.sample_rate() != bus.sample_rate() || m == 0)
+		return false;
+	if (ir.num_channels() != 1 && ir.num_channels() != nc)
+		return false;
+	if (n == 0)
+		return true;
+
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	const u32 full = n + m - 1;
+	const u32 out_len = keep_tail ? full : n;
+	std::vector<std::vector<float>> dry_ch(nc);
+	for (u32 c = 0; c < nc; ++c)
+		bus_get_channel(bus, c, dry_ch[c], n);
+	bus.resize(out_len);
+
+	tp.parallel_for(0, nc, [&](i64 c0, i64 c1) {
+		std::vector<float> h, y(full);
+		for (i64 c = c0; c < c1; ++c) {
+			bus_get_channel(ir, ir.num_channels() == 1 ? 0 : (u32) c, h, m);
+			const std::vector<float>& x = dry_ch[c];
+			convolve_channel(x.data(), n, h.data(), m, y.data(), block_size);
+			for (u32 e = 0; e < out_len; ++e)
+				y[e] = wet * y[e] + (e < n ? dry * x[e] : 0.0f);
+			bus_put_channel(bus, (u32) c, y.data(), out_len);
+		}
+	}, 1);
+	return true;
+}
+
+/*** Reverb. ***/
+
+void reverb_impulse(MixBus& ir, u32 nchannels, u32 sample_rate, const ReverbParams& rp) {
+	const double decay = std::max((double) rp.decay_sec, 0.01);
+	const u32 pre = (u32) (std::max(rp.predelay_ms, 0.0f) * sample_rate / 1000.0);
+	const u32 len = pre + (u32) (decay * sample_rate);
+	const double damp = CLAMP((double) rp.damping, 0.0, 1.0);
+
+	ir = MixBus(nchannels, sample_rate);
+	ir.resize(len);
+	for (u32 c = 0; c < ir.num_channels(); ++c) {
+		// Different noise on each channel, so the reverb is wide.
+		std::mt19937 rng(rp.seed * 7919 + c);
+		std::uniform_real_distribution<float> uni(-1.0f, 1.0f);
+		std::vector<float> h(len, 0.0f);
+		double lp = 0.0, energy = 0.0;
+		for (u32 e = pre; e < len; ++e) {
+			const double t = (double) (e - pre) / (double) sample_rate;
+			// -60 dB (a factor of 1000) at t == decay; the lowpass closes down as the tail goes on.
+			const double env = exp(-6.907755 * t / decay);
+			const double a = 1.0 - damp * 0.95 * (t / decay);
+			lp += a * ((double) uni(rng) - lp);
+			h[e] = (float) (lp * env);
+			energy += h[e] * (double) h[e];
+		}
+		// Unit energy, so the wet signal is about as loud as the dry.
+		const float g = (energy > 0.0) ? (float) (1.0 / sqrt(energy)) : 0.0f;
+		for (float& v : h)
+			v *= g;
+		bus_put_channel(ir, c, h.data(), len);
+	}
+}
+
+bool bus_reverb(MixBus& bus, const ReverbParams& rp, ThreadPool* pool) {
+	MixBus ir;
+	reverb_impulse(ir, bus.num_channels(), bus.sample_rate(), rp);
+	return bus_convolve(bus, ir, rp.wet, rp.dry, true, pool);
+}
+
+/*** EQ. ***/
+
+/* Blackman window over n points. */
+static double filt_blackman(u32 i, u32 n) {
+	if (n < 2)
+		return 1.0;
+	const double x = 2.0 * M_PI * (double) i / (double) (n - 1);
+	return 0.42 - 0.5 * cos(x) + 0.08 * cos(2.0 * x);
+}
+
+/* The EQ curve's gain in dB at frequency f. */
+static double eq_gain_db(const std::vector<EqBand>& bands, double f) {
+	if (bands.empty())
+		return 0.0;
+	if (f <= bands.front().freq_hz)
+		return bands.front().gain_db;
+	if (f >= bands.back().freq_hz)
+		return bands.back().gain_db;
+	for (u32 e = 1; e < bands.size(); ++e) {
+		if (f <= bands[e].freq_hz) {
+			const double l0 = log(bands[e - 1].freq_hz), l1 = log(bands[e].freq_hz);
+			const double t = (l1 > l0) ? (log(f) - l0) / (l1 - l0) : 1.0;
+			return bands[e - 1].gain_db + t * (bands[e].gain_db - bands[e - 1].gain_db);
+		}
+	}
+	return bands.back().gain_db;
+}
+
+void eq_fir(const std::vector<EqBand>& bands_in, u32 sample_rate, u32 taps, std::vector<float>& h) {
+	std::vector<EqBand> bands;
+	for (const EqBand& b : bands_in)
+		if (b.freq_hz > 0.0f)
+			bands.push_back(b);
+	std::sort(bands.begin(), bands.end(), [](const EqBand& a, const EqBand& b) { return a.freq_hz < b.freq_hz; });
+	taps |= 1;
+
+	// Frequency sampling: the magnitude response on a fine grid with zero phase, transformed back, centred
+	// and windowed.
+	u32 g = 16;
+	while (g < taps * 4)
+		g <<= 1;
+	FftPlan fft(g);
+	std::vector<float> re(fft.bins()), im(fft.bins(), 0.0f), imp(g);
+	for (u32 k = 0; k < fft.bins(); ++k) {
+		const double f = (double) k * sample_rate / (double) g;
+		re[k] = (float) pow(10.0, eq_gain_db(bands, std::max(f, 1.0)) / 20.0);
+	}
+	fft.inverse(re.data(), im.data(), imp.data());
+
+	const u32 half = taps / 2;
+	h.resize(taps);
+	for (u32 e = 0; e < taps; ++e) {
+		const u32 idx = (e + g - half) % g;
+		h[e] = (float) (imp[idx] * filt_blackman(e, taps));
+	}
+}
+
+bool bus_eq(MixBus& bus, const std::vector<EqBand>& bands, u32 taps, ThreadPool* pool) {
+	std::vector<float> h;
+	eq_fir(bands, bus.sample_rate(), taps, h);
+	MixBus ir(1, bus.sample_rate());
+	ir.resize((u32) h.size());
+	memcpy(ir.data(), h.data(), h.size() * sizeof(float));
+
+	// Linear phase: the filter delays everything by half its length, so drop that much from the front.
+	const u32 n = bus.num_samples(), delay = (u32) h.size() / 2;
+	if (!bus_convolve(bus, ir, 1.0f, 0.0f, true, pool))
+		return false;
+	memmove(bus.data(), bus.sample_pos(delay), size_t(n) * bus.num_channels() * sizeof(float));
+	bus.resize(n);
+	return true;
+}
+
+/*** Resampling. ***/
+
+/* Zeroth-order modified Bessel function of the first kind, for the Kaiser window. */
+static double filt_bessel_i0(double x) {
+	double sum = 1.0, term = 1.0;
+	const double q = x * x / 4.0;
+	for (int k = 1; k < 64; ++k) {
+		term *= q / ((double) k * k);
+		sum += term;
+		if (term < sum * 1e-17)
+			break;
+	}
+	return sum;
+}
+
+/* Kaiser window at x in [-1, 1]. */
+static double filt_kaiser(double x, double beta) {
+	if (x <= -1.0 || x >= 1.0)
+		return 0.0;
+	return filt_bessel_i0(beta * sqrt(1.0 - x * x)) / filt_bessel_i0(beta);
+}
+
+static double filt_sinc(double x) {
+	if (fabs(x) < 1e-12)
+		return 1.0;
+	return sin(M_PI * x) / (M_PI * x);
+}
+
+void lowpass_fir(double cutoff, u32 taps, double kaiser_beta, std::vector<float>& h) {
+	h.resize(taps);
+	const double mid = (taps - 1) / 2.0;
+	for (u32 e = 0; e < taps; ++e) {
+		const double t = (double) e - mid;
+		h[e] = (float) (2.0 * cutoff * filt_sinc(2.0 * cutoff * t) * filt_kaiser(mid > 0.0 ? t / (mid + 1.0) : 0.0, kaiser_beta));
+	}
+}
+
+static u32 filt_gcd(u32 a, u32 b) {
+	while (b != 0) {
+		u32 t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Largest number of filter phases tabled; past this, neighbouring phases are interpolated. */
+#define	RESAMPLE_MAX_PHASES	1024
+
+bool bus_resample(const MixBus& in, MixBus& out, u32 new_rate, u32 quality, ThreadPool* pool) {
+	const u32 r1 = in.sample_rate(), nc = in.num_channels(), n = in.num_samples();
+	if (0 == r1 || 0 == new_rate)
+		return false;
+	const u32 g = filt_gcd(r1, new_rate);
+	const u64 L = new_rate / g, M = r1 / g;
+	const u64 out_n = (u64(n) * L + M - 1) / M;
+	if (out_n > 0xFFFFFFFFULL / nc)
+		return false;
+
+	out = MixBus(nc, new_rate);
+	out.resize((u32) out_n);
+	if (0 == n)
+		return true;
+
+	// Output sample i sits at input time t = i * M / L; it's the sum of input samples around t weighted
+	// by a Kaiser-windowed sinc, stretched when downsampling so it also cuts below the new Nyquist.
+	quality = CLAMP(quality, 8U, 64U);
+	const double fc = std::min(1.0, (double) new_rate / (double) r1);
+	const double beta = 8.6;
+	const u32 K = 2 * (u32) ceil((double) quality / fc);
+	const u32 half = K / 2;
+	const u32 nphase = (u32) std::min(L, (u64) RESAMPLE_MAX_PHASES);
+
+	// Row p is the filter for fractional time p / nphase; row nphase (time 1.0) is there for interpolation.
+	std::vector<float> table(size_t(nphase + 1) * K);
+	for (u32 p = 0; p <= nphase; ++p) {
+		const double phi = (double) p / (double) nphase;
+		for (u32 j = 0; j < K; ++j) {
+			const double tau = phi + (double) (half - 1) - (double) j;
+			table[size_t(p) * K + j] = (float) (fc * filt_sinc(fc * tau) * filt_kaiser(tau / (double) half, beta));
+		}
+	}
+
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	tp.parallel_for(0, nc, [&](i64 c0, i64 c1) {
+		std::vector<float> x, y(out_n);
+		for (i64 c = c0; c < c1; ++c) {
+			// Padded with K zeros on both sides, so every tap is in range.
+			std::vector<float> ch;
+			bus_get_channel(in, (u32) c, ch, n);
+			x.assign(n + 2 * K, 0.0f);
+			memcpy(x.data() + K, ch.data(), n * sizeof(float));
+			for (u64 i = 0; i < out_n; ++i) {
+				const u64 num = i * M;
+				const u64 base = num / L;
+				const u64 rem = num % L;
+				const float* xp = x.data() + K + base - (half - 1);
+				if (nphase == L) {
+					y[i] = filt_dot(table.data() + size_t(rem) * K, xp, K);
+				} else {
+					const double pos = (double) rem * nphase / (double) L;
+					const u32 p = (u32) pos;
+					const float w = (float) (pos - p);
+					const float a = filt_dot(table.data() + size_t(p) * K, xp, K);
+					const float b = filt_dot(table.data() + size_t(p + 1) * K, xp, K);
+					y[i] = a + w * (b - a);
+				}
+			}
+			bus_put_channel(out, (u32) c, y.data(), (u32) out_n);
+		}
+	}, 1);
+	return true;
+}
+
+/*** WavBuild wrappers. ***/
+
+WavBuild* wav_convolve(const WavBuild* wb, const WavBuild* ir, float wet, float dry, ThreadPool* pool) {
+	NOT_NULL_OR_RETURN(wb, nullptr);
+	NOT_NULL_OR_RETURN(ir, nullptr);
+	MixBus bus(wb), irb(ir);
+	if (!bus_convolve(bus, irb, wet, dry, true, pool))
+		return nullptr;
+	return bus.to_wav_build();
+}
+
+WavBuild* wav_reverb(const WavBuild* wb, const ReverbParams& rp, ThreadPool* pool) {
+	NOT_NULL_OR_RETURN(wb, nullptr);
+	MixBus bus(wb);
+	if (!bus_reverb(bus, rp, pool))
+		return nullptr;
+	return bus.to_wav_build();
+}
+
+WavBuild* wav_eq(const WavBuild* wb, const std::vector<EqBand>& bands, ThreadPool* pool) {
+	NOT_NULL_OR_RETURN(wb, nullptr);
+	MixBus bus(wb);
+	if (!bus_eq(bus, bands, 2047, pool))
+		return nullptr;
+	return bus.to_wav_build();
+}
+
+WavBuild* wav_resample(const WavBuild* wb, u32 new_rate, ThreadPool* pool) {
+	NOT_NULL_OR_RETURN(wb, nullptr);
+	MixBus bus(wb), out;
+	if (!bus_resample(bus, out, new_rate, 24, pool))
+		return nullptr;
+	return out.to_wav_build();
+}
+
+/* end wavfilter.cpp */
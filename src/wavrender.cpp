@@ -138,50 +138,6 @@ static u16 amp_adjust_u16(u16 sample, int pct) {
 	return (u16)val;
 }
 
-static int __maxamp(u16* samples, u32 nsamples) {
-	u16* c = samples, * ce = samples + nsamples;
-	int ma = 0;
-
-	while (c < ce) {
-		int v;
-		v = (int)(*c);
-		v -= 32768;
-		v = abs(v);
-		if (v > ma)
-			ma = v;
-		++c;
-	}
-
-	return ma;
-}
-
-static int __maxampadd(u16* s1, u16* s2, u32 ns1, u32 ns2) {
-	u32 ns = std::min(ns1, ns2);
-	u16* c1, *c2, *ce;
-	int ma = 0;
-
-	c1 = s1;
-	c2 = s2;
-	ce = s1 + ns;
-	while (c1 < ce) {
-		int v1, v2;
-
-		v1 = (int)(*c1);
-		v2 = (int)(*c2);
-		v1 -= 32768;
-		v2 -= 32768;
-		v1 += v2;
-		v1 = abs(v1);
-		if (v1 > ma)
-			ma = v1;
-
-		++c1;
-		++c2;
-	}
-
-	return ma;
-}
-
 #ifdef MIXDUMP
 static bool mixdump = false;
 static std::ofstream mixo;
@@ -211,33 +167,196 @@ static u16 __mixin(u16 mix, u16 add) {
 	return ((u16)mixs);
 }
 
-/* Older mix code, with an amplitude adjustment. */
-static u16 __mixin_ampadj(u16 mix, u16 add, int target_amp, int max_amp_add) {
-	i32 mixs = (i32)mix;
-	i32 adds = (i32)add;
-
-	mixs -= 32768;
-	adds -= 32768;
-
-	if (sign_function(mixs) == sign_function(adds)) {
-		if (mixs < 0)
-			mixs = (mixs + adds) + ((mixs * adds) / 32768);
-		else
-			mixs = (mixs + adds) - ((mixs * adds) / 32768);
-	} else {
-		mixs = (mixs + adds);
+/*** Float mixing kernels. On the float bus a sample is (PCM - 32768) / 32768, so 16-bit full scale is [-1, 1);
+     nothing clips until wav_float_to_pcm(). Each kernel has an AVX2 or SSE2 body and a scalar tail. ***/
+
+#define	WAV_FLOAT_SCALE		(1.0f / 32768.0f)
+
+/* Samples per block when a mix is done a piece at a time through float scratch buffers on the stack. */
+#define	WAV_MIX_BLOCK		2048
+
+/* PCM to float, times gain. (PCM - 32768) is just the PCM with its top bit flipped, read as signed. */
+static void wav_pcm_to_float(const u16* in, float* out, u32 n, float gain) {
+	const float g = gain * WAV_FLOAT_SCALE;
+	u32 e = 0;
+#if defined(CODEHAPPY_AVX2)
+	const __m128i flip = _mm_set1_epi16((short) 0x8000);
+	const __m256 vg = _mm256_set1_ps(g);
+	for (; e + 8 <= n; e += 8) {
+		__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (in + e)), flip);
+		_mm256_storeu_ps(out + e, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(s)), vg));
+	}
+#elif defined(CODEHAPPY_SSE2)
+	const __m128i flip = _mm_set1_epi16((short) 0x8000);
+	const __m128 vg = _mm_set1_ps(g);
+	for (; e + 8 <= n; e += 8) {
+		__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (in + e)), flip);
+		// sign-extend to 32 bits: put each sample in the top half, then shift it back down arithmetically.
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+		_mm_storeu_ps(out + e, _mm_mul_ps(_mm_cvtepi32_ps(lo), vg));
+		_mm_storeu_ps(out + e + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vg));
 	}
-
-	if (target_amp < max_amp_add) {
-		i64 scale = mixs;
-		scale *= target_amp;
-		scale /= max_amp_add;
-		mixs = (int)scale;
+#endif
+	for (; e < n; ++e)
+		out[e] = (float) ((i32) in[e] - 32768) * g;
+}
+
+/* Mono PCM to interleaved stereo float, with a gain for each side. */
+static void wav_pcm_mono_to_stereo(const u16* in, float* out, u32 nframes, float gl, float gr) {
+	u32 e = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i flip = _mm_set1_epi16((short) 0x8000);
+	const __m128 vl = _mm_set1_ps(gl * WAV_FLOAT_SCALE), vr = _mm_set1_ps(gr * WAV_FLOAT_SCALE);
+	for (; e + 4 <= nframes; e += 4) {
+		__m128i s = _mm_xor_si128(_mm_loadl_epi64((const __m128i*) (in + e)), flip);
+		__m128 m = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+		__m128 l = _mm_mul_ps(m, vl), r = _mm_mul_ps(m, vr);
+		_mm_storeu_ps(out + 2 * e, _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(out + 2 * e + 4, _mm_unpackhi_ps(l, r));
+	}
+#endif
+	for (; e < nframes; ++e) {
+		const float m = (float) ((i32) in[e] - 32768) * WAV_FLOAT_SCALE;
+		out[2 * e] = m * gl;
+		out[2 * e + 1] = m * gr;
+	}
+}
+
+/* Interleaved stereo PCM down to mono float: left * gl + right * gr. */
+static void wav_pcm_stereo_to_mono(const u16* in, float* out, u32 nframes, float gl, float gr) {
+	u32 e = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128i flip = _mm_set1_epi16((short) 0x8000);
+	const __m128 vl = _mm_set1_ps(gl * WAV_FLOAT_SCALE), vr = _mm_set1_ps(gr * WAV_FLOAT_SCALE);
+	for (; e + 4 <= nframes; e += 4) {
+		__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (in + 2 * e)), flip);
+		__m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+		__m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+		__m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+		_mm_storeu_ps(out + e, _mm_add_ps(_mm_mul_ps(l, vl), _mm_mul_ps(r, vr)));
+	}
+#endif
+	for (; e < nframes; ++e)
+		out[e] = ((float) ((i32) in[2 * e] - 32768) * gl + (float) ((i32) in[2 * e + 1] - 32768) * gr) * WAV_FLOAT_SCALE;
+}
+
+/* acc += in * gain, where the even samples (left, in stereo) get gain g0 and the odd ones g1. n must be even
+   if g0 != g1. */
+static void wav_mix_add(float* acc, const float* in, u32 n, float g0, float g1) {
+	u32 e = 0;
+#if defined(CODEHAPPY_AVX2)
+	const __m256 vg = _mm256_setr_ps(g0, g1, g0, g1, g0, g1, g0, g1);
+	for (; e + 8 <= n; e += 8)
+		_mm256_storeu_ps(acc + e, _mm256_add_ps(_mm256_loadu_ps(acc + e), _mm256_mul_ps(_mm256_loadu_ps(in + e), vg)));
+#elif defined(CODEHAPPY_SSE2)
+	const __m128 vg = _mm_setr_ps(g0, g1, g0, g1);
+	for (; e + 4 <= n; e += 4)
+		_mm_storeu_ps(acc + e, _mm_add_ps(_mm_loadu_ps(acc + e), _mm_mul_ps(_mm_loadu_ps(in + e), vg)));
+#endif
+	for (; e < n; ++e)
+		acc[e] += in[e] * ((e & 1) ? g1 : g0);
+}
+
+/* The __mixin() mixing law on float samples: a + b - ab if both are non-negative, a + b + ab otherwise (which
+   keeps two loud signals from summing past full scale.) Inputs below -1 count as -1. acc = mix(acc, in). */
+static inline float wav_mix_law1(float a, float b) {
+	a = std::max(a, -1.0f);
+	b = std::max(b, -1.0f);
+	const float p = a * b;
+	return (a < 0.0f || b < 0.0f) ? a + b + p : a + b - p;
+}
+
+static void wav_mix_law(float* acc, const float* in, u32 n) {
+	u32 e = 0;
+#if defined(CODEHAPPY_AVX2)
+	const __m256 neg1 = _mm256_set1_ps(-1.0f), zero = _mm256_setzero_ps();
+	for (; e + 8 <= n; e += 8) {
+		__m256 a = _mm256_max_ps(_mm256_loadu_ps(acc + e), neg1);
+		__m256 b = _mm256_max_ps(_mm256_loadu_ps(in + e), neg1);
+		__m256 p = _mm256_mul_ps(a, b);
+		__m256 neg = _mm256_or_ps(_mm256_cmp_ps(a, zero, _CMP_LT_OQ), _mm256_cmp_ps(b, zero, _CMP_LT_OQ));
+		_mm256_storeu_ps(acc + e, _mm256_add_ps(_mm256_add_ps(a, b), _mm256_blendv_ps(_mm256_sub_ps(zero, p), p, neg)));
+	}
+#elif defined(CODEHAPPY_SSE2)
+	const __m128 neg1 = _mm_set1_ps(-1.0f), zero = _mm_setzero_ps();
+	for (; e + 4 <= n; e += 4) {
+		__m128 a = _mm_max_ps(_mm_loadu_ps(acc + e), neg1);
+		__m128 b = _mm_max_ps(_mm_loadu_ps(in + e), neg1);
+		__m128 p = _mm_mul_ps(a, b);
+		__m128 neg = _mm_or_ps(_mm_cmplt_ps(a, zero), _mm_cmplt_ps(b, zero));
+		// +p where either is negative, -p where neither is.
+		__m128 sp = _mm_or_ps(_mm_and_ps(neg, p), _mm_andnot_ps(neg, _mm_sub_ps(zero, p)));
+		_mm_storeu_ps(acc + e, _mm_add_ps(_mm_add_ps(a, b), sp));
+	}
+#endif
+	for (; e < n; ++e)
+		acc[e] = wav_mix_law1(acc[e], in[e]);
+}
+
+/* buf *= gain. */
+static void wav_scale(float* buf, u32 n, float gain) {
+	u32 e = 0;
+#if defined(CODEHAPPY_AVX2)
+	const __m256 vg = _mm256_set1_ps(gain);
+	for (; e + 8 <= n; e += 8)
+		_mm256_storeu_ps(buf + e, _mm256_mul_ps(_mm256_loadu_ps(buf + e), vg));
+#elif defined(CODEHAPPY_SSE2)
+	const __m128 vg = _mm_set1_ps(gain);
+	for (; e + 4 <= n; e += 4)
+		_mm_storeu_ps(buf + e, _mm_mul_ps(_mm_loadu_ps(buf + e), vg));
+#endif
+	for (; e < n; ++e)
+		buf[e] *= gain;
+}
+
+/* The largest magnitude in buf. */
+static float wav_peak(const float* buf, u32 n) {
+	float mx = 0.0f;
+	u32 e = 0;
+#if defined(CODEHAPPY_SSE2)
+	// clearing the sign bit gives the magnitude.
+	const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 vm = _mm_setzero_ps();
+	for (; e + 4 <= n; e += 4)
+		vm = _mm_max_ps(vm, _mm_and_ps(_mm_loadu_ps(buf + e), mask));
+	float t[4];
+	_mm_storeu_ps(t, vm);
+	mx = std::max(std::max(t[0], t[1]), std::max(t[2], t[3]));
+#endif
+	for (; e < n; ++e)
+		mx = std::max(mx, (float) fabs(buf[e]));
+	return mx;
+}
+
+/* Float back to PCM, rounding, and clipping to 16-bit full scale. The signed result is XORed with flip: the
+   default gives our offset-binary samples, 0 gives signed PCM. */
+static void wav_float_to_pcm(const float* in, u16* out, u32 n, u16 flip = 0x8000) {
+	u32 e = 0;
+#if defined(CODEHAPPY_SSE2)
+	const __m128 lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f), sc = _mm_set1_ps(32768.0f);
+	const __m128i vflip = _mm_set1_epi16((short) flip);
+	for (; e + 8 <= n; e += 8) {
+		// clamp before converting: out-of-range floats convert to 0x80000000 whatever their sign.
+		__m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + e), sc), lo), hi);
+		__m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(in + e + 4), sc), lo), hi);
+		__m128i s = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+		_mm_storeu_si128((__m128i*) (out + e), _mm_xor_si128(s, vflip));
+	}
+#endif
+	for (; e < n; ++e) {
+		// NaN fails both comparisons and comes out as silence.
+		float v = in[e] * 32768.0f;
+		i32 iv = 0;
+		if (v >= 32767.0f)
+			iv = 32767;
+		else if (v <= -32768.0f)
+			iv = -32768;
+		else if (v == v)
+			iv = (i32) lrintf(v);
+		out[e] = (u16) iv ^ flip;
 	}
-
-	mixs += 32768;
-	mixs = CLAMP(mixs, 0, 65535);
-	return ((u16)mixs);
 }
 
 double frequency_note(MusicalNote note, int octave) {
@@ -612,6 +731,65 @@ void WavFile::out_to_file(const char* pname) const {
 	fclose(f);
 }
 
+WavStreamWriter::WavStreamWriter() {
+	f = nullptr;
+	nch = 0;
+	sr = 0;
+	nframes = 0;
+	ok = false;
+}
+
+WavStreamWriter::~WavStreamWriter() {
+	close();
+}
+
+bool WavStreamWriter::open(const char* path, u32 nchannels, u32 sample_rate) {
+	u8 hdr[WAV_HEADER_LEN];
+	close();
+	f = fopen(path, "wb");
+	NOT_NULL_OR_RETURN(f, false);
+	nch = nchannels;
+	sr = sample_rate;
+	nframes = 0;
+	// The lengths in the header are filled in by close().
+	basic_wave_hdr(hdr, nch, sr);
+	ok = (fwrite(hdr, 1, WAV_HEADER_LEN, f) == WAV_HEADER_LEN);
+	return ok;
+}
+
+bool WavStreamWriter::write(const i16* samples, u32 nfr) {
+	if (is_null(f) || !ok)
+		return false;
+	// A .WAV can't hold more than 4 GB.
+	if ((nframes + nfr) * nch * 2 + WAV_HEADER_LEN > 0xFFFFFFFFULL) {
+		ok = false;
+		return false;
+	}
+	ok = (fwrite(samples, nch * sizeof(i16), nfr, f) == nfr);
+	if (ok)
+		nframes += nfr;
+	return ok;
+}
+
+bool WavStreamWriter::close(void) {
+	if (is_null(f))
+		return false;
+	const u32 data_len = (u32) (nframes * nch * 2);
+	const u32 file_len = data_len + WAV_HEADER_LEN - 8;
+	if (ok && fseek(f, WAV_OFFS_FILELEN, SEEK_SET) == 0) {
+		u32 v = CPU_TO_LE32(file_len);
+		ok = (fwrite(&v, 4, 1, f) == 1);
+	}
+	if (ok && fseek(f, WAV_OFFS_DATALEN, SEEK_SET) == 0) {
+		u32 v = CPU_TO_LE32(data_len);
+		ok = (fwrite(&v, 4, 1, f) == 1);
+	}
+	if (fclose(f) != 0)
+		ok = false;
+	f = nullptr;
+	return ok;
+}
+
 u8* WavFile::data_chunk_start(void) const {
 	NOT_NULL_OR_RETURN(data, nullptr);
 	return data + WAV_OFFS_WAVDATA;
@@ -966,41 +1144,37 @@ void WavBuild::mix_from_pos(WavBuild* wb2, u32 ns_start1, u32 ns_start2, u32 nsa
 			mix_mono_in_from_pos(wb2, ns_start1, ns_start2, nsamples);
 		return;
 	}
-	// Data chunk & data chunk end.
-	u16* dc, * dce;
-	dc = (u16 *)data_chunk();
-	dce = dc + (num_samples() * nc);
-
-	// Copy chunk & copy chunk end.
-	u16* cc, * cce;
-	cc = (u16 *)wb2->data_chunk();
-	cce = cc + (wb2->num_samples() * nc);
-	cc = wb2->sample_pos(ns_start2);
-
-#if 0
-	// Amplitude checks -- find target amplitude and maximum (summed) amplitude.
-	// You only need this if you're using __mixin_ampadj().
-	int amp_t, amp_mx;
-	amp_t = __maxamp(sample_pos(ns_start1), dce - sample_pos(ns_start1));
-	amp_mx = __maxampadd(sample_pos(ns_start1), wb2->sample_pos(ns_start2), dce - sample_pos(ns_start1), cce - cc);
-#endif
-
-	// Do the mix.
-	u16* p, * pe;
-	p = sample_pos(ns_start1);
-	pe = p + (nsamples * nc);
-	while (p < pe && p < dce && cc < cce) {
-		*p = __mixin(*p, *cc);
-//		*p = __mixin_ampadj(*p, *cc, amp_t, amp_mx);
-		++p;
-		++cc;
-		if (2 == nc) {
-			*p = __mixin(*p, *cc);
-//			*p = __mixin_ampadj(*p, *cc, amp_t, amp_mx);
-			++p;
-			++cc;
-		}
-	}
+	const u32 ns1 = num_samples(), ns2 = wb2->num_samples();
+	if (ns_start1 >= ns1 || ns_start2 >= ns2)
+		return;
+	nsamples = std::min(nsamples, std::min(ns1 - ns_start1, ns2 - ns_start2));
+
+	// Do the mix, a block at a time through float.
+	float mix[WAV_MIX_BLOCK], add[WAV_MIX_BLOCK];
+	u16* p = sample_pos(ns_start1);
+	u16* cc = wb2->sample_pos(ns_start2);
+	u32 n = nsamples * nc;
+	while (n > 0) {
+		const u32 nb = std::min(n, (u32) WAV_MIX_BLOCK);
+		wav_pcm_to_float(p, mix, nb, 1.0f);
+		wav_pcm_to_float(cc, add, nb, 1.0f);
+		wav_mix_law(mix, add, nb);
+		wav_float_to_pcm(mix, p, nb);
+		p += nb;
+		cc += nb;
+		n -= nb;
+	}
+}
+
+/* Left and right gains for a mono signal panned into stereo: the far side is turned down by |pan| percent. */
+static void wav_pan_gains(int pan, float gain, float* gl, float* gr) {
+	pan = CLAMP(pan, -100, 100);
+	*gl = gain;
+	*gr = gain;
+	if (pan < 0)
+		*gr = gain * float(100 + pan) / 100.0f;
+	else if (pan > 0)
+		*gl = gain * float(100 - pan) / 100.0f;
 }
 
 void WavBuild::mix_mono_in_from_pos(WavBuild* wb2, u32 ns_start1, u32 ns_start2, u32 nsamples, int pan) {
@@ -1010,39 +1184,26 @@ void WavBuild::mix_mono_in_from_pos(WavBuild* wb2, u32 ns_start1, u32 ns_start2,
 		return;
 	if (num_channels() != 2 || wb2->num_channels() != 1)
 		return;
-
-	// Data chunk & data chunk end.
-	u16* dc, * dce;
-	dc = (u16 *)data_chunk();
-	dce = dc + (num_samples() * 2);
-
-	// Copy chunk & copy chunk end.
-	u16* cc, * cce;
-	cc = (u16 *)wb2->data_chunk();
-	cce = cc + wb2->num_samples();
-	cc = wb2->sample_pos(ns_start2);
-
-	// Do the mix.
-	u16* p, * pe;
-	p = sample_pos(ns_start1);
-	pe = p + (nsamples * 2);
-	while (p < pe && p < dce && cc < cce) {
-		u16 mono_signal = *cc;
-		if (0 == pan) {
-			*p = __mixin(*p, mono_signal);
-			++p;
-			*p = __mixin(*p, mono_signal);
-		} else if (pan < 0) {
-			*p = __mixin(*p, mono_signal);
-			++p;
-			*p = __mixin(*p, amp_adjust_u16(mono_signal, 100 + pan));
-		} else {
-			*p = __mixin(*p, amp_adjust_u16(mono_signal, 100 - pan));
-			++p;
-			*p = __mixin(*p, mono_signal);
-		}
-		++p;
-		++cc;
+	const u32 ns1 = num_samples(), ns2 = wb2->num_samples();
+	if (ns_start1 >= ns1 || ns_start2 >= ns2)
+		return;
+	nsamples = std::min(nsamples, std::min(ns1 - ns_start1, ns2 - ns_start2));
+
+	// Do the mix: the mono signal is spread to stereo (and panned) on its way into float.
+	float mix[WAV_MIX_BLOCK], add[WAV_MIX_BLOCK];
+	float gl, gr;
+	wav_pan_gains(pan, 1.0f, &gl, &gr);
+	u16* p = sample_pos(ns_start1);
+	u16* cc = wb2->sample_pos(ns_start2);
+	while (nsamples > 0) {
+		const u32 nb = std::min(nsamples, (u32) WAV_MIX_BLOCK / 2);
+		wav_pcm_to_float(p, mix, nb * 2, 1.0f);
+		wav_pcm_mono_to_stereo(cc, add, nb, gl, gr);
+		wav_mix_law(mix, add, nb * 2);
+		wav_float_to_pcm(mix, p, nb * 2);
+		p += nb * 2;
+		cc += nb;
+		nsamples -= nb;
 	}
 }
 
@@ -1053,46 +1214,37 @@ void WavBuild::mix_stereo_in_from_pos(WavBuild* wb2, u32 ns_start1, u32 ns_start
 		return;
 	if (num_channels() != 1 || wb2->num_channels() != 2)
 		return;
-
-	// Data chunk & data chunk end.
-	u16* dc, * dce;
-	dc = (u16 *)data_chunk();
-	dce = dc + num_samples();
-
-	// Copy chunk & copy chunk end.
-	u16* cc, * cce;
-	cc = (u16 *)wb2->data_chunk();
-	cce = cc + wb2->num_samples() * 2;
-	cc = wb2->sample_pos(ns_start2);
+	const u32 ns1 = num_samples(), ns2 = wb2->num_samples();
+	if (ns_start1 >= ns1 || ns_start2 >= ns2)
+		return;
+	nsamples = std::min(nsamples, std::min(ns1 - ns_start1, ns2 - ns_start2));
+
+	// Take one channel, or the average of both.
+	float gl = 0.5f, gr = 0.5f;
+	switch (channel_flags) {
+	case CHANNEL_LEFT:
+		gl = 1.0f;
+		gr = 0.0f;
+		break;
+	case CHANNEL_RIGHT:
+		gl = 0.0f;
+		gr = 1.0f;
+		break;
+	}
 
 	// Do the mix.
-	u32 u;
-	u16* p, * pe;
-	p = sample_pos(ns_start1);
-	pe = p + nsamples;
-	while (p < pe && p < dce && cc < cce) {
-		switch (channel_flags) {
-		case CHANNEL_LEFT:
-			*p = __mixin(*p, *cc);
-			++cc;
-			++cc;
-			break;
-		case CHANNEL_RIGHT:
-			++cc;
-			*p = __mixin(*p, *cc);
-			++cc;
-			break;
-		case CHANNEL_BOTH:
-		default:
-			u = u32(*cc);
-			++cc;
-			u += u32(*cc);
-			u >>= 1;
-			++cc;
-			*p = __mixin(*p, u16(u));
-			break;
-		}
-		++p;
+	float mix[WAV_MIX_BLOCK], add[WAV_MIX_BLOCK];
+	u16* p = sample_pos(ns_start1);
+	u16* cc = wb2->sample_pos(ns_start2);
+	while (nsamples > 0) {
+		const u32 nb = std::min(nsamples, (u32) WAV_MIX_BLOCK);
+		wav_pcm_to_float(p, mix, nb, 1.0f);
+		wav_pcm_stereo_to_mono(cc, add, nb, gl, gr);
+		wav_mix_law(mix, add, nb);
+		wav_float_to_pcm(mix, p, nb);
+		p += nb;
+		cc += nb * 2;
+		nsamples -= nb;
 	}
 }
 
@@ -1174,6 +1326,109 @@ float* WavBuild::channel_sample_data_f(u32 channel_flag) const {
 	return ret;
 }
 
+MixBus::MixBus(u32 nchannels, u32 sample_rate) {
+	nch = CLAMP(nchannels, 1, 2);
+	sr = sample_rate;
+}
+
+MixBus::MixBus(const WavBuild* wb) {
+	nch = 2;
+	sr = 44100;
+	NOT_NULL_OR_RETURN_VOID(wb);
+	nch = wb->num_channels();
+	sr = wb->sample_rate();
+	buf.resize(size_t(wb->num_samples()) * nch);
+	wav_pcm_to_float(wb->sample_data(), buf.data(), u32(buf.size()), 1.0f);
+}
+
+bool MixBus::mix_in(const WavBuild* wb, u32 ns_start, float gain, int pan) {
+	NOT_NULL_OR_RETURN(wb, false);
+	if (wb->sample_rate() != sr)
+		return false;
+	const u32 wnc = wb->num_channels();
+	const u32 nsw = wb->num_samples();
+	if (ns_start + nsw > num_samples())
+		resize(ns_start + nsw);
+
+	// The source is converted a block at a time into float (spread or averaged to our channel count),
+	// then added in with the gain and pan.
+	float add[WAV_MIX_BLOCK];
+	float gl = gain, gr = gain;
+	if (2 == nch)
+		wav_pan_gains(pan, gain, &gl, &gr);
+	const u32 bf = WAV_MIX_BLOCK / std::max(nch, wnc);
+	const u16* src = wb->sample_data();
+	float* dst = sample_pos(ns_start);
+	for (u32 f = 0; f < nsw; f += bf) {
+		const u32 nf = std::min(bf, nsw - f);
+		if (wnc == nch)
+			wav_pcm_to_float(src + f * wnc, add, nf * nch, 1.0f);
+		else if (1 == wnc)
+			wav_pcm_mono_to_stereo(src + f, add, nf, 1.0f, 1.0f);
+		else
+			wav_pcm_stereo_to_mono(src + f * 2, add, nf, 0.5f, 0.5f);
+		wav_mix_add(dst + f * nch, add, nf * nch, gl, gr);
+	}
+	return true;
+}
+
+bool MixBus::mix_in(const MixBus& bus, u32 ns_start, float gain, int pan) {
+	if (bus.sr != sr || bus.nch != nch)
+		return false;
+	const u32 nsb = bus.num_samples();
+	if (ns_start + nsb > num_samples())
+		resize(ns_start + nsb);
+	float gl = gain, gr = gain;
+	if (2 == nch)
+		wav_pan_gains(pan, gain, &gl, &gr);
+	wav_mix_add(sample_pos(ns_start), bus.data(), nsb * nch, gl, gr);
+	return true;
+}
+
+void MixBus::apply_gain(float gain) {
+	wav_scale(buf.data(), u32(buf.size()), gain);
+}
+
+float MixBus::peak(void) const {
+	return wav_peak(buf.data(), u32(buf.size()));
+}
+
+void MixBus::normalize(float level) {
+	const float pk = peak();
+	if (pk > 0.0f)
+		apply_gain(level / pk);
+}
+
+void MixBus::to_pcm(u16* out, u32 ns_start, u32 nsamples) const {
+	NOT_NULL_OR_RETURN_VOID(out);
+	if (ns_start >= num_samples())
+		return;
+	nsamples = std::min(nsamples, num_samples() - ns_start);
+	wav_float_to_pcm(buf.data() + size_t(ns_start) * nch, out, nsamples * nch);
+}
+
+WavBuild* MixBus::to_wav_build(WavBuild* wb) const {
+	if (is_null(wb))
+		wb = new WavBuild;
+	NOT_NULL_OR_RETURN(wb, nullptr);
+	if (wb->sp.length() == 0) {
+		u8 hdr[WAV_HEADER_LEN];
+		basic_wave_hdr(hdr, nch, sr);
+		wb->sp.memcat(hdr, WAV_HEADER_LEN);
+	} else if (wb->num_channels() != nch || wb->sample_rate() != sr) {
+		return nullptr;
+	}
+
+	// Convert straight into the end of the WavBuild's buffer.
+	const u32 ns = num_samples();
+	const u32 len = wb->sp.length();
+	if (wb->sp.resize(len + ns * nch * 2) != 0)
+		return nullptr;
+	wav_float_to_pcm(buf.data(), (u16*) (wb->sp.buffer() + len), ns * nch);
+	wb->ensure_header();
+	return wb;
+}
+
 #ifdef CODEHAPPY_SDL
 
 Mix_Chunk* WavBuild::sdl_mixchunk(void) {
@@ -1742,156 +1997,34 @@ WavBuild* WavRender::mix_voices(std::vector<WavBuild*>& wbs) const {
 	std::sort(wbs.begin(), wbs.end(), wb_comp);
 
 	WavBuild* wb = wbs[0]->copy();
-	i32* mixd;
-	u32 ns = wb->num_samples() * wb->num_channels();
-	mixd = new i32 [ns];
-	NOT_NULL_OR_RETURN(mixd, wb);
-	u16* d = wb->sample_data(), * de = d + ns;
-	i32* c = mixd;
-
-#if 0
-	// Try the original c_library algorithm here.
-	while (d < de) {
-		*c = (i32)(*d) - 32768;
-		++d;
-		++c;
-	}
-	for (u32 e = 1; e < wbs.size(); ++e) {
-		u32 nsc = wbs[e]->num_samples() * wbs[e]->num_channels();
-		u16* cc = wbs[e]->sample_data(), * cce = cc + nsc;
-		c = mixd;
-		while (cc < cce) {
-			i32 mixs = *c;
-			i32 adds = (i32)(*cc) - 32768;
-			if (sign_function(mixs) == sign_function(adds)) {
-				if (mixs < 0)
-					mixs = (mixs + adds) + ((mixs * adds) / 32768);
-				else
-					mixs = (mixs + adds) - ((mixs * adds) / 32768);
-			} else {
-				mixs = (mixs + adds);
+	NOT_NULL_OR_RETURN(wb, wb);
+	const u32 nc = wb->num_channels();
+	const u32 ns = wb->num_samples() * nc;
+	const u32 nblocks = (ns + WAV_MIX_BLOCK - 1) / WAV_MIX_BLOCK;
+	u16* out = wb->sample_data();
+
+	// One pass over the output: each block is read into float, has every voice folded into it by the __mixin()
+	// law (the voices are longest first, so we can stop at the first one that has ended), and is written back
+	// to PCM once. Nothing clips until then. The blocks are independent, so they're spread across the pool.
+	ThreadPool::shared().parallel_for(0, nblocks, [&](i64 b0, i64 b1) {
+		float mix[WAV_MIX_BLOCK], add[WAV_MIX_BLOCK];
+		for (i64 b = b0; b < b1; ++b) {
+			const u32 s0 = u32(b) * WAV_MIX_BLOCK;
+			const u32 n = std::min(ns - s0, (u32) WAV_MIX_BLOCK);
+			wav_pcm_to_float(out + s0, mix, n, 1.0f);
+			for (u32 e = 1; e < wbs.size(); ++e) {
+				const u32 nsc = wbs[e]->num_samples() * nc;
+				if (nsc <= s0)
+					break;
+				const u32 nv = std::min(n, nsc - s0);
+				wav_pcm_to_float(wbs[e]->sample_data() + s0, add, nv, 1.0f);
+				wav_mix_law(mix, add, nv);
 			}
-			*c = mixs;
-
-			++cc;
-			++c;
-		}
-	}
-
-	i32* ce = mixd + ns;
-	c = mixd;
-	d = wb->sample_data();
-	while (c < ce) {
-		i32 mixs = *c;
-		mixs += 32768;
-		mixs = CLAMP(mixs, 0, 65535);
-		*d = (u16)(mixs);
-		++c;
-		++d;
-	}
-#endif
-
-#if 1
-	while (d < de) {
-		*c = (i32)(*d);
-		++d;
-		++c;
-	}
-
-	// Use the __mixin() algorithm, but with less clipping.
-	for (u32 e = 1; e < wbs.size(); ++e) {
-		u32 nsc = wbs[e]->num_samples() * wbs[e]->num_channels();
-		u16* cc = wbs[e]->sample_data(), * cce = cc + nsc;
-		c = mixd;
-		while (cc < cce) {
-			i32 mixs;
-			i32 s1 = *c, s2 = (i32)(*cc);
-			if (s1 < 0) s1 = 0;
-			if (s2 < 0) s2 = 0;
-			if (s1 < 32768 || s2 < 32768)
-				mixs = ((s1 * s2) / 32768UL);
-			else
-				mixs = 2 * (s1 + s2) - (i32)(((u64)s1 * (u64)s2) / 32768ULL) - 65536;
-			*c = mixs;
-			++cc;
-			++c;
+			wav_float_to_pcm(mix, out + s0, n);
 		}
-	}
-
-	i32* ce = mixd + ns;
-	c = mixd;
-	d = wb->sample_data();
-	while (c < ce) {
-		i32 mixs = *c;
-		mixs = CLAMP(mixs, 0, 65535);
-		*d = (u16)(mixs);
-		++c;
-		++d;
-	}
-#endif
+	}, 4);
 
-#if 0
-	// Now we're going to do a straight additive mix of all samples, in 32 bits to avoid clipping as much as possible.
-	while (d < de) {
-		*c = (i32)(*d) - 32768;
-		++d;
-		++c;
-	}
-
-	for (u32 e = 1; e < wbs.size(); ++e) {
-		u32 nsc = wbs[e]->num_samples() * wbs[e]->num_channels();
-		u16* cc = wbs[e]->sample_data(), * cce = cc + nsc;
-		c = mixd;
-		while (cc < cce) {
-			*c += ((i32)(*cc) - 32768);
-			++cc;
-			++c;
-		}
-	}
-
-	// The amplitude adjustments below work, but make the mix too quiet.
-
-	// Determine the maximum amplitude, and if more than 1 in 128 samples is beyond dynamic range, scale
-	// the maximum amplitude down.
-	u32 mx_a = 0, c_clip = 0;
-	i32* ce = mixd + ns;
-	c = mixd;
-	while (c < ce) {
-		if (abs(*c) > mx_a)
-			mx_a = abs(*c);
-		if (*c < -32768 || *c > 32767)
-			++c_clip;
-		++c;
-	}
-	c_clip <<= 7;
-	if (c_clip > ns) {
-		i64 calc;
-		c = mixd;
-		while (c < ce) {
-			calc = (i64)(*c);
-			calc *= 32768;
-			calc /= mx_a;
-			*c = (i32)calc;
-			++c;
-		}
-	}
-
-	// Convert back to u16.
-	d = wb->sample_data();
-	c = mixd;
-	while (d < de) {
-		i32 val = *c;
-		val += 32768;
-		val = CLAMP(val, 0, 65535);
-		*d = (u16)val;
-		++c;
-		++d;
-	}
-#endif
-
-	delete [] mixd;
-
-	return wb;	
+	return wb;
 }
 
 Voices::Voices(WavRender& wr) {
@@ -1969,86 +2102,202 @@ void WavRender::quiet_channels(Channels& ch) const {
 
 #endif  // CODEHAPPY_SDL
 
-struct MidiRender {
+/*** Parallel, streaming MIDI rendering. The MIDI channels are divided among a few parts, each with its own copy of
+     the soundfont (tsf_copy() shares the sample data), balanced by note count. Each block of the song, every part
+     renders its channels into its own float buffer at the same time; the parts are summed, converted to PCM and
+     handed on, so only one block of the song is ever held in memory. ***/
+
+/* Events are applied every this many sample frames (the original renderer's granularity.) */
+#define	MIDI_RENDER_STEP	64
+
+/* After the last event, keep rendering (up to this long) until every note has died away. */
+#define	MIDI_TAIL_MSEC		5000
+
+struct MidiPart {
 	tsf*		soundfont;
 	tml_message*	msg;
-	u8*		stream;
-	int		len;
-	u32		nch;
 	double		msec;
-	double		sr;
-	int		program;
-	std::unordered_map<int, int> channel_to_prog;
+	u32		channel_mask;
+	int		channel_prog[16];
+	std::vector<float> buf;
 };
 
-static bool __render_midi(MidiRender& mr) {
-	const u32 RENDER_SAMPLES_ITERATION = 64;
-	int sample_block, sample_count = (mr.len / (mr.nch * sizeof(short)));
-	u8* stream = mr.stream;
+/* Render nframes sample frames of one part's channels, executing its events as we go. */
+static void __render_midi_part(MidiPart& mp, u32 nframes, u32 nch, double sr, int program) {
+	float* out = mp.buf.data();
 
-	for (sample_block = RENDER_SAMPLES_ITERATION; sample_count; sample_count -= sample_block, stream += (sample_block * mr.nch * sizeof(short))) {
-		sample_block = std::min(sample_block, sample_count);
+	for (u32 f = 0; f < nframes; f += MIDI_RENDER_STEP) {
+		const u32 nb = std::min((u32) MIDI_RENDER_STEP, nframes - f);
 
 		/* Execute all MIDI messages up to time msec */
-		for (mr.msec += sample_block * (1000.0 / mr.sr); mr.msg && mr.msec >= mr.msg->time; mr.msg = mr.msg->next) {
-			switch (mr.msg->type) {
+		for (mp.msec += nb * (1000.0 / sr); mp.msg && mp.msec >= mp.msg->time; mp.msg = mp.msg->next) {
+			const int ch = mp.msg->channel & 15;
+			if ((mp.channel_mask & (1UL << ch)) == 0)
+				continue;
+			switch (mp.msg->type) {
 				case TML_PROGRAM_CHANGE:
-					mr.channel_to_prog[mr.msg->channel] = mr.msg->program;
-					tsf_channel_set_presetnumber(mr.soundfont, mr.msg->channel, mr.msg->program, (mr.msg->channel == MIDI_CHANNEL_DRUMS));
+					mp.channel_prog[ch] = mp.msg->program;
+					tsf_channel_set_presetnumber(mp.soundfont, ch, mp.msg->program, (ch == MIDI_CHANNEL_DRUMS));
 					break;
 
 				case TML_NOTE_ON:
-					if (mr.program >= 0 && mr.channel_to_prog[mr.msg->channel] != mr.program)
+					if (program >= 0 && mp.channel_prog[ch] != program)
 						break;
-					tsf_channel_note_on(mr.soundfont, mr.msg->channel, mr.msg->key, mr.msg->velocity / 127.0f);
+					tsf_channel_note_on(mp.soundfont, ch, mp.msg->key, mp.msg->velocity / 127.0f);
 					break;
 
 				case TML_NOTE_OFF:
-					if (mr.program >= 0 && mr.channel_to_prog[mr.msg->channel] != mr.program)
+					if (program >= 0 && mp.channel_prog[ch] != program)
 						break;
-					tsf_channel_note_off(mr.soundfont, mr.msg->channel, mr.msg->key);
+					tsf_channel_note_off(mp.soundfont, ch, mp.msg->key);
 					break;
 
 				case TML_PITCH_BEND:
-					tsf_channel_set_pitchwheel(mr.soundfont, mr.msg->channel, mr.msg->pitch_bend);
+					tsf_channel_set_pitchwheel(mp.soundfont, ch, mp.msg->pitch_bend);
 					break;
 
 				case TML_CONTROL_CHANGE:
-					tsf_channel_midi_control(mr.soundfont, mr.msg->channel, mr.msg->control, mr.msg->control_value);
+					tsf_channel_midi_control(mp.soundfont, ch, mp.msg->control, mp.msg->control_value);
 					break;
 			}
 		}
 
-		tsf_render_short(mr.soundfont, (short*)stream, sample_block, 0);
+		tsf_render_float(mp.soundfont, out + f * nch, (int) nb, 0);
 	}
+}
+
+/* Divide the channels that play notes among at most max_parts parts, heaviest channel first onto the lightest part. */
+static void midi_split_channels(tml_message* midi, u32 max_parts, std::vector<u32>& masks) {
+	u64 notes[16] = { 0 };
+	for (tml_message* m = midi; m != nullptr; m = m->next)
+		if (m->type == TML_NOTE_ON)
+			++notes[m->channel & 15];
+
+	std::vector<int> order;
+	for (int c = 0; c < 16; ++c)
+		if (notes[c] > 0)
+			order.push_back(c);
+	std::sort(order.begin(), order.end(), [&notes](int a, int b) { return notes[a] > notes[b]; });
 
-	return (mr.msg != nullptr);
+	const u32 np = std::max(std::min(max_parts, (u32) order.size()), 1U);
+	std::vector<u64> load(np, 0);
+	masks.assign(np, 0);
+	for (int c : order) {
+		u32 lightest = (u32) (std::min_element(load.begin(), load.end()) - load.begin());
+		masks[lightest] |= (1UL << c);
+		load[lightest] += notes[c];
+	}
+	// Channels without notes can still carry controller and program events; they're harmless on the first part.
+	for (int c = 0; c < 16; ++c)
+		if (notes[c] == 0)
+			masks[0] |= (1UL << c);
 }
 
-WavBuild* WavRender::build_midi(WavBuild* wb, tml_message* midi, tsf* soundfont, int program) {
-	MidiRender mr;
-	wb = ensure_wav_build(wb);
+u64 WavRender::stream_midi(tml_message* midi, tsf* soundfont, WavBlockSink sink, int program, ThreadPool* pool,
+				u32 max_parts, u32 block_msec) {
+	NOT_NULL_OR_RETURN(midi, 0);
+	NOT_NULL_OR_RETURN(soundfont, 0);
+	ThreadPool& tp = not_null(pool) ? *pool : ThreadPool::shared();
+	block_msec = std::max(block_msec, 10U);
+	if (0 == max_parts)
+		max_parts = (u32) tp.size() + 1;
+
+	// Blocks are a whole number of event steps, so the event timing is the same whatever the block size.
+	u32 block_frames = msec_to_nsamples(block_msec);
+	block_frames = std::max((block_frames / MIDI_RENDER_STEP) * MIDI_RENDER_STEP, (u32) MIDI_RENDER_STEP);
+	const u32 ns = block_frames * nch;
+
+	std::vector<u32> masks;
+	midi_split_channels(midi, max_parts, masks);
+	std::vector<MidiPart> parts(masks.size());
+	for (u32 p = 0; p < parts.size(); ++p) {
+		MidiPart& mp = parts[p];
+		// A copy starts with no channel state, so the drum bank has to be set again.
+		mp.soundfont = tsf_copy(soundfont);
+		if (is_null(mp.soundfont)) {
+			parts.resize(p);
+			break;
+		}
+		tsf_channel_set_bank_preset(mp.soundfont, MIDI_CHANNEL_DRUMS, 128, 0);
+		mp.msg = midi;
+		mp.msec = 0.0;
+		mp.channel_mask = masks[p];
+		memset(mp.channel_prog, 0, sizeof(mp.channel_prog));
+		mp.buf.resize(ns);
+	}
+
+	std::vector<u16> pcm(ns);
+	const double sr_d = (double) sr;
+	const u32 tail_blocks = (MIDI_TAIL_MSEC + block_msec - 1) / block_msec;
+	u64 nframes = 0;
+	u32 tail = 0;
+	bool ok = !parts.empty();
+
+	while (ok) {
+		tp.parallel_for(0, (i64) parts.size(), [&](i64 p0, i64 p1) {
+			for (i64 p = p0; p < p1; ++p)
+				__render_midi_part(parts[p], block_frames, nch, sr_d, program);
+		}, 1);
+
+		float* mix = parts[0].buf.data();
+		for (u32 p = 1; p < parts.size(); ++p)
+			wav_mix_add(mix, parts[p].buf.data(), ns, 1.0f, 1.0f);
+		// The soundfont renders signed PCM, as build_midi() always has.
+		wav_float_to_pcm(mix, pcm.data(), ns, 0);
+		nframes += block_frames;
+		if (!sink((const i16*) pcm.data(), block_frames))
+			break;
 
-	mr.soundfont = soundfont;
-	mr.msg = midi;
-	mr.len = 16384;
-	mr.stream = new u8 [mr.len];
-	NOT_NULL_OR_RETURN(mr.stream, nullptr);
-	mr.nch = nch;
-	mr.msec = 0.0;
-	mr.sr = (double)sr;
-	mr.program = program;
+		bool events = false, voices = false;
+		for (const MidiPart& mp : parts) {
+			events = events || not_null(mp.msg);
+			voices = voices || tsf_active_voice_count(mp.soundfont) > 0;
+		}
+		if (!events && (!voices || ++tail >= tail_blocks))
+			break;
+	}
 
-	do {
-		__render_midi(mr);
-		wb->sp.memcat(mr.stream, mr.len);
-	} while (mr.msg != nullptr);
+	for (MidiPart& mp : parts)
+		tsf_close(mp.soundfont);
+	return nframes;
+}
+
+WavBuild* WavRender::build_midi(WavBuild* wb, tml_message* midi, tsf* soundfont, int program) {
+	wb = ensure_wav_build(wb);
+	NOT_NULL_OR_RETURN(wb, nullptr);
+	const u32 bytes_per_frame = nch * sizeof(i16);
+	stream_midi(midi, soundfont, [wb, bytes_per_frame](const i16* pcm, u32 nframes) {
+		return wb->sp.memcat((const u8*) pcm, nframes * bytes_per_frame) == 0;
+	}, program);
 	wb->ensure_header();
+	return wb;
+}
 
-	delete [] mr.stream;
-	tsf_reset(soundfont);
+bool WavRender::render_midi_to_file(const char* wav_path, tml_message* midi, tsf* soundfont, int program, ThreadPool* pool) {
+	WavStreamWriter ws;
+	if (!ws.open(wav_path, nch, sr))
+		return false;
+	stream_midi(midi, soundfont, [&ws](const i16* pcm, u32 nframes) {
+		return ws.write(pcm, nframes);
+	}, program, pool);
+	return ws.close();
+}
 
-	return wb;
+bool WavRender::render_midi_to_file(const char* wav_path, const char* midi_path, const char* sf_path, int program, ThreadPool* pool) {
+	tml_message* midi;
+	tsf* soundfont;
+	bool ret;
+	midi = tml_load_filename(midi_path);
+	NOT_NULL_OR_RETURN(midi, false);
+	soundfont = load_soundfont_for_render(sf_path);
+	if (is_null(soundfont)) {
+		tml_free(midi);
+		return false;
+	}
+	ret = render_midi_to_file(wav_path, midi, soundfont, program, pool);
+	tsf_close(soundfont);
+	tml_free(midi);
+	return ret;
 }
 
 WavBuild* WavRender::build_midi(WavBuild* wb, const char* midi_path, const char* sf_path, int program) {